@@ -0,0 +1,173 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __bench_bench_h__
+#define __bench_bench_h__
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "app.h"
+#include "mrtrix.h"
+#include "thread.h"
+#include "file/utils.h"
+
+namespace MR
+{
+  namespace Bench
+  {
+
+    /*! \page benchmarks Benchmarks
+     * The programs in the bench/ folder time the core processing kernels
+     * on synthetic data. They are built using:
+     * \code
+     * $ ./build bench
+     * \endcode
+     * and placed in bench/bin/. Each program writes one line per
+     * measurement to standard output, as tab-separated fields:
+     * \code
+     * benchmark  variant  size  threads  ops  ns_per_op  min_ns_per_op
+     * \endcode
+     * where \c ns_per_op is the median over all repeats, and \c
+     * min_ns_per_op the fastest repeat. Benchmarks that scale with the
+     * number of threads are run for each value supplied to the -threads
+     * option, providing the scaling curve directly. */
+
+
+    //! the command-line options common to all benchmarks
+    const App::OptionGroup Options = App::OptionGroup ("Benchmark options")
+      + App::Option ("size", "the size of the synthetic data set (the meaning and default depend on the benchmark).")
+      +   App::Argument ("n").type_integer (1, 1, std::numeric_limits<int>::max())
+
+      + App::Option ("repeat", "the number of timed repeats of each measurement (default: 5).")
+      +   App::Argument ("n").type_integer (1, 5, 1000)
+
+      + App::Option ("threads", "the numbers of threads to use for benchmarks that report scaling "
+                     "with the number of threads, as a comma-separated list (default: 1, then doubling "
+                     "up to the number of threads provided by the hardware).")
+      +   App::Argument ("list").type_sequence_int();
+
+
+
+    //! the size requested using the -size option, or \a default_size
+    inline size_t size (size_t default_size)
+    {
+      App::Options opt = App::get_options ("size");
+      return opt.size() ? size_t (int (opt[0][0])) : default_size;
+    }
+
+    //! the list of thread counts for which to report scaling
+    inline std::vector<size_t> thread_counts ()
+    {
+      std::vector<size_t> counts;
+      App::Options opt = App::get_options ("threads");
+      if (opt.size()) {
+        std::vector<int> list = parse_ints (opt[0][0]);
+        for (size_t n = 0; n < list.size(); ++n)
+          if (list[n] > 0)
+            counts.push_back (list[n]);
+      }
+      else {
+        const size_t max_threads = std::max (std::thread::hardware_concurrency(), 1U);
+        for (size_t n = 1; n < max_threads; n *= 2)
+          counts.push_back (n);
+        counts.push_back (max_threads);
+      }
+      return counts;
+    }
+
+
+    //! prevent the compiler from optimising away the computation of \a value
+    template <typename T>
+      inline void keep (const T& value)
+      {
+        asm volatile ("" : : "g" (&value) : "memory");
+      }
+
+
+
+    //! time a kernel and report the result in tab-separated form
+    /*! The functor provided to operator() is invoked once untimed (to warm
+     * up caches and allocate memory), then timed for the number of
+     * repeats requested. It must perform the number of operations stated
+     * in each invocation. */
+    class Timer
+    {
+      public:
+        Timer (const std::string& benchmark) :
+          benchmark (benchmark) {
+            App::Options opt = App::get_options ("repeat");
+            repeats = opt.size() ? int (opt[0][0]) : 5;
+            static bool header_written = false;
+            if (!header_written) {
+              std::cout << "# benchmark\tvariant\tsize\tthreads\tops\tns_per_op\tmin_ns_per_op\n";
+              header_written = true;
+            }
+          }
+
+        template <class Functor>
+          void operator() (const std::string& variant, size_t size, size_t ops, Functor&& functor, size_t threads = 1)
+          {
+            typedef std::chrono::high_resolution_clock clock;
+            functor();
+            std::vector<double> times (repeats);
+            for (size_t n = 0; n < repeats; ++n) {
+              const clock::time_point start = clock::now();
+              functor();
+              times[n] = std::chrono::duration_cast<std::chrono::nanoseconds> (clock::now() - start).count() / double (ops);
+            }
+            std::sort (times.begin(), times.end());
+            std::cout << benchmark << "\t" << variant << "\t" << size << "\t" << threads << "\t" << ops << "\t"
+              << times[repeats/2] << "\t" << times[0] << std::endl;
+          }
+
+      private:
+        const std::string benchmark;
+        size_t repeats;
+    };
+
+
+
+    //! a temporary file name, deleted (if it exists) on destruction
+    class TempFile
+    {
+      public:
+        TempFile (const char* suffix) :
+          name (File::create_tempfile (0, suffix)) {
+            File::unlink (name);
+          }
+        ~TempFile () {
+          if (Path::exists (name)) {
+            try { File::unlink (name); }
+            catch (...) { }
+          }
+        }
+
+        const std::string name;
+    };
+
+  }
+}
+
+#endif
+
@@ -0,0 +1,116 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "command.h"
+#include "bench.h"
+#include "point.h"
+#include "math/SH.h"
+#include "image/header.h"
+#include "image/buffer.h"
+#include "image/voxel.h"
+#include "image/loop.h"
+#include "image/transform.h"
+#include "dwi/tractography/properties.h"
+#include "dwi/tractography/seeding/basic.h"
+#include "dwi/tractography/algorithms/iFOD2.h"
+
+
+using namespace MR;
+using namespace App;
+using namespace MR::DWI;
+
+void usage ()
+{
+  DESCRIPTION
+  + "benchmark the iFOD2 tracking algorithm, by timing its next() "
+    "method on a synthetic FOD image."
+
+  + "The synthetic image is a cube of side equal to the -size option "
+    "(default: 32), containing a single fibre orientation along the z axis "
+    "(lmax = 8). Each streamline is initialised at the centre of the "
+    "image, and propagated until it terminates. Timings are reported per "
+    "call to next(), which generates one point along the internal arc; "
+    "the candidate paths are generated and sampled once per step, i.e. "
+    "every (samples_per_step - 1) calls.";
+
+  REQUIRES_AT_LEAST_ONE_ARGUMENT = false;
+
+  OPTIONS
+  + Bench::Options;
+}
+
+
+#define NUM_CALLS 100000
+
+
+void run ()
+{
+  typedef float value_type;
+  const size_t size = Bench::size (32);
+  const int lmax = 8;
+
+  Image::Header header;
+  header.set_ndim (4);
+  for (size_t n = 0; n < 3; ++n) {
+    header.dim(n) = size;
+    header.vox(n) = 2.0;
+  }
+  header.dim(3) = Math::SH::NforL (lmax);
+  header.vox(3) = 1.0;
+  header.datatype() = DataType::Float32;
+
+  Bench::TempFile file ("mif");
+  {
+    Math::Vector<value_type> fibre;
+    Math::SH::delta (fibre, Point<value_type> (0.0, 0.0, 1.0), lmax);
+    Image::Buffer<value_type> buffer (file.name, header);
+    auto vox = buffer.voxel();
+    Image::LoopInOrder loop (vox, 0, 3);
+    for (auto l = loop (vox); l; ++l)
+      for (vox[3] = 0; vox[3] < vox.dim(3); ++vox[3])
+        vox.value() = 0.1 * fibre[vox[3]];
+  }
+
+  const Point<value_type> centre = Image::Transform (header).voxel2scanner (Point<value_type> (0.5*(size-1), 0.5*(size-1), 0.5*(size-1)));
+
+  Tractography::Properties properties;
+  properties.seeds.add (new Tractography::Seeding::Sphere (str(centre[0]) + "," + str(centre[1]) + "," + str(centre[2]) + ",1", properties.seeds.get_rng()));
+  properties["init_direction"] = "0,0,1";
+
+  Tractography::Algorithms::iFOD2::Shared shared (file.name, properties);
+  Tractography::Algorithms::iFOD2 method (shared);
+
+  Bench::Timer timer ("iFOD2");
+  timer ("next", size, NUM_CALLS, [&] () {
+      size_t count = 0;
+      while (count < NUM_CALLS) {
+        method.pos = centre;
+        method.dir.set (0.0, 0.0, 1.0);
+        if (!method.init())
+          throw Exception ("failed to initialise streamline in synthetic FOD image");
+        Tractography::Tracking::term_t termination;
+        do {
+          termination = method.next();
+          ++count;
+        } while (termination == Tractography::Tracking::CONTINUE && count < NUM_CALLS);
+      }
+      });
+}
+
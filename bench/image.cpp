@@ -0,0 +1,126 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "command.h"
+#include "bench.h"
+#include "image/header.h"
+#include "image/buffer.h"
+#include "image/buffer_scratch.h"
+#include "image/voxel.h"
+#include "image/loop.h"
+#include "image/threaded_loop.h"
+
+
+using namespace MR;
+using namespace App;
+
+void usage ()
+{
+  DESCRIPTION
+  + "benchmark image voxel access for each on-disk data type, and the "
+    "scaling of Image::ThreadedLoop with the number of threads."
+
+  + "The synthetic images are cubes of side equal to the -size option (default: 128).";
+
+  REQUIRES_AT_LEAST_ONE_ARGUMENT = false;
+
+  OPTIONS
+  + Bench::Options;
+}
+
+
+
+const uint8_t datatypes[] = {
+  DataType::Bit,
+  DataType::Int8,
+  DataType::UInt8,
+  DataType::Int16LE,
+  DataType::Int16BE,
+  DataType::UInt16LE,
+  DataType::Int32LE,
+  DataType::UInt32LE,
+  DataType::Float32LE,
+  DataType::Float32BE,
+  DataType::Float64LE,
+  DataType::Undefined
+};
+
+
+
+class ScaleAndShift {
+  public:
+    template <class InputVoxelType, class OutputVoxelType>
+      void operator() (InputVoxelType& in, OutputVoxelType& out) {
+        out.value() = 2.0f * in.value() + 1.0f;
+      }
+};
+
+
+
+
+void run ()
+{
+  const size_t size = Bench::size (128);
+  Image::Header header;
+  header.set_ndim (3);
+  for (size_t n = 0; n < 3; ++n) {
+    header.dim(n) = size;
+    header.vox(n) = 1.0;
+  }
+  const size_t num_voxels = Image::voxel_count (header);
+
+  Bench::Timer voxel_access ("voxel_access");
+  for (const uint8_t* type = datatypes; *type != DataType::Undefined; ++type) {
+    header.datatype() = *type;
+    Bench::TempFile file ("mif");
+    Image::Buffer<float> buffer (file.name, header);
+    auto vox = buffer.voxel();
+    Image::LoopInOrder loop (vox);
+
+    voxel_access (std::string ("write_") + header.datatype().specifier(), size, num_voxels, [&] () {
+        float value = 0.0f;
+        for (auto l = loop (vox); l; ++l)
+          vox.value() = (value += 1.0f);
+        });
+
+    voxel_access (std::string ("read_") + header.datatype().specifier(), size, num_voxels, [&] () {
+        float sum = 0.0f;
+        for (auto l = loop (vox); l; ++l)
+          sum += vox.value();
+        Bench::keep (sum);
+        });
+  }
+
+
+  Image::BufferScratch<float> in_buffer (header), out_buffer (header);
+  auto in = in_buffer.voxel();
+  auto out = out_buffer.voxel();
+
+  Bench::Timer threaded_loop ("threaded_loop");
+  const std::vector<size_t> thread_counts = Bench::thread_counts();
+  for (size_t n = 0; n < thread_counts.size(); ++n) {
+    Thread::set_number_of_threads (thread_counts[n]);
+    threaded_loop ("scale_and_shift", size, num_voxels, [&] () {
+        Image::ThreadedLoop (in).run (ScaleAndShift(), in, out);
+        }, thread_counts[n]);
+  }
+  Thread::set_number_of_threads (0);
+}
+
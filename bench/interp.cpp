@@ -0,0 +1,109 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "command.h"
+#include "bench.h"
+#include "point.h"
+#include "math/rng.h"
+#include "image/header.h"
+#include "image/buffer_scratch.h"
+#include "image/voxel.h"
+#include "image/loop.h"
+#include "image/interp/nearest.h"
+#include "image/interp/linear.h"
+#include "image/interp/cubic.h"
+
+
+using namespace MR;
+using namespace App;
+
+void usage ()
+{
+  DESCRIPTION
+  + "benchmark the throughput of the image interpolators, at random "
+    "positions within a 4D image."
+
+  + "The synthetic image is a cube of side equal to the -size option "
+    "(default: 96), with 45 volumes (as for a lmax=8 FOD image), and "
+    "each lookup retrieves the values for all volumes, as done during "
+    "tracking.";
+
+  REQUIRES_AT_LEAST_ONE_ARGUMENT = false;
+
+  OPTIONS
+  + Bench::Options;
+}
+
+
+#define NUM_POSITIONS 100000
+
+
+
+template <class Interp>
+  void run_interp (Bench::Timer& timer, const std::string& name, Interp& interp, const std::vector<Point<float>>& positions, size_t size)
+  {
+    timer (name, size, positions.size(), [&] () {
+        float sum = 0.0;
+        for (size_t n = 0; n < positions.size(); ++n) {
+          interp.voxel (positions[n]);
+          for (interp[3] = 0; interp[3] < interp.dim(3); ++interp[3])
+            sum += interp.value();
+        }
+        Bench::keep (sum);
+        });
+  }
+
+
+
+void run ()
+{
+  const size_t size = Bench::size (96);
+  Image::Header header;
+  header.set_ndim (4);
+  for (size_t n = 0; n < 3; ++n) {
+    header.dim(n) = size;
+    header.vox(n) = 2.0;
+  }
+  header.dim(3) = 45;
+  header.vox(3) = 1.0;
+
+  Math::RNG rng (1);
+  Image::BufferScratch<float> buffer (header);
+  auto vox = buffer.voxel();
+  Image::LoopInOrder loop (vox);
+  for (auto l = loop (vox); l; ++l)
+    vox.value() = rng.uniform();
+
+  std::vector<Point<float>> positions (NUM_POSITIONS);
+  for (size_t n = 0; n < positions.size(); ++n)
+    positions[n].set (rng.uniform() * (size-1), rng.uniform() * (size-1), rng.uniform() * (size-1));
+
+  Bench::Timer timer ("interp");
+
+  Image::Interp::Nearest<decltype(vox)> nearest (vox);
+  run_interp (timer, "nearest", nearest, positions, size);
+
+  Image::Interp::Linear<decltype(vox)> linear (vox);
+  run_interp (timer, "linear", linear, positions, size);
+
+  Image::Interp::Cubic<decltype(vox)> cubic (vox);
+  run_interp (timer, "cubic", cubic, positions, size);
+}
+
@@ -0,0 +1,121 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "command.h"
+#include "bench.h"
+#include "thread_queue.h"
+
+
+using namespace MR;
+using namespace App;
+
+void usage ()
+{
+  DESCRIPTION
+  + "benchmark the throughput of the Thread::Queue, as used via "
+    "Thread::run_queue() and Thread::run_ordered_queue(), with "
+    "trivial items and negligible per-item processing, so that "
+    "the overhead of the queue itself dominates."
+
+  + "The -size option sets the number of items to push through "
+    "the queue (default: 10000000). Pipelines with a multi-threaded "
+    "stage are run for each number of threads requested.";
+
+  REQUIRES_AT_LEAST_ONE_ARGUMENT = false;
+
+  OPTIONS
+  + Bench::Options;
+}
+
+
+
+class Source {
+  public:
+    Source (size_t num) : num (num), n (0) { }
+    bool operator() (size_t& item) {
+      if (n >= num) return false;
+      item = n++;
+      return true;
+    }
+  private:
+    const size_t num;
+    size_t n;
+};
+
+class Pipe {
+  public:
+    bool operator() (const size_t& in, size_t& out) {
+      out = 2*in;
+      return true;
+    }
+};
+
+class Sink {
+  public:
+    Sink () : sum (0) { }
+    ~Sink () { Bench::keep (sum); }
+    bool operator() (const size_t& item) {
+      sum += item;
+      return true;
+    }
+  private:
+    size_t sum;
+};
+
+
+
+void run ()
+{
+  const size_t num = Bench::size (10000000);
+  Bench::Timer timer ("queue");
+
+  timer ("source_sink", num, num, [&] () {
+      Source source (num);
+      Sink sink;
+      Thread::run_queue (source, size_t(), sink);
+      });
+
+  const std::vector<size_t> thread_counts = Bench::thread_counts();
+  for (size_t n = 0; n < thread_counts.size(); ++n) {
+    Thread::set_number_of_threads (thread_counts[n]);
+
+    timer ("source_multisink", num, num, [&] () {
+        Source source (num);
+        Sink sink;
+        Thread::run_queue (source, size_t(), Thread::multi (sink));
+        }, thread_counts[n]);
+
+    timer ("source_multipipe_sink", num, num, [&] () {
+        Source source (num);
+        Pipe pipe;
+        Sink sink;
+        Thread::run_queue (source, size_t(), Thread::multi (pipe), size_t(), sink);
+        }, thread_counts[n]);
+
+    timer ("ordered_source_multipipe_sink", num, num, [&] () {
+        Source source (num);
+        Pipe pipe;
+        Sink sink;
+        Thread::run_ordered_queue (source, size_t(), Thread::multi (pipe), size_t(), sink);
+        }, thread_counts[n]);
+  }
+  Thread::set_number_of_threads (0);
+}
+
@@ -0,0 +1,91 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "command.h"
+#include "bench.h"
+#include "point.h"
+#include "math/rng.h"
+#include "math/SH.h"
+
+
+using namespace MR;
+using namespace App;
+
+void usage ()
+{
+  DESCRIPTION
+  + "benchmark the evaluation of spherical harmonic series along "
+    "arbitrary directions, both directly (Math::SH::value) and using "
+    "the precomputed associated Legendre functions (Math::SH::PrecomputedAL), "
+    "as used during tracking."
+
+  + "The -size option sets the harmonic order lmax (default: 8).";
+
+  REQUIRES_AT_LEAST_ONE_ARGUMENT = false;
+
+  OPTIONS
+  + Bench::Options;
+}
+
+
+#define NUM_DIRECTIONS 100000
+
+
+void run ()
+{
+  typedef float value_type;
+
+  const int lmax = Bench::size (8);
+  if (lmax % 2)
+    throw Exception ("harmonic order must be even");
+
+  Math::RNG rng (1);
+  std::vector<value_type> coefs (Math::SH::NforL (lmax));
+  for (size_t n = 0; n < coefs.size(); ++n)
+    coefs[n] = rng.normal();
+
+  std::vector<Point<value_type>> directions (NUM_DIRECTIONS);
+  for (size_t n = 0; n < directions.size(); ++n) {
+    directions[n].set (rng.normal(), rng.normal(), rng.normal());
+    directions[n].normalise();
+  }
+
+  Bench::Timer timer ("SH");
+
+  timer ("value", lmax, directions.size(), [&] () {
+      value_type sum = 0.0;
+      for (size_t n = 0; n < directions.size(); ++n)
+        sum += Math::SH::value (&coefs[0], directions[n], lmax);
+      Bench::keep (sum);
+      });
+
+  Math::SH::PrecomputedAL<value_type> precomputer;
+  timer ("PrecomputedAL_init", lmax, 1, [&] () {
+      precomputer.init (lmax);
+      });
+
+  timer ("PrecomputedAL_value", lmax, directions.size(), [&] () {
+      value_type sum = 0.0;
+      for (size_t n = 0; n < directions.size(); ++n)
+        sum += precomputer.value (coefs, directions[n]);
+      Bench::keep (sum);
+      });
+}
+
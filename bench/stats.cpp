@@ -0,0 +1,154 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <atomic>
+
+#include "command.h"
+#include "bench.h"
+#include "thread.h"
+#include "math/rng.h"
+#include "math/matrix.h"
+#include "math/stats/glm.h"
+#include "math/stats/permutation.h"
+#include "image/header.h"
+#include "image/buffer_scratch.h"
+#include "image/loop.h"
+#include "image/filter/connected_components.h"
+#include "stats/tfce.h"
+
+
+using namespace MR;
+using namespace App;
+
+void usage ()
+{
+  DESCRIPTION
+  + "benchmark the statistical inference kernels: threshold-free cluster "
+    "enhancement (TFCE), and the permutation loop of the general linear "
+    "model (GLM) t-test."
+
+  + "The -size option sets the number of elements (default: 32768). For "
+    "TFCE, these form a cube of voxels within which the statistic varies "
+    "smoothly. The GLM is fitted for 40 subjects in two groups, and its "
+    "permutation loop is run for each number of threads requested.";
+
+  REQUIRES_AT_LEAST_ONE_ARGUMENT = false;
+
+  OPTIONS
+  + Bench::Options;
+}
+
+
+#define NUM_SUBJECTS 40
+#define NUM_PERMUTATIONS 100
+
+typedef float value_type;
+
+
+
+class GLMPermutations {
+  public:
+    GLMPermutations (const Math::Stats::GLMTTest& glm, const std::vector<std::vector<size_t>>& permutations, std::atomic<size_t>& index) :
+      glm (glm), permutations (permutations), index (index) { }
+
+    void execute () {
+      std::vector<value_type> stats;
+      size_t n;
+      while ((n = index++) < permutations.size()) {
+        value_type max_stat = 0.0, min_stat = 0.0;
+        glm (permutations[n], stats, max_stat, min_stat);
+        Bench::keep (max_stat);
+      }
+    }
+
+  private:
+    const Math::Stats::GLMTTest& glm;
+    const std::vector<std::vector<size_t>>& permutations;
+    std::atomic<size_t>& index;
+};
+
+
+
+
+void run ()
+{
+  const size_t num_elements = Bench::size (32768);
+  Math::RNG rng (1);
+  Bench::Timer timer ("stats");
+
+  // TFCE:
+  {
+    const size_t side = std::max (std::round (std::cbrt (value_type (num_elements))), value_type (1.0));
+    Image::Header header;
+    header.set_ndim (3);
+    for (size_t n = 0; n < 3; ++n) {
+      header.dim(n) = side;
+      header.vox(n) = 1.0;
+    }
+    Image::BufferScratch<value_type> mask_buffer (header);
+    auto mask = mask_buffer.voxel();
+    std::vector<value_type> stats;
+    Image::LoopInOrder loop (mask);
+    for (auto l = loop (mask); l; ++l) {
+      mask.value() = 1.0;
+      stats.push_back (5.0 * std::sin (0.3*mask[0]) * std::sin (0.25*mask[1]) * std::sin (0.2*mask[2]) + 0.5 * rng.normal());
+    }
+    const value_type max_stat = *std::max_element (stats.begin(), stats.end());
+
+    Image::Filter::Connector connector (false);
+    connector.precompute_adjacency (mask);
+    Stats::TFCE::Enhancer enhancer (connector, 0.1, 0.5, 2.0);
+    std::vector<value_type> enhanced;
+
+    timer ("TFCE", stats.size(), stats.size(), [&] () {
+        Bench::keep (enhancer (max_stat, stats, enhanced));
+        });
+  }
+
+
+  // GLM permutations:
+  {
+    Math::Matrix<value_type> measurements (num_elements, NUM_SUBJECTS), design (NUM_SUBJECTS, 2), contrast (1, 2);
+    for (size_t r = 0; r < measurements.rows(); ++r)
+      for (size_t c = 0; c < measurements.columns(); ++c)
+        measurements (r,c) = rng.normal() + ( c < NUM_SUBJECTS/2 ? 0.0 : 0.5 );
+    for (size_t r = 0; r < NUM_SUBJECTS; ++r) {
+      design (r,0) = 1.0;
+      design (r,1) = r < NUM_SUBJECTS/2 ? 0.0 : 1.0;
+    }
+    contrast (0,0) = 0.0;
+    contrast (0,1) = 1.0;
+
+    Math::Stats::GLMTTest glm (measurements, design, contrast);
+    std::vector<std::vector<size_t>> permutations;
+    Math::Stats::generate_permutations (NUM_PERMUTATIONS, NUM_SUBJECTS, permutations, true);
+
+    const std::vector<size_t> thread_counts = Bench::thread_counts();
+    for (size_t n = 0; n < thread_counts.size(); ++n) {
+      timer ("GLM_permutation", num_elements, NUM_PERMUTATIONS, [&] () {
+          std::atomic<size_t> index (0);
+          GLMPermutations processor (glm, permutations, index);
+          auto threads = Thread::run (Thread::multi (processor, thread_counts[n]), "GLM permutation threads");
+          threads.wait();
+          }, thread_counts[n]);
+    }
+  }
+}
+
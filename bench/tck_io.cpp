@@ -0,0 +1,84 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "command.h"
+#include "bench.h"
+#include "math/rng.h"
+#include "dwi/tractography/file.h"
+#include "dwi/tractography/properties.h"
+#include "dwi/tractography/streamline.h"
+
+
+using namespace MR;
+using namespace App;
+using namespace MR::DWI;
+
+void usage ()
+{
+  DESCRIPTION
+  + "benchmark the bandwidth of reading and writing track files."
+
+  + "The -size option sets the number of streamlines (default: 100000), "
+    "each consisting of 100 points. Timings are reported per point; the "
+    "bandwidth in bytes/ns is 12 / ns_per_op.";
+
+  REQUIRES_AT_LEAST_ONE_ARGUMENT = false;
+
+  OPTIONS
+  + Bench::Options;
+}
+
+
+#define POINTS_PER_STREAMLINE 100
+
+
+void run ()
+{
+  const size_t num_tracks = Bench::size (100000);
+  const size_t num_points = num_tracks * POINTS_PER_STREAMLINE;
+
+  Math::RNG rng (1);
+  std::vector<Tractography::Streamline<float>> tracks (num_tracks, Tractography::Streamline<float> (POINTS_PER_STREAMLINE));
+  for (size_t n = 0; n < tracks.size(); ++n)
+    for (size_t i = 0; i < tracks[n].size(); ++i)
+      tracks[n][i].set (rng.normal(), rng.normal(), rng.normal());
+
+  Bench::TempFile file ("tck");
+  Bench::Timer timer ("tck_io");
+
+  timer ("write", num_tracks, num_points, [&] () {
+      Tractography::Properties properties;
+      Tractography::Writer<float> writer (file.name, properties);
+      for (size_t n = 0; n < tracks.size(); ++n)
+        writer (tracks[n]);
+      });
+
+  timer ("read", num_tracks, num_points, [&] () {
+      Tractography::Properties properties;
+      Tractography::Reader<float> reader (file.name, properties);
+      Tractography::Streamline<float> tck;
+      size_t count = 0;
+      while (reader (tck))
+        count += tck.size();
+      if (count != num_points)
+        throw Exception ("unexpected number of points read back from track file");
+      });
+}
+
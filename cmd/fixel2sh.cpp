@@ -26,6 +26,7 @@
 #include "image/buffer.h"
 #include "image/buffer_sparse.h"
 #include "image/loop.h"
+#include "image/threaded_loop.h"
 #include "image/voxel.h"
 
 #include "image/sparse/fixel_metric.h"
@@ -60,6 +61,40 @@ void usage ()
 
 
 
+class Converter
+{
+  public:
+    Converter (const size_t lmax, const size_t sh_axis) :
+      aPSF (lmax),
+      sh_axis (sh_axis),
+      n (Math::SH::NforL (lmax)),
+      values (n) { }
+
+    template <class FixelVoxelType, class SHVoxelType>
+      void operator() (FixelVoxelType& fixel, SHVoxelType& sh)
+      {
+        values.assign (n, float(0.0));
+        for (size_t index = 0; index != fixel.value().size(); ++index) {
+          apsf_values = aPSF (apsf_values, fixel.value()[index].dir);
+          const float scale_factor = fixel.value()[index].value;
+          for (ssize_t i = 0; i != n; ++i)
+            values[i] += apsf_values[i] * scale_factor;
+        }
+        for (sh[sh_axis] = 0; sh[sh_axis] != n; ++sh[sh_axis])
+          sh.value() = values[sh[sh_axis]];
+      }
+
+  protected:
+    Math::SH::aPSF<float> aPSF;
+    const size_t sh_axis;
+    const ssize_t n;
+    std::vector<float> values;
+    Math::Vector<float> apsf_values;
+};
+
+
+
+
 void run ()
 {
 
@@ -69,7 +104,6 @@ void run ()
 
   const size_t lmax = 8;
   const ssize_t n = Math::SH::NforL (lmax);
-  Math::SH::aPSF<float> aPSF (lmax);
 
   Image::Header H_out (H_in);
   H_out.datatype() = DataType::Float32;
@@ -80,21 +114,8 @@ void run ()
 
   Image::Buffer<float> sh_data (argument[1], H_out);
   auto sh = sh_data.voxel();
-  std::vector<float> values;
-  Math::Vector<float> apsf_values;
-
-  Image::LoopInOrder loop (fixel, "converting sparse fixel data to SH image... ");
-  for (auto l = loop (fixel, sh); l; ++l) {
-    values.assign (n, float(0.0));
-    for (size_t index = 0; index != fixel.value().size(); ++index) {
-      apsf_values = aPSF (apsf_values, fixel.value()[index].dir);
-      const float scale_factor = fixel.value()[index].value;
-      for (ssize_t i = 0; i != n; ++i)
-        values[i] += apsf_values[i] * scale_factor;
-    }
-    for (sh[sh_dim] = 0; sh[sh_dim] != n; ++sh[sh_dim])
-      sh.value() = values[sh[sh_dim]];
-  }
 
-}
+  Image::ThreadedLoop ("converting sparse fixel data to SH image... ", fixel)
+    .run (Converter (lmax, sh_dim), fixel, sh);
 
+}
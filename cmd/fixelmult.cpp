@@ -25,7 +25,9 @@
 #include "image/buffer.h"
 #include "image/buffer_sparse.h"
 #include "image/loop.h"
+#include "image/threaded_loop.h"
 #include "image/voxel.h"
+#include "image/sparse/allocate.h"
 #include "image/sparse/fixel_metric.h"
 #include "image/sparse/voxel.h"
 
@@ -63,15 +65,20 @@ void run ()
   Image::BufferSparse<FixelMetric> output_data (argument[2], input_header1);
   auto output_vox = output_data.voxel();
 
-  Image::LoopInOrder loop (input_data1, "multiplying fixel images...");
-  for (auto i = loop (input_vox1, input_vox2, output_vox); i; ++i) {
-    if (input_vox1.value().size() != input_vox2.value().size())
-      throw Exception ("the fixel images do not have corresponding fixels in all voxels");
-    output_vox.value().set_size (input_vox1.value().size());
-    for (size_t fixel = 0; fixel != input_vox1.value().size(); ++fixel) {
-      output_vox.value()[fixel] = input_vox1.value()[fixel];
-      output_vox.value()[fixel].value = input_vox1.value()[fixel].value * input_vox2.value()[fixel].value;
-    }
-  }
+  typedef Image::BufferSparse<FixelMetric>::voxel_type FixelVoxel;
+
+  Image::Sparse::allocate ([] (FixelVoxel& in1, FixelVoxel& in2) {
+      if (in1.value().size() != in2.value().size())
+        throw Exception ("the fixel images do not have corresponding fixels in all voxels");
+      return in1.value().size();
+    }, output_vox, input_vox1, input_vox2);
+
+  Image::ThreadedLoop ("multiplying fixel images...", input_data1).run (
+      [] (FixelVoxel& in1, FixelVoxel& in2, FixelVoxel& out) {
+        for (size_t fixel = 0; fixel != in1.value().size(); ++fixel) {
+          out.value()[fixel] = in1.value()[fixel];
+          out.value()[fixel].value = in1.value()[fixel].value * in2.value()[fixel].value;
+        }
+      }, input_vox1, input_vox2, output_vox);
 }
 
@@ -23,9 +23,12 @@
 #include "command.h"
 #include "progressbar.h"
 #include "image/buffer.h"
+#include "image/buffer_scratch.h"
 #include "image/buffer_sparse.h"
 #include "image/loop.h"
+#include "image/threaded_loop.h"
 #include "image/voxel.h"
+#include "image/sparse/allocate.h"
 #include "image/sparse/fixel_metric.h"
 #include "image/sparse/voxel.h"
 
@@ -54,44 +57,63 @@ void usage ()
 
 
 
+typedef Image::BufferSparse<FixelMetric>::voxel_type FixelVoxel;
+
+
+
 void run ()
 {
   Image::Header input_header (argument[0]);
   Image::BufferSparse<FixelMetric> input_data (input_header);
   auto input_vox = input_data.voxel();
 
-  float threshold = argument[1];
+  const float threshold = argument[1];
 
   Image::BufferSparse<FixelMetric> output (argument[2], input_header);
   auto output_vox = output.voxel();
 
   Options opt = get_options("crop");
 
-  Image::LoopInOrder loop (input_vox, "thresholding fixel image...");
-  for (auto i = loop (input_vox, output_vox); i; ++i) {
-    if (opt.size()) {
-        size_t fixel_count = 0;
-        for (size_t f = 0; f != input_vox.value().size(); ++f) {
-          if (input_vox.value()[f].value > threshold)
-            fixel_count++;
-        }
-        output_vox.value().set_size (fixel_count);
-        fixel_count = 0;
-        for (size_t f = 0; f != input_vox.value().size(); ++f) {
-          if (input_vox.value()[f].value > threshold)
-            output_vox.value()[fixel_count++] = input_vox.value()[f];
-        }
-    } else {
-      output_vox.value().set_size (input_vox.value().size());
-      for (size_t f = 0; f != input_vox.value().size(); ++f) {
-        output_vox.value()[f] = input_vox.value()[f];
-        if (input_vox.value()[f].value > threshold)
-          output_vox.value()[f].value = 1.0;
-        else
-          output_vox.value()[f].value = 0.0;
-      }
-    }
+  if (opt.size()) {
+
+    Image::BufferScratch<uint32_t> count_data (input_header, "fixel count");
+    auto count_vox = count_data.voxel();
+    Image::ThreadedLoop ("thresholding fixel image...", input_vox).run (
+        [&] (FixelVoxel& in, decltype(count_vox)& count) {
+          uint32_t fixel_count = 0;
+          for (size_t f = 0; f != in.value().size(); ++f) {
+            if (in.value()[f].value > threshold)
+              fixel_count++;
+          }
+          count.value() = fixel_count;
+        }, input_vox, count_vox);
+
+    Image::Sparse::allocate ([] (decltype(count_vox)& count) { return count.value(); }, output_vox, count_vox);
+
+    Image::ThreadedLoop (input_vox).run (
+        [&] (FixelVoxel& in, FixelVoxel& out) {
+          size_t fixel_count = 0;
+          for (size_t f = 0; f != in.value().size(); ++f) {
+            if (in.value()[f].value > threshold)
+              out.value()[fixel_count++] = in.value()[f];
+          }
+        }, input_vox, output_vox);
+
+  } else {
+
+    Image::Sparse::allocate ([] (FixelVoxel& in) { return in.value().size(); }, output_vox, input_vox);
+
+    Image::ThreadedLoop ("thresholding fixel image...", input_vox).run (
+        [&] (FixelVoxel& in, FixelVoxel& out) {
+          for (size_t f = 0; f != in.value().size(); ++f) {
+            out.value()[f] = in.value()[f];
+            if (in.value()[f].value > threshold)
+              out.value()[f].value = 1.0;
+            else
+              out.value()[f].value = 0.0;
+          }
+        }, input_vox, output_vox);
+
   }
 
 }
-
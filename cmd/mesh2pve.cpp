@@ -50,14 +50,18 @@ void usage ()
     "NeuroImage, 2012, 62, 1924-1938";
 
   ARGUMENTS
-  + Argument ("source",   "the mesh file (currently only .vtk files are supported)").type_file_in()
+  + Argument ("source",   "the mesh file (legacy .vtk files in ASCII or binary format, or FreeSurfer surface files)").type_file_in()
   + Argument ("template", "the template image").type_image_in()
   + Argument ("output",   "the output image").type_image_out();
 
   OPTIONS
   + Option ("first", "indicates that the mesh file is provided by FSL FIRST, so the vertex locations need to be transformed accordingly "
                      "(must provide the input image to FIRST)")
-    + Argument ("source_image").type_image_in();
+    + Argument ("source_image").type_image_in()
+
+  + Option ("exact", "compute the exact volume of intersection between the mesh and each voxel, "
+                     "rather than estimating it by testing a regular grid of points within the voxel "
+                     "(requires a closed mesh)");
 
 
 };
@@ -82,6 +86,6 @@ void run ()
   Image::Header template_image (argument[1]);
 
   // Create the output image
-  mesh.output_pve_image (template_image, argument[2]);
+  mesh.output_pve_image (template_image, argument[2], get_options ("exact").size());
 
 }
@@ -30,6 +30,10 @@
 #include "image/threaded_copy.h"
 #include "image/stride.h"
 
+#include <algorithm>
+#include <map>
+#include <type_traits>
+
 
 using namespace MR;
 using namespace App;
@@ -157,26 +161,62 @@ typedef Image::Buffer<complex_type>::voxel_type complex_vox_type;
   STACK FRAMEWORK:
  **********************************************************************/
 
-
-class Evaluator;
-
-
-class Chunk : public std::vector<complex_type> {
+// The expression is held as a graph of nodes, built up as the command-line
+// is parsed. The type of each node (real or complex) is inferred at
+// construction, so that real-valued sub-expressions are computed entirely
+// in single-precision real arithmetic. Operations whose operands are all
+// constant are evaluated there and then, and identical sub-expressions are
+// represented by the same node, so that they are only computed once.
+//
+// Each node is evaluated over a chunk of voxels (spanning the two innermost
+// axes of the loop) into per-thread storage. The kernel for each operation
+// is instantiated for the value type and for whether each operand varies
+// over the chunk or is constant, so that its inner loop reduces to a single
+// inlined expression that the compiler can vectorise.
+
+
+class Chunk {
   public:
+    Chunk () : is_complex (false), is_scalar (false), generation (0) { }
+
+    bool is_complex, is_scalar;
     complex_type value;
+    std::vector<real_type> real_values;
+    std::vector<complex_type> complex_values;
+    size_t generation;
+
+    std::vector<real_type>& values (real_type) { return real_values; }
+    std::vector<complex_type>& values (complex_type) { return complex_values; }
+
+    real_type scalar (real_type) const { return value.real(); }
+    complex_type scalar (complex_type) const { return value; }
+
+    const real_type* data (real_type) { return &real_values[0]; }
+    const complex_type* data (complex_type) {
+      if (!is_complex) {
+        complex_values.resize (real_values.size());
+        for (size_t n = 0; n < real_values.size(); ++n)
+          complex_values[n] = real_values[n];
+      }
+      return &complex_values[0];
+    }
 };
 
 
 class ThreadLocalStorageItem {
   public:
     Chunk chunk;
-    Ptr<complex_vox_type> vox;
+    Ptr<real_vox_type> real_vox;
+    Ptr<complex_vox_type> complex_vox;
+    Ptr<Math::RNG> rng;
 };
 
 class ThreadLocalStorage : public std::vector<ThreadLocalStorageItem> {
   public:
+    ThreadLocalStorage () : iter (NULL), generation (0) { }
 
-      void load (Chunk& chunk, complex_vox_type& vox) {
+    template <class VoxelType, typename ValueType>
+      void load (std::vector<ValueType>& chunk, VoxelType& vox) const {
         for (size_t n = 0; n < vox.ndim(); ++n)
           if (vox.dim(n) > 1)
             vox[n] = (*iter)[n];
@@ -191,20 +231,14 @@ class ThreadLocalStorage : public std::vector<ThreadLocalStorageItem> {
         }
       }
 
-    Chunk& next () {
-      ThreadLocalStorageItem& item ((*this)[current++]);
-      if (item.vox) load (item.chunk, *item.vox);
-      return item.chunk;
-    }
+    void reset (const Image::Iterator& current_position) { iter = &current_position; ++generation; }
 
-    void reset (const Image::Iterator& current_position) { current = 0; iter = &current_position; }
+    size_t chunk_size () const { return dim[0] * dim[1]; }
 
     const Image::Iterator* iter;
     std::vector<size_t> axes;
     std::vector<size_t> dim;
-
-  private:
-    size_t current;
+    size_t generation;
 };
 
 
@@ -212,106 +246,160 @@ class ThreadLocalStorage : public std::vector<ThreadLocalStorageItem> {
 
 
 
-class StackEntry {
+class Node {
   public:
+    Node (const std::string& description, const std::string& key) :
+      description (description),
+      key (key),
+      is_complex (false),
+      index (0) { }
+    virtual ~Node () { }
+
+    // human-readable form of the expression:
+    const std::string description;
+    // identifies identical sub-expressions (empty if never to be shared):
+    const std::string key;
+    bool is_complex;
+    size_t index;
+
+    virtual bool is_constant () const { return false; }
+    virtual complex_type constant_value () const { return complex_type (0.0); }
+
+    virtual void get_header (Image::Header& header) const { }
+
+    // list all distinct nodes in the graph, operands before their operations:
+    virtual void get_nodes (std::vector<Node*>& nodes) {
+      if (std::find (nodes.begin(), nodes.end(), this) == nodes.end())
+        nodes.push_back (this);
+    }
 
-    StackEntry (const char* entry) : 
-      arg (entry) { }
-
-    StackEntry (Evaluator* evaluator_p) : 
-      arg (NULL),
-      evaluator (evaluator_p) { }
+    virtual void allocate (ThreadLocalStorageItem& item, size_t chunk_size) const {
+      item.chunk.is_complex = is_complex;
+      if (is_complex)
+        item.chunk.complex_values.resize (chunk_size);
+      else
+        item.chunk.real_values.resize (chunk_size);
+    }
 
-    void load () {
-      if (!arg) 
-        return;
-      try {
-        buffer = new Image::Buffer<complex_type> (arg);
-      }
-      catch (Exception) {
-        std::string a = lowercase (arg);
-        if      (a ==  "nan")  { value =  std::numeric_limits<real_type>::quiet_NaN(); }
-        else if (a == "-nan")  { value = -std::numeric_limits<real_type>::quiet_NaN(); }
-        else if (a ==  "inf")  { value =  std::numeric_limits<real_type>::infinity(); }
-        else if (a == "-inf")  { value = -std::numeric_limits<real_type>::infinity(); }
-        else if (a == "rand")  { value = 0.0; rng = new Math::RNG(); rng_gausssian = false; } 
-        else if (a == "randn") { value = 0.0; rng = new Math::RNG(); rng_gausssian = true; } 
-        else                   { value =  to<complex_type> (arg); }
+    Chunk& evaluate (ThreadLocalStorage& storage) const {
+      ThreadLocalStorageItem& item (storage[index]);
+      if (item.chunk.generation != storage.generation) {
+        compute (storage, item);
+        item.chunk.generation = storage.generation;
       }
-      arg = NULL;
+      return item.chunk;
     }
 
-    const char* arg;
-    RefPtr<Evaluator> evaluator;
-    RefPtr<Image::Buffer<complex_type> > buffer;
-    Ptr<Math::RNG> rng;
-    complex_type value;
-    bool rng_gausssian;
+  protected:
+    virtual void compute (ThreadLocalStorage& storage, ThreadLocalStorageItem& item) const = 0;
+};
 
-    bool is_complex () const;
 
-    Chunk& evaluate (ThreadLocalStorage& storage) const;
+
+class ConstantNode : public Node {
+  public:
+    ConstantNode (complex_type value, const std::string& description) :
+      Node (description, "value:" + bit_pattern (value.real()) + "," + bit_pattern (value.imag())),
+      value (value) {
+        is_complex = value.imag() != 0.0;
+      }
+
+    const complex_type value;
+
+    bool is_constant () const { return true; }
+    complex_type constant_value () const { return value; }
+
+    void allocate (ThreadLocalStorageItem& item, size_t chunk_size) const {
+      item.chunk.is_complex = is_complex;
+      item.chunk.is_scalar = true;
+      item.chunk.value = value;
+    }
+
+  protected:
+    void compute (ThreadLocalStorage& storage, ThreadLocalStorageItem& item) const { }
+
+    // constants are merged only if bitwise identical, so key on the exact bit pattern:
+    static std::string bit_pattern (real_type value) {
+      uint32_t bits;
+      memcpy (&bits, &value, sizeof (bits));
+      return str (bits);
+    }
 };
 
 
-class Evaluator
-{
-  public: 
-    Evaluator (const std::string& name, const char* format_string, bool complex_maps_to_real = false, bool real_maps_to_complex = false) : 
-      id (name),
-      format (format_string),
-      ZtoR (complex_maps_to_real),
-      RtoZ (real_maps_to_complex) { }
-    virtual ~Evaluator() { }
-    const std::string id;
-    const char* format;
-    bool ZtoR, RtoZ;
-    std::vector<StackEntry> operands;
 
-    Chunk& evaluate (ThreadLocalStorage& storage) const {
-      Chunk& in1 (operands[0].evaluate (storage));
-      if (num_args() == 1) return evaluate (in1);
-      Chunk& in2 (operands[1].evaluate (storage));
-      if (num_args() == 2) return evaluate (in1, in2);
-      Chunk& in3 (operands[2].evaluate (storage));
-      return evaluate (in1, in2, in3);
+class ImageNode : public Node {
+  public:
+    ImageNode (const std::string& path, const Image::Header& header) :
+      Node (header.name(), "image:" + path) {
+        is_complex = header.datatype().is_complex();
+        if (is_complex)
+          complex_buffer = new Image::Buffer<complex_type> (header);
+        else
+          real_buffer = new Image::Buffer<real_type> (header);
+      }
+
+    RefPtr<Image::Buffer<real_type> > real_buffer;
+    RefPtr<Image::Buffer<complex_type> > complex_buffer;
+
+    void get_header (Image::Header& header) const {
+      const Image::Header& H (real_buffer ? Image::Header (*real_buffer) : Image::Header (*complex_buffer));
+
+      if (header.ndim() == 0) {
+        header = H;
+        return;
+      }
+
+      if (header.ndim() < H.ndim())
+        header.set_ndim (H.ndim());
+      for (size_t n = 0; n < std::min (header.ndim(), H.ndim()); ++n) {
+        if (header.dim(n) > 1 && H.dim(n) > 1 && header.dim(n) != H.dim(n))
+          throw Exception ("dimensions of input images do not match - aborting");
+        header.dim(n) = std::max (header.dim(n), H.dim(n));
+        if (!std::isfinite (header.vox(n)))
+          header.vox(n) = H.vox(n);
+      }
     }
-    virtual Chunk& evaluate (Chunk& in) const { throw Exception ("operation \"" + id + "\" not supported!"); return in; }
-    virtual Chunk& evaluate (Chunk& a, Chunk& b) const { throw Exception ("operation \"" + id + "\" not supported!"); return a; }
-    virtual Chunk& evaluate (Chunk& a, Chunk& b, Chunk& c) const { throw Exception ("operation \"" + id + "\" not supported!"); return a; }
-
-    virtual bool is_complex () const {
-      for (size_t n = 0; n < operands.size(); ++n) 
-        if (operands[n].is_complex())  
-          return !ZtoR;
-      return RtoZ;
+
+    void allocate (ThreadLocalStorageItem& item, size_t chunk_size) const {
+      Node::allocate (item, chunk_size);
+      if (is_complex)
+        item.complex_vox = new complex_vox_type (*complex_buffer);
+      else
+        item.real_vox = new real_vox_type (*real_buffer);
     }
-    size_t num_args () const { return operands.size(); }
 
+  protected:
+    void compute (ThreadLocalStorage& storage, ThreadLocalStorageItem& item) const {
+      if (is_complex)
+        storage.load (item.chunk.complex_values, *item.complex_vox);
+      else
+        storage.load (item.chunk.real_values, *item.real_vox);
+    }
 };
 
 
 
-inline bool StackEntry::is_complex () const {
-  if (buffer) return buffer->datatype().is_complex();
-  if (evaluator) return evaluator->is_complex();
-  return value.imag() != 0.0;
-}
-
+class RandomNode : public Node {
+  public:
+    RandomNode (bool gaussian) :
+      Node (gaussian ? "randn()" : "rand()", ""),
+      gaussian (gaussian) { }
 
+    const bool gaussian;
 
-inline Chunk& StackEntry::evaluate (ThreadLocalStorage& storage) const
-{
-  if (evaluator) return evaluator->evaluate (storage);
-  if (rng) {
-    Chunk& chunk = storage.next();
-    for (size_t n = 0; n < chunk.size(); ++n)
-      chunk[n] = rng_gausssian ? rng->normal() : rng->uniform(); 
-    return chunk;
-  }
-  return storage.next();
-}
+    void allocate (ThreadLocalStorageItem& item, size_t chunk_size) const {
+      Node::allocate (item, chunk_size);
+      item.rng = new Math::RNG();
+    }
 
+  protected:
+    void compute (ThreadLocalStorage& storage, ThreadLocalStorageItem& item) const {
+      std::vector<real_type>& values (item.chunk.real_values);
+      for (size_t n = 0; n < values.size(); ++n)
+        values[n] = gaussian ? item.rng->normal() : item.rng->uniform();
+    }
+};
 
 
 
@@ -336,205 +424,442 @@ inline void replace (std::string& orig, size_t n, const std::string& value)
 }
 
 
-// TODO: move this into StackEntry class and compute string at construction
-// to make sure full operation is recorded, even for scalar operations that
-// get evaluated there and then and so get left out if the string is created
-// later:
-std::string operation_string (const StackEntry& entry) 
+inline std::string operation_string (const char* format, const std::vector<RefPtr<Node> >& operands)
 {
-  if (entry.buffer)
-    return entry.buffer->name();
-  else if (entry.rng)
-    return entry.rng_gausssian ? "randn()" : "rand()";
-  else if (entry.evaluator) {
-    std::string s = entry.evaluator->format;
-    for (size_t n = 0; n < entry.evaluator->operands.size(); ++n) 
-      replace (s, n, operation_string (entry.evaluator->operands[n]));
-    return s;
+  std::string s = format;
+  for (size_t n = 0; n < operands.size(); ++n)
+    replace (s, n, operands[n]->description);
+  return s;
+}
+
+
+inline std::string operation_key (const std::string& name, const std::vector<RefPtr<Node> >& operands)
+{
+  std::string key = name + "(";
+  for (size_t n = 0; n < operands.size(); ++n) {
+    if (operands[n]->key.empty())
+      return std::string();
+    key += (n ? "," : "") + operands[n]->key;
   }
-  else return str(entry.value);
+  return key + ")";
 }
 
 
 
 
 
-template <class Operation>
-class UnaryEvaluator : public Evaluator 
-{
+// select the R() or Z() form of an operation:
+class RealValued {
+  public:
+    typedef real_type value_type;
+    template <class Operation, class... Args>
+      static inline auto call (const Operation& op, Args... args) -> decltype (op.R (args...)) { return op.R (args...); }
+};
+
+class ComplexValued {
+  public:
+    typedef complex_type value_type;
+    template <class Operation, class... Args>
+      static inline auto call (const Operation& op, Args... args) -> decltype (op.Z (args...)) { return op.Z (args...); }
+};
+
+
+
+// operand values over the chunk, either varying or constant:
+template <typename ValueType>
+class Varying {
+  public:
+    Varying (const ValueType* data) : data (data) { }
+    ValueType operator[] (size_t n) const { return data[n]; }
+  private:
+    const ValueType* data;
+};
+
+template <typename ValueType>
+class Uniform {
+  public:
+    Uniform (ValueType value) : value (value) { }
+    ValueType operator[] (size_t n) const { return value; }
+  private:
+    const ValueType value;
+};
+
+
+
+template <class Mode, class Operation, typename ResultType>
+class Kernel {
   public:
-    UnaryEvaluator (const std::string& name, Operation operation, const StackEntry& operand) : 
-      Evaluator (name, operation.format, operation.ZtoR, operation.RtoZ), 
-      op (operation) { 
-        operands.push_back (operand);
+    Kernel (const Operation& op, std::vector<ResultType>& out) : op (op), out (out) { }
+
+    template <class... Operands>
+      void operator() (const Operands&... operands) {
+        ResultType* o = &out[0];
+        const size_t size = out.size();
+        for (size_t n = 0; n < size; ++n)
+          o[n] = Mode::call (op, operands[n]...);
       }
 
-    Operation op;
+  private:
+    const Operation& op;
+    std::vector<ResultType>& out;
+};
 
-    virtual Chunk& evaluate (Chunk& in) const { 
-      if (operands[0].is_complex()) 
-        for (size_t n = 0; n < in.size(); ++n)
-          in[n] = op.Z (in[n]);
-      else 
-        for (size_t n = 0; n < in.size(); ++n)
-          in[n] = op.R (in[n].real());
 
-      return in; 
-    }
+
+// bind the accessor for the leading operand, and pass on the remainder:
+template <class Functor, class First>
+class Bind {
+  public:
+    Bind (Functor& functor, const First& first) : functor (functor), first (first) { }
+    template <class... Rest>
+      void operator() (const Rest&... rest) { functor (first, rest...); }
+  private:
+    Functor& functor;
+    const First first;
 };
 
+template <typename ValueType, class Functor>
+inline void dispatch (Functor& functor)
+{
+  functor();
+}
 
+template <typename ValueType, class Functor, class... Chunks>
+inline void dispatch (Functor& functor, Chunk& first, Chunks&... rest)
+{
+  if (first.is_scalar) {
+    Bind<Functor, Uniform<ValueType> > bound (functor, Uniform<ValueType> (first.scalar (ValueType())));
+    dispatch<ValueType> (bound, rest...);
+  }
+  else {
+    Bind<Functor, Varying<ValueType> > bound (functor, Varying<ValueType> (first.data (ValueType())));
+    dispatch<ValueType> (bound, rest...);
+  }
+}
 
 
+template <class Mode, class Operation, class... Chunks>
+inline void run_kernel (const Operation& op, Chunk& out, Chunks&... operands)
+{
+  typedef typename Mode::value_type value_type;
+  typedef decltype (Mode::call (op, (operands, value_type())...)) result_type;
+  Kernel<Mode, Operation, result_type> kernel (op, out.values (result_type()));
+  dispatch<value_type> (kernel, operands...);
+}
 
 
-template <class Operation>
-class BinaryEvaluator : public Evaluator 
+template <class Mode, class Operation, class... Args>
+inline bool result_is_complex (const Operation& op, Args... args)
 {
+  return std::is_same<decltype (Mode::call (op, args...)), complex_type>::value;
+}
+
+
+
+
+class OperationNode : public Node {
   public:
-    BinaryEvaluator (const std::string& name, Operation operation, const StackEntry& operand1, const StackEntry& operand2) : 
-      Evaluator (name, operation.format, operation.ZtoR, operation.RtoZ),
-      op (operation) { 
-        operands.push_back (operand1);
-        operands.push_back (operand2);
+    OperationNode (const std::string& name, const char* format, const std::vector<RefPtr<Node> >& operands) :
+      Node (operation_string (format, operands), operation_key (name, operands)),
+      operands (operands),
+      complex_operands (false) {
+        for (size_t n = 0; n < operands.size(); ++n)
+          if (operands[n]->is_complex)
+            complex_operands = true;
       }
 
-    Operation op;
+    const std::vector<RefPtr<Node> > operands;
+    bool complex_operands;
 
-    virtual Chunk& evaluate (Chunk& a, Chunk& b) const {
-      Chunk& out (a.size() ? a : b);
-      if (operands[0].is_complex() || operands[1].is_complex()) {
-        for (size_t n = 0; n < out.size(); ++n) 
-          out[n] = op.Z (
-              a.size() ? a[n] : a.value, 
-              b.size() ? b[n] : b.value );
+    void get_header (Image::Header& header) const {
+      for (size_t n = 0; n < operands.size(); ++n)
+        operands[n]->get_header (header);
+    }
+
+    void get_nodes (std::vector<Node*>& nodes) {
+      for (size_t n = 0; n < operands.size(); ++n)
+        operands[n]->get_nodes (nodes);
+      Node::get_nodes (nodes);
+    }
+
+  protected:
+    // check upfront that the operation is defined for the operand type:
+    template <class Function>
+      void check (const std::string& name, Function function) {
+        try { function(); }
+        catch (...) {
+          throw Exception ("operation \"" + name + "\" not supported for data type supplied");
+        }
       }
-      else {
-        for (size_t n = 0; n < out.size(); ++n) 
-          out[n] = op.R (
-              a.size() ? a[n].real() : a.value.real(), 
-              b.size() ? b[n].real() : b.value.real() );
+};
+
+
+
+template <class Operation>
+class UnaryNode : public OperationNode {
+  public:
+    UnaryNode (const std::string& name, const Operation& operation, const std::vector<RefPtr<Node> >& operands) :
+      OperationNode (name, operation.format, operands),
+      op (operation) {
+        const complex_type z (0.0);
+        const real_type r (0.0);
+        if (complex_operands) {
+          check (name, [&] { op.Z (z); });
+          is_complex = result_is_complex<ComplexValued> (op, z);
+        }
+        else {
+          check (name, [&] { op.R (r); });
+          is_complex = result_is_complex<RealValued> (op, r);
+        }
       }
-      return out;
+
+  protected:
+    const Operation op;
+
+    void compute (ThreadLocalStorage& storage, ThreadLocalStorageItem& item) const {
+      Chunk& a (operands[0]->evaluate (storage));
+      if (complex_operands)
+        run_kernel<ComplexValued> (op, item.chunk, a);
+      else
+        run_kernel<RealValued> (op, item.chunk, a);
     }
+};
+
+
+
+template <class Operation>
+class BinaryNode : public OperationNode {
+  public:
+    BinaryNode (const std::string& name, const Operation& operation, const std::vector<RefPtr<Node> >& operands) :
+      OperationNode (name, operation.format, operands),
+      op (operation) {
+        const complex_type z (0.0);
+        const real_type r (0.0);
+        if (complex_operands) {
+          check (name, [&] { op.Z (z, z); });
+          is_complex = result_is_complex<ComplexValued> (op, z, z);
+        }
+        else {
+          check (name, [&] { op.R (r, r); });
+          is_complex = result_is_complex<RealValued> (op, r, r);
+        }
+      }
 
+  protected:
+    const Operation op;
+
+    void compute (ThreadLocalStorage& storage, ThreadLocalStorageItem& item) const {
+      Chunk& a (operands[0]->evaluate (storage));
+      Chunk& b (operands[1]->evaluate (storage));
+      if (complex_operands)
+        run_kernel<ComplexValued> (op, item.chunk, a, b);
+      else
+        run_kernel<RealValued> (op, item.chunk, a, b);
+    }
 };
 
 
 
 template <class Operation>
-class TernaryEvaluator : public Evaluator 
-{
+class TernaryNode : public OperationNode {
   public:
-    TernaryEvaluator (const std::string& name, Operation operation, const StackEntry& operand1, const StackEntry& operand2, const StackEntry& operand3) : 
-      Evaluator (name, operation.format, operation.ZtoR, operation.RtoZ),
-      op (operation) { 
-        operands.push_back (operand1);
-        operands.push_back (operand2);
-        operands.push_back (operand3);
+    TernaryNode (const std::string& name, const Operation& operation, const std::vector<RefPtr<Node> >& operands) :
+      OperationNode (name, operation.format, operands),
+      op (operation) {
+        const complex_type z (0.0);
+        const real_type r (0.0);
+        if (complex_operands) {
+          check (name, [&] { op.Z (z, z, z); });
+          is_complex = result_is_complex<ComplexValued> (op, z, z, z);
+        }
+        else {
+          check (name, [&] { op.R (r, r, r); });
+          is_complex = result_is_complex<RealValued> (op, r, r, r);
+        }
       }
 
-    Operation op;
+  protected:
+    const Operation op;
+
+    void compute (ThreadLocalStorage& storage, ThreadLocalStorageItem& item) const {
+      Chunk& a (operands[0]->evaluate (storage));
+      Chunk& b (operands[1]->evaluate (storage));
+      Chunk& c (operands[2]->evaluate (storage));
+      if (complex_operands)
+        run_kernel<ComplexValued> (op, item.chunk, a, b, c);
+      else
+        run_kernel<RealValued> (op, item.chunk, a, b, c);
+    }
+};
+
+
+
+
+
+
 
-    virtual Chunk& evaluate (Chunk& a, Chunk& b, Chunk& c) const {
-      Chunk& out (a.size() ? a : (b.size() ? b : c));
-      if (operands[0].is_complex() || operands[1].is_complex() || operands[2].is_complex()) {
-        for (size_t n = 0; n < out.size(); ++n) 
-          out[n] = op.Z (
-              a.size() ? a[n] : a.value,
-              b.size() ? b[n] : b.value,
-              c.size() ? c[n] : c.value );
+class StackEntry {
+  public:
+    StackEntry (const char* entry) :
+      arg (entry) { }
+
+    StackEntry (const RefPtr<Node>& node) :
+      arg (NULL),
+      node (node) { }
+
+    const char* arg;
+    RefPtr<Node> node;
+};
+
+
+
+class Stack : public std::vector<StackEntry> {
+  public:
+
+    // return the node for the entry at the given depth from the top of the stack:
+    RefPtr<Node>& operator() (size_t depth) {
+      StackEntry& entry ((*this)[size()-1-depth]);
+      if (entry.arg) {
+        entry.node = load (entry.arg);
+        entry.arg = NULL;
       }
-      else {
-        for (size_t n = 0; n < out.size(); ++n) 
-          out[n] = op.R (
-              a.size() ? a[n].real() : a.value.real(), 
-              b.size() ? b[n].real() : b.value.real(), 
-              c.size() ? c[n].real() : c.value.real() );
+      return entry.node;
+    }
+
+    // replace the top num_operands entries with the node supplied, reusing an
+    // identical existing node if there is one:
+    void push (size_t num_operands, Node* node) {
+      RefPtr<Node> entry (node);
+      if (node->key.size()) {
+        std::map<std::string, RefPtr<Node> >::iterator existing = nodes.find (node->key);
+        if (existing != nodes.end())
+          entry = existing->second;
+        else
+          nodes[node->key] = entry;
       }
-      return out;
+      for (size_t n = 0; n < num_operands; ++n)
+        pop_back();
+      push_back (StackEntry (entry));
     }
 
+    bool has_operands (size_t num) const {
+      return size() >= num;
+    }
+
+  private:
+    std::map<std::string, RefPtr<Node> > nodes;
+
+    RefPtr<Node> load (const char* arg) {
+      std::map<std::string, RefPtr<Node> >::iterator existing = nodes.find (std::string ("image:") + arg);
+      if (existing != nodes.end())
+        return existing->second;
+
+      try {
+        Image::Header header (arg);
+        RefPtr<Node> node (new ImageNode (arg, header));
+        nodes[node->key] = node;
+        return node;
+      }
+      catch (Exception) {
+        std::string a = lowercase (arg);
+        complex_type value;
+        if      (a ==  "nan")  { value =  std::numeric_limits<real_type>::quiet_NaN(); }
+        else if (a == "-nan")  { value = -std::numeric_limits<real_type>::quiet_NaN(); }
+        else if (a ==  "inf")  { value =  std::numeric_limits<real_type>::infinity(); }
+        else if (a == "-inf")  { value = -std::numeric_limits<real_type>::infinity(); }
+        else if (a == "rand")  { return RefPtr<Node> (new RandomNode (false)); }
+        else if (a == "randn") { return RefPtr<Node> (new RandomNode (true)); }
+        else                   { value =  to<complex_type> (arg); }
+        return RefPtr<Node> (new ConstantNode (value, str (value)));
+      }
+    }
 };
 
 
 
 
 
+
 template <class Operation>
-void unary_operation (const std::string& operation_name, std::vector<StackEntry>& stack, Operation operation)
+void unary_operation (const std::string& operation_name, Stack& stack, Operation operation)
 {
-  if (stack.empty()) 
+  if (!stack.has_operands (1))
     throw Exception ("no operand in stack for operation \"" + operation_name + "\"!");
-  StackEntry& a (stack[stack.size()-1]);
-  a.load();
-  if (a.evaluator || a.buffer) {
-    StackEntry entry (new UnaryEvaluator<Operation> (operation_name, operation, stack.back()));
-    stack.back() = entry;
-  }
-  else {
+  std::vector<RefPtr<Node> > operands (1, stack(0));
+  if (operands[0]->is_constant()) {
+    const complex_type a (operands[0]->constant_value());
+    complex_type value;
     try {
-      a.value = ( a.value.imag() == 0.0 ? operation.R (a.value.real()) : operation.Z (a.value) );
+      value = ( a.imag() == 0.0 ? complex_type (operation.R (a.real())) : complex_type (operation.Z (a)) );
     }
     catch (...) {
       throw Exception ("operation \"" + operation_name + "\" not supported for data type supplied");
     }
+    stack.push (1, new ConstantNode (value, operation_string (operation.format, operands)));
   }
-};
+  else
+    stack.push (1, new UnaryNode<Operation> (operation_name, operation, operands));
+}
 
 
 
 
 
 template <class Operation>
-void binary_operation (const std::string& operation_name, std::vector<StackEntry>& stack, Operation operation)
+void binary_operation (const std::string& operation_name, Stack& stack, Operation operation)
 {
-  if (stack.size() < 2) 
+  if (!stack.has_operands (2))
     throw Exception ("not enough operands in stack for operation \"" + operation_name + "\"");
-  StackEntry& a (stack[stack.size()-2]);
-  StackEntry& b (stack[stack.size()-1]);
-  a.load();
-  b.load();
-  if (a.evaluator || a.buffer || b.evaluator || b.buffer) {
-    StackEntry entry (new BinaryEvaluator<Operation> (operation_name, operation, stack[stack.size()-2], stack[stack.size()-1]));
-    stack.pop_back();
-    stack.back() = entry;
-  }
-  else {
-    a.value = ( a.value.imag() == 0.0  && b.value.imag() == 0.0 ? 
-      operation.R (a.value.real(), b.value.real()) :
-      operation.Z (a.value, b.value) );
-    stack.pop_back();
+  std::vector<RefPtr<Node> > operands;
+  operands.push_back (stack(1));
+  operands.push_back (stack(0));
+  if (operands[0]->is_constant() && operands[1]->is_constant()) {
+    const complex_type a (operands[0]->constant_value());
+    const complex_type b (operands[1]->constant_value());
+    complex_type value;
+    try {
+      value = ( a.imag() == 0.0 && b.imag() == 0.0 ?
+          complex_type (operation.R (a.real(), b.real())) :
+          complex_type (operation.Z (a, b)) );
+    }
+    catch (...) {
+      throw Exception ("operation \"" + operation_name + "\" not supported for data type supplied");
+    }
+    stack.push (2, new ConstantNode (value, operation_string (operation.format, operands)));
   }
+  else
+    stack.push (2, new BinaryNode<Operation> (operation_name, operation, operands));
 }
 
 
 
 
 template <class Operation>
-void ternary_operation (const std::string& operation_name, std::vector<StackEntry>& stack, Operation operation)
+void ternary_operation (const std::string& operation_name, Stack& stack, Operation operation)
 {
-  if (stack.size() < 3) 
+  if (!stack.has_operands (3))
     throw Exception ("not enough operands in stack for operation \"" + operation_name + "\"");
-  StackEntry& a (stack[stack.size()-3]);
-  StackEntry& b (stack[stack.size()-2]);
-  StackEntry& c (stack[stack.size()-1]);
-  a.load();
-  b.load();
-  c.load();
-  if (a.evaluator || a.buffer || b.evaluator || b.buffer || c.evaluator || c.buffer) {
-    StackEntry entry (new TernaryEvaluator<Operation> (operation_name, operation, stack[stack.size()-3], stack[stack.size()-2], stack[stack.size()-1]));
-    stack.pop_back();
-    stack.pop_back();
-    stack.back() = entry;
-  }
-  else {
-    a.value = ( a.value.imag() == 0.0  && b.value.imag() == 0.0  && c.value.imag() == 0.0 ? 
-      operation.R (a.value.real(), b.value.real(), c.value.real()) :
-      operation.Z (a.value, b.value, c.value) );
-    stack.pop_back();
-    stack.pop_back();
+  std::vector<RefPtr<Node> > operands;
+  operands.push_back (stack(2));
+  operands.push_back (stack(1));
+  operands.push_back (stack(0));
+  if (operands[0]->is_constant() && operands[1]->is_constant() && operands[2]->is_constant()) {
+    const complex_type a (operands[0]->constant_value());
+    const complex_type b (operands[1]->constant_value());
+    const complex_type c (operands[2]->constant_value());
+    complex_type value;
+    try {
+      value = ( a.imag() == 0.0 && b.imag() == 0.0 && c.imag() == 0.0 ?
+          complex_type (operation.R (a.real(), b.real(), c.real())) :
+          complex_type (operation.Z (a, b, c)) );
+    }
+    catch (...) {
+      throw Exception ("operation \"" + operation_name + "\" not supported for data type supplied");
+    }
+    stack.push (3, new ConstantNode (value, operation_string (operation.format, operands)));
   }
+  else
+    stack.push (3, new TernaryNode<Operation> (operation_name, operation, operands));
 }
 
 
@@ -546,122 +871,86 @@ void ternary_operation (const std::string& operation_name, std::vector<StackEntr
  **********************************************************************/
 
 
-void get_header (const StackEntry& entry, Image::Header& header) 
-{
-  if (entry.evaluator) {
-    for (size_t n = 0; n < entry.evaluator->operands.size(); ++n)
-      get_header (entry.evaluator->operands[n], header);
-    return;
-  }
-
-  if (!entry.buffer) 
-    return;
-
-  if (header.ndim() == 0) {
-    header = *entry.buffer;
-    return;
-  }
-
-  if (header.ndim() < entry.buffer->ndim()) 
-    header.set_ndim (entry.buffer->ndim());
-  for (size_t n = 0; n < std::min (header.ndim(), entry.buffer->ndim()); ++n) {
-    if (header.dim(n) > 1 && entry.buffer->dim(n) > 1 && header.dim(n) != entry.buffer->dim(n))
-      throw Exception ("dimensions of input images do not match - aborting");
-    header.dim(n) = std::max (header.dim(n), entry.buffer->dim(n));
-    if (!std::isfinite (header.vox(n))) 
-      header.vox(n) = entry.buffer->vox(n);
-  }
-
-}
-
-
-
-
-
-
+template <typename ValueType>
 class ThreadFunctor {
   public:
     ThreadFunctor (
         const Image::ThreadedLoop& threaded_loop,
-        const StackEntry& top_of_stack, 
-        Image::Buffer<complex_type>& output_image) :
-      top_entry (top_of_stack),
+        const RefPtr<Node>& top_of_stack,
+        Image::Buffer<ValueType>& output_image) :
+      top_node (top_of_stack),
       vox (output_image),
       loop (threaded_loop.inner_axes()) {
         storage.axes = loop.axes();
         storage.dim.push_back (vox.dim(storage.axes[0]));
         storage.dim.push_back (vox.dim(storage.axes[1]));
-        chunk_size = vox.dim (storage.axes[0]) * vox.dim (storage.axes[1]);
-        allocate_storage (top_entry);
-      }
-
-    void allocate_storage (const StackEntry& entry) {
-      if (entry.evaluator) {
-        for (size_t n = 0; n < entry.evaluator->operands.size(); ++n)
-          allocate_storage (entry.evaluator->operands[n]);
-        return;
-      }
 
-      storage.push_back (ThreadLocalStorageItem());
-      if (entry.buffer) {
-        storage.back().vox = new complex_vox_type (*entry.buffer);
-        storage.back().chunk.resize (chunk_size);
-        return;
-      }
-      else if (entry.rng) {
-        storage.back().chunk.resize (chunk_size);
+        std::vector<Node*> nodes;
+        top_node->get_nodes (nodes);
+        storage.resize (nodes.size());
+        for (size_t n = 0; n < nodes.size(); ++n) {
+          nodes[n]->index = n;
+          nodes[n]->allocate (storage[n], storage.chunk_size());
+        }
       }
-      else storage.back().chunk.value = entry.value;
-    }
 
 
     void operator() (const Image::Iterator& iter) {
       storage.reset (iter);
       Image::voxel_assign (vox, iter);
 
-      Chunk& chunk = top_entry.evaluate (storage);
-
-      std::vector<complex_type>::const_iterator value (chunk.begin());
-      for (auto l = loop (vox); l; ++l) 
+      const ValueType* value = top_node->evaluate (storage).data (ValueType());
+      for (auto l = loop (vox); l; ++l)
         vox.value() = *(value++);
     }
 
 
 
-    const StackEntry& top_entry;
-    complex_vox_type vox;
+    const RefPtr<Node> top_node;
+    typename Image::Buffer<ValueType>::voxel_type vox;
     Image::LoopInOrder loop;
     ThreadLocalStorage storage;
-    size_t chunk_size;
 };
 
 
 
+template <typename ValueType>
+void run_operations (const RefPtr<Node>& top, const std::string& output_path, const Image::Header& header)
+{
+  Image::Buffer<ValueType> output (output_path, header);
+
+  Image::ThreadedLoop loop ("computing: " + top->description + " ...", output, 0, output.ndim(), 2);
+
+  ThreadFunctor<ValueType> functor (loop, top, output);
+  loop.run_outer (functor);
+}
+
 
 
-void run_operations (const std::vector<StackEntry>& stack) 
+void run_operations (Stack& stack)
 {
   if (!stack[1].arg)
-    throw Exception (std::string ("error opening output image \"") + stack[1].arg + "\"!");
+    throw Exception ("error opening output image!");
+  const std::string output_path (stack[1].arg);
+  stack.pop_back();
+  const RefPtr<Node> top (stack(0));
 
   Image::Header header;
-  get_header (stack[0], header);
+  top->get_header (header);
   if (header.ndim() == 0)
     throw Exception ("no valid images supplied - cannot produce output image");
 
-  if (stack[0].is_complex()) {
+  if (top->is_complex) {
     header.datatype() = DataType::from_command_line (DataType::CFloat32);
     if (!header.datatype().is_complex())
       throw Exception ("output datatype must be complex");
   }
   else header.datatype() = DataType::from_command_line (DataType::Float32);
 
-  Image::Buffer<complex_type> output (stack[1].arg, header);
-
-  Image::ThreadedLoop loop ("computing: " + operation_string(stack[0]) + " ...", output, 0, output.ndim(), 2);
-
-  ThreadFunctor functor (loop, stack[0], output);
-  loop.run_outer (functor);
+  if (header.datatype().is_complex())
+    run_operations<complex_type> (top, output_path, header);
+  else
+    run_operations<real_type> (top, output_path, header);
 }
 
 
@@ -674,38 +963,39 @@ void run_operations (const std::vector<StackEntry>& stack)
         OPERATIONS BASIC FRAMEWORK:
 **********************************************************************/
 
+// Operations define R() for real operands and/or Z() for complex operands.
+// The return type of each determines whether the result is real or complex;
+// the default implementations throw to indicate the operation is not
+// supported for that type.
 class OpBase {
   public:
-    OpBase (const char* format_string, bool complex_maps_to_real = false, bool real_map_to_complex = false) :
-      format (format_string),
-      ZtoR (complex_maps_to_real),
-      RtoZ (real_map_to_complex) { }
+    OpBase (const char* format_string) :
+      format (format_string) { }
     const char* format;
-    const bool ZtoR, RtoZ;
 };
 
 class OpUnary : public OpBase {
   public:
-    OpUnary (const char* format_string, bool complex_maps_to_real = false, bool real_map_to_complex = false) :
-      OpBase (format_string, complex_maps_to_real, real_map_to_complex) { }
-    complex_type R (real_type v) const { throw Exception ("operation not supported!"); return v; }
+    OpUnary (const char* format_string) :
+      OpBase (format_string) { }
+    real_type R (real_type v) const { throw Exception ("operation not supported!"); return v; }
     complex_type Z (complex_type v) const { throw Exception ("operation not supported!"); return v; }
 };
 
 
 class OpBinary : public OpBase {
   public:
-    OpBinary (const char* format_string, bool complex_maps_to_real = false, bool real_map_to_complex = false) :
-      OpBase (format_string, complex_maps_to_real, real_map_to_complex) { }
-    complex_type R (real_type a, real_type b) const { throw Exception ("operation not supported!"); return a; }
+    OpBinary (const char* format_string) :
+      OpBase (format_string) { }
+    real_type R (real_type a, real_type b) const { throw Exception ("operation not supported!"); return a; }
     complex_type Z (complex_type a, complex_type b) const { throw Exception ("operation not supported!"); return a; }
 };
 
 class OpTernary : public OpBase {
   public:
-    OpTernary (const char* format_string, bool complex_maps_to_real = false, bool real_map_to_complex = false) :
-      OpBase (format_string, complex_maps_to_real, real_map_to_complex) { }
-    complex_type R (real_type a, real_type b, real_type c) const { throw Exception ("operation not supported!"); return a; }
+    OpTernary (const char* format_string) :
+      OpBase (format_string) { }
+    real_type R (real_type a, real_type b, real_type c) const { throw Exception ("operation not supported!"); return a; }
     complex_type Z (complex_type a, complex_type b, complex_type c) const { throw Exception ("operation not supported!"); return a; }
 };
 
@@ -717,159 +1007,159 @@ class OpTernary : public OpBase {
 
 class OpAbs : public OpUnary {
   public:
-    OpAbs () : OpUnary ("|%1|", true) { }
-    complex_type R (real_type v) const { return std::abs (v); }
-    complex_type Z (complex_type v) const { return std::abs (v); }
+    OpAbs () : OpUnary ("|%1|") { }
+    real_type R (real_type v) const { return std::abs (v); }
+    real_type Z (complex_type v) const { return std::abs (v); }
 };
 
 class OpNeg : public OpUnary {
   public:
     OpNeg () : OpUnary ("-%1") { }
-    complex_type R (real_type v) const { return -v; }
+    real_type R (real_type v) const { return -v; }
     complex_type Z (complex_type v) const { return -v; }
 };
 
 class OpSqrt : public OpUnary {
   public:
     OpSqrt () : OpUnary ("sqrt (%1)") { } 
-    complex_type R (real_type v) const { return std::sqrt (v); }
+    real_type R (real_type v) const { return std::sqrt (v); }
     complex_type Z (complex_type v) const { return std::sqrt (v); }
 };
 
 class OpExp : public OpUnary {
   public:
     OpExp () : OpUnary ("exp (%1)") { }
-    complex_type R (real_type v) const { return std::exp (v); }
+    real_type R (real_type v) const { return std::exp (v); }
     complex_type Z (complex_type v) const { return std::exp (v); }
 };
 
 class OpLog : public OpUnary {
   public:
     OpLog () : OpUnary ("log (%1)") { }
-    complex_type R (real_type v) const { return std::log (v); }
+    real_type R (real_type v) const { return std::log (v); }
     complex_type Z (complex_type v) const { return std::log (v); }
 };
 
 class OpLog10 : public OpUnary {
   public:
     OpLog10 () : OpUnary ("log10 (%1)") { }
-    complex_type R (real_type v) const { return std::log10 (v); }
+    real_type R (real_type v) const { return std::log10 (v); }
     complex_type Z (complex_type v) const { return std::log10 (v); }
 };
 
 class OpCos : public OpUnary {
   public:
     OpCos () : OpUnary ("cos (%1)") { } 
-    complex_type R (real_type v) const { return std::cos (v); }
+    real_type R (real_type v) const { return std::cos (v); }
     complex_type Z (complex_type v) const { return std::cos (v); }
 };
 
 class OpSin : public OpUnary {
   public:
     OpSin () : OpUnary ("sin (%1)") { } 
-    complex_type R (real_type v) const { return std::sin (v); }
+    real_type R (real_type v) const { return std::sin (v); }
     complex_type Z (complex_type v) const { return std::sin (v); }
 };
 
 class OpTan : public OpUnary {
   public:
     OpTan () : OpUnary ("tan (%1)") { }
-    complex_type R (real_type v) const { return std::tan (v); }
+    real_type R (real_type v) const { return std::tan (v); }
     complex_type Z (complex_type v) const { return std::tan (v); }
 };
 
 class OpCosh : public OpUnary {
   public:
     OpCosh () : OpUnary ("cosh (%1)") { }
-    complex_type R (real_type v) const { return std::cosh (v); }
+    real_type R (real_type v) const { return std::cosh (v); }
     complex_type Z (complex_type v) const { return std::cosh (v); }
 };
 
 class OpSinh : public OpUnary {
   public:
     OpSinh () : OpUnary ("sinh (%1)") { }
-    complex_type R (real_type v) const { return std::sinh (v); }
+    real_type R (real_type v) const { return std::sinh (v); }
     complex_type Z (complex_type v) const { return std::sinh (v); }
 };
 
 class OpTanh : public OpUnary {
   public:
     OpTanh () : OpUnary ("tanh (%1)") { } 
-    complex_type R (real_type v) const { return std::tanh (v); }
+    real_type R (real_type v) const { return std::tanh (v); }
     complex_type Z (complex_type v) const { return std::tanh (v); }
 };
 
 class OpAcos : public OpUnary {
   public:
     OpAcos () : OpUnary ("acos (%1)") { }
-    complex_type R (real_type v) const { return std::acos (v); }
+    real_type R (real_type v) const { return std::acos (v); }
 };
 
 class OpAsin : public OpUnary {
   public:
     OpAsin () : OpUnary ("asin (%1)") { } 
-    complex_type R (real_type v) const { return std::asin (v); }
+    real_type R (real_type v) const { return std::asin (v); }
 };
 
 class OpAtan : public OpUnary {
   public:
     OpAtan () : OpUnary ("atan (%1)") { }
-    complex_type R (real_type v) const { return std::atan (v); }
+    real_type R (real_type v) const { return std::atan (v); }
 };
 
 class OpAcosh : public OpUnary {
   public:
     OpAcosh () : OpUnary ("acosh (%1)") { } 
-    complex_type R (real_type v) const { return std::acosh (v); }
+    real_type R (real_type v) const { return std::acosh (v); }
 };
 
 class OpAsinh : public OpUnary {
   public:
     OpAsinh () : OpUnary ("asinh (%1)") { }
-    complex_type R (real_type v) const { return std::asinh (v); }
+    real_type R (real_type v) const { return std::asinh (v); }
 };
 
 class OpAtanh : public OpUnary {
   public:
     OpAtanh () : OpUnary ("atanh (%1)") { }
-    complex_type R (real_type v) const { return std::atanh (v); }
+    real_type R (real_type v) const { return std::atanh (v); }
 };
 
 
 class OpRound : public OpUnary {
   public:
     OpRound () : OpUnary ("round (%1)") { } 
-    complex_type R (real_type v) const { return std::round (v); }
+    real_type R (real_type v) const { return std::round (v); }
 };
 
 class OpCeil : public OpUnary {
   public:
     OpCeil () : OpUnary ("ceil (%1)") { } 
-    complex_type R (real_type v) const { return std::ceil (v); }
+    real_type R (real_type v) const { return std::ceil (v); }
 };
 
 class OpFloor : public OpUnary {
   public:
     OpFloor () : OpUnary ("floor (%1)") { }
-    complex_type R (real_type v) const { return std::floor (v); }
+    real_type R (real_type v) const { return std::floor (v); }
 };
 
 class OpReal : public OpUnary {
   public:
-    OpReal () : OpUnary ("real (%1)", true) { }
-    complex_type Z (complex_type v) const { return v.real(); }
+    OpReal () : OpUnary ("real (%1)") { }
+    real_type Z (complex_type v) const { return v.real(); }
 };
 
 class OpImag : public OpUnary {
   public:
-    OpImag () : OpUnary ("imag (%1)", true) { }
-    complex_type Z (complex_type v) const { return v.imag(); }
+    OpImag () : OpUnary ("imag (%1)") { }
+    real_type Z (complex_type v) const { return v.imag(); }
 };
 
 class OpPhase : public OpUnary {
   public:
-    OpPhase () : OpUnary ("phase (%1)", true) { }
-    complex_type Z (complex_type v) const { return std::arg (v); }
+    OpPhase () : OpUnary ("phase (%1)") { }
+    real_type Z (complex_type v) const { return std::arg (v); }
 };
 
 class OpConj : public OpUnary {
@@ -880,23 +1170,23 @@ class OpConj : public OpUnary {
 
 class OpIsNaN : public OpUnary {
   public:
-    OpIsNaN () : OpUnary ("isnan (%1)", true, false) { }
-    complex_type R (real_type v) const { return std::isnan (v) != 0; }
-    complex_type Z (complex_type v) const { return std::isnan (v.real()) != 0 || std::isnan (v.imag()) != 0; }
+    OpIsNaN () : OpUnary ("isnan (%1)") { }
+    real_type R (real_type v) const { return std::isnan (v) != 0; }
+    real_type Z (complex_type v) const { return std::isnan (v.real()) != 0 || std::isnan (v.imag()) != 0; }
 };
 
 class OpIsInf : public OpUnary {
   public:
-    OpIsInf () : OpUnary ("isinf (%1)", true, false) { }
-    complex_type R (real_type v) const { return std::isinf (v) != 0; }
-    complex_type Z (complex_type v) const { return std::isinf (v.real()) != 0 || std::isinf (v.imag()) != 0; }
+    OpIsInf () : OpUnary ("isinf (%1)") { }
+    real_type R (real_type v) const { return std::isinf (v) != 0; }
+    real_type Z (complex_type v) const { return std::isinf (v.real()) != 0 || std::isinf (v.imag()) != 0; }
 };
 
 class OpFinite : public OpUnary {
   public:
-    OpFinite () : OpUnary ("finite (%1)", true, false) { }
-    complex_type R (real_type v) const { return std::isfinite (v) != 0; }
-    complex_type Z (complex_type v) const { return std::isfinite (v.real()) != 0|| std::isfinite (v.imag()) != 0; }
+    OpFinite () : OpUnary ("finite (%1)") { }
+    real_type R (real_type v) const { return std::isfinite (v) != 0; }
+    real_type Z (complex_type v) const { return std::isfinite (v.real()) != 0|| std::isfinite (v.imag()) != 0; }
 };
 
 
@@ -907,91 +1197,91 @@ class OpFinite : public OpUnary {
 class OpAdd : public OpBinary {
   public:
     OpAdd () : OpBinary ("(%1 + %2)") { } 
-    complex_type R (real_type a, real_type b) const { return a+b; }
+    real_type R (real_type a, real_type b) const { return a+b; }
     complex_type Z (complex_type a, complex_type b) const { return a+b; }
 };
 
 class OpSubtract : public OpBinary {
   public:
     OpSubtract () : OpBinary ("(%1 - %2)") { } 
-    complex_type R (real_type a, real_type b) const { return a-b; }
+    real_type R (real_type a, real_type b) const { return a-b; }
     complex_type Z (complex_type a, complex_type b) const { return a-b; }
 };
 
 class OpMultiply : public OpBinary {
   public:
     OpMultiply () : OpBinary ("(%1 * %2)") { }
-    complex_type R (real_type a, real_type b) const { return a*b; }
+    real_type R (real_type a, real_type b) const { return a*b; }
     complex_type Z (complex_type a, complex_type b) const { return a*b; }
 };
 
 class OpDivide : public OpBinary {
   public:
     OpDivide () : OpBinary ("(%1 / %2)") { } 
-    complex_type R (real_type a, real_type b) const { return a/b; }
+    real_type R (real_type a, real_type b) const { return a/b; }
     complex_type Z (complex_type a, complex_type b) const { return a/b; }
 };
 
 class OpPow : public OpBinary {
   public:
     OpPow () : OpBinary ("%1^%2") { }
-    complex_type R (real_type a, real_type b) const { return std::pow (a, b); }
+    real_type R (real_type a, real_type b) const { return std::pow (a, b); }
     complex_type Z (complex_type a, complex_type b) const { return std::pow (a, b); }
 };
 
 class OpMin : public OpBinary {
   public:
     OpMin () : OpBinary ("min (%1, %2)") { }
-    complex_type R (real_type a, real_type b) const { return std::min (a, b); }
+    real_type R (real_type a, real_type b) const { return std::min (a, b); }
 };
 
 class OpMax : public OpBinary {
   public:
     OpMax () : OpBinary ("max (%1, %2)") { } 
-    complex_type R (real_type a, real_type b) const { return std::max (a, b); }
+    real_type R (real_type a, real_type b) const { return std::max (a, b); }
 };
 
 class OpLessThan : public OpBinary {
   public:
     OpLessThan () : OpBinary ("(%1 < %2)") { }
-    complex_type R (real_type a, real_type b) const { return a < b; }
+    real_type R (real_type a, real_type b) const { return a < b; }
 };
 
 class OpGreaterThan : public OpBinary {
   public:
     OpGreaterThan () : OpBinary ("(%1 > %2)") { } 
-    complex_type R (real_type a, real_type b) const { return a > b; }
+    real_type R (real_type a, real_type b) const { return a > b; }
 };
 
 class OpLessThanOrEqual : public OpBinary {
   public:
     OpLessThanOrEqual () : OpBinary ("(%1 <= %2)") { }
-    complex_type R (real_type a, real_type b) const { return a <= b; }
+    real_type R (real_type a, real_type b) const { return a <= b; }
 };
 
 class OpGreaterThanOrEqual : public OpBinary {
   public:
     OpGreaterThanOrEqual () : OpBinary ("(%1 >= %2)") { } 
-    complex_type R (real_type a, real_type b) const { return a >= b; }
+    real_type R (real_type a, real_type b) const { return a >= b; }
 };
 
 class OpEqual : public OpBinary {
   public:
-    OpEqual () : OpBinary ("(%1 == %2)", true) { }
-    complex_type R (real_type a, real_type b) const { return a == b; }
-    complex_type Z (complex_type a, complex_type b) const { return a == b; }
+    OpEqual () : OpBinary ("(%1 == %2)") { }
+    real_type R (real_type a, real_type b) const { return a == b; }
+    real_type Z (complex_type a, complex_type b) const { return a == b; }
 };
 
 class OpNotEqual : public OpBinary {
   public:
-    OpNotEqual () : OpBinary ("(%1 != %2)", true) { }
-    complex_type R (real_type a, real_type b) const { return a != b; }
-    complex_type Z (complex_type a, complex_type b) const { return a != b; }
+    OpNotEqual () : OpBinary ("(%1 != %2)") { }
+    real_type R (real_type a, real_type b) const { return a != b; }
+    real_type Z (complex_type a, complex_type b) const { return a != b; }
 };
 
 class OpComplex : public OpBinary {
   public:
-    OpComplex () : OpBinary ("(%1 + %2 i)", false, true) { }
+    OpComplex () : OpBinary ("(%1 + %2 i)") { }
     complex_type R (real_type a, real_type b) const { return complex_type (a, b); }
 };
 
@@ -1008,7 +1298,7 @@ class OpComplex : public OpBinary {
 class OpIf : public OpTernary {
   public:
     OpIf () : OpTernary ("(%1 ? %2 : %3)") { }
-    complex_type R (real_type a, real_type b, real_type c) const { return a ? b : c; }
+    real_type R (real_type a, real_type b, real_type c) const { return a ? b : c; }
     complex_type Z (complex_type a, complex_type b, complex_type c) const { return a.real() ? b : c; }
 };
 
@@ -1019,7 +1309,7 @@ class OpIf : public OpTernary {
  **********************************************************************/
 
 void run () {
-  std::vector<StackEntry> stack;
+  Stack stack;
 
   for (int n = 1; n < App::argc; ++n) {
 
@@ -1098,9 +1388,9 @@ void run () {
   //print_stack( stack);
 
   if (stack.size() == 1) {
-    if (stack[0].evaluator || stack[0].buffer) 
+    if (!stack(0)->is_constant())
       throw Exception ("output image not specified");
-    print (str(stack[0].value) + "\n");
+    print (str(stack(0)->constant_value()) + "\n");
     return;
   }
 
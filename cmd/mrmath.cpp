@@ -23,6 +23,7 @@
 #include "command.h"
 #include "progressbar.h"
 #include "ptr.h"
+#include "thread_queue.h"
 #include "image/buffer.h"
 #include "image/buffer_preload.h"
 #include "image/buffer_scratch.h"
@@ -30,8 +31,11 @@
 #include "image/threaded_loop.h"
 #include "image/utils.h"
 #include "image/voxel.h"
+#include "image/handler/default.h"
 #include "math/math.h"
 
+#include <algorithm>
+#include <atomic>
 #include <limits>
 #include <vector>
 
@@ -50,6 +54,9 @@ const char* operations[] = {
   "max",
   "absmax", // Maximum of absolute values
   "magmax", // Value for which the magnitude is the maximum (i.e. preserves signed-ness)
+  "median",
+  "percentile",
+  "trimmedmean",
   NULL
 };
 
@@ -61,7 +68,14 @@ void usage ()
 
     + "mean, sum, product, rms (root-mean-square value), var (unbiased variance), "
     "std (unbiased standard deviation), min, max, absmax (maximum absolute value), "
-    "magmax (value with maximum absolute value, preserving its sign)."
+    "magmax (value with maximum absolute value, preserving its sign), "
+    "median, percentile (as set using the -percentile option), "
+    "trimmedmean (mean after discarding the fraction of lowest and highest values set using the -trim option)."
+
+    + "When operating across multiple input images, the images are processed "
+    "one row at a time: each row is read from all input images concurrently, "
+    "so that the amount of memory required does not depend on the number of "
+    "input images."
 
     + "See also 'mrcalc' to compute per-voxel operations.";
 
@@ -72,7 +86,14 @@ void usage ()
 
   OPTIONS
   + Option ("axis", "perform operation along a specified axis of a single input image")
-    + Argument ("index").type_integer();
+    + Argument ("index").type_integer()
+
+  + Option ("percentile", "the percentile to compute for the 'percentile' operation (default = 50)")
+    + Argument ("value").type_float (0.0, 50.0, 100.0)
+
+  + Option ("trim", "the fraction of values to discard from each end of the distribution "
+                    "for the 'trimmedmean' operation (default = 0.1)")
+    + Argument ("fraction").type_float (0.0, 0.1, 0.49);
 
 }
 
@@ -231,40 +252,232 @@ class MagMax {
 
 
 
+// Accumulating operations are applied to each value in turn:
 template <class Operation>
+class Accumulate {
+  public:
+    value_type operator() (value_type* begin, value_type* end) const {
+      Operation op;
+      for (; begin != end; ++begin)
+        op (*begin);
+      return op.result();
+    }
+};
+
+
+// Order statistics are computed in-place over the full set of values:
+class Percentile {
+  public:
+    Percentile (const float percentile) : fraction (percentile / 100.0) { }
+    value_type operator() (value_type* begin, value_type* end) const {
+      end = std::partition (begin, end, [] (value_type val) { return std::isfinite (val); });
+      if (begin == end)
+        return NAN;
+      const double rank = fraction * (end - begin - 1);
+      value_type* lower = begin + size_t (rank);
+      std::nth_element (begin, lower, end);
+      if (lower+1 == end || rank == size_t (rank))
+        return *lower;
+      const value_type upper = *std::min_element (lower+1, end);
+      return *lower + (rank - size_t (rank)) * (upper - *lower);
+    }
+  protected:
+    const double fraction;
+};
+
+
+class Median : public Percentile {
+  public:
+    Median () : Percentile (50.0) { }
+};
+
+
+class TrimmedMean {
+  public:
+    TrimmedMean (const float trim) : trim (trim) { }
+    value_type operator() (value_type* begin, value_type* end) const {
+      end = std::partition (begin, end, [] (value_type val) { return std::isfinite (val); });
+      if (begin == end)
+        return NAN;
+      const size_t discard = trim * (end - begin);
+      if (discard) {
+        std::nth_element (begin, begin + discard, end);
+        std::nth_element (begin + discard, end - discard - 1, end);
+      }
+      double sum = 0.0;
+      for (value_type* p = begin + discard; p != end - discard; ++p)
+        sum += *p;
+      return sum / double (end - begin - 2*discard);
+    }
+  protected:
+    const float trim;
+};
+
+
+
+
+
+template <class Reducer>
 class AxisKernel {
   public:
-    AxisKernel (size_t axis) : axis (axis) { }
+    AxisKernel (const Reducer& reducer, size_t axis) : reducer (reducer), axis (axis) { }
 
     template <class InputVoxelType, class OutputVoxelType>
       void operator() (InputVoxelType& in, OutputVoxelType& out) {
-        Operation op;
+        values.resize (in.dim(axis));
         for (in[axis] = 0; in[axis] < in.dim(axis); ++in[axis])
-          op (in.value());
-        out.value() = op.result();
+          values[in[axis]] = in.value();
+        out.value() = reducer (&values[0], &values[0] + values.size());
       }
   protected:
+    const Reducer reducer;
     const size_t axis;
+    std::vector<value_type> values;
 };
 
 
 
 
 
-class ImageKernelBase {
+// Processing across images is performed one row (along the first axis) at a
+//   time: the loader(s) read the same row from all input images, the reducers
+//   compute the operation for each voxel of the row, and the writer stores the
+//   result. The queues between stages bound the number of rows held in memory,
+//   while allowing the next rows to be read as the current ones are processed.
+class Row {
   public:
-    ImageKernelBase (const std::string& path) :
-      output_path (path) { }
-    virtual ~ImageKernelBase() { }
-    virtual void process (const Image::Header& image_in) = 0;
-  protected:
-    const std::string output_path;
+    Row () : index (0) { }
+    size_t index;
+    // for input rows, the values of all input images for each voxel are contiguous:
+    std::vector<value_type> data;
+};
+
+
+class RowIndexer {
+  public:
+    RowIndexer (const Image::Header& header) :
+      header (header),
+      num_rows (Image::voxel_count (header, 1, header.ndim())),
+      next (0) { }
+
+    bool get (size_t& index) {
+      index = next++;
+      return index < num_rows;
+    }
+
+    // set the position of the voxel along all axes but the first:
+    template <class VoxelType> 
+      void set_position (VoxelType& vox, size_t index) const {
+        for (size_t axis = 1; axis < header.ndim(); ++axis) {
+          vox[axis] = index % header.dim(axis);
+          index /= header.dim(axis);
+        }
+      }
+
+    const Image::Header& header;
+    const size_t num_rows;
+  private:
+    std::atomic<size_t> next;
 };
 
 
+class RowLoader {
+  public:
+    RowLoader (RowIndexer& indexer, VecPtr<BufferType>& buffers) :
+      indexer (indexer),
+      buffers (buffers) {
+        for (size_t i = 0; i != buffers.size(); ++i)
+          voxels.push_back (new VoxelType (*buffers[i]));
+      }
+
+    RowLoader (const RowLoader& that) :
+      indexer (that.indexer),
+      buffers (that.buffers) {
+        for (size_t i = 0; i != buffers.size(); ++i)
+          voxels.push_back (new VoxelType (*buffers[i]));
+      }
+
+    bool operator() (Row& row) {
+      if (!indexer.get (row.index))
+        return false;
+      const size_t num_inputs = voxels.size();
+      const size_t row_length = indexer.header.dim(0);
+      row.data.resize (num_inputs * row_length);
+      for (size_t i = 0; i != num_inputs; ++i) {
+        VoxelType& vox (*voxels[i]);
+        indexer.set_position (vox, row.index);
+        for (vox[0] = 0; vox[0] < ssize_t (row_length); ++vox[0])
+          row.data[vox[0]*num_inputs + i] = vox.value();
+      }
+      return true;
+    }
 
+  private:
+    RowIndexer& indexer;
+    VecPtr<BufferType>& buffers;
+    VecPtr<VoxelType> voxels;
+};
+
+
+template <class Reducer>
+class RowReducer {
+  public:
+    RowReducer (const Reducer& reducer, const size_t num_inputs) :
+      reducer (reducer),
+      num_inputs (num_inputs) { }
+
+    bool operator() (Row& in, Row& out) {
+      const size_t row_length = in.data.size() / num_inputs;
+      out.index = in.index;
+      out.data.resize (row_length);
+      for (size_t n = 0; n != row_length; ++n) 
+        out.data[n] = reducer (&in.data[n*num_inputs], &in.data[(n+1)*num_inputs]);
+      return true;
+    }
+
+  private:
+    const Reducer reducer;
+    const size_t num_inputs;
+};
+
+
+class RowWriter {
+  public:
+    RowWriter (const RowIndexer& indexer, BufferType& buffer, const std::string& message) :
+      indexer (indexer),
+      vox (buffer),
+      progress (message, indexer.num_rows) { }
+
+    bool operator() (const Row& row) {
+      indexer.set_position (vox, row.index);
+      for (vox[0] = 0; vox[0] < vox.dim(0); ++vox[0])
+        vox.value() = row.data[vox[0]];
+      ++progress;
+      return true;
+    }
+
+  private:
+    const RowIndexer& indexer;
+    VoxelType vox;
+    ProgressBar progress;
+};
+
+
+
+
+template <class Reducer>
+void process_axis (const Reducer& reducer, Image::ThreadedLoop& loop, const size_t axis, PreloadVoxelType& vox_in, VoxelType& vox_out)
+{
+  loop.run (AxisKernel<Reducer> (reducer, axis), vox_in, vox_out);
+}
+
+
+// Inputs that are not memory-mapped (e.g. compressed images) are loaded into RAM
+//   in their entirety when opened. Where the operation can be accumulated, these
+//   are instead processed one image at a time, to avoid holding all of them in
+//   memory at once:
 template <class Operation>
-class ImageKernel : public ImageKernelBase {
+class SequentialKernel {
   protected:
     class InitFunctor { 
       public: 
@@ -290,32 +503,83 @@ class ImageKernel : public ImageKernelBase {
     };
 
   public:
-    ImageKernel (const Image::Header& header, const std::string& path) :
-      ImageKernelBase (path),
-      header (header),
+    SequentialKernel (const Image::Header& header) :
       buffer (header) {
         Image::ThreadedLoop (buffer).run (InitFunctor(), buffer.voxel());
       }
 
-    ~ImageKernel()
-    {
-      Image::Buffer<value_type> out (output_path, header);
-      Image::ThreadedLoop (buffer).run (ResultFunctor(), out.voxel(), buffer.voxel());
-    }
-
-    void process (const Image::Header& image_in)
-    {
+    void process (const Image::Header& image_in) {
       Image::Buffer<value_type> in (image_in);
       Image::ThreadedLoop (buffer).run (ProcessFunctor(), buffer.voxel(), in.voxel());
     }
 
+    void write (const std::string& output_path, const Image::Header& header) {
+      Image::Buffer<value_type> out (output_path, header);
+      Image::ThreadedLoop (buffer).run (ResultFunctor(), out.voxel(), buffer.voxel());
+    }
+
   protected:
-    const Image::Header& header;
     Image::BufferScratch<Operation> buffer;
-
 };
 
 
+// whether the image data will be memory-mapped, rather than loaded into RAM:
+bool is_mapped (const Image::Header& header)
+{
+  const Image::Handler::Base* handler (header.__get_handler());
+  return dynamic_cast<const Image::Handler::Default*> (handler) && handler->files.size() <= MAX_FILES_PER_IMAGE;
+}
+
+
+
+
+template <class Reducer>
+void process_rows (const Reducer& reducer, const VecPtr<Image::Header>& headers_in, const Image::Header& header, const std::string& output_path, const std::string& message)
+{
+  VecPtr<BufferType> buffers_in;
+  for (size_t i = 0; i != headers_in.size(); ++i)
+    buffers_in.push_back (new BufferType (*headers_in[i]));
+  BufferType buffer_out (output_path, header);
+
+  RowIndexer indexer (header);
+  RowLoader loader (indexer, buffers_in);
+  RowReducer<Reducer> row_reducer (reducer, buffers_in.size());
+  RowWriter writer (indexer, buffer_out, message);
+  Thread::run_queue (Thread::multi (loader), Row(), Thread::multi (row_reducer), Row(), writer);
+}
+
+
+// order statistics require all values at each voxel, so the inputs are always
+//   processed together:
+template <class Reducer>
+void process_images (const Reducer& reducer, const VecPtr<Image::Header>& headers_in, const Image::Header& header, const std::string& output_path, const std::string& message)
+{
+  process_rows (reducer, headers_in, header, output_path, message);
+}
+
+
+template <class Operation>
+void process_images (const Accumulate<Operation>& reducer, const VecPtr<Image::Header>& headers_in, const Image::Header& header, const std::string& output_path, const std::string& message)
+{
+  for (size_t i = 0; i != headers_in.size(); ++i) {
+    if (!is_mapped (*headers_in[i])) {
+      DEBUG ("image \"" + headers_in[i]->name() + "\" is not memory-mapped - processing input images sequentially");
+      SequentialKernel<Operation> kernel (header);
+      {
+        ProgressBar progress (message, headers_in.size());
+        for (size_t n = 0; n != headers_in.size(); ++n) {
+          kernel.process (*headers_in[n]);
+          ++progress;
+        }
+      }
+      kernel.write (output_path, header);
+      return;
+    }
+  }
+  process_rows (reducer, headers_in, header, output_path, message);
+}
+
+
 
 
 void run ()
@@ -324,7 +588,17 @@ void run ()
   const int op = argument[num_inputs];
   const std::string& output_path = argument.back();
 
-  Options opt = get_options ("axis");
+  float percentile = 50.0;
+  Options opt = get_options ("percentile");
+  if (opt.size())
+    percentile = opt[0][0];
+
+  float trim = 0.1;
+  opt = get_options ("trim");
+  if (opt.size())
+    trim = opt[0][0];
+
+  opt = get_options ("axis");
   if (opt.size()) {
 
     if (num_inputs != 1)
@@ -351,21 +625,23 @@ void run ()
     Image::ThreadedLoop loop (std::string("computing ") + operations[op] + " along axis " + str(axis) + "...", buffer_out);
 
     switch (op) {
-      case 0: loop.run (AxisKernel<Mean>   (axis), vox_in, vox_out); return;
-      case 1: loop.run (AxisKernel<Sum>    (axis), vox_in, vox_out); return;
-      case 2: loop.run (AxisKernel<Product>(axis), vox_in, vox_out); return;
-      case 3: loop.run (AxisKernel<RMS>    (axis), vox_in, vox_out); return;
-      case 4: loop.run (AxisKernel<Var>    (axis), vox_in, vox_out); return;
-      case 5: loop.run (AxisKernel<Std>    (axis), vox_in, vox_out); return;
-      case 6: loop.run (AxisKernel<Min>    (axis), vox_in, vox_out); return;
-      case 7: loop.run (AxisKernel<Max>    (axis), vox_in, vox_out); return;
-      case 8: loop.run (AxisKernel<AbsMax> (axis), vox_in, vox_out); return;
-      case 9: loop.run (AxisKernel<MagMax> (axis), vox_in, vox_out); return;
+      case 0:  process_axis (Accumulate<Mean>(),    loop, axis, vox_in, vox_out); return;
+      case 1:  process_axis (Accumulate<Sum>(),     loop, axis, vox_in, vox_out); return;
+      case 2:  process_axis (Accumulate<Product>(), loop, axis, vox_in, vox_out); return;
+      case 3:  process_axis (Accumulate<RMS>(),     loop, axis, vox_in, vox_out); return;
+      case 4:  process_axis (Accumulate<Var>(),     loop, axis, vox_in, vox_out); return;
+      case 5:  process_axis (Accumulate<Std>(),     loop, axis, vox_in, vox_out); return;
+      case 6:  process_axis (Accumulate<Min>(),     loop, axis, vox_in, vox_out); return;
+      case 7:  process_axis (Accumulate<Max>(),     loop, axis, vox_in, vox_out); return;
+      case 8:  process_axis (Accumulate<AbsMax>(),  loop, axis, vox_in, vox_out); return;
+      case 9:  process_axis (Accumulate<MagMax>(),  loop, axis, vox_in, vox_out); return;
+      case 10: process_axis (Median(),              loop, axis, vox_in, vox_out); return;
+      case 11: process_axis (Percentile (percentile), loop, axis, vox_in, vox_out); return;
+      case 12: process_axis (TrimmedMean (trim),    loop, axis, vox_in, vox_out); return;
       default: assert (0);
     }
 
   } else {
-
     if (num_inputs < 2)
       throw Exception ("mrmath requires either multiple input images, or the -axis option to be provided");
 
@@ -397,35 +673,24 @@ void run ()
       }
     }
 
-    // Instantiate a kernel depending on the operation requested
-    Ptr<ImageKernelBase> kernel;
+    const std::string message = std::string("computing ") + operations[op] + " across " + str(headers_in.size()) + " images...";
     switch (op) {
-      case 0: kernel = new ImageKernel<Mean>    (header, output_path); break;
-      case 1: kernel = new ImageKernel<Sum>     (header, output_path); break;
-      case 2: kernel = new ImageKernel<Product> (header, output_path); break;
-      case 3: kernel = new ImageKernel<RMS>     (header, output_path); break;
-      case 4: kernel = new ImageKernel<Var>     (header, output_path); break;
-      case 5: kernel = new ImageKernel<Std>     (header, output_path); break;
-      case 6: kernel = new ImageKernel<Min>     (header, output_path); break;
-      case 7: kernel = new ImageKernel<Max>     (header, output_path); break;
-      case 8: kernel = new ImageKernel<AbsMax>  (header, output_path); break;
-      case 9: kernel = new ImageKernel<MagMax>  (header, output_path); break;
+      case 0:  process_images (Accumulate<Mean>(),    headers_in, header, output_path, message); break;
+      case 1:  process_images (Accumulate<Sum>(),     headers_in, header, output_path, message); break;
+      case 2:  process_images (Accumulate<Product>(), headers_in, header, output_path, message); break;
+      case 3:  process_images (Accumulate<RMS>(),     headers_in, header, output_path, message); break;
+      case 4:  process_images (Accumulate<Var>(),     headers_in, header, output_path, message); break;
+      case 5:  process_images (Accumulate<Std>(),     headers_in, header, output_path, message); break;
+      case 6:  process_images (Accumulate<Min>(),     headers_in, header, output_path, message); break;
+      case 7:  process_images (Accumulate<Max>(),     headers_in, header, output_path, message); break;
+      case 8:  process_images (Accumulate<AbsMax>(),  headers_in, header, output_path, message); break;
+      case 9:  process_images (Accumulate<MagMax>(),  headers_in, header, output_path, message); break;
+      case 10: process_images (Median(),              headers_in, header, output_path, message); break;
+      case 11: process_images (Percentile (percentile), headers_in, header, output_path, message); break;
+      case 12: process_images (TrimmedMean (trim),    headers_in, header, output_path, message); break;
       default: assert (0);
     }
 
-    // Feed the input images to the kernel one at a time
-    {
-      ProgressBar progress (std::string("computing ") + operations[op] + " across " 
-          + str(headers_in.size()) + " images...", num_inputs);
-      for (size_t i = 0; i != headers_in.size(); ++i) {
-        kernel->process (*headers_in[i]);
-        ++progress;
-      }
-    }
-
-    // Image output is handled by the kernel destructor
-
   }
 
 }
-
@@ -22,6 +22,7 @@
 
 #include <iomanip>
 #include <vector>
+#include <mutex>
 
 #include "command.h"
 #include "point.h"
@@ -30,7 +31,8 @@
 #include "image/voxel.h"
 #include "image/buffer.h"
 #include "image/loop.h"
-#include "math/median.h"
+#include "image/threaded_loop.h"
+#include "math/quantile_sketch.h"
 
 
 using namespace MR;
@@ -68,6 +70,13 @@ OPTIONS
   "that the first line of the histogram gives the centre of the bins.")
   + Argument ("file").type_file_out ()
 
+  + Option ("percentile",
+  "also output the specified percentile (in the range 0 to 100) of the intensities. "
+  "Multiple such options can be supplied if required. Note that for large images, "
+  "percentiles (and the median) are estimated from a fixed-size histogram with a relative "
+  "precision of at least 2^-7.").allow_multiple()
+  + Argument ("value").type_float (0.0, 50.0, 100.0)
+
   + Option ("bins",
   "the number of bins to use to generate the histogram (default = 100).")
   + Argument ("num").type_integer (2, 100, std::numeric_limits<int>::max())
@@ -87,109 +96,114 @@ typedef float value_type;
 typedef cfloat complex_type;
 
 
-class CalibrateHistogram
+
+// Running statistics for a single (real) component, using Welford's algorithm;
+//   partial results from different threads are combined using the pairwise
+//   update of Chan et al.
+class RunningStats
 {
   public:
-    CalibrateHistogram (int nbins) : min (INFINITY), max (-INFINITY), width (0.0), bins (nbins) { }
-
-    value_type min, max, width;
-    int bins;
-
-    void operator() (value_type val) {
-      if (std::isfinite (val)) {
-        if (val < min) min = val;
-        if (val > max) max = val;
-      }
+    RunningStats () : count (0), mean (0.0), M2 (0.0), min (INFINITY), max (-INFINITY) { }
+
+    void operator() (double val) {
+      ++count;
+      const double delta = val - mean;
+      mean += delta / double (count);
+      M2 += delta * (val - mean);
+      if (val < min) min = val;
+      if (val > max) max = val;
     }
 
-    void init (std::ostream& stream) {
-      width = (max - min) / float (bins+1);
-      for (int i = 0; i < bins; i++)
-        stream << (min + width/2.0) + i* width << " ";
-      stream << "\n";
+    RunningStats& operator+= (const RunningStats& that) {
+      if (!that.count)
+        return *this;
+      if (!count)
+        return (*this = that);
+      const double total = count + that.count;
+      const double delta = that.mean - mean;
+      mean += delta * that.count / total;
+      M2 += that.M2 + delta * delta * (count * double (that.count) / total);
+      count += that.count;
+      min = std::min (min, that.min);
+      max = std::max (max, that.max);
+      return *this;
     }
+
+    double std () const { return std::sqrt (M2 / double (count)); }
+
+    size_t count;
+    double mean, M2, min, max;
 };
 
 
 
-class Stats
+
+template <typename ValueType> class Stats
 {
   public:
-    Stats (bool is_complex = false) :
-      mean (0.0, 0.0),
-      std (0.0, 0.0),
-      min (INFINITY, INFINITY),
-      max (-INFINITY, -INFINITY),
-      count (0),
-      dump (NULL),
-      is_complex (is_complex) { }
-
-    void generate_histogram (const CalibrateHistogram& cal) {
-      hmin = cal.min;
-      hwidth = cal.width;
-      hist.resize (cal.bins);
-    }
+    static const bool is_complex = std::is_same<ValueType, complex_type>::value;
+
+    Stats () : dump (NULL), hmin (0.0), hwidth (0.0) { }
 
     void dump_to (std::ostream& stream) {
       dump = &stream;
     }
 
-    void write_histogram (std::ostream& stream) {
+    void generate_histogram (value_type min, value_type width, int nbins) {
+      hmin = min;
+      hwidth = width;
+      hist.assign (nbins, 0);
+    }
+
+    void write_histogram (std::ostream& stream) const {
       for (size_t i = 0; i < hist.size(); ++i)
         stream << hist[i] << " ";
       stream << "\n";
     }
 
+    //! empty statistics, with the same histogram bins
+    Stats empty_copy () const {
+      Stats stats;
+      stats.generate_histogram (hmin, hwidth, hist.size());
+      return stats;
+    }
 
-    void operator() (complex_type val) {
-      if (std::isfinite (val.real()) && std::isfinite (val.imag())) {
-        mean += val;
-        std += cdouble (val.real()*val.real(), val.imag()*val.imag());
-        if (min.real() > val.real()) min = complex_type (val.real(), min.imag());
-        if (min.imag() > val.imag()) min = complex_type (min.real(), val.imag());
-        if (max.real() < val.real()) max = complex_type (val.real(), max.imag());
-        if (max.imag() < val.imag()) max = complex_type (max.real(), val.imag());
-        count++;
-
+    void operator() (ValueType val) {
+      if (is_finite (val)) {
+        add (val);
         if (dump)
           *dump << str(val) << "\n";
-
-        if (!is_complex)
-          values.push_back(val.real());
-
-
-        if (hist.size()) {
-          int bin = int ( (val.real()-hmin) / hwidth);
-          if (bin < 0)
-            bin = 0;
-          else if (bin >= int (hist.size()))
-            bin = hist.size()-1;
-          hist[bin]++;
-        }
       }
     }
 
-    template <class Set> void print (Set& ima, const std::vector<std::string>& fields) {
+    Stats& operator+= (const Stats& that) {
+      re += that.re;
+      im += that.im;
+      sketch += that.sketch;
+      for (size_t i = 0; i < hist.size(); ++i)
+        hist[i] += that.hist[i];
+      return *this;
+    }
 
-      if (count) {
-        mean /= double (count);
-        std = complex_type (sqrt (std.real()/double(count) - mean.real()*mean.real()),
-            sqrt (std.imag()/double(count) - mean.imag()*mean.imag()));
-      }
+    size_t count () const { return re.count; }
 
-      std::sort (values.begin(), values.end());
+    template <class Set> void print (Set& ima, const std::vector<std::string>& fields, const std::vector<float>& percentiles) {
+
+      const size_t count = re.count;
 
       if (fields.size()) {
         if (!count) 
           return;
         for (size_t n = 0; n < fields.size(); ++n) {
-          if (fields[n] == "mean") std::cout << str(mean) << " ";
-          else if (fields[n] == "median") std::cout << Math::median (values) << " ";
-          else if (fields[n] == "std") std::cout << str(std) << " ";
-          else if (fields[n] == "min") std::cout << str(min) << " ";
-          else if (fields[n] == "max") std::cout << str(max) << " ";
+          if (fields[n] == "mean") std::cout << format (re.mean, im.mean) << " ";
+          else if (fields[n] == "median") std::cout << sketch.median() << " ";
+          else if (fields[n] == "std") std::cout << format (re.std(), im.std()) << " ";
+          else if (fields[n] == "min") std::cout << format (re.min, im.min) << " ";
+          else if (fields[n] == "max") std::cout << format (re.max, im.max) << " ";
           else if (fields[n] == "count") std::cout << count << " ";
         }
+        for (size_t n = 0; n < percentiles.size(); ++n)
+          std::cout << sketch.quantile (percentiles[n] / 100.0) << " ";
         std::cout << "\n";
 
       }
@@ -206,33 +220,146 @@ class Stats
         int width = is_complex ? 24 : 12;
         std::cout << std::setw(15) << std::right << s << " ";
 
-        std::cout << std::setw(width) << std::right << ( count ? str(mean) : "N/A" );
+        std::cout << std::setw(width) << std::right << ( count ? format (re.mean, im.mean) : "N/A" );
 
         if (!is_complex) {
-          std::cout << " " << std::setw(width) << std::right << ( count ? str(Math::median (values)) : "N/A" );
+          std::cout << " " << std::setw(width) << std::right << ( count ? str(sketch.median()) : "N/A" );
         }
-        std::cout << " " << std::setw(width) << std::right << ( count > 1 ? str(std) : "N/A" )
-          << " " << std::setw(width) << std::right << ( count ? str(min) : "N/A" )
-          << " " << std::setw(width) << std::right << ( count ? str(max) : "N/A" )
-          << " " << std::setw(12) << std::right << count << "\n";
+        std::cout << " " << std::setw(width) << std::right << ( count > 1 ? format (re.std(), im.std()) : "N/A" )
+          << " " << std::setw(width) << std::right << ( count ? format (re.min, im.min) : "N/A" )
+          << " " << std::setw(width) << std::right << ( count ? format (re.max, im.max) : "N/A" )
+          << " " << std::setw(12) << std::right << count;
+        for (size_t n = 0; n < percentiles.size(); ++n)
+          std::cout << " " << std::setw(width) << std::right << ( count ? str(sketch.quantile (percentiles[n] / 100.0)) : "N/A" );
+        std::cout << "\n";
       }
 
     }
 
   private:
-    cdouble mean, std;
-    complex_type min, max;
-    size_t count;
+    RunningStats re, im;
+    Math::QuantileSketch sketch;
+    std::ostream* dump;
     value_type hmin, hwidth;
     std::vector<size_t> hist;
-    std::ostream* dump;
-    bool is_complex;
-    std::vector<float> values;
+
+    static bool is_finite (value_type val) { return std::isfinite (val); }
+    static bool is_finite (complex_type val) { return std::isfinite (val.real()) && std::isfinite (val.imag()); }
+
+    // real-valued data bypass complex arithmetic entirely:
+    void add (value_type val) {
+      re (val);
+      sketch (val);
+      if (hist.size()) {
+        int bin = int ( (val-hmin) / hwidth);
+        if (bin < 0)
+          bin = 0;
+        else if (bin >= int (hist.size()))
+          bin = hist.size()-1;
+        hist[bin]++;
+      }
+    }
+    void add (complex_type val) { re (val.real()); im (val.imag()); }
+
+    static std::string format (double real, double imag) {
+      return is_complex ? str (cdouble (real, imag)) : str (real);
+    }
 };
 
 
 
-void print_header (bool is_complex)
+// Per-thread accumulation of statistics for use with Image::ThreadedLoop;
+//   the partial statistics of each thread are merged into the master on destruction
+template <typename ValueType> class StatsKernel
+{
+  public:
+    StatsKernel (Stats<ValueType>& master) : 
+      master (master),
+      mutex (new std::mutex),
+      local (master.empty_copy()) { }
+
+    StatsKernel (const StatsKernel& that) :
+      master (that.master),
+      mutex (that.mutex),
+      local (that.master.empty_copy()) { }
+
+    ~StatsKernel () {
+      std::lock_guard<std::mutex> lock (*mutex);
+      master += local;
+    }
+
+    template <class VoxelType> 
+      void operator() (VoxelType& vox) {
+        local (vox.value());
+      }
+
+    template <class VoxelType, class MaskType> 
+      void operator() (VoxelType& vox, MaskType& mask) {
+        if (mask.value())
+          local (vox.value());
+      }
+
+  private:
+    Stats<ValueType>& master;
+    RefPtr<std::mutex> mutex;
+    Stats<ValueType> local;
+};
+
+
+
+// Per-thread determination of the range of intensities, to calibrate the
+//   histogram bins before the statistics are gathered
+class CalibrateHistogram
+{
+  public:
+    CalibrateHistogram (value_type& min, value_type& max) :
+      master_min (min),
+      master_max (max),
+      mutex (new std::mutex),
+      min (INFINITY),
+      max (-INFINITY) { }
+
+    CalibrateHistogram (const CalibrateHistogram& that) :
+      master_min (that.master_min),
+      master_max (that.master_max),
+      mutex (that.mutex),
+      min (INFINITY),
+      max (-INFINITY) { }
+
+    ~CalibrateHistogram () {
+      std::lock_guard<std::mutex> lock (*mutex);
+      master_min = std::min (master_min, min);
+      master_max = std::max (master_max, max);
+    }
+
+    void operator() (value_type val) {
+      if (std::isfinite (val)) {
+        if (val < min) min = val;
+        if (val > max) max = val;
+      }
+    }
+
+    template <class VoxelType> 
+      void operator() (VoxelType& vox) {
+        (*this) (complex_type (vox.value()).real());
+      }
+
+    template <class VoxelType, class MaskType> 
+      void operator() (VoxelType& vox, MaskType& mask) {
+        if (mask.value())
+          (*this) (complex_type (vox.value()).real());
+      }
+
+  private:
+    value_type& master_min;
+    value_type& master_max;
+    RefPtr<std::mutex> mutex;
+    value_type min, max;
+};
+
+
+
+void print_header (bool is_complex, const std::vector<float>& percentiles)
 {
   int width = is_complex ? 24 : 12;
   std::cout << std::setw(15) << std::right << "channel"
@@ -242,12 +369,20 @@ void print_header (bool is_complex)
   std::cout  << " " << std::setw(width) << std::right << "std. dev."
     << " " << std::setw(width) << std::right << "min"
     << " " << std::setw(width) << std::right << "max"
-    << " " << std::setw(12) << std::right << "count\n";
+    << " " << std::setw(12) << std::right << "count";
+  for (size_t n = 0; n < percentiles.size(); ++n)
+    std::cout << " " << std::setw(width) << std::right << ("p" + str(percentiles[n]));
+  std::cout << "\n";
 }
 
 
-void run () {
-  Image::Buffer<complex_type> data (argument[0]);
+
+
+template <typename ValueType>
+void execute (const Image::Header& header)
+{
+  const bool is_complex = Stats<ValueType>::is_complex;
+  Image::Buffer<ValueType> data (header);
   auto vox = data.voxel();
 
   Image::Loop inner_loop (0, 3);
@@ -257,7 +392,7 @@ void run () {
 
   Options opt = get_options ("histogram");
   if (opt.size()) {
-    if (data.datatype().is_complex())
+    if (is_complex)
       throw Exception ("histogram generation not supported for complex data types");
     hist_stream = new File::OFStream (opt[0][0]);
   }
@@ -266,8 +401,13 @@ void run () {
   opt = get_options ("bins");
   if (opt.size())
     nbins = opt[0][0];
-  CalibrateHistogram calibrate (nbins);
 
+  std::vector<float> percentiles;
+  opt = get_options ("percentile");
+  for (size_t n = 0; n < opt.size(); ++n) 
+    percentiles.push_back (opt[n][0]);
+  if (percentiles.size() && is_complex)
+    throw Exception ("percentiles not supported for complex data types");
 
   opt = get_options ("dump");
   if (opt.size())
@@ -277,6 +417,9 @@ void run () {
   if (opt.size())
     position_stream = new File::OFStream (opt[0][0]);
 
+  // values need to be visited in order if they are to be written out:
+  const bool ordered = dumpstream || position_stream;
+
   std::vector<std::string> fields;
   opt = get_options ("output");
   for (size_t n = 0; n < opt.size(); ++n) 
@@ -286,113 +429,15 @@ void run () {
 
   Options voxels = get_options ("voxel");
 
+  Ptr<Image::Buffer<bool> > mask_data;
   opt = get_options ("mask");
-  if (opt.size()) { // within mask:
-
+  if (opt.size()) {
     if (voxels.size())
       throw Exception ("cannot use mask with -voxel option");
-
-    Image::Buffer<bool> mask_data (opt[0][0]);
-    check_dimensions (mask_data, data, 0, 3);
-    auto mask = mask_data.voxel();
-
-    if (hist_stream) {
-      ProgressBar progress ("calibrating histogram...", Image::voxel_count (vox));
-      for (auto i = outer_loop (vox); i; ++i) {
-        for (auto j = inner_loop (mask, vox); j; ++j) {
-          if (mask.value())
-            calibrate (complex_type(vox.value()).real());
-          ++progress;
-        }
-      }
-      calibrate.init (*hist_stream);
-    }
-
-    for (auto i = outer_loop (vox); i; ++i) {
-      Stats stats (vox.datatype().is_complex());
-
-      if (dumpstream)
-        stats.dump_to (*dumpstream);
-
-      if (hist_stream)
-        stats.generate_histogram (calibrate);
-
-      for (auto j = inner_loop (mask, vox); j; ++j) {
-        if (mask.value() > 0.5) {
-          stats (vox.value());
-          if (position_stream) {
-            for (size_t i = 0; i < vox.ndim(); ++i)
-              *position_stream << vox[i] << " ";
-            *position_stream << "\n";
-          }
-        }
-      }
-
-      if (!header_shown)
-        print_header (vox.datatype().is_complex());
-      header_shown = true;
-
-      stats.print (vox, fields);
-
-      if (hist_stream)
-        stats.write_histogram (*hist_stream);
-    }
-
-    return;
+    mask_data = new Image::Buffer<bool> (opt[0][0]);
+    check_dimensions (*mask_data, data, 0, 3);
   }
 
-
-
-
-  if (!voxels.size()) { // whole data set:
-
-    if (hist_stream) {
-      ProgressBar progress ("calibrating histogram...", Image::voxel_count (vox));
-      for (auto i = outer_loop (vox); i; ++i) {
-        for (auto j = inner_loop (vox); j; ++j) {
-          calibrate (complex_type(vox.value()).real());
-          ++progress;
-        }
-      }
-      calibrate.init (*hist_stream);
-    }
-
-    for (auto l = outer_loop (vox); l; ++l) {
-      Stats stats (vox.datatype().is_complex());
-
-      if (dumpstream)
-        stats.dump_to (*dumpstream);
-
-      if (hist_stream)
-        stats.generate_histogram (calibrate);
-
-      for (auto j = inner_loop (vox); j; ++j) {
-        stats (vox.value());
-        if (position_stream) {
-          for (size_t i = 0; i < vox.ndim(); ++i)
-            *position_stream << vox[i] << " ";
-          *position_stream << "\n";
-        }
-      }
-
-      if (!header_shown)
-        print_header (vox.datatype().is_complex());
-      header_shown = true;
-
-      stats.print (vox, fields);
-
-      if (hist_stream)
-        stats.write_histogram (*hist_stream);
-    }
-
-    return;
-  }
-
-
-
-
-  // voxels:
-
   std::vector<Point<ssize_t> > voxel (voxels.size());
   for (size_t i = 0; i < voxels.size(); ++i) {
     std::vector<int> x = parse_ints (voxels[i][0]);
@@ -406,49 +451,106 @@ void run () {
     voxel[i].set (x[0], x[1], x[2]);
   }
 
+  // the histogram bins span the range of intensities over all volumes:
+  value_type hmin (INFINITY), hmax (-INFINITY), hwidth (0.0);
   if (hist_stream) {
-    ProgressBar progress ("calibrating histogram...", voxel.size());
-    for (auto i = outer_loop (vox); i; ++i) {
-      for (size_t i = 0; i < voxel.size(); ++i) {
-        vox[0] = voxel[i][0];
-        vox[1] = voxel[i][1];
-        vox[2] = voxel[i][2];
-        calibrate (complex_type(vox.value()).real());
-        ++progress;
+    {
+      CalibrateHistogram calibrate (hmin, hmax);
+      for (auto l = outer_loop (vox); l; ++l) {
+        if (voxel.size()) {
+          for (size_t i = 0; i < voxel.size(); ++i) {
+            vox[0] = voxel[i][0];
+            vox[1] = voxel[i][1];
+            vox[2] = voxel[i][2];
+            calibrate (vox);
+          }
+        }
+        else if (mask_data) 
+          Image::ThreadedLoop (vox, 0, 3).run (calibrate, vox, mask_data->voxel());
+        else 
+          Image::ThreadedLoop (vox, 0, 3).run (calibrate, vox);
       }
     }
-    calibrate.init (*hist_stream);
+    hwidth = (hmax - hmin) / value_type (nbins+1);
+    for (int i = 0; i < nbins; i++)
+      *hist_stream << (hmin + hwidth/2.0) + i* hwidth << " ";
+    *hist_stream << "\n";
   }
 
-  for (auto i = outer_loop (vox); i; ++i) {
-    Stats stats (vox.datatype().is_complex());
+
+  for (auto l = outer_loop (vox); l; ++l) {
+    Stats<ValueType> stats;
 
     if (dumpstream)
       stats.dump_to (*dumpstream);
 
     if (hist_stream)
-      stats.generate_histogram (calibrate);
-
-    for (size_t i = 0; i < voxel.size(); ++i) {
-      vox[0] = voxel[i][0];
-      vox[1] = voxel[i][1];
-      vox[2] = voxel[i][2];
-      stats (vox.value());
-      if (position_stream) {
-        for (size_t i = 0; i < vox.ndim(); ++i)
-          *position_stream << vox[i] << " ";
-        *position_stream << "\n";
+      stats.generate_histogram (hmin, hwidth, nbins);
+
+    if (voxel.size() || ordered) {
+
+      auto write_position = [&] () {
+        if (position_stream) {
+          for (size_t i = 0; i < vox.ndim(); ++i)
+            *position_stream << vox[i] << " ";
+          *position_stream << "\n";
+        }
+      };
+
+      if (voxel.size()) {
+        for (size_t i = 0; i < voxel.size(); ++i) {
+          vox[0] = voxel[i][0];
+          vox[1] = voxel[i][1];
+          vox[2] = voxel[i][2];
+          stats (vox.value());
+          write_position();
+        }
+      }
+      else if (mask_data) {
+        auto mask = mask_data->voxel();
+        for (auto j = inner_loop (mask, vox); j; ++j) {
+          if (mask.value()) {
+            stats (vox.value());
+            write_position();
+          }
+        }
       }
+      else {
+        for (auto j = inner_loop (vox); j; ++j) {
+          stats (vox.value());
+          write_position();
+        }
+      }
+
+    }
+    else {
+
+      StatsKernel<ValueType> kernel (stats);
+      if (mask_data) 
+        Image::ThreadedLoop (vox, 0, 3).run (kernel, vox, mask_data->voxel());
+      else 
+        Image::ThreadedLoop (vox, 0, 3).run (kernel, vox);
+
     }
 
     if (!header_shown)
-      print_header (vox.datatype().is_complex());
+      print_header (is_complex, percentiles);
     header_shown = true;
 
-    stats.print (vox, fields);
+    stats.print (vox, fields, percentiles);
 
     if (hist_stream)
       stats.write_histogram (*hist_stream);
   }
 }
 
+
+
+void run () 
+{
+  Image::Header header (argument[0]);
+  if (header.datatype().is_complex())
+    execute<complex_type> (header);
+  else
+    execute<value_type> (header);
+}
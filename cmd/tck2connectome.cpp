@@ -61,12 +61,15 @@ void usage ()
 	AUTHOR = "Robert E. Smith (r.smith@brain.org.au)";
 
   DESCRIPTION
-  + "generate a connectome matrix from a streamlines file and a node parcellation image";
+  + "generate a connectome matrix from a streamlines file and a node parcellation image"
+
+  + "multiple edge metrics can be computed from a single pass through the track file by providing the -metric option more than once";
 
   ARGUMENTS
   + Argument ("tracks_in",      "the input track file").type_file_in()
   + Argument ("nodes_in",       "the input node parcellation image").type_image_in()
-  + Argument ("connectome_out", "the output .csv file containing edge weights").type_file_out();
+  + Argument ("connectome_out", "the output .csv file containing edge weights "
+                                "(if multiple metrics are requested, the metric name is appended to this file name for each output)").type_file_out();
 
 
   OPTIONS
@@ -119,27 +122,27 @@ void run ()
     WARN ("(This may indicate poor parcellation image preparation, use of incorrect config file in labelconfig, or very poor registration)");
   }
 
-  // Get the metric & assignment mechanism for connectome construction
-  Ptr<Connectomics::Metric_base>    metric    (Connectomics::load_metric (nodes_data));
+  // Get the metric(s) & assignment mechanism for connectome construction
+  VecPtr<Connectomics::Metric_base> metrics;
+  std::vector<std::string> metric_names;
+  Connectomics::load_metrics (nodes_data, metrics, metric_names);
   Ptr<Connectomics::Tck2nodes_base> tck2nodes (Connectomics::load_assignment_mode (nodes_data));
 
   // Prepare for reading the track data
   Tractography::Properties properties;
   Tractography::Reader<float> reader (argument[0], properties);
 
-  // Multi-threaded connectome construction
+  // Multi-threaded connectome construction: each thread accumulates its own
+  //   partial connectome, which are then merged once all streamlines are processed
   Mapping::TrackLoader loader (reader, properties["count"].empty() ? 0 : to<size_t>(properties["count"]), "Constructing connectome... ");
-  Mapper mapper (*tck2nodes, *metric);
-  Connectome connectome (max_node_index);
-  Thread::run_queue (
-      loader, 
-      Thread::batch (Tractography::Streamline<float>()), 
-      Thread::multi (mapper), 
-      Thread::batch (Mapped_track()), 
-      connectome);
-
-  if (metric->scale_edges_by_streamline_count())
-    connectome.scale_by_streamline_count();
+  Connectome connectome (max_node_index, metrics);
+  {
+    Connectome::Accumulator accumulator (connectome, *tck2nodes);
+    Thread::run_queue (
+        loader, 
+        Thread::batch (Tractography::Streamline<float>()), 
+        Thread::multi (accumulator));
+  }
 
   connectome.error_check (missing_nodes);
 
@@ -151,6 +154,16 @@ void run ()
   if (opt.size())
     connectome.zero_diagonal();
 
-  connectome.write (argument[2]);
+  if (metrics.size() == 1) {
+    connectome.write (argument[2], 0);
+  } else {
+    const std::string path (argument[2]);
+    const size_t slash = path.find_last_of ('/');
+    size_t ext = path.find_last_of ('.');
+    if (ext == std::string::npos || (slash != std::string::npos && ext < slash))
+      ext = path.size();
+    for (size_t i = 0; i != metrics.size(); ++i)
+      connectome.write (path.substr (0, ext) + "_" + metric_names[i] + path.substr (ext), i);
+  }
 
 }
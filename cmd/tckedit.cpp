@@ -188,11 +188,13 @@ void run ()
   update_output_step_size (properties, upsample, downsample);
   Receiver receiver (output_path, properties, count, number, skip);
 
-  Thread::run_queue (
+  // streamlines must be written in the same order as they were read,
+  //   so that they remain matched with any associated data:
+  Thread::run_ordered_queue (
       loader, 
-      Thread::batch (Tractography::Streamline<>()),
+      Tractography::Streamline<>(),
       Thread::multi (worker), 
-      Thread::batch (Tractography::Streamline<>()),
+      Tractography::Streamline<>(),
       receiver);
 
 }
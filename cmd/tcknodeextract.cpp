@@ -196,11 +196,13 @@ void run ()
   INFO ("A total of " + str (writer.file_count()) + " output track files will be generated");
 
   Mapping::TrackLoader loader (reader, properties["count"].empty() ? 0 : to<size_t>(properties["count"]), "extracting streamlines of interest... ");
-  Thread::run_queue (
+  // output files must preserve the order of streamlines in the input file,
+  //   as each streamline is written (as empty if not selected) to every file:
+  Thread::run_ordered_queue (
       loader, 
-      Thread::batch (Tractography::Streamline<float>()), 
+      Tractography::Streamline<float>(), 
       Thread::multi (mapper), 
-      Thread::batch (MappedTrackWithData()), 
+      MappedTrackWithData(), 
       writer);
 
 }
@@ -25,8 +25,9 @@
 #include "command.h"
 #include "progressbar.h"
 #include "get_set.h"
-#include "image/buffer_preload.h"
+#include "image/buffer.h"
 #include "image/voxel.h"
+#include "image/registration/warp/sampler.h"
 #include "thread_queue.h"
 #include "dwi/tractography/file.h"
 #include "dwi/tractography/properties.h"
@@ -36,6 +37,8 @@ using namespace MR::DWI;
 using namespace App;
 
 
+const char* interp_choices[] = { "linear", "cubic", NULL };
+
 void usage ()
 {
   DESCRIPTION
@@ -45,6 +48,13 @@ void usage ()
   + Argument ("tracks", "the input track file.").type_file_in()
   + Argument ("transform", "the image containing the transform.").type_image_in()
   + Argument ("output", "the output track file").type_file_out();
+
+  OPTIONS
+  + Option ("interp",
+      "set the interpolation method to use when sampling the transform (default: linear). "
+      "With cubic interpolation, the transform is converted once into the coefficients "
+      "of a cubic B-spline, so that the warped streamlines are smooth.")
+  + Argument ("method").type_choice (interp_choices);
 }
 
 
@@ -73,29 +83,18 @@ class Loader
 class Warper
 {
   public:
-    Warper (const Image::BufferPreload<value_type>::voxel_type& warp_voxel) :
-      interp (warp_voxel) { }
+    Warper (const Image::Registration::Warp::Sampler& warp) :
+      warp (warp) { }
 
     bool operator () (const TrackType& in, TrackType& out) {
       out.resize (in.size());
       for (size_t n = 0; n < in.size(); ++n) 
-        out[n] = pos(in[n]);
+        out[n] = warp.scanner (in[n]);
       return true;
     }
 
-    Point<value_type> pos (const Point<value_type>& x) {
-      Point<value_type> p;
-      if (!interp.scanner (x)) {
-        interp[3] = 0; p[0] = interp.value();
-        interp[3] = 1; p[1] = interp.value();
-        interp[3] = 2; p[2] = interp.value();
-      }
-      return p;
-    }
-
-
   protected:
-    Image::Interp::Linear<Image::BufferPreload<value_type>::voxel_type> interp;
+    const Image::Registration::Warp::Sampler& warp;
 };
 
 
@@ -127,17 +126,21 @@ void run ()
 {
   Loader loader (argument[0]);
 
-  Image::BufferPreload<value_type> data (argument[1]);
+  Options opt = get_options ("interp");
+  const bool cubic = opt.size() && int (opt[0][0]) == 1;
+
+  Image::Buffer<value_type> data (argument[1]);
   auto vox = data.voxel();
-  Warper warper (vox);
+  Image::Registration::Warp::Sampler warp (vox, cubic);
+  Warper warper (warp);
 
   Writer writer (argument[2], loader.properties);
 
-  Thread::run_queue (
+  Thread::run_ordered_queue (
       loader, 
-      Thread::batch (TrackType(), 1024), 
+      TrackType(), 
       Thread::multi (warper), 
-      Thread::batch (TrackType(), 1024), 
+      TrackType(), 
       writer);
 }
 
@@ -21,15 +21,25 @@
 */
 
 
+#include <mutex>
 #include <vector>
 
 #include "command.h"
 #include "point.h"
 #include "progressbar.h"
 #include "ptr.h"
+#include "thread_queue.h"
 
 #include "file/ofstream.h"
 
+#include "image/buffer.h"
+#include "image/header.h"
+#include "image/loop.h"
+#include "image/transform.h"
+#include "image/voxel.h"
+
+#include "math/quantile_sketch.h"
+
 #include "dwi/tractography/file.h"
 #include "dwi/tractography/properties.h"
 #include "dwi/tractography/weights.h"
@@ -50,32 +60,361 @@ void usage ()
 	AUTHOR = "Robert E. Smith (r.smith@brain.org.au)";
 
   DESCRIPTION
-  + "calculate statistics on streamlines length.";
+  + "calculate statistics on streamlines length, number of points, step size and curvature."
+
+  + "All statistics are computed in a single multi-threaded pass through the track file. "
+    "The statistics of streamline length and number of points are exact (the length being "
+    "derived from the number of points and the step size); the medians of the step size "
+    "and curvature are estimated using a bounded amount of memory, and are only exact for "
+    "track files containing fewer than approximately one million points."
+
+  + "By default, only the statistics of streamline length are reported. The -detailed option "
+    "additionally reports the number of points, step size, curvature and bounding box of the "
+    "streamlines, in a table with one labelled row per quantity."
+
+  + "Curvature is computed at each point along the streamline as the angle between the "
+    "adjacent steps, divided by their mean length, and is reported in radians per mm.";
 
   ARGUMENTS
   + Argument ("tracks_in", "the input track file").type_file_in();
 
   OPTIONS
+  + Option ("detailed", "also report statistics of the number of points, step size and curvature, "
+            "and the bounding box of the streamlines")
+
   + Option ("histogram", "output a histogram of streamline lengths")
     + Argument ("path").type_file_out()
 
   + Option ("dump", "dump the streamlines lengths to a text file")
     + Argument ("path").type_file_out()
 
+  + Option ("ends_density", "output an image of the density of streamline endpoints, on the voxel grid of a template image")
+    + Argument ("template").type_image_in()
+    + Argument ("path").type_image_out()
+
   + Tractography::TrackWeightsInOption;
 
 };
 
 
 
+
+// running (weighted) mean & variance, with minimum and maximum, that can be
+//   combined across threads:
+class Moments
+{
+  public:
+    Moments () :
+      weight (0.0),
+      mean (0.0),
+      m2 (0.0),
+      min (std::numeric_limits<double>::infinity()),
+      max (-std::numeric_limits<double>::infinity()) { }
+
+    void operator() (double value, double w) {
+      if (!(w > 0.0))
+        return;
+      weight += w;
+      const double delta = value - mean;
+      mean += delta * w / weight;
+      m2 += w * delta * (value - mean);
+      min = std::min (min, value);
+      max = std::max (max, value);
+    }
+
+    Moments& operator+= (const Moments& that) {
+      if (!that.weight)
+        return *this;
+      if (!weight)
+        return *this = that;
+      const double total = weight + that.weight;
+      const double delta = that.mean - mean;
+      mean += delta * that.weight / total;
+      m2 += that.m2 + delta * delta * weight * that.weight / total;
+      weight = total;
+      min = std::min (min, that.min);
+      max = std::max (max, that.max);
+      return *this;
+    }
+
+    double stdev () const { return std::sqrt (m2 / weight); }
+
+    double weight, mean, m2, min, max;
+};
+
+
+
+
+// all statistics gathered from the streamlines; each thread gathers its own,
+//   which are merged once all streamlines have been processed:
+class Statistics
+{
+  public:
+    Statistics (const Image::Info* ends_template) :
+      count (0),
+      lower (std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity()),
+      upper (-std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity()),
+      ends_template (ends_template),
+      transform (ends_template ? new Image::Transform (*ends_template) : nullptr),
+      ends (ends_template ? Image::voxel_count (*ends_template, 0, 3) : 0, 0.0f) { }
+
+    void operator() (const Streamline<float>& tck)
+    {
+      const float weight = tck.weight;
+      ++count;
+      if (points.size() <= tck.size())
+        points.resize (tck.size() + 1, 0.0);
+      points[tck.size()] += weight;
+
+      for (size_t i = 0; i < tck.size(); ++i) {
+        for (size_t n = 0; n < 3; ++n) {
+          lower[n] = std::min (lower[n], tck[i][n]);
+          upper[n] = std::max (upper[n], tck[i][n]);
+        }
+      }
+
+      for (size_t i = 1; i < tck.size(); ++i) {
+        const float step = dist (tck[i-1], tck[i]);
+        steps (step, weight);
+        step_sketch (step, weight);
+      }
+
+      for (size_t i = 1; i + 1 < tck.size(); ++i) {
+        const Point<float> a (tck[i] - tck[i-1]), b (tck[i+1] - tck[i]);
+        const float la = a.norm(), lb = b.norm();
+        if (la > 0.0f && lb > 0.0f) {
+          const float angle = std::acos (std::min (std::max (a.dot (b) / (la * lb), -1.0f), 1.0f));
+          const float value = 2.0f * angle / (la + lb);
+          curvature (value, weight);
+          curvature_sketch (value, weight);
+        }
+      }
+
+      if (transform && tck.size()) {
+        add_end (tck.front(), weight);
+        if (tck.size() > 1)
+          add_end (tck.back(), weight);
+      }
+    }
+
+    Statistics& operator+= (const Statistics& that)
+    {
+      count += that.count;
+      if (points.size() < that.points.size())
+        points.resize (that.points.size(), 0.0);
+      for (size_t i = 0; i < that.points.size(); ++i)
+        points[i] += that.points[i];
+      for (size_t n = 0; n < 3; ++n) {
+        lower[n] = std::min (lower[n], that.lower[n]);
+        upper[n] = std::max (upper[n], that.upper[n]);
+      }
+      steps += that.steps;
+      curvature += that.curvature;
+      step_sketch += that.step_sketch;
+      curvature_sketch += that.curvature_sketch;
+      for (size_t i = 0; i < ends.size(); ++i)
+        ends[i] += that.ends[i];
+      return *this;
+    }
+
+    size_t count;
+    // sum of streamline weights by number of points:
+    std::vector<double> points;
+    Point<float> lower, upper;
+    Moments steps, curvature;
+    Math::QuantileSketch step_sketch, curvature_sketch;
+    const Image::Info* ends_template;
+    Ptr<Image::Transform> transform;
+    std::vector<float> ends;
+
+  private:
+    void add_end (const Point<float>& p, float weight)
+    {
+      const Point<float> v (transform->scanner2voxel (p));
+      size_t index = 0, stride = 1;
+      for (size_t n = 0; n < 3; ++n) {
+        const ssize_t x = std::round (v[n]);
+        if (x < 0 || x >= ends_template->dim(n))
+          return;
+        index += x * stride;
+        stride *= ends_template->dim(n);
+      }
+      ends[index] += weight;
+    }
+};
+
+
+
+
+// per-thread functor: gathers its own statistics, merged into the master
+//   on destruction
+class Accumulator
+{
+  public:
+    Accumulator (Statistics& master, float step_size) :
+      master (master),
+      local (master.ends_template),
+      step_size (step_size),
+      mutex (new std::mutex) { }
+
+    Accumulator (const Accumulator& that) :
+      master (that.master),
+      local (master.ends_template),
+      step_size (that.step_size),
+      mutex (that.mutex) { }
+
+    ~Accumulator ()
+    {
+      std::lock_guard<std::mutex> lock (*mutex);
+      master += local;
+    }
+
+    bool operator() (const Streamline<float>& tck)
+    {
+      local (tck);
+      return true;
+    }
+
+    // as above, also providing the length of the streamline for -dump:
+    bool operator() (const Streamline<float>& tck, float& length)
+    {
+      local (tck);
+      length = (tck.size() ? (tck.size()-1) : 0) * step_size;
+      return true;
+    }
+
+  private:
+    Statistics& master;
+    Statistics local;
+    const float step_size;
+    RefPtr<std::mutex> mutex;
+};
+
+
+// reads the whole track file, with progress reported against the count in the header:
+class TrackSource
+{
+  public:
+    TrackSource (Tractography::Reader<float>& reader, size_t header_count) :
+      reader (reader),
+      progress (new ProgressBar ("Reading track file... ", header_count)) { }
+
+    bool operator() (Streamline<float>& tck)
+    {
+      if (!reader (tck)) {
+        progress = NULL;
+        return false;
+      }
+      ++(*progress);
+      return true;
+    }
+
+  private:
+    Tractography::Reader<float>& reader;
+    Ptr<ProgressBar> progress;
+};
+
+
+class DumpWriter
+{
+  public:
+    DumpWriter (const std::string& path) :
+      out (path, std::ios_base::out | std::ios_base::trunc) { }
+
+    bool operator() (const float& length) {
+      out << length << "\n";
+      return true;
+    }
+
+  private:
+    File::OFStream out;
+};
+
+
+
+
+// exact statistics derived from a histogram of (weighted) counts; the
+//   median is the bin for which the cumulative count is closest to half
+//   the total:
+class HistogramStats
+{
+  public:
+    HistogramStats (const std::vector<double>& histogram) :
+      total (0.0), mean (0.0), stdev (0.0), min (histogram.size()), median (0), max (0)
+    {
+      for (size_t i = 0; i != histogram.size(); ++i) {
+        total += histogram[i];
+        mean += i * histogram[i];
+        if (histogram[i]) {
+          if (min == histogram.size())
+            min = i;
+          max = i;
+        }
+      }
+      mean /= total;
+      for (size_t i = 0; i != histogram.size(); ++i)
+        stdev += histogram[i] * Math::pow2 (i - mean);
+      stdev = std::sqrt (stdev / total);
+
+      double running_sum = 0.0, prev_sum = 0.0;
+      do {
+        prev_sum = running_sum;
+        running_sum += histogram[median++];
+      } while (running_sum < 0.5*total);
+      --median;
+      if (median && std::abs (prev_sum - (0.5*total)) < std::abs (running_sum - (0.5*total)))
+        --median;
+    }
+
+    double total, mean, stdev;
+    size_t min, median, max;
+};
+
+
+
+
+const size_t width = 12;
+
+void print_row (const std::string& label, double mean, double median, double stdev, double min, double max, double count)
+{
+  if (label.size())
+    std::cout << std::setw(10) << std::left << label;
+  std::cout << " " << std::setw(width) << std::right << mean
+            << " " << std::setw(width) << std::right << median
+            << " " << std::setw(width) << std::right << stdev
+            << " " << std::setw(width) << std::right << min
+            << " " << std::setw(width) << std::right << max
+            << " " << std::setw(width) << std::right << count << "\n";
+}
+
+void print_row (const std::string& label, const Moments& moments, Math::QuantileSketch& sketch)
+{
+  if (moments.weight)
+    print_row (label, moments.mean, std::min (std::max (sketch.median(), moments.min), moments.max),
+        moments.stdev(), moments.min, moments.max, moments.weight);
+  else
+    print_row (label, NAN, NAN, NAN, NAN, NAN, 0.0);
+}
+
+
+
+
 void run ()
 {
 
   const bool weights_provided = get_options ("tck_weights_in").size();
 
   float step_size = 1.0;
-  size_t count = 0, header_count = 0;
-  std::vector<double> histogram;
+  size_t header_count = 0;
+
+  Ptr<Image::Header> ends_template;
+  Options opt = get_options ("ends_density");
+  if (opt.size()) {
+    ends_template = new Image::Header (opt[0][0]);
+    ends_template->set_ndim (3);
+  }
+
+  Statistics statistics (ends_template);
 
   {
     Tractography::Properties properties;
@@ -92,73 +431,72 @@ void run ()
       step_size = 1.0;
     }
 
-    Ptr<File::OFStream> dump;
-    Options opt = get_options ("dump");
-    if (opt.size())
-      dump = new File::OFStream (std::string(opt[0][0]), std::ios_base::out | std::ios_base::trunc);
-
-    ProgressBar progress ("Reading track file... ", header_count);
-    Tractography::Streamline<> tck;
-    while (reader (tck)) {
-      ++count;
-      const size_t length = tck.size() ? (tck.size()-1) : 0;
-      while (histogram.size() <= length)
-        histogram.push_back (0.0);
-      histogram[length] += tck.weight;
-      if (dump)
-        (*dump) << (length * step_size) << "\n";
-      ++progress;
+    TrackSource loader (reader, header_count);
+    Accumulator accumulator (statistics, step_size);
+
+    opt = get_options ("dump");
+    if (opt.size()) {
+      // the lengths must be written in the order of the track file:
+      DumpWriter writer (opt[0][0]);
+      Thread::run_ordered_queue (loader, 
+          Thread::batch (Streamline<float>()), 
+          Thread::multi (accumulator), 
+          Thread::batch (float()), 
+          writer);
+    }
+    else {
+      Thread::run_queue (loader, 
+          Thread::batch (Streamline<float>()), 
+          Thread::multi (accumulator));
     }
   }
 
+  // lengths are derived from the number of points, with zero-length
+  //   streamlines containing either zero or one point:
+  const std::vector<double>& points (statistics.points);
+  if (points.empty())
+    throw Exception ("no streamlines found in track file");
+  std::vector<double> histogram (std::max (points.size(), size_t(2)) - 1, 0.0);
+  histogram[0] = points[0];
+  for (size_t i = 1; i != points.size(); ++i)
+    histogram[i-1] += points[i];
+
+  HistogramStats lengths (histogram), point_counts (points);
+
   if (histogram.front())
     WARN ("read " + str(histogram.front()) + " zero-length tracks");
-  if (count != header_count)
-    WARN ("expected " + str(header_count) + " tracks according to header; read " + str(count));
-
-  size_t min = histogram.size();
-  double total = 0.0, mean = 0.0;
-  for (size_t i = 0; i != histogram.size(); ++i) {
-    total += histogram[i];
-    mean += i * histogram[i];
-    if (histogram[i] && min == histogram.size())
-      min = i;
-  }
-  mean /= total;
-  double stdev = 0.0;
-  for (size_t i = 0; i != histogram.size(); ++i)
-    stdev += histogram[i] * Math::pow2 (i - mean);
-  stdev = std::sqrt(stdev / total);
-  size_t median = 0;
-  double running_sum = 0.0, prev_sum = 0.0;
-  do {
-    prev_sum = running_sum;
-    running_sum += histogram[median++];
-  } while (running_sum < 0.5*total);
-  --median;
-  if (std::abs (prev_sum - (0.5*total)) < std::abs (running_sum - (0.5*total)))
-    --median;
-  const size_t max = histogram.size() - 1;
-
-  const size_t width = 12;
-
-  std::cout << " " << std::setw(width) << std::right << "mean"
+  if (statistics.count != header_count)
+    WARN ("expected " + str(header_count) + " tracks according to header; read " + str(statistics.count));
+
+  // without -detailed, the output is a single unlabelled row of length statistics:
+  const bool detailed = get_options ("detailed").size();
+  const std::string label_column = detailed ? std::string (10, ' ') : std::string();
+
+  std::cout << label_column
+            << " " << std::setw(width) << std::right << "mean"
             << " " << std::setw(width) << std::right << "median"
             << " " << std::setw(width) << std::right << "std. dev."
             << " " << std::setw(width) << std::right << "min"
             << " " << std::setw(width) << std::right << "max"
             << " " << std::setw(width) << std::right << "count\n";
 
-  std::cout << " " << std::setw(width) << std::right << (step_size * mean)
-            << " " << std::setw(width) << std::right << (step_size * median)
-            << " " << std::setw(width) << std::right << (step_size * stdev)
-            << " " << std::setw(width) << std::right << (step_size * min)
-            << " " << std::setw(width) << std::right << (step_size * max)
-            << " " << std::setw(width) << std::right << (total) << "\n";
+  print_row (detailed ? "length" : "", step_size * lengths.mean, step_size * lengths.median, step_size * lengths.stdev,
+      step_size * lengths.min, step_size * lengths.max, lengths.total);
+
+  if (detailed) {
+    print_row ("points", point_counts.mean, point_counts.median, point_counts.stdev,
+        point_counts.min, point_counts.max, point_counts.total);
+    print_row ("step size", statistics.steps, statistics.step_sketch);
+    print_row ("curvature", statistics.curvature, statistics.curvature_sketch);
 
-  Options opt = get_options ("length_hist");
+    if (std::isfinite (statistics.lower[0]))
+      std::cout << "bounding box: [ " << statistics.lower[0] << " " << statistics.lower[1] << " " << statistics.lower[2] << " ] to [ "
+                << statistics.upper[0] << " " << statistics.upper[1] << " " << statistics.upper[2] << " ]\n";
+  }
+
+  opt = get_options ("histogram");
   if (opt.size()) {
-    File::OFStream out (argument[1], std::ios_base::out | std::ios_base::trunc);
+    File::OFStream out (opt[0][0], std::ios_base::out | std::ios_base::trunc);
     if (weights_provided) {
       out << "Length,Sum_weights\n";
       for (size_t i = 0; i != histogram.size(); ++i)
@@ -172,4 +510,17 @@ void run ()
     out.close();
   }
 
+  opt = get_options ("ends_density");
+  if (opt.size()) {
+    Image::Header H (*ends_template);
+    H.datatype() = DataType::Float32;
+    H.datatype().set_byte_order_native();
+    Image::Buffer<float> buffer (opt[0][1], H);
+    auto out = buffer.voxel();
+    const std::vector<float>& ends (statistics.ends);
+    size_t index = 0;
+    for (auto l = Image::Loop (0, 3) (out); l; ++l)
+      out.value() = ends[index++];
+  }
+
 }
@@ -26,6 +26,7 @@
 #include "app.h"
 #include "debug.h"
 #include "progressbar.h"
+#include "thread_profile.h"
 #include "file/path.h"
 #include "file/config.h"
 #include "version.h"
@@ -61,6 +62,7 @@ namespace MR
                                      + Option ("nthreads", "use this number of threads in multi-threaded applications")
                                        + Argument ("number").type_integer (0, 1, std::numeric_limits<int>::max())
                                      + Option ("failonwarn", "terminate program if a warning is produced")
+                                     + Option ("profile", "report the time spent in each stage of any multi-threaded processing on exit.")
                                      + Option ("help", "display this information page and exit.")
                                      + Option ("version", "display version information and exit.");
 
@@ -366,6 +368,19 @@ namespace MR
       }
       if (get_options ("failonwarn").size() || File::Config::get_bool ("FailOnWarn", false))
         fail_on_warn = true;
+
+      //CONF option: ThreadProfile
+      //CONF default: 0 (false)
+      //CONF report the time spent in each stage of any multi-threaded
+      //CONF processing when the program exits (equivalent to the -profile
+      //CONF option).
+
+      //CONF option: ThreadProfileFile
+      //CONF default: none
+      //CONF if thread profiling is enabled, also write the report in JSON
+      //CONF format to this file.
+      if (get_options ("profile").size() || File::Config::get_bool ("ThreadProfile", false))
+        Thread::Profile::enable (File::Config::get ("ThreadProfileFile"));
     }
 
 
@@ -24,6 +24,7 @@
 #define __file_dicom_element_h__
 
 #include <vector>
+#include <mutex>
 
 #include "ptr.h"
 #include "hash_map.h"
@@ -74,9 +75,10 @@ namespace MR {
           }
 
           std::string tag_name () const {
-            if (dict.empty()) init_dict();
-            const char* s = dict[tag()];
-            return (s ? s : "");
+            // files may be scanned concurrently (see Tree::read()):
+            std::call_once (dict_initialised, init_dict);
+            UnorderedMap<uint32_t, const char*>::Type::const_iterator entry = dict.find (tag());
+            return (entry != dict.end() && entry->second ? entry->second : "");
           }
 
           uint32_t tag () const {
@@ -134,6 +136,7 @@ namespace MR {
           }
 
           static UnorderedMap<uint32_t, const char*>::Type dict;
+          static std::once_flag dict_initialised;
           static void init_dict();
 
           void report_unknown_tag_with_implicit_syntax () const {
@@ -31,6 +31,14 @@
 */
 
 
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sys/stat.h>
+
+#include "thread_queue.h"
+#include "file/config.h"
 #include "file/path.h"
 #include "file/dicom/element.h"
 #include "file/dicom/quick_scan.h"
@@ -71,7 +79,259 @@ namespace MR {
 
 
 
-      void Tree::read_dir (const std::string& filename, ProgressBar& progress)
+      namespace {
+
+        // The outcome of scanning one file, along with the size and
+        //   modification time of the file at the time
+        class ScannedFile : public QuickScan {
+          public:
+            ScannedFile () : size (0), mtime (0), is_image (false) { }
+            int64_t size, mtime;
+            bool is_image;
+        };
+
+
+
+        std::string escape (const std::string& text)
+        {
+          std::string s;
+          for (size_t n = 0; n < text.size(); ++n) {
+            switch (text[n]) {
+              case '\\': s += "\\\\"; break;
+              case '\t': s += "\\t"; break;
+              case '\n': s += "\\n"; break;
+              default: s += text[n];
+            }
+          }
+          return s;
+        }
+
+        std::string unescape (const std::string& text)
+        {
+          std::string s;
+          for (size_t n = 0; n < text.size(); ++n) {
+            if (text[n] == '\\' && n+1 < text.size()) {
+              ++n;
+              s += ( text[n] == 't' ? '\t' : ( text[n] == 'n' ? '\n' : text[n] ) );
+            }
+            else
+              s += text[n];
+          }
+          return s;
+        }
+
+
+
+        //CONF option: DICOMIndexFolder
+        //CONF default: (none)
+        //CONF the folder in which to keep an index of the contents of each
+        //CONF DICOM folder scanned. Files whose size and modification time are
+        //CONF unchanged since the previous scan are then not read again,
+        //CONF which can greatly speed up repeated access to large DICOM
+        //CONF folders, particularly on network storage. If not set, no index
+        //CONF is kept.
+
+        // On-disk index of the results of scanning the files in a folder,
+        //   keyed by file name, size and modification time
+        class Index {
+          public:
+            Index (const std::string& folder) : changed (false) {
+              const std::string index_folder = File::Config::get ("DICOMIndexFolder");
+              if (index_folder.empty())
+                return;
+              char* path = realpath (folder.c_str(), nullptr);
+              if (!path)
+                return;
+              const std::string absolute_path (path);
+              std::free (path);
+              index_file = Path::join (index_folder, "dicom-index-" + MR::printf ("%016zx", std::hash<std::string>() (absolute_path)) + ".txt");
+              load (absolute_path);
+            }
+
+            const ScannedFile* find (const std::string& filename, int64_t size, int64_t mtime) const {
+              std::map<std::string,ScannedFile>::const_iterator entry = cached.find (filename);
+              if (entry == cached.end() || entry->second.size != size || entry->second.mtime != mtime)
+                return nullptr;
+              return &entry->second;
+            }
+
+            void add (const ScannedFile& file, bool from_cache) {
+              if (index_file.empty())
+                return;
+              updated.push_back (file);
+              if (!from_cache)
+                changed = true;
+            }
+
+            void save () {
+              if (index_file.empty() || (!changed && updated.size() == cached.size()))
+                return;
+              const std::string temp_file = index_file + ".tmp";
+              {
+                std::ofstream out (temp_file.c_str());
+                if (!out) {
+                  INFO ("unable to write DICOM index file \"" + index_file + "\"");
+                  return;
+                }
+                out << header << "\n" << escape (folder) << "\n";
+                for (size_t n = 0; n < updated.size(); ++n) {
+                  const ScannedFile& f (updated[n]);
+                  out << escape (f.filename) << "\t" << f.size << "\t" << f.mtime << "\t" << f.is_image;
+                  const std::string* fields[] = { &f.modality, &f.patient, &f.patient_ID, &f.patient_DOB,
+                    &f.study, &f.study_ID, &f.study_date, &f.study_time, &f.series, &f.series_date, &f.series_time, &f.sequence };
+                  for (size_t i = 0; i < sizeof (fields) / sizeof (fields[0]); ++i)
+                    out << "\t" << escape (*fields[i]);
+                  out << "\t" << f.series_number << "\t" << f.bits_alloc << "\t" << f.dim[0] << "\t" << f.dim[1] << "\t" << f.data << "\n";
+                }
+                if (!out.good()) {
+                  INFO ("error writing DICOM index file \"" + index_file + "\"");
+                  return;
+                }
+              }
+              if (std::rename (temp_file.c_str(), index_file.c_str()))
+                INFO ("unable to write DICOM index file \"" + index_file + "\"");
+            }
+
+          private:
+            static const char* header;
+            std::string index_file, folder;
+            std::map<std::string,ScannedFile> cached;
+            std::vector<ScannedFile> updated;
+            bool changed;
+
+            void load (const std::string& absolute_path) {
+              folder = absolute_path;
+              std::ifstream in (index_file.c_str());
+              if (!in)
+                return;
+              std::string line;
+              // guard against hash collisions between folders:
+              if (!std::getline (in, line) || line != header || !std::getline (in, line) || unescape (line) != folder)
+                return;
+              while (std::getline (in, line)) {
+                const std::vector<std::string> fields = split (line, "\t", false);
+                if (fields.size() != 21)
+                  continue;
+                ScannedFile f;
+                try {
+                  f.filename = unescape (fields[0]);
+                  f.size = to<int64_t> (fields[1]);
+                  f.mtime = to<int64_t> (fields[2]);
+                  f.is_image = to<int> (fields[3]);
+                  std::string* strings[] = { &f.modality, &f.patient, &f.patient_ID, &f.patient_DOB,
+                    &f.study, &f.study_ID, &f.study_date, &f.study_time, &f.series, &f.series_date, &f.series_time, &f.sequence };
+                  for (size_t i = 0; i < sizeof (strings) / sizeof (strings[0]); ++i)
+                    *strings[i] = unescape (fields[4+i]);
+                  f.series_number = to<size_t> (fields[16]);
+                  f.bits_alloc = to<size_t> (fields[17]);
+                  f.dim[0] = to<size_t> (fields[18]);
+                  f.dim[1] = to<size_t> (fields[19]);
+                  f.data = to<size_t> (fields[20]);
+                }
+                catch (Exception&) {
+                  continue;
+                }
+                cached.insert (std::make_pair (f.filename, f));
+              }
+              DEBUG ("loaded " + str (cached.size()) + " entries from DICOM index file \"" + index_file + "\"");
+            }
+        };
+
+        const char* Index::header = "mrtrix DICOM index 1";
+
+
+
+        class FileSource {
+          public:
+            FileSource (size_t count) : count (count), current (0) { }
+            bool operator() (size_t& index) {
+              if (current >= count)
+                return false;
+              index = current++;
+              return true;
+            }
+          private:
+            const size_t count;
+            size_t current;
+        };
+
+
+
+        // Reads the relevant DICOM fields from each file, unless the file is
+        //   in the index and unchanged (run in parallel)
+        class FileScanner {
+          public:
+            FileScanner (const std::vector<std::string>& files, const Index& index) :
+              files (files), index (index) { }
+
+            bool operator() (const size_t& n, std::pair<ScannedFile,bool>& item) {
+              ScannedFile& file (item.first);
+              struct stat buf;
+              if (stat (files[n].c_str(), &buf))
+                return false;
+              const ScannedFile* cached = index.find (files[n], buf.st_size, buf.st_mtime);
+              item.second = cached;
+              if (cached) {
+                file = *cached;
+                return true;
+              }
+              file.size = buf.st_size;
+              file.mtime = buf.st_mtime;
+              file.is_image = false;
+              try {
+                if (file.read (files[n])) {
+                  INFO ("error reading file \"" + files[n] + "\" - assuming not DICOM");
+                }
+                else if (! (file.dim[0] && file.dim[1] && file.bits_alloc && file.data)) {
+                  INFO ("DICOM file \"" + files[n] + "\" does not seem to contain image data - ignored");
+                }
+                else {
+                  file.is_image = true;
+                }
+              }
+              catch (Exception& E) {
+                E.display (3);
+              }
+              file.filename = files[n];
+              return true;
+            }
+
+          private:
+            const std::vector<std::string>& files;
+            const Index& index;
+        };
+
+
+
+        // Inserts the images into the tree in the order the files were
+        //   listed, so the result does not depend on the number of threads
+        class TreeInserter {
+          public:
+            TreeInserter (Tree& tree, Index& index, ProgressBar& progress) :
+              tree (tree), index (index), progress (progress) { }
+
+            bool operator() (const std::pair<ScannedFile,bool>& item) {
+              if (item.first.is_image)
+                tree.add (item.first);
+              index.add (item.first, item.second);
+              ++progress;
+              return true;
+            }
+
+          private:
+            Tree& tree;
+            Index& index;
+            ProgressBar& progress;
+        };
+
+      }
+
+
+
+
+
+
+      void Tree::read_dir (const std::string& filename, std::vector<std::string>& files)
       {
         try { 
           Path::Dir folder (filename); 
@@ -79,16 +339,9 @@ namespace MR {
           while ((entry = folder.read_name()).size()) {
             std::string name (Path::join (filename, entry));
             if (Path::is_dir (name))
-              read_dir (name, progress);
-            else {
-              try { 
-                read_file (name); 
-              }
-              catch (Exception& E) { 
-                E.display (3);
-              }
-            }
-            ++progress;
+              read_dir (name, files);
+            else 
+              files.push_back (name);
           }
         }
         catch (Exception& E) { 
@@ -113,12 +366,21 @@ namespace MR {
           return;
         }
 
+        add (reader);
+      }
+
+
+
+
+
+      void Tree::add (const QuickScan& reader)
+      {
         RefPtr<Patient> patient = find (reader.patient, reader.patient_ID, reader.patient_DOB);
         RefPtr<Study> study = patient->find (reader.study, reader.study_ID, reader.study_date, reader.study_time);
         RefPtr<Series> series = study->find (reader.series, reader.series_number, reader.modality, reader.series_date, reader.series_time);
 
         RefPtr<Image> image (new Image);
-        image->filename = filename;
+        image->filename = reader.filename;
         image->series = series;
         image->sequence_name = reader.sequence;
         series->push_back (image);
@@ -131,8 +393,17 @@ namespace MR {
       void Tree::read (const std::string& filename)
       {
         ProgressBar progress ("scanning DICOM folder \"" + shorten (filename) + "\"", 0);
-        if (Path::is_dir (filename))
-          read_dir (filename, progress);
+        if (Path::is_dir (filename)) {
+          std::vector<std::string> files;
+          read_dir (filename, files);
+
+          Index index (filename);
+          FileSource source (files.size());
+          FileScanner scanner (files, index);
+          TreeInserter inserter (*this, index, progress);
+          Thread::run_ordered_queue (source, size_t(), Thread::multi (scanner), std::pair<ScannedFile,bool>(), inserter);
+          index.save();
+        }
         else {
           try {
             read_file (filename);
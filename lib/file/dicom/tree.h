@@ -32,6 +32,7 @@ namespace MR {
 
       class Series; 
       class Patient;
+      class QuickScan;
 
       class Tree : public std::vector< RefPtr<Patient> > { 
         public:
@@ -48,8 +49,11 @@ namespace MR {
             }
           }
 
+          //! add the image described by \a reader to the relevant series
+          void add (const QuickScan& reader);
+
         protected:
-          void read_dir (const std::string& filename, ProgressBar& progress);
+          void read_dir (const std::string& filename, std::vector<std::string>& files);
           void read_file (const std::string& filename);
       }; 
 
@@ -202,6 +202,43 @@ namespace MR
             return result;
           }
 
+          //! the values at the current position for all positions along \a axis
+          /*! \a axis must be one of the non-spatial axes (3 or above). The
+           * position is transformed, and the interpolation weights computed,
+           * once for all positions along \a axis. The values are identical
+           * to those returned by value() at each position along \a axis. */
+          void row (std::vector<value_type>& values, size_t axis) {
+            if (oversampling) {
+              Point<float> d (x[0]+from[0], x[1]+from[1], x[2]+from[2]);
+              values.assign (interp.dim (axis), value_type (0.0));
+              Point<float> s;
+              for (int z = 0; z < OS[2]; ++z) {
+                s[2] = d[2] + z*inc[2];
+                for (int y = 0; y < OS[1]; ++y) {
+                  s[1] = d[1] + y*inc[1];
+                  for (int x = 0; x < OS[0]; ++x) {
+                    s[0] = d[0] + x*inc[0];
+                    Point<float> pos;
+                    Image::Transform::transform_position (pos, direct_transform, s);
+                    interp.voxel (pos);
+                    if (!interp) continue;
+                    interp.row (samples, axis);
+                    for (size_t n = 0; n < values.size(); ++n)
+                      values[n] += samples[n];
+                  }
+                }
+              }
+              for (size_t n = 0; n < values.size(); ++n)
+                values[n] *= norm;
+            }
+            else {
+              Point<float> pos;
+              Image::Transform::transform_position (pos, direct_transform, x);
+              interp.voxel (pos);
+              interp.row (values, axis);
+            }
+          }
+
           Position<Reslice<Interpolator,VoxelType> > operator[] (size_t axis) {
             return Position<Reslice<Interpolator,VoxelType> > (*this, axis);
           }
@@ -215,6 +252,7 @@ namespace MR
           float norm;
           Math::Matrix<float> direct_transform;
           value_type result;
+          std::vector<value_type> samples;
 
           ssize_t get_pos (size_t axis) const {
             return axis < 3 ? x[axis] : interp[axis];
@@ -29,11 +29,12 @@
 #include "image/nav.h"
 #include "image/voxel.h"
 
+#include "image/threaded_loop.h"
+
 #include "image/filter/base.h"
 
 #include "math/matrix.h"
 
-#include <stack>
 #include <iostream>
 
 namespace MR
@@ -60,12 +61,79 @@ namespace MR
       }
 
 
+      //! \cond skip
+      namespace {
+
+        const uint32_t __not_in_set = std::numeric_limits<uint32_t>::max();
+
+        // disjoint sets stored as an array of parent indices, with each
+        // element outside all sets marked as __not_in_set. The parent of
+        // each element always precedes it, so that each set is represented
+        // by its first element:
+        inline uint32_t __find_root (std::vector<uint32_t>& parent, uint32_t i)
+        {
+          while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+          }
+          return i;
+        }
+
+        inline void __merge (std::vector<uint32_t>& parent, uint32_t a, uint32_t b)
+        {
+          a = __find_root (parent, a);
+          b = __find_root (parent, b);
+          if (a < b)
+            parent[b] = a;
+          else if (b < a)
+            parent[a] = b;
+        }
+
+        // replace the parent of each element with the label of its set,
+        // numbered from 1 in order of the first element of each set, and 0
+        // for those outside all sets:
+        inline void __label_sets (std::vector<uint32_t>& parent, std::vector<cluster>& clusters)
+        {
+          for (size_t i = 0; i < parent.size(); ++i) {
+            if (parent[i] == __not_in_set) {
+              parent[i] = 0;
+              continue;
+            }
+            if (parent[i] == i) {
+              cluster c;
+              c.label = clusters.size() + 1;
+              c.size = 0;
+              clusters.push_back (c);
+              parent[i] = c.label;
+            }
+            else {
+              // the parent always precedes the element, and so has already
+              // been replaced by the label of the set:
+              parent[i] = parent[parent[i]];
+            }
+            ++clusters[parent[i]-1].size;
+          }
+        }
+
+      }
+      //! \endcond
+
+
+
+
+      //! connected components over an explicit adjacency graph of mask voxels
+      /*! The adjacency between the voxels in the mask is computed once by
+       * precompute_adjacency(), and stored in compressed sparse row form.
+       * Clusters are then identified using union-find, which requires no
+       * recursion or explicit stack, and is safe to invoke concurrently
+       * from multiple threads. */
       class Connector {
 
         public:
           Connector (bool do_26_connectivity) :
             do_26_connectivity (do_26_connectivity),
-            dim_to_ignore (4, false) {
+            dim_to_ignore (4, false),
+            adjacency_offsets (1, 0) {
               dim_to_ignore[3] = true;
           }
 
@@ -73,21 +141,10 @@ namespace MR
           // Perform connected components on the mask.
           const std::vector<std::vector<int> >& run (std::vector<cluster>& clusters,
                                                      std::vector<uint32_t>& labels) const {
-            labels.resize (adjacent_indices.size(), 0);
-            uint32_t current_label = 1;
-            for (uint32_t i = 0; i < labels.size(); i++) {
-              // this node has not been already clustered
-              if (labels[i] == 0) {
-                cluster cluster;
-                cluster.label = current_label;
-                cluster.size = 0;
-                depth_first_search (i, cluster, labels);
-                clusters.push_back (cluster);
-                current_label++;
-              }
-            }
-            if (clusters.size() > std::numeric_limits<uint32_t>::max())
-              throw Exception ("The number of clusters is larger than can be labelled with an unsigned 32bit integer.");
+            labels.resize (num_nodes());
+            for (uint32_t i = 0; i < labels.size(); i++)
+              labels[i] = i;
+            label (clusters, labels);
             return mask_indices;
           }
 
@@ -97,21 +154,10 @@ namespace MR
                     std::vector<uint32_t>& labels,
                     const std::vector<float>& data,
                     const float threshold) const {
-            labels.resize (adjacent_indices.size(), 0);
-            uint32_t current_label = 1;
-            for (uint32_t i = 0; i < labels.size(); i++) {
-              // this node has not been already clustered and is above threshold
-              if (labels[i] == 0 && data[i] > threshold) {
-                cluster cluster;
-                cluster.label = current_label;
-                cluster.size = 0;
-                depth_first_search (i, cluster, labels, data, threshold);
-                clusters.push_back (cluster);
-                current_label++;
-              }
-            }
-            if (clusters.size() > std::numeric_limits<uint32_t>::max())
-              throw Exception ("The number of clusters is larger than can be labelled with an unsigned 32bit integer.");
+            labels.resize (num_nodes());
+            for (uint32_t i = 0; i < labels.size(); i++)
+              labels[i] = data[i] > threshold ? i : __not_in_set;
+            label (clusters, labels);
           }
 
 
@@ -142,6 +188,9 @@ namespace MR
                 index_image.value() = 0;
               }
             }
+            if (mask_indices.size() >= __not_in_set)
+              throw Exception ("The number of voxels in the mask is larger than can be indexed with an unsigned 32bit integer.");
+
             // Here we pre-compute the offsets for our neighbours in 4D space
             std::vector< std::vector<int> > neighbour_offsets;
             std::vector<int> offset (4);
@@ -161,101 +210,48 @@ namespace MR
             }
             // 2nd pass, define adjacency
             MaskVoxelType mask_neigh (mask);
+            adjacency_offsets.assign (1, 0);
+            adjacency.clear();
             for (std::vector<std::vector<int> >::const_iterator it = mask_indices.begin(); it != mask_indices.end(); ++it) {
-              std::vector<uint32_t> neighbour_indices;
               for (std::vector< std::vector<int> >::const_iterator offset = neighbour_offsets.begin(); offset != neighbour_offsets.end(); ++offset) {
                 for (size_t dim = 0; dim < mask.ndim(); dim++)
                   mask_neigh[dim] = (*it)[dim] + (*offset)[dim];
                 if (Image::Nav::within_bounds (mask_neigh)) {
                   if (mask_neigh.value() >= 0.5)
-                    neighbour_indices.push_back (Image::Nav::get_value_at_pos (index_image, mask_neigh));
+                    adjacency.push_back (Image::Nav::get_value_at_pos (index_image, mask_neigh));
                 }
               }
-              adjacent_indices.push_back (neighbour_indices);
+              adjacency_offsets.push_back (adjacency.size());
             }
 
             return mask_indices;
           }
 
 
-          bool next_neighbour (uint32_t& node, std::vector<uint32_t>& labels) const {
-            for (size_t n = 0; n < adjacent_indices[node].size(); n++) {
-              if (labels[adjacent_indices[node][n]] == 0) {
-                node = adjacent_indices[node][n];
-                return true;
-              }
-            }
-            return false;
-          }
-
+          size_t num_nodes () const { return adjacency_offsets.size() - 1; }
 
-          bool next_neighbour (uint32_t& node,
-                               std::vector<uint32_t>& labels,
-                               const std::vector<float>& data,
-                               const float threshold) const {
-            for (size_t n = 0; n < adjacent_indices[node].size(); n++) {
-              if (labels[adjacent_indices[node][n]] == 0 && data[adjacent_indices[node][n]] > threshold) {
-                node = adjacent_indices[node][n];
-                return true;
-              }
-            }
-            return false;
-          }
 
+          bool do_26_connectivity;
+          std::vector<bool> dim_to_ignore;
+          std::vector<std::vector<int> > mask_indices;
+          // the neighbours of node n are adjacency[adjacency_offsets[n]] up to
+          // (but not including) adjacency[adjacency_offsets[n+1]]:
+          std::vector<size_t> adjacency_offsets;
+          std::vector<uint32_t> adjacency;
 
-          // use a non-recursive depth first search to agglomerate adjacent voxels
-          void depth_first_search (uint32_t root,
-                                   cluster& cluster,
-                                   std::vector<uint32_t>& labels) const {
-            uint32_t node = root;
-            std::stack<uint32_t> stack;
-            while (true) {
-              labels[node] = cluster.label;
-              stack.push (node);
-              cluster.size++;
-              if (next_neighbour (node, labels)) {
-                continue;
-              } else {
-                do {
-                  if (stack.top() == root)
-                    return;
-                  stack.pop();
-                  node = stack.top();
-                } while (!next_neighbour (node, labels));
-              }
-            }
-          }
+        protected:
 
-          // use a non-recursive depth first search to agglomerate adjacent voxels
-          void depth_first_search (uint32_t root,
-                                   cluster& cluster,
-                                   std::vector<uint32_t>& labels,
-                                   const std::vector<float>& data,
-                                   const float threshold) const {
-            uint32_t node = root;
-            std::stack<uint32_t> stack;
-            while (true) {
-              labels[node] = cluster.label;
-              stack.push (node);
-              cluster.size++;
-              if (next_neighbour (node, labels, data, threshold)) {
+          // merge the sets of all adjacent nodes, then label the sets:
+          void label (std::vector<cluster>& clusters, std::vector<uint32_t>& sets) const {
+            for (uint32_t i = 0; i < sets.size(); ++i) {
+              if (sets[i] == __not_in_set)
                 continue;
-              } else {
-                do {
-                  if (stack.top() == root)
-                    return;
-                  stack.pop();
-                  node = stack.top();
-                } while (!next_neighbour (node, labels, data, threshold));
-              }
+              for (size_t n = adjacency_offsets[i]; n < adjacency_offsets[i+1]; ++n)
+                if (adjacency[n] < i && sets[adjacency[n]] != __not_in_set)
+                  __merge (sets, i, adjacency[n]);
             }
+            __label_sets (sets, clusters);
           }
-
-
-          bool do_26_connectivity;
-          std::vector<bool> dim_to_ignore;
-          std::vector<std::vector<int> > mask_indices;
-          std::vector<std::vector<uint32_t> > adjacent_indices;
       };
 
 
@@ -306,23 +302,56 @@ namespace MR
         template <class InputVoxelType, class OutputVoxelType>
         void operator() (InputVoxelType& in, OutputVoxelType& out) {
 
-
-          Connector connector (do_26_connectivity);
-
-          if (dim_to_ignore.size())
-            connector.set_dim_to_ignore (dim_to_ignore);
-
-          connector.precompute_adjacency (in);
-
           Ptr<ProgressBar> progress;
           if (message.size()) {
             progress = new ProgressBar (message);
             ++(*progress);
           }
 
+          // the mask is read in full before anything is written, so that
+          // the input and output may refer to the same image:
+          size_t num_voxels = 1;
+          for (size_t axis = 0; axis < 4; ++axis) {
+            dims[axis] = axis < in.ndim() ? in.dim (axis) : 1;
+            strides[axis] = num_voxels;
+            num_voxels *= dims[axis];
+          }
+          if (num_voxels >= __not_in_set)
+            throw Exception ("The number of voxels in the image is larger than can be labelled with an unsigned 32bit integer.");
+
+          std::vector<uint32_t> sets (num_voxels);
+          uint32_t index = 0;
+          for (auto l = Image::Loop() (in); l; ++l, ++index)
+            sets[index] = in.value() >= 0.5 ? index : __not_in_set;
+
+          find_neighbour_offsets();
+
+          // label the voxels within slabs of planes along the last
+          // non-singleton axis in parallel, then merge the clusters across
+          // the boundaries between slabs:
+          size_t slab_axis = 3;
+          while (slab_axis && dims[slab_axis] == 1)
+            --slab_axis;
+          const ssize_t num_slabs = std::min (dims[slab_axis], std::max (ssize_t (4 * Thread::number_of_threads()), ssize_t (1)));
+          std::vector<ssize_t> slab_start (num_slabs + 1);
+          for (ssize_t n = 0; n <= num_slabs; ++n)
+            slab_start[n] = (n * dims[slab_axis]) / num_slabs;
+
+          Image::Info range;
+          range.set_ndim (1);
+          range.dim(0) = num_slabs;
+          ThreadedLoop (range, std::vector<size_t> (1, 0), std::vector<size_t>()).run_outer (
+              [&] (const Iterator& pos) {
+                merge_neighbours (sets, slab_axis, slab_start[pos[0]], slab_start[pos[0]], slab_start[pos[0]+1]);
+              });
+          for (ssize_t n = 1; n < num_slabs; ++n)
+            merge_neighbours (sets, slab_axis, slab_start[n]-1, slab_start[n], slab_start[n]+1);
+
+          if (progress)
+            ++(*progress);
+
           std::vector<cluster> clusters;
-          std::vector<uint32_t> labels;
-          std::vector<std::vector<int> > mask_indices = connector.run (clusters, labels);
+          __label_sets (sets, clusters);
 
           if (progress)
             ++(*progress);
@@ -330,22 +359,16 @@ namespace MR
           if (progress)
             ++(*progress);
 
-          std::vector<int> label_lookup (clusters.size(), 0);
+          std::vector<int> label_lookup (clusters.size() + 1, 0);
           for (uint32_t c = 0; c < clusters.size(); c++)
-            label_lookup[clusters[c].label - 1] = c + 1;
-
-          Image::LoopInOrder loop (out);
-          for (auto l = loop (out); l; ++l) 
-            out.value() = 0;
-
-          for (uint32_t i = 0; i < mask_indices.size(); i++) {
-            Image::Nav::set_pos (out, mask_indices[i]);
-            if (largest_only) {
-              if (label_lookup[labels[i] - 1] == 1)
-                out.value() = 1;
-            } else {
-              out.value() = label_lookup[labels[i] - 1];
-            }
+            label_lookup[clusters[c].label] = c + 1;
+
+          index = 0;
+          for (auto l = Image::Loop() (out); l; ++l, ++index) {
+            if (largest_only)
+              out.value() = label_lookup[sets[index]] == 1;
+            else
+              out.value() = label_lookup[sets[index]];
           }
         }
 
@@ -370,6 +393,75 @@ namespace MR
           std::vector<bool> dim_to_ignore;
           bool largest_only;
           bool do_26_connectivity;
+
+          ssize_t dims[4];
+          size_t strides[4];
+          // the offsets to those neighbours that precede each voxel:
+          std::vector<std::vector<int> > neighbour_offsets;
+
+
+          void find_neighbour_offsets ()
+          {
+            neighbour_offsets.clear();
+            std::vector<int> offset (4);
+            for (offset[3] = -1; offset[3] <= 1; offset[3]++) {
+              for (offset[2] = -1; offset[2] <= 1; offset[2]++) {
+                for (offset[1] = -1; offset[1] <= 1; offset[1]++) {
+                  for (offset[0] = -1; offset[0] <= 1; offset[0]++) {
+                    ssize_t linear = 0;
+                    size_t distance = 0;
+                    bool ignored = false;
+                    for (size_t axis = 0; axis < 4; ++axis) {
+                      linear += offset[axis] * ssize_t (strides[axis]);
+                      distance += abs (offset[axis]);
+                      if (offset[axis] && (axis >= dim_to_ignore.size() || dim_to_ignore[axis] || dims[axis] == 1))
+                        ignored = true;
+                    }
+                    if (ignored || linear >= 0 || (!do_26_connectivity && distance > 1))
+                      continue;
+                    neighbour_offsets.push_back (offset);
+                  }
+                }
+              }
+            }
+          }
+
+
+          // merge each voxel in the planes [from, to) along slab_axis with
+          // those preceding neighbours that lie in planes at or after
+          // lower_bound:
+          void merge_neighbours (std::vector<uint32_t>& sets, size_t slab_axis, ssize_t lower_bound, ssize_t from, ssize_t to) const
+          {
+            ssize_t begin[4] = { 0, 0, 0, 0 }, end[4] = { dims[0], dims[1], dims[2], dims[3] };
+            begin[slab_axis] = from;
+            end[slab_axis] = to;
+            ssize_t pos[4];
+            for (pos[3] = begin[3]; pos[3] < end[3]; ++pos[3]) {
+              for (pos[2] = begin[2]; pos[2] < end[2]; ++pos[2]) {
+                for (pos[1] = begin[1]; pos[1] < end[1]; ++pos[1]) {
+                  for (pos[0] = begin[0]; pos[0] < end[0]; ++pos[0]) {
+                    const uint32_t index = pos[0] + strides[1]*pos[1] + strides[2]*pos[2] + strides[3]*pos[3];
+                    if (sets[index] == __not_in_set)
+                      continue;
+                    for (std::vector<std::vector<int> >::const_iterator offset = neighbour_offsets.begin(); offset != neighbour_offsets.end(); ++offset) {
+                      uint32_t neighbour = index;
+                      bool within_bounds = true;
+                      for (size_t axis = 0; axis < 4; ++axis) {
+                        const ssize_t p = pos[axis] + (*offset)[axis];
+                        if (p < (axis == slab_axis ? lower_bound : 0) || p >= dims[axis]) {
+                          within_bounds = false;
+                          break;
+                        }
+                        neighbour += (*offset)[axis] * ssize_t (strides[axis]);
+                      }
+                      if (within_bounds && sets[neighbour] != __not_in_set)
+                        __merge (sets, index, neighbour);
+                    }
+                  }
+                }
+              }
+            }
+          }
       };
       //! @}
     }
@@ -24,10 +24,9 @@
 #define __image_filter_dilate_h__
 
 #include "ptr.h"
-#include "image/buffer_scratch.h"
-#include "image/copy.h"
 #include "image/loop.h"
 #include "image/filter/base.h"
+#include "image/filter/packed_mask.h"
 
 
 
@@ -74,32 +73,17 @@ namespace MR
           template <class InputVoxelType, class OutputVoxelType>
           void operator() (InputVoxelType& input, OutputVoxelType& output)
           {
-
-            RefPtr <BufferScratch<bool> > in_data (new BufferScratch<bool> (input));
-            RefPtr <BufferScratch<bool>::voxel_type> in (new BufferScratch<bool>::voxel_type (*in_data));
-            Image::copy (input, *in);
-
-            RefPtr <BufferScratch<bool> > out_data;
-            RefPtr <BufferScratch<bool>::voxel_type> out;
+            PackedMask mask (input);
 
             Ptr<ProgressBar> progress;
             if (message.size())
-              progress = new ProgressBar (message, npass_ + 1);
-
-            for (unsigned int pass = 0; pass < npass_; pass++) {
-              out_data = new BufferScratch<bool> (input);
-              out = new BufferScratch<bool>::voxel_type (*out_data);
-              LoopInOrder loop (*in);
-              for (auto l = LoopInOrder(*in) (*in, *out); l; ++l)
-                out->value() = dilate (*in);
-              if (pass < npass_ - 1) {
-                in_data = out_data;
-                in = out;
-              }
-              if (progress)
-                ++(*progress);
+              progress = new ProgressBar (message, npass_ * (input.ndim() > 3 ? voxel_count (input, 3) : 1));
+
+            for (auto l = Loop (3) (input, output); l; ++l) {
+              mask.load (input);
+              mask.dilate (npass_, progress);
+              mask.save (output);
             }
-            Image::copy (*out, output);
           }
 
 
@@ -109,20 +93,6 @@ namespace MR
 
 
         protected:
-
-          bool dilate (BufferScratch<bool>::voxel_type& in)
-          {
-            if (in.value()) return true;
-            bool val;
-            if (in[0] > 0) { in[0]--; val = in.value(); in[0]++; if (val) return true; }
-            if (in[1] > 0) { in[1]--; val = in.value(); in[1]++; if (val) return true; }
-            if (in[2] > 0) { in[2]--; val = in.value(); in[2]++; if (val) return true; }
-            if (in[0] < in.dim(0)-1) { in[0]++; val = in.value(); in[0]--; if (val) return true; }
-            if (in[1] < in.dim(1)-1) { in[1]++; val = in.value(); in[1]--; if (val) return true; }
-            if (in[2] < in.dim(2)-1) { in[2]++; val = in.value(); in[2]--; if (val) return true; }
-            return false;
-          }
-
           unsigned int npass_;
       };
       //! @}
@@ -25,10 +25,9 @@
 
 #include "progressbar.h"
 #include "ptr.h"
-#include "image/buffer_scratch.h"
-#include "image/copy.h"
 #include "image/loop.h"
 #include "image/filter/base.h"
+#include "image/filter/packed_mask.h"
 
 namespace MR
 {
@@ -71,33 +70,19 @@ namespace MR
 
 
           template <class InputVoxelType, class OutputVoxelType>
-          void operator() (InputVoxelType& input, OutputVoxelType& output) {
-
-            RefPtr <BufferScratch<bool> > in_data (new BufferScratch<bool> (input));
-            RefPtr <BufferScratch<bool>::voxel_type> in (new BufferScratch<bool>::voxel_type (*in_data));
-            Image::copy (input, *in);
-
-            RefPtr <BufferScratch<bool> > out_data;
-            RefPtr <BufferScratch<bool>::voxel_type> out;
+          void operator() (InputVoxelType& input, OutputVoxelType& output)
+          {
+            PackedMask mask (input);
 
             Ptr<ProgressBar> progress;
             if (message.size())
-              progress = new ProgressBar (message, npass_ + 1);
-
-            for (unsigned int pass = 0; pass < npass_; pass++) {
-              out_data = new BufferScratch<bool> (input);
-              out = new BufferScratch<bool>::voxel_type (*out_data);
-              for (auto l = LoopInOrder(*in) (*in, *out); l; ++l) 
-               out->value() = erode (*in);
-              
-              if (pass < npass_ - 1) {
-                in_data = out_data;
-                in = out;
-              }
-              if (progress)
-                ++(*progress);
+              progress = new ProgressBar (message, npass_ * (input.ndim() > 3 ? voxel_count (input, 3) : 1));
+
+            for (auto l = Loop (3) (input, output); l; ++l) {
+              mask.load (input);
+              mask.erode (npass_, progress);
+              mask.save (output);
             }
-            Image::copy(*out, output);
           }
 
 
@@ -107,24 +92,6 @@ namespace MR
 
 
         protected:
-
-          bool erode (BufferScratch<bool>::voxel_type& in)
-          {
-            if (!in.value()) return false;
-            if (   (in[0] == 0) || (in[0] == in.dim(0)-1)
-                || (in[1] == 0) || (in[1] == in.dim(1)-1)
-                || (in[2] == 0) || (in[2] == in.dim(2)-1))
-              return false;
-            bool val;
-            if (in[0] > 0) { in[0]--; val = in.value(); in[0]++; if (!val) return false; }
-            if (in[1] > 0) { in[1]--; val = in.value(); in[1]++; if (!val) return false; }
-            if (in[2] > 0) { in[2]--; val = in.value(); in[2]++; if (!val) return false; }
-            if (in[0] < in.dim(0)-1) { in[0]++; val = in.value(); in[0]--; if (!val) return false; }
-            if (in[1] < in.dim(1)-1) { in[1]++; val = in.value(); in[1]--; if (!val) return false; }
-            if (in[2] < in.dim(2)-1) { in[2]++; val = in.value(); in[2]--; if (!val) return false; }
-            return true;
-          }
-
           unsigned int npass_;
       };
       //! @}
@@ -24,9 +24,10 @@
 #define __image_filter_median3D_h__
 
 #include "image/info.h"
-#include "image/threaded_copy.h"
-#include "image/adapter/median3D.h"
+#include "image/threaded_loop.h"
+#include "image/voxel.h"
 #include "image/filter/base.h"
+#include "math/median.h"
 
 namespace MR
 {
@@ -34,6 +35,127 @@ namespace MR
   {
     namespace Filter
     {
+      //! \cond skip
+      namespace {
+
+        // the values within the filter neighbourhood, kept sorted as values
+        // enter and leave, excluding NaNs:
+        template <typename ValueType>
+          class __MedianWindow {
+            public:
+              void clear () { values.clear(); }
+
+              void add (ValueType value) {
+                if (!Math::not_a_number (value))
+                  values.insert (std::upper_bound (values.begin(), values.end(), value), value);
+              }
+
+              void remove (ValueType value) {
+                if (!Math::not_a_number (value))
+                  values.erase (std::lower_bound (values.begin(), values.end(), value));
+              }
+
+              // identical to Math::median() on the same values:
+              ValueType median () const {
+                const size_t num = values.size();
+                if (!num)
+                  return std::numeric_limits<ValueType>::quiet_NaN();
+                const size_t middle = num/2;
+                if (num & 1U)
+                  return values[middle];
+                return (values[middle] + values[middle-1])/2.0;
+              }
+
+            protected:
+              std::vector<ValueType> values;
+          };
+
+
+        // for masks, a histogram of two bins suffices:
+        template <>
+          class __MedianWindow<bool> {
+            public:
+              __MedianWindow () { clear(); }
+
+              void clear () { count[0] = count[1] = 0; }
+              void add (bool value) { ++count[value]; }
+              void remove (bool value) { --count[value]; }
+
+              bool median () const {
+                const size_t num = count[0] + count[1];
+                if (!num)
+                  return false;
+                const size_t middle = num/2;
+                const bool upper = middle >= count[0];
+                if (num & 1U)
+                  return upper;
+                return (upper + (middle-1 >= count[0]))/2.0;
+              }
+
+            protected:
+              size_t count[2];
+          };
+
+
+
+        // process one row of the image along the x axis, sliding the
+        // neighbourhood along the row: as the window moves by one voxel, the
+        // plane of values leaving it is removed, and the plane entering it
+        // is added.
+        template <class InputVoxelType, class OutputVoxelType>
+          class __MedianRow {
+            public:
+              typedef typename InputVoxelType::value_type value_type;
+
+              __MedianRow (const InputVoxelType& in, const OutputVoxelType& out, const std::vector<int>& half_extent) :
+                in (in), out (out), extent (half_extent) { }
+
+              void operator() (const Iterator& pos) {
+                voxel_assign (in, pos, 1);
+                voxel_assign (out, pos, 1);
+                const ssize_t nx = in.dim(0);
+                const ssize_t from[2] = { std::max (pos[1]-extent[1], ssize_t (0)), std::max (pos[2]-extent[2], ssize_t (0)) };
+                const ssize_t to[2] = { std::min (pos[1]+extent[1]+1, ssize_t (in.dim(1))), std::min (pos[2]+extent[2]+1, ssize_t (in.dim(2))) };
+
+                // copy all rows within the neighbourhood:
+                rows.clear();
+                for (in[2] = from[1]; in[2] < to[1]; ++in[2])
+                  for (in[1] = from[0]; in[1] < to[0]; ++in[1])
+                    for (in[0] = 0; in[0] < nx; ++in[0])
+                      rows.push_back (in.value());
+                const size_t num_rows = rows.size() / nx;
+
+                window.clear();
+                for (ssize_t x = 0; x < std::min (ssize_t (extent[0]), nx); ++x)
+                  for (size_t r = 0; r < num_rows; ++r)
+                    window.add (rows[r*nx + x]);
+
+                for (out[0] = 0; out[0] < nx; ++out[0]) {
+                  const ssize_t entering = out[0] + extent[0];
+                  if (entering < nx)
+                    for (size_t r = 0; r < num_rows; ++r)
+                      window.add (rows[r*nx + entering]);
+                  const ssize_t leaving = out[0] - extent[0] - 1;
+                  if (leaving >= 0)
+                    for (size_t r = 0; r < num_rows; ++r)
+                      window.remove (rows[r*nx + leaving]);
+                  out.value() = window.median();
+                }
+              }
+
+            protected:
+              InputVoxelType in;
+              OutputVoxelType out;
+              const std::vector<int> extent;
+              std::vector<value_type> rows;
+              __MedianWindow<value_type> window;
+          };
+
+      }
+      //! \endcond
+
+
+
       /** \addtogroup Filters
       @{ */
 
@@ -54,7 +176,12 @@ namespace MR
        * median_filter (src, dest);
        *
        * \endcode
-       */
+       *
+       * Each row of the image along the x axis is processed in turn (in
+       * parallel across rows), with the neighbourhood sliding along the row,
+       * so that only the values entering and leaving the neighbourhood need
+       * to be considered for each voxel. The result is identical to that of
+       * Adapter::Median3D. */
       class Median : public Base
       {
 
@@ -66,8 +193,9 @@ namespace MR
 
           template <class InfoType>
           Median (const InfoType& in, const std::vector<int>& extent) :
-              Base (in),
-              extent_ (extent) { }
+              Base (in) {
+            set_extent (extent);
+          }
 
           //! Set the extent of median filtering neighbourhood in voxels.
           //! This must be set as a single value for all three dimensions
@@ -84,11 +212,20 @@ namespace MR
 
           template <class InputVoxelType, class OutputVoxelType>
           void operator() (InputVoxelType& in, OutputVoxelType& out) {
-              Adapter::Median3D<InputVoxelType> median (in, extent_);
+              if (extent_.size() != 1 && extent_.size() != 3)
+                throw Exception ("unexpected number of elements specified in extent");
+              std::vector<int> half_extent (3);
+              for (size_t i = 0; i < 3; ++i)
+                half_extent[i] = (extent_[extent_.size() == 1 ? 0 : i] - 1) / 2;
+
+              std::vector<size_t> outer_axes;
+              for (size_t i = 1; i < in.ndim(); ++i)
+                outer_axes.push_back (i);
+              __MedianRow<InputVoxelType, OutputVoxelType> row (in, out, half_extent);
               if (message.size())
-                threaded_copy_with_progress_message (message, median, out);
+                ThreadedLoop (message, in, outer_axes, std::vector<size_t> (1, 0)).run_outer (row);
               else
-                threaded_copy (median, out);
+                ThreadedLoop (in, outer_axes, std::vector<size_t> (1, 0)).run_outer (row);
           }
 
       protected:
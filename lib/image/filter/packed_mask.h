@@ -0,0 +1,268 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __image_filter_packed_mask_h__
+#define __image_filter_packed_mask_h__
+
+#include <cstdint>
+#include <vector>
+
+#include "progressbar.h"
+#include "image/info.h"
+#include "image/iterator.h"
+#include "image/threaded_loop.h"
+
+// the number of passes beyond which dilation & erosion are computed by
+// thresholding a distance transform, rather than by successive passes:
+#define MRTRIX_MORPHOLOGY_DISTANCE_TRANSFORM_PASSES 128
+
+namespace MR
+{
+  namespace Image
+  {
+    namespace Filter
+    {
+
+      /** \addtogroup Filters
+        @{ */
+
+      //! a 3D mask stored as bit-packed rows, for use in morphological operations
+      /*! Each row along the x axis is stored as consecutive 64-bit words,
+       * with 64 voxels per word, so that the neighbours of a voxel along the
+       * row can be obtained by shifting the words, and its neighbours in
+       * adjacent rows and slices by word-wise operations on those rows.
+       * Operations are performed in parallel across slices.
+       *
+       * Voxels beyond the edge of the image are considered to lie outside the
+       * mask, so that erosion also removes any voxels on the edge of the
+       * image, as do Filter::Erode and Filter::Dilate. */
+      class PackedMask
+      {
+        public:
+          template <class InfoType>
+            PackedMask (const InfoType& info) :
+              nx (info.dim(0)),
+              ny (info.ndim() > 1 ? info.dim(1) : 1),
+              nz (info.ndim() > 2 ? info.dim(2) : 1),
+              words_per_row ((nx + 63) / 64),
+              last_word_mask (nx % 64 ? (uint64_t (1) << (nx % 64)) - 1 : ~uint64_t (0)),
+              data (words_per_row * ny * nz, 0),
+              buffer (data.size(), 0) { }
+
+          //! read the 3D volume at the current position of \a vox along axes 3 and above
+          template <class VoxelType>
+            void load (VoxelType& vox) {
+              for (vox[2] = 0; vox[2] < nz; ++vox[2]) {
+                for (vox[1] = 0; vox[1] < ny; ++vox[1]) {
+                  uint64_t* r = row (data, vox[1], vox[2]);
+                  std::fill (r, r + words_per_row, 0);
+                  for (vox[0] = 0; vox[0] < nx; ++vox[0])
+                    if (vox.value())
+                      r[vox[0] / 64] |= uint64_t (1) << (vox[0] % 64);
+                }
+              }
+            }
+
+          //! write the mask into the 3D volume at the current position of \a vox along axes 3 and above
+          template <class VoxelType>
+            void save (VoxelType& vox) const {
+              for (vox[2] = 0; vox[2] < nz; ++vox[2]) {
+                for (vox[1] = 0; vox[1] < ny; ++vox[1]) {
+                  const uint64_t* r = row (data, vox[1], vox[2]);
+                  for (vox[0] = 0; vox[0] < nx; ++vox[0])
+                    vox.value() = (r[vox[0] / 64] >> (vox[0] % 64)) & 1U;
+                }
+              }
+            }
+
+          //! dilate the mask by \a npass passes of the 6-connected neighbourhood
+          /*! This adds all voxels within a city-block distance of \a npass of
+           * the mask. */
+          void dilate (size_t npass, ProgressBar* progress = nullptr) {
+            if (npass > MRTRIX_MORPHOLOGY_DISTANCE_TRANSFORM_PASSES)
+              distance_threshold (false, npass, progress);
+            else
+              run_passes (false, npass, progress);
+          }
+
+          //! erode the mask by \a npass passes of the 6-connected neighbourhood
+          /*! This retains only those voxels further than a city-block distance
+           * of \a npass from any voxel outside the mask. */
+          void erode (size_t npass, ProgressBar* progress = nullptr) {
+            if (npass > MRTRIX_MORPHOLOGY_DISTANCE_TRANSFORM_PASSES)
+              distance_threshold (true, npass, progress);
+            else
+              run_passes (true, npass, progress);
+          }
+
+        protected:
+          const ssize_t nx, ny, nz;
+          const size_t words_per_row;
+          const uint64_t last_word_mask;
+          std::vector<uint64_t> data, buffer;
+
+          uint64_t* row (std::vector<uint64_t>& v, ssize_t y, ssize_t z) const {
+            return &v[words_per_row * (y + ny * z)];
+          }
+          const uint64_t* row (const std::vector<uint64_t>& v, ssize_t y, ssize_t z) const {
+            return &v[words_per_row * (y + ny * z)];
+          }
+
+
+          // invoke functor (n) for n in [0, count), in parallel:
+          template <class Functor>
+            static void parallel (ssize_t count, Functor&& functor) {
+              Info range;
+              range.set_ndim (1);
+              range.dim(0) = count;
+              ThreadedLoop (range, std::vector<size_t> (1, 0), std::vector<size_t>()).run_outer (
+                  [&] (const Iterator& pos) { functor (pos[0]); });
+            }
+
+
+          void run_passes (bool erode, size_t npass, ProgressBar* progress) {
+            for (size_t pass = 0; pass < npass; ++pass) {
+              parallel (nz, [&] (ssize_t z) {
+                  for (ssize_t y = 0; y < ny; ++y)
+                    process_row (erode, y, z);
+                  });
+              std::swap (data, buffer);
+              if (progress)
+                ++(*progress);
+            }
+          }
+
+
+          // a single pass of dilation or erosion along one row, from data
+          // into buffer; absent neighbours (beyond the edge of the image) are
+          // treated as outside the mask:
+          void process_row (bool erode, ssize_t y, ssize_t z) {
+            const uint64_t* in = row (data, y, z);
+            const uint64_t* neighbours[4] = {
+              y > 0 ? row (data, y-1, z) : nullptr,
+              y < ny-1 ? row (data, y+1, z) : nullptr,
+              z > 0 ? row (data, y, z-1) : nullptr,
+              z < nz-1 ? row (data, y, z+1) : nullptr
+            };
+            uint64_t* out = row (buffer, y, z);
+
+            for (size_t w = 0; w < words_per_row; ++w) {
+              const uint64_t previous = w > 0 ? in[w-1] : 0;
+              const uint64_t next = w < words_per_row-1 ? in[w+1] : 0;
+              const uint64_t lower = (in[w] << 1) | (previous >> 63);
+              const uint64_t upper = (in[w] >> 1) | (next << 63);
+              uint64_t result = in[w];
+              if (erode) {
+                result &= lower & upper;
+                for (size_t n = 0; n < 4; ++n)
+                  result &= neighbours[n] ? neighbours[n][w] : 0;
+              }
+              else {
+                result |= lower | upper;
+                for (size_t n = 0; n < 4; ++n)
+                  if (neighbours[n])
+                    result |= neighbours[n][w];
+              }
+              out[w] = result;
+            }
+            out[words_per_row-1] &= last_word_mask;
+          }
+
+
+
+
+          // compute the exact city-block distance of each voxel to the
+          // nearest voxel inside the mask (for dilation) or outside it (for
+          // erosion, including all voxels beyond the edge of the image), and
+          // threshold it at npass. The city-block distance transform is
+          // separable, and computed by a forward and backward scan along each
+          // axis in turn. Distances beyond npass are irrelevant, and
+          // saturate at npass+1:
+          void distance_threshold (bool erode, size_t npass, ProgressBar* progress) {
+            const uint32_t beyond = npass + 1;
+            const uint32_t edge = erode ? 0 : beyond;
+            std::vector<uint32_t> distance (nx * ny * nz);
+
+            parallel (nz, [&] (ssize_t z) {
+                uint32_t* slice = &distance[nx * ny * z];
+                for (ssize_t y = 0; y < ny; ++y) {
+                  const uint64_t* r = row (data, y, z);
+                  uint32_t* d = slice + nx * y;
+                  for (ssize_t x = 0; x < nx; ++x)
+                    d[x] = ((r[x / 64] >> (x % 64)) & 1U) != erode ? 0 : beyond;
+                  scan (d, nx, 1, 1, edge);
+                }
+                scan (slice, ny, nx, nx, edge);
+                });
+
+            parallel (ny, [&] (ssize_t y) {
+                scan (&distance[nx * y], nz, nx * ny, nx, edge);
+                });
+
+            parallel (nz, [&] (ssize_t z) {
+                for (ssize_t y = 0; y < ny; ++y) {
+                  uint64_t* r = row (data, y, z);
+                  const uint32_t* d = &distance[nx * (y + ny * z)];
+                  std::fill (r, r + words_per_row, 0);
+                  for (ssize_t x = 0; x < nx; ++x)
+                    if ((d[x] > npass) == erode)
+                      r[x / 64] |= uint64_t (1) << (x % 64);
+                }
+                });
+
+            if (progress)
+              for (size_t pass = 0; pass < npass; ++pass)
+                ++(*progress);
+          }
+
+
+          // 1D city-block distance transform along n positions separated by
+          // stride, for width adjacent lines at once, with the value beyond
+          // either end given by edge:
+          static void scan (uint32_t* d, ssize_t n, ssize_t stride, ssize_t width, uint32_t edge) {
+            for (ssize_t l = 0; l < width; ++l)
+              d[l] = std::min (d[l], edge + 1);
+            for (ssize_t i = 1; i < n; ++i) {
+              uint32_t* v = d + i*stride;
+              const uint32_t* previous = v - stride;
+              for (ssize_t l = 0; l < width; ++l)
+                v[l] = std::min (v[l], previous[l] + 1);
+            }
+            uint32_t* last = d + (n-1)*stride;
+            for (ssize_t l = 0; l < width; ++l)
+              last[l] = std::min (last[l], edge + 1);
+            for (ssize_t i = n-2; i >= 0; --i) {
+              uint32_t* v = d + i*stride;
+              const uint32_t* next = v + stride;
+              for (ssize_t l = 0; l < width; ++l)
+                v[l] = std::min (v[l], next[l] + 1);
+            }
+          }
+
+      };
+      //! @}
+    }
+  }
+}
+
+
+
+
+#endif
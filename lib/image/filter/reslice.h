@@ -25,6 +25,7 @@
 
 #include "image/adapter/reslice.h"
 #include "image/threaded_copy.h"
+#include "image/threaded_loop.h"
 #include "datatype.h"
 
 namespace MR
@@ -34,6 +35,39 @@ namespace MR
     namespace Filter
     {
 
+      //! \cond skip
+      namespace {
+
+        // reslice all volumes along axis 3 for each row of the destination
+        // along the x axis, so that the source position and interpolation
+        // weights are computed only once per spatial position:
+        template <class ResliceType, class VoxelTypeDestination>
+          class __ResliceRows {
+            public:
+              __ResliceRows (const ResliceType& interp, const VoxelTypeDestination& destination) :
+                interp (interp), destination (destination) { }
+
+              void operator() (const Iterator& pos) {
+                voxel_assign (interp, pos);
+                voxel_assign (destination, pos);
+                for (destination[0] = 0; destination[0] < destination.dim(0); ++destination[0]) {
+                  interp[0] = destination[0];
+                  interp.row (values, 3);
+                  for (destination[3] = 0; destination[3] < destination.dim(3); ++destination[3])
+                    destination.value() = values[destination[3]];
+                }
+              }
+
+            protected:
+              ResliceType interp;
+              VoxelTypeDestination destination;
+              std::vector<typename ResliceType::value_type> values;
+          };
+
+      }
+      //! \endcond
+
+
       //! convenience function to regrid one DataSet onto another
       /*! This function resamples (regrids) the Image \a source onto the
        * Image& \a destination, using the templated interpolator class.
@@ -53,7 +87,11 @@ namespace MR
        * Image::Filter::reslice<Image::Interp::Linear> (source, destination, operation);
        * DataSet::Interp::reslice<DataSet::Interp::Linear> (destination, source);
        * \endcode
-       */
+       *
+       * For images with more than one volume along axis 3, all volumes are
+       * resliced together for each spatial position, so that the source
+       * position and the interpolation weights are computed only once for
+       * all volumes. */
       template <template <class VoxelType> class Interpolator, class VoxelTypeDestination, class VoxelTypeSource>
         void reslice (
             VoxelTypeSource& source,
@@ -62,8 +100,21 @@ namespace MR
             const std::vector<int>& oversampling = Adapter::AutoOverSample,
             const typename VoxelTypeDestination::value_type value_when_out_of_bounds = DataType::default_out_of_bounds_value<typename VoxelTypeDestination::value_type>())
         {
-          Adapter::Reslice<Interpolator,VoxelTypeSource> interp (source, destination, transform, oversampling, value_when_out_of_bounds);
-          Image::threaded_copy_with_progress_message ("reslicing \"" + source.name() + "\"...", interp, destination, 2);
+          typedef Adapter::Reslice<Interpolator,VoxelTypeSource> ResliceType;
+          ResliceType interp (source, destination, transform, oversampling, value_when_out_of_bounds);
+          const std::string message ("reslicing \"" + source.name() + "\"...");
+          if (destination.ndim() < 4 || destination.dim(3) < 2) {
+            Image::threaded_copy_with_progress_message (message, interp, destination, 2);
+            return;
+          }
+
+          std::vector<size_t> outer_axes, inner_axes (1, 0);
+          inner_axes.push_back (3);
+          for (size_t axis = 1; axis < destination.ndim(); ++axis)
+            if (axis != 3)
+              outer_axes.push_back (axis);
+          __ResliceRows<ResliceType,VoxelTypeDestination> rows (interp, destination);
+          ThreadedLoop (message, destination, outer_axes, inner_axes).run_outer (rows);
         }
 
 
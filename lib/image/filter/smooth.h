@@ -25,9 +25,9 @@
 
 
 #include "image/buffer_scratch.h"
-#include "image/copy.h"
 #include "image/threaded_copy.h"
-#include "image/adapter/gaussian1D.h"
+#include "image/threaded_loop.h"
+#include "image/voxel.h"
 #include "image/filter/base.h"
 
 namespace MR
@@ -36,6 +36,98 @@ namespace MR
   {
     namespace Filter
     {
+      //! \cond skip
+      namespace {
+
+        // the maximum number of adjacent lines along the x axis convolved
+        // together when smoothing along any other axis:
+        const size_t __smooth_max_lanes = 32;
+
+        // convolve the lines of an image along one axis with a 1D kernel.
+        // Each line (or, for axes other than x, a tile of adjacent lines
+        // along x) is copied into a contiguous zero-padded buffer, with the
+        // lines interleaved, so that the convolution reduces to a single
+        // vectorisable loop per kernel coefficient. Where the kernel extends
+        // beyond the image, the result is renormalised by the sum of the
+        // kernel coefficients actually used, as in Adapter::Gaussian1D.
+        template <class InputVoxelType, class OutputVoxelType, typename ValueType>
+          class __SmoothLines {
+            public:
+              __SmoothLines (const InputVoxelType& in, const OutputVoxelType& out, size_t axis, const std::vector<float>& kernel) :
+                in (in), out (out), axis (axis), kernel (kernel),
+                radius ((kernel.size() - 1) / 2),
+                size (in.dim (axis)),
+                weights (size, ValueType (1.0)) {
+                  for (ssize_t i = 0; i < size; ++i) {
+                    if (i >= radius && i < size - radius)
+                      continue;
+                    weights[i] = 0.0;
+                    for (ssize_t c = 0; c < ssize_t (kernel.size()); ++c)
+                      if (i + c - radius >= 0 && i + c - radius < size)
+                        weights[i] += kernel[c];
+                  }
+                }
+
+              void operator() (const Iterator& pos) {
+                voxel_assign (in, pos);
+                voxel_assign (out, pos);
+                if (axis == 0)
+                  process (0, 1);
+                else for (ssize_t x = 0; x < in.dim(0); x += __smooth_max_lanes)
+                  process (x, std::min (ssize_t (__smooth_max_lanes), in.dim(0) - x));
+              }
+
+            protected:
+              InputVoxelType in;
+              OutputVoxelType out;
+              const size_t axis;
+              const std::vector<float> kernel;
+              const ssize_t radius, size;
+              std::vector<ValueType> weights, line, result;
+
+              void process (ssize_t x, ssize_t lanes) {
+                const size_t padding = radius * lanes;
+                line.resize (size * lanes + 2 * padding);
+                std::fill (line.begin(), line.begin() + padding, ValueType (0.0));
+                std::fill (line.end() - padding, line.end(), ValueType (0.0));
+
+                ValueType* p = &line[padding];
+                for (in[axis] = 0; in[axis] < size; ++in[axis]) {
+                  for (ssize_t l = 0; l < lanes; ++l) {
+                    if (axis)
+                      in[0] = x + l;
+                    *p++ = in.value();
+                  }
+                }
+
+                const size_t count = size * lanes;
+                result.assign (count, ValueType (0.0));
+                ValueType* r = &result[0];
+                for (size_t c = 0; c < kernel.size(); ++c) {
+                  const ValueType* s = &line[c * lanes];
+                  const float k = kernel[c];
+                  for (size_t n = 0; n < count; ++n)
+                    r[n] += s[n] * k;
+                }
+
+                r = &result[0];
+                for (out[axis] = 0; out[axis] < size; ++out[axis]) {
+                  const ValueType w = weights[out[axis]];
+                  const bool boundary = out[axis] < radius || out[axis] >= size - radius;
+                  for (ssize_t l = 0; l < lanes; ++l) {
+                    if (axis)
+                      out[0] = x + l;
+                    out.value() = boundary ? *r / w : *r;
+                    ++r;
+                  }
+                }
+              }
+          };
+
+      }
+      //! \endcond
+
+
       /** \addtogroup Filters
       @{ */
 
@@ -61,7 +153,12 @@ namespace MR
        * smooth_filter (src, dest);
        *
        * \endcode
-       */
+       *
+       * The image is smoothed along each axis in turn, in parallel across
+       * the lines along that axis, with each line copied into a contiguous
+       * buffer for the convolution. Intermediate results alternate between
+       * at most two scratch buffers. The result is identical to that of
+       * applying Adapter::Gaussian1D along each axis in turn. */
       class Smooth : public Base
       {
 
@@ -131,40 +228,89 @@ namespace MR
           template <class InputVoxelType, class OutputVoxelType, typename ValueType = float>
           void operator() (InputVoxelType& input, OutputVoxelType& output, ValueType type = 0.0f)
           {
-            RefPtr <BufferScratch<ValueType> > in_data (new BufferScratch<ValueType> (input));
-            RefPtr <typename BufferScratch<ValueType>::voxel_type> in (new typename BufferScratch<ValueType>::voxel_type (*in_data));
-            threaded_copy (input, *in);
+            std::vector<size_t> axes;
+            for (size_t dim = 0; dim < this->ndim(); dim++)
+              if (kernel (dim).size())
+                axes.push_back (dim);
 
-            RefPtr <BufferScratch<ValueType> > out_data;
-            RefPtr <typename BufferScratch<ValueType>::voxel_type> out;
+            if (axes.empty()) {
+              threaded_copy (input, output);
+              return;
+            }
 
             Ptr<ProgressBar> progress;
-            if (message.size()) {
-              size_t axes_to_smooth = 0;
-              for (std::vector<float>::const_iterator i = stdev.begin(); i != stdev.end(); ++i)
-                if (*i)
-                  ++axes_to_smooth;
-              progress = new ProgressBar (message, axes_to_smooth + 1);
+            if (message.size())
+              progress = new ProgressBar (message, axes.size());
+
+            // the first pass reads from the input, and the last writes
+            // directly to the output; any passes in between alternate
+            // between two scratch buffers:
+            typedef typename BufferScratch<ValueType>::voxel_type scratch_type;
+            Ptr<BufferScratch<ValueType> > scratch_data[2];
+            Ptr<scratch_type> scratch[2];
+            for (size_t n = 0; n < std::min (axes.size() - 1, size_t (2)); ++n) {
+              scratch_data[n] = new BufferScratch<ValueType> (input);
+              scratch[n] = new scratch_type (*scratch_data[n]);
             }
 
-            for (size_t dim = 0; dim < this->ndim(); dim++) {
-              if (stdev[dim] > 0) {
-                out_data = new BufferScratch<ValueType> (input);
-                out = new typename BufferScratch<ValueType>::voxel_type (*out_data);
-                Adapter::Gaussian1D<typename BufferScratch<ValueType>::voxel_type > gaussian (*in, stdev[dim], dim, extent[dim]);
-                threaded_copy (gaussian, *out);
-                in_data = out_data;
-                in = out;
-                if (progress)
-                  ++(*progress);
-              }
+            for (size_t n = 0; n < axes.size(); ++n) {
+              const bool first = n == 0, last = n == axes.size() - 1;
+              if (first && last)
+                smooth_axis<ValueType> (input, output, axes[n]);
+              else if (first)
+                smooth_axis<ValueType> (input, *scratch[0], axes[n]);
+              else if (last)
+                smooth_axis<ValueType> (*scratch[(n-1) & 1U], output, axes[n]);
+              else
+                smooth_axis<ValueType> (*scratch[(n-1) & 1U], *scratch[n & 1U], axes[n]);
+              if (progress)
+                ++(*progress);
             }
-            threaded_copy (*in, output);
           }
 
         protected:
           std::vector<int> extent;
           std::vector<float> stdev;
+
+          //! the normalised kernel along \a axis, as used by Adapter::Gaussian1D
+          std::vector<float> kernel (size_t axis) const
+          {
+            std::vector<float> coefs;
+            if (stdev[axis] <= 0.0)
+              return coefs;
+            const ssize_t radius = extent[axis] ? (extent[axis] - 1) / 2 : ssize_t (ceil (2.5 * stdev[axis] / vox (axis)));
+            if (radius < 1)
+              return coefs;
+            coefs.resize (2 * radius + 1);
+            float norm_factor = 0.0;
+            for (ssize_t c = 0; c < ssize_t (coefs.size()); ++c) {
+              coefs[c] = exp (-((c-radius) * (c-radius) * vox(axis) * vox(axis)) / (2 * stdev[axis] * stdev[axis]));
+              norm_factor += coefs[c];
+            }
+            for (size_t c = 0; c < coefs.size(); ++c)
+              coefs[c] /= norm_factor;
+            return coefs;
+          }
+
+          template <typename ValueType, class InputVoxelType, class OutputVoxelType>
+          void smooth_axis (InputVoxelType& input, OutputVoxelType& output, size_t axis) const
+          {
+            std::vector<size_t> outer_axes, inner_axes (1, axis);
+            for (size_t n = 0; n < input.ndim(); ++n) {
+              if (n == axis)
+                continue;
+              if (n == 0)
+                inner_axes.push_back (n);
+              else
+                outer_axes.push_back (n);
+            }
+
+            __SmoothLines<InputVoxelType, OutputVoxelType, ValueType> lines (input, output, axis, kernel (axis));
+            if (outer_axes.empty())
+              lines (Iterator (input));
+            else
+              ThreadedLoop (input, outer_axes, inner_axes).run_outer (lines);
+          }
       };
       //! @}
     }
@@ -21,6 +21,9 @@
 */
 
 
+#include <algorithm>
+#include <limits>
+
 #include "image/handler/sparse.h"
 
 
@@ -33,12 +36,36 @@ namespace MR
     {
 
 
+      //CONF option: SparseDataInitialSize
+      //CONF default: 16777216
+      //CONF the initial size in bytes of the sparse data of a newly created
+      //CONF sparse image (e.g. fixel image); this is enough to store
+      //CONF whole-brain fixel data at 2.5mm resolution.
+
+      //CONF option: SparseDataArenaSize
+      //CONF default: 1048576
+      //CONF the size in bytes of the regions of sparse data reserved at a
+      //CONF time by each thread writing to a sparse image.
+
+      //CONF option: SparseDataCompact
+      //CONF default: 1 (true)
+      //CONF whether to compact the sparse data of a sparse image on closing,
+      //CONF if space has been left unused as voxels were reallocated.
+
+
       Sparse::Sparse (Default& handler, const std::string& sparse_class, const size_t sparse_size, const File::Entry entry) :
           Default (handler),
           class_name (sparse_class),
           class_size (sparse_size),
           file (entry),
-          data_end (0) { }
+          arena_size (File::Config::get_int ("SparseDataArenaSize", 1048576)),
+          data_end (0),
+          num_segments (0),
+          free_bytes (0)
+      {
+        segment_start[0] = 0;
+        std::fill (segment_start + 1, segment_start + max_segments + 1, std::numeric_limits<uint64_t>::max());
+      }
 
 
       void Sparse::load()
@@ -54,23 +81,21 @@ namespace MR
 
         if (current_sparse_data_size) {
 
-          mmap = new File::MMap (file, Base::writable, true, current_sparse_data_size);
+          segments[0] = new File::MMap (file, Base::writable, true, current_sparse_data_size);
+          segment_address[0] = segments[0]->address();
+          segment_start[1] = current_sparse_data_size;
+          num_segments = 1;
           data_end = current_sparse_data_size;
 
         } else if (Base::writable) {
 
-          // Default = initialise 16MB, this is enough to store whole-brain fixel data at 2.5mm resolution
           const uint64_t init_sparse_data_size = File::Config::get_int ("SparseDataInitialSize", 16777216);
-          const size_t new_file_size = file.start + init_sparse_data_size;
-          DEBUG ("Initialising output sparse data file " + file.name + ": new file size " + str(new_file_size) + " (" + str(init_sparse_data_size) + " of which is initial sparse data buffer)");
-          File::resize (file.name, new_file_size);
-          mmap = new File::MMap (file, Base::writable, false, init_sparse_data_size);
+          DEBUG ("Initialising output sparse data file " + file.name + ": new file size " + str(file.start + init_sparse_data_size) + " (" + str(init_sparse_data_size) + " of which is initial sparse data buffer)");
+          add_segment (init_sparse_data_size);
 
-          // Writes a single uint32_t(0) to the start of the sparse data region
+          // The first segment is zero-filled, so the start of the sparse data holds a single uint32_t(0)
           // Any voxel that has its value initialised to 0 will point here, and therefore dereferencing of any
           //   such voxel will yield a Sparse::Value with zero elements
-          memset (off2mem (0), 0x00, sizeof (uint32_t));
-
           data_end = sizeof(uint32_t);
 
         }
@@ -90,13 +115,27 @@ namespace MR
       void Sparse::unload()
       {
 
+        {
+          std::lock_guard<std::mutex> lock (mutex);
+
+          // Reclaim the space still held by any arenas; these can no longer be used
+          for (std::vector<Arena*>::iterator i = arenas.begin(); i != arenas.end(); ++i) {
+            add_free ((*i)->next, (*i)->end - (*i)->next);
+            (*i)->handler = nullptr;
+            (*i)->next = (*i)->end = 0;
+          }
+          arenas.clear();
+
+          // This needs to happen before the raw image data are unloaded, since these are updated
+          if (Base::writable && free_bytes && File::Config::get_bool ("SparseDataCompact", true))
+            compact();
+        }
+
         Default::unload();
 
+        // All data beyond data_end are zero, so the segments can be written back as-is before truncating
         const uint64_t truncate_file_size = (data_end == size()) ? 0 : file.start + data_end;
-        // Null the excess data before closing the memory map to prevent std::ofstream from giving an error
-        //   (writing uninitialised values)
-        memset (off2mem(data_end), 0x00, size() - data_end);
-        mmap = NULL;
+        clear_segments();
 
         if (truncate_file_size) {
           DEBUG ("truncating sparse image data file " + file.name + " to " + str(truncate_file_size) + " bytes");
@@ -120,91 +159,281 @@ namespace MR
 
       uint64_t Sparse::set_numel (const uint64_t old_offset, const uint32_t numel)
       {
+        assert (Base::writable);
+
+        // If this voxel is being cleared (i.e. no elements), rather than returning a pointer to a voxel with
+        //   zero elements, instead return a pointer to the start of the sparse data, where there's a single
+        //   uint32_t(0) which can be used for any and all voxels with zero elements
+        if (old_offset && shrink (old_offset, numel))
+          return numel ? old_offset : 0;
+        if (!numel)
+          return 0;
+
+        uint64_t offset;
+        {
+          std::lock_guard<std::mutex> lock (mutex);
+          offset = allocate (record_size (numel));
+        }
 
+        // Write the uint32_t indicating the number of elements in this voxel
+        memcpy (off2mem(offset), &numel, sizeof(uint32_t));
+        return offset;
+      }
+
+
+
+      uint64_t Sparse::set_numel (const uint64_t old_offset, const uint32_t numel, Arena& arena)
+      {
         assert (Base::writable);
 
-        // Before allocating new memory, verify that the current offset does not point to
-        //   a voxel that has more elements than is required
-        if (old_offset) {
+        if (old_offset && shrink (old_offset, numel))
+          return numel ? old_offset : 0;
+        if (!numel)
+          return 0;
 
-          assert (old_offset < data_end);
+        const uint64_t offset = allocate (record_size (numel), arena);
+        memcpy (off2mem(offset), &numel, sizeof(uint32_t));
+        return offset;
+      }
 
-          const uint32_t existing_numel = get_numel (old_offset);
-          if (existing_numel >= numel) {
 
-            // Set the new number of elements, clear the unwanted data, and return
-            memcpy (off2mem(old_offset), &numel, sizeof(uint32_t));
-            memset (off2mem(old_offset) + sizeof(uint32_t) + (numel * class_size), 0x00, ((existing_numel - numel) * class_size));
-            // If this voxel is being cleared (i.e. no elements), rather than returning a pointer to a voxel with
-            //   zero elements, instead return a pointer to the start of the sparse data, where there's a single
-            //   uint32_t(0) which can be used for any and all voxels with zero elements
-            return numel ? old_offset : 0;
 
-          } else {
 
-            // Existing memory allocation for this voxel is not sufficient; erase it
-            // Note that the handler makes no attempt at re-using this memory later; new data is just concatenated
-            //   to the end of the buffer
-            memset (off2mem(old_offset), 0x00, sizeof(uint32_t) + (existing_numel * class_size));
+      uint8_t* Sparse::get (const uint64_t voxel_offset, const size_t index) const
+      {
+        assert (index < get_numel (voxel_offset));
+        const uint64_t offset = sizeof(uint32_t) + (index * class_size);
+        uint8_t* const ptr = off2mem(voxel_offset) + offset;
+        return ptr;
+      }
 
-          }
+
+
+
+
+
+      void Sparse::add_segment (const uint64_t min_size)
+      {
+        if (num_segments == max_segments)
+          throw Exception ("maximum number of sparse data segments exceeded for image \"" + name + "\"");
+
+        // Each new segment is as large as all previous segments combined, so that the total size doubles
+        const uint64_t start = size();
+        const uint64_t segment_size = std::max (start, min_size);
+
+        const size_t new_file_size = file.start + start + segment_size;
+        DEBUG ("Extending sparse data file " + file.name + ": new file size " + str(new_file_size) + " (" + str(start + segment_size) + " of which is for sparse data)");
+        File::resize (file.name, new_file_size);
+
+        segments[num_segments] = new File::MMap (File::Entry (file.name, file.start + start), Base::writable, false, segment_size);
+        segment_address[num_segments] = segments[num_segments]->address();
+        // Explicitly null the new memory, since the entire segment is written back to file
+        memset (segment_address[num_segments], 0x00, segment_size);
+        segment_start[num_segments+1] = start + segment_size;
+        ++num_segments;
+      }
+
+
+
+      void Sparse::clear_segments ()
+      {
+        for (size_t n = 0; n != num_segments; ++n) {
+          segments[n] = NULL;
+          segment_start[n+1] = std::numeric_limits<uint64_t>::max();
+        }
+        num_segments = 0;
+      }
+
+
+
+      uint64_t Sparse::allocate (const uint64_t bytes)
+      {
+        uint64_t offset;
+        if (take_free (bytes, offset))
+          return offset;
+        return extend (bytes);
+      }
+
+
+
+      uint64_t Sparse::allocate (const uint64_t bytes, Arena& arena)
+      {
+        assert (!arena.handler || arena.handler == this);
+        if (arena.end - arena.next >= bytes) {
+          const uint64_t offset = arena.next;
+          arena.next += bytes;
+          return offset;
         }
 
-        // Don't allocate memory for voxels with no sparse data; just point them all to the start of the
-        //   sparse data where theres a single uint32_t(0)
-        if (!numel)
-          return 0;
+        std::lock_guard<std::mutex> lock (mutex);
+        uint64_t offset;
+        if (take_free (bytes, offset))
+          return offset;
+
+        // Return whatever remains of the arena, and reserve a new one
+        if (arena.handler) {
+          add_free (arena.next, arena.end - arena.next);
+        } else {
+          arena.handler = this;
+          arenas.push_back (&arena);
+        }
+        const uint64_t chunk = std::max (arena_size, bytes);
+        arena.next = extend (chunk);
+        arena.end = arena.next + chunk;
 
-        const int64_t requested_size = sizeof (uint32_t) + (numel * class_size);
-        if (data_end + requested_size > size()) {
+        offset = arena.next;
+        arena.next += bytes;
+        return offset;
+      }
 
-          // size() should never be empty if data is being written...
-          assert (size());
-          uint64_t new_sparse_data_size = 2 * size();
 
-          // Cover rare case where a huge memory request occurs early
-          while (new_sparse_data_size < data_end + requested_size)
-            new_sparse_data_size *= 2;
 
-          // Memory error arises due to the uninitialised data between the end of the sparse data and the end
-          //   of the file at its current size being written using std::ofstream
-          // Therefore, explicitly null all data that hasn't already been written
-          //   (this does not prohibit the use of this memory for subsequent sparse data though)
-          memset (off2mem(data_end), 0x00, size() - data_end);
+      bool Sparse::take_free (const uint64_t bytes, uint64_t& offset)
+      {
+        // Use the smallest unused block that is large enough
+        std::map< uint64_t, std::vector<uint64_t> >::iterator block = free_blocks.lower_bound (bytes);
+        if (block == free_blocks.end())
+          return false;
+
+        const uint64_t block_size = block->first;
+        offset = block->second.back();
+        block->second.pop_back();
+        if (block->second.empty())
+          free_blocks.erase (block);
+
+        free_bytes -= block_size;
+        add_free (offset + bytes, block_size - bytes);
+        return true;
+      }
 
-          mmap = NULL;
 
-          const size_t new_file_size = file.start + new_sparse_data_size;
-          DEBUG ("Resizing sparse data file " + file.name + ": new file size " + str(new_file_size) + " (" + str(new_sparse_data_size) + " of which is for sparse data)");
-          File::resize (file.name, new_file_size);
-          mmap = new File::MMap (file, Base::writable, true, new_sparse_data_size);
 
+      uint64_t Sparse::extend (const uint64_t bytes)
+      {
+        // Find space at the end of the sparse data, without straddling two segments
+        for (;;) {
+          size_t n = 0;
+          while (n != num_segments && data_end >= segment_start[n+1])
+            ++n;
+          if (n == num_segments) {
+            add_segment (bytes);
+          } else if (data_end + bytes <= segment_start[n+1]) {
+            break;
+          } else {
+            add_free (data_end, segment_start[n+1] - data_end);
+            data_end = segment_start[n+1];
+          }
         }
 
-        // Write the uint32_t indicating the number of elements in this voxel
-        memcpy (off2mem(data_end), &numel, sizeof(uint32_t));
+        const uint64_t offset = data_end;
+        data_end += bytes;
+        return offset;
+      }
+
 
-        // The return value is the offset from the beginning of the sparse data
-        const uint64_t ret = data_end;
-        data_end += requested_size;
 
-        return ret;
+      void Sparse::add_free (const uint64_t offset, const uint64_t bytes)
+      {
+        if (!bytes)
+          return;
+        if (offset + bytes == data_end) {
+          data_end = offset;
+          return;
+        }
+        free_bytes += bytes;
+        // Blocks too small to hold even a single element can only be recovered through compaction
+        if (bytes >= record_size (1))
+          free_blocks[bytes].push_back (offset);
       }
 
 
 
+      bool Sparse::shrink (const uint64_t old_offset, const uint32_t numel)
+      {
+        // Verify whether the current offset points to a voxel that has at least as many elements as required
+        const uint32_t existing_numel = get_numel (old_offset);
+        if (existing_numel >= numel) {
+
+          // Set the new number of elements, clear and release the unwanted data
+          memcpy (off2mem(old_offset), &numel, sizeof(uint32_t));
+          const uint64_t unused = (existing_numel - numel) * class_size;
+          memset (off2mem(old_offset) + record_size (numel), 0x00, unused);
+          if (numel)
+            release (old_offset + record_size (numel), unused);
+          else
+            release (old_offset, record_size (existing_numel));
+          return true;
 
-      uint8_t* Sparse::get (const uint64_t voxel_offset, const size_t index) const
+        }
+
+        // Existing memory allocation for this voxel is not sufficient; erase it, and make it available
+        //   for subsequent requests
+        memset (off2mem(old_offset), 0x00, record_size (existing_numel));
+        release (old_offset, record_size (existing_numel));
+        return false;
+      }
+
+
+
+      void Sparse::release (const uint64_t offset, const uint64_t bytes)
       {
-        assert (index < get_numel (voxel_offset));
-        const uint64_t offset = sizeof(uint32_t) + (index * class_size);
-        assert (voxel_offset + offset + class_size <= data_end);
-        uint8_t* const ptr = off2mem(voxel_offset) + offset;
-        return ptr;
+        if (!bytes)
+          return;
+        std::lock_guard<std::mutex> lock (mutex);
+        add_free (offset, bytes);
+      }
+
+
+
+      void Sparse::release (Arena& arena)
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        add_free (arena.next, arena.end - arena.next);
+        arenas.erase (std::find (arenas.begin(), arenas.end(), &arena));
+        arena.handler = nullptr;
+        arena.next = arena.end = 0;
       }
 
 
 
+      void Sparse::compact ()
+      {
+        DEBUG ("compacting sparse image data file " + file.name + ": " + str(free_bytes) + " of " + str(data_end) + " bytes unused");
+
+        // Gather the data for each voxel in the order of the raw image data, updating the offsets
+        std::vector<uint8_t> data (sizeof(uint32_t), 0x00);
+        data.reserve (data_end - free_bytes);
+        const size_t values_per_address = files.size() * bytes_per_segment / (addresses.size() * sizeof(uint64_t));
+        for (size_t n = 0; n != addresses.size(); ++n) {
+          uint64_t* const values = reinterpret_cast<uint64_t*> (addresses[n]);
+          for (size_t i = 0; i != values_per_address; ++i) {
+            if (values[i]) {
+              const uint32_t numel = get_numel (values[i]);
+              if (numel) {
+                const uint8_t* const record = off2mem (values[i]);
+                values[i] = data.size();
+                data.insert (data.end(), record, record + record_size (numel));
+              } else {
+                values[i] = 0;
+              }
+            }
+          }
+        }
+
+        // Copy back into the segments, nulling everything beyond
+        for (size_t n = 0; n != num_segments && segment_start[n] < data_end; ++n) {
+          const uint64_t begin = segment_start[n], end = std::min (segment_start[n+1], data_end);
+          const uint64_t copied = begin < data.size() ? std::min (end, uint64_t (data.size())) - begin : 0;
+          if (copied)
+            memcpy (segment_address[n], &data[begin], copied);
+          memset (segment_address[n] + copied, 0x00, end - begin - copied);
+        }
+
+        data_end = data.size();
+        free_blocks.clear();
+        free_bytes = 0;
+      }
+
 
     }
   }
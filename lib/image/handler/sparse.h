@@ -26,7 +26,10 @@
 #include <cassert>
 #include <cstring>
 #include <fstream>
+#include <map>
+#include <mutex>
 #include <typeinfo>
+#include <vector>
 
 #include "debug.h"
 #include "ptr.h"
@@ -70,6 +73,18 @@ namespace MR
       //     be determined from the sparse data alone, the relevant Image::Format instead enforces
       //     the endianness of the image data to be native, and assumes that the sparse data has
       //     the same endianness. If the endianness does not match, the file won't open.
+      // * The sparse data are held in memory as a series of segments, each covering a contiguous
+      //     range of offsets; when more space is needed, a new segment is appended rather than the
+      //     existing data being reallocated, so pointers to sparse data remain valid while other
+      //     threads write. The sparse data for a voxel never straddle two segments.
+      // * Space released when a voxel is shrunk or reallocated is zeroed and kept in free lists
+      //     keyed by size, from which subsequent requests are served where possible. When closing
+      //     an image that has accumulated such unused space, the sparse data are by default
+      //     compacted, in the order of the raw image data.
+      // * Writers may allocate through an Arena: a chunk of the sparse data reserved for a single
+      //     thread, from which allocations proceed without locking. Each copy of an
+      //     Image::Sparse::Voxel holds its own Arena, so that sparse images can be written from
+      //     ThreadedLoop workers, provided that each voxel is written by a single thread.
 
 
 
@@ -81,6 +96,25 @@ namespace MR
           ~Sparse () { close(); }
 
 
+          // A region of the sparse data reserved for the allocations of a single thread
+          // A copy of an Arena starts out empty; on destruction, any unused space is returned to the handler
+          class Arena
+          {
+            public:
+              Arena () : handler (nullptr), next (0), end (0) { }
+              Arena (const Arena&) : handler (nullptr), next (0), end (0) { }
+              ~Arena () { if (handler) handler->release (*this); }
+
+              // the remainder of the current range is returned to the handler, as on destruction:
+              Arena& operator= (const Arena&) { if (handler) handler->release (*this); return *this; }
+
+            private:
+              Sparse* handler;
+              uint64_t next, end;
+              friend class Sparse;
+          };
+
+
           // Find the number of elements in a particular voxel based on the file offset
           uint32_t get_numel (const uint64_t) const;
 
@@ -88,7 +122,10 @@ namespace MR
           //   sufficiently large to contain the new information
           // Receives current offset value for that voxel, and the desired number of elements
           // Return value is the offset from the start of the sparse data
+          // This may be called concurrently for different voxels; if an Arena is provided, new memory is
+          //   taken from it where possible rather than from the shared pool
           uint64_t set_numel (const uint64_t, const uint32_t);
+          uint64_t set_numel (const uint64_t, const uint32_t, Arena&);
 
           // Return a pointer to an element in a voxel
           uint8_t* get (const uint64_t, const size_t) const;
@@ -102,17 +139,56 @@ namespace MR
           virtual void load ();
           virtual void unload ();
 
+          static const size_t max_segments = 64;
+
           const std::string class_name;
           const size_t class_size;
           const File::Entry file;
+          const uint64_t arena_size;
           uint64_t data_end;
-          Ptr<File::MMap> mmap;
+
+          // segment n covers offsets [segment_start[n], segment_start[n+1]); entries beyond the last
+          //   segment are never read, so these can be accessed without locking
+          Ptr<File::MMap> segments[max_segments];
+          uint8_t* segment_address[max_segments];
+          uint64_t segment_start[max_segments+1];
+          size_t num_segments;
+
+          // Everything below is protected by the mutex
+          std::mutex mutex;
+          // Offsets of unused regions of the sparse data, keyed by their size in bytes
+          std::map< uint64_t, std::vector<uint64_t> > free_blocks;
+          // Total number of unused bytes below data_end, including those too small to be reused
+          uint64_t free_bytes;
+          // Arenas currently holding unused space
+          std::vector<Arena*> arenas;
 
 
-          uint64_t size() const { return (mmap ? mmap->size() : 0); }
+          uint64_t size() const { return num_segments ? segment_start[num_segments] : 0; }
 
           // Convert a file position offset (as read from the image data) to a pointer to the relevant sparsely-stored data
-          uint8_t* off2mem (const uint64_t i) const { assert (mmap); return (mmap->address() + i); }
+          uint8_t* off2mem (const uint64_t i) const
+          {
+            assert (num_segments);
+            size_t n = 0;
+            while (i >= segment_start[n+1])
+              ++n;
+            return segment_address[n] + (i - segment_start[n]);
+          }
+
+          uint64_t record_size (const uint32_t numel) const { return sizeof(uint32_t) + (numel * class_size); }
+
+          void add_segment (const uint64_t);
+          void clear_segments ();
+          uint64_t allocate (const uint64_t);
+          uint64_t allocate (const uint64_t, Arena&);
+          bool take_free (const uint64_t, uint64_t&);
+          uint64_t extend (const uint64_t);
+          void add_free (const uint64_t, const uint64_t);
+          bool shrink (const uint64_t, const uint32_t);
+          void release (const uint64_t, const uint64_t);
+          void release (Arena&);
+          void compact ();
 
 
       };
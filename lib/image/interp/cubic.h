@@ -145,11 +145,56 @@ namespace MR
             return Hz.value (r);
           }
 
+          //! the values at the current position for all positions along \a axis
+          /*! \a axis must be one of the non-spatial axes (3 or above). The
+           * neighbourhood is gathered once for all positions along \a axis,
+           * after which the interpolation proceeds across all positions at
+           * once. The values are identical to those returned by value() at
+           * each position along \a axis. */
+          void row (std::vector<value_type>& values, size_t axis) {
+            assert (axis > 2);
+            const ssize_t n = dim (axis);
+            values.resize (n);
+            if (out_of_bounds) {
+              std::fill (values.begin(), values.end(), out_of_bounds_value);
+              return;
+            }
+
+            ssize_t c[] = { ssize_t (std::floor (P[0])-1), ssize_t (std::floor (P[1])-1), ssize_t (std::floor (P[2])-1) };
+            row_values.resize (84 * n);
+            value_type* p = &row_values[0];
+            for (ssize_t z = 0; z < 4; ++z) {
+              (*this)[2] = check (c[2] + z, dim (2)-1);
+              for (ssize_t y = 0; y < 4; ++y) {
+                (*this)[1] = check (c[1] + y, dim (1)-1);
+                for (ssize_t x = 0; x < 4; ++x) {
+                  (*this)[0] = check (c[0] + x, dim (0)-1);
+                  for ((*this)[axis] = 0; (*this)[axis] < n; ++(*this)[axis])
+                    *p++ = VoxelType::value();
+                }
+              }
+            }
+
+            // interpolate along x, then y, then z, as in value():
+            const value_type* in = &row_values[0];
+            value_type* q = &row_values[64*n];
+            for (ssize_t zy = 0; zy < 16; ++zy)
+              for (ssize_t i = 0; i < n; ++i)
+                q[zy*n + i] = Hx.value (in[(4*zy)*n + i], in[(4*zy+1)*n + i], in[(4*zy+2)*n + i], in[(4*zy+3)*n + i]);
+            value_type* r = &row_values[80*n];
+            for (ssize_t z = 0; z < 4; ++z)
+              for (ssize_t i = 0; i < n; ++i)
+                r[z*n + i] = Hy.value (q[(4*z)*n + i], q[(4*z+1)*n + i], q[(4*z+2)*n + i], q[(4*z+3)*n + i]);
+            for (ssize_t i = 0; i < n; ++i)
+              values[i] = Hz.value (r[i], r[n + i], r[2*n + i], r[3*n + i]);
+          }
+
           const value_type out_of_bounds_value;
 
         protected:
           Math::Hermite<value_type> Hx, Hy, Hz;
           Point<float> P;
+          std::vector<value_type> row_values;
 
           ssize_t check (ssize_t x, ssize_t dim) const {
             if (x < 0) return 0;
@@ -187,6 +187,45 @@ namespace MR
             return val;
           }
 
+          //! the values at the current position for all positions along \a axis
+          /*! \a axis must be one of the non-spatial axes (3 or above). The
+           * values are identical to those returned by value() at each
+           * position along \a axis. */
+          void row (std::vector<value_type>& values, size_t axis) {
+            assert (axis > 2);
+            const ssize_t n = dim (axis);
+            values.resize (n);
+            if (out_of_bounds) {
+              std::fill (values.begin(), values.end(), out_of_bounds_value);
+              return;
+            }
+
+            // the corners in the same order as in value():
+            const float weights[] = { faaa, faab, fabb, faba, fbba, fbaa, fbab, fbbb };
+            const ssize_t corners[][3] = { {0,0,0}, {0,0,1}, {0,1,1}, {0,1,0}, {1,1,0}, {1,0,0}, {1,0,1}, {1,1,1} };
+            const ssize_t base[] = { (*this)[0], (*this)[1], (*this)[2] };
+
+            std::fill (values.begin(), values.end(), value_type (0.0));
+            for (size_t c = 0; c < 8; ++c) {
+              if (!weights[c])
+                continue;
+              (*this)[0] = base[0] + corners[c][0];
+              (*this)[1] = base[1] + corners[c][1];
+              (*this)[2] = base[2] + corners[c][2];
+              if (c == 0) {
+                for ((*this)[axis] = 0; (*this)[axis] < n; ++(*this)[axis])
+                  values[(*this)[axis]] = weights[c] * value_type (VoxelType::value());
+              }
+              else {
+                for ((*this)[axis] = 0; (*this)[axis] < n; ++(*this)[axis])
+                  values[(*this)[axis]] += weights[c] * value_type (VoxelType::value());
+              }
+            }
+            (*this)[0] = base[0];
+            (*this)[1] = base[1];
+            (*this)[2] = base[2];
+          }
+
           const value_type out_of_bounds_value;
 
         protected:
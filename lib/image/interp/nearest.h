@@ -77,6 +77,7 @@ namespace MR
           typedef typename VoxelType::value_type value_type;
 
           using Transform::set_to_nearest;
+          using VoxelType::dim;
           using Transform::image2voxel;
           using Transform::scanner2voxel;
           using Transform::operator!;
@@ -131,6 +132,19 @@ namespace MR
             return VoxelType::value();
           }
 
+          //! the values at the current position for all positions along \a axis
+          /*! \a axis must be one of the non-spatial axes (3 or above). */
+          void row (std::vector<value_type>& values, size_t axis) {
+            assert (axis > 2);
+            values.resize (dim (axis));
+            if (out_of_bounds) {
+              std::fill (values.begin(), values.end(), out_of_bounds_value);
+              return;
+            }
+            for ((*this)[axis] = 0; (*this)[axis] < dim (axis); ++(*this)[axis])
+              values[(*this)[axis]] = VoxelType::value();
+          }
+
           const value_type out_of_bounds_value;
       };
 
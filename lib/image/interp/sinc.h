@@ -150,6 +150,15 @@ namespace MR
             return Sinc_z.value (z_values);
           }
 
+          //! the values at the current position for all positions along \a axis
+          /*! \a axis must be one of the non-spatial axes (3 or above). */
+          void row (std::vector<value_type>& values, size_t axis) {
+            assert (axis > 2);
+            values.resize (dim (axis));
+            for ((*this)[axis] = 0; (*this)[axis] < dim (axis); ++(*this)[axis])
+              values[(*this)[axis]] = value();
+          }
+
           const value_type out_of_bounds_value;
 
         protected:
@@ -0,0 +1,263 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __image_registration_warp_sampler_h__
+#define __image_registration_warp_sampler_h__
+
+#include <cmath>
+#include <vector>
+
+#include "exception.h"
+#include "point.h"
+#include "image/transform.h"
+
+namespace MR
+{
+  namespace Image
+  {
+    namespace Registration
+    {
+      namespace Warp
+      {
+
+        //! \addtogroup interp
+        // @{
+
+        //! evaluate a deformation field at arbitrary scanner-space positions
+        /*! The deformation field is a 4D image with 3 volumes, providing at
+         * each voxel the scanner-space position that it maps to. The field is
+         * held in memory with its 3 components interleaved, so that all
+         * components are obtained from a single computation of the
+         * interpolation weights.
+         *
+         * With linear interpolation, the results are identical to those of
+         * Interp::Linear applied to each volume in turn. With cubic
+         * interpolation, the field is converted on construction into the
+         * coefficients of the interpolating cubic B-spline (with mirror
+         * boundary conditions), so that each evaluation only requires the
+         * weighted sum over the 4x4x4 neighbourhood.
+         *
+         * Positions outside the field (as for Interp::Linear) yield an
+         * invalid (NaN) Point. The evaluation functions are const, so a
+         * single Sampler can be shared by any number of threads.
+         *
+         * \code
+         * Image::Buffer<float> warp_buffer (argument[1]);
+         * auto warp_vox = warp_buffer.voxel();
+         * Image::Registration::Warp::Sampler warp (warp_vox);
+         *
+         * Point<float> warped = warp.scanner (position);
+         * \endcode */
+        class Sampler : public Image::Transform
+        {
+          public:
+            template <class VoxelType>
+              Sampler (VoxelType& field, bool cubic = false) :
+                Image::Transform (field),
+                cubic (cubic)
+              {
+                if (field.ndim() != 4 || field.dim(3) != 3)
+                  throw Exception ("deformation field \"" + field.name() + "\" must be a 4D image with 3 volumes");
+                for (size_t n = 0; n < 3; ++n) {
+                  size[n] = field.dim(n);
+                  stride[n] = n ? stride[n-1] * size[n-1] : 3;
+                }
+                data.resize (3 * size[0] * size[1] * size[2]);
+
+                float* p = &data[0];
+                for (field[2] = 0; field[2] < field.dim(2); ++field[2])
+                  for (field[1] = 0; field[1] < field.dim(1); ++field[1])
+                    for (field[0] = 0; field[0] < field.dim(0); ++field[0])
+                      for (field[3] = 0; field[3] < 3; ++field[3])
+                        *p++ = field.value();
+
+                if (cubic)
+                  for (size_t axis = 0; axis < 3; ++axis)
+                    prefilter (axis);
+              }
+
+            //! the position that voxel-space position \a pos maps to
+            Point<float> voxel (const Point<float>& pos) const {
+              if (check_bounds (pos))
+                return Point<float>();
+              return cubic ? value_cubic (pos) : value_linear (pos);
+            }
+
+            //! the position that image-space position \a pos maps to
+            Point<float> image (const Point<float>& pos) const {
+              return voxel (image2voxel (pos));
+            }
+
+            //! the position that scanner-space position \a pos maps to
+            Point<float> scanner (const Point<float>& pos) const {
+              return voxel (scanner2voxel (pos));
+            }
+
+          protected:
+            const bool cubic;
+            ssize_t size[3], stride[3];
+            std::vector<float> data;
+
+            // as for Interp::Linear, including the order of summation:
+            Point<float> value_linear (const Point<float>& pos) const {
+              Point<float> f (pos[0]-std::floor (pos[0]), pos[1]-std::floor (pos[1]), pos[2]-std::floor (pos[2]));
+              ssize_t offset = 0;
+              for (size_t n = 0; n < 3; ++n) {
+                if (pos[n] < 0.0)
+                  f[n] = 0.0;
+                else {
+                  offset += stride[n] * ssize_t (std::floor (pos[n]));
+                  if (pos[n] > bounds[n]-0.5) f[n] = 0.0;
+                }
+              }
+
+              const float weights[] = {
+                float ((1.0-f[0]) * (1.0-f[1]) * (1.0-f[2])),
+                float ((1.0-f[0]) * (1.0-f[1]) *      f[2] ),
+                float ((1.0-f[0]) *      f[1]  *      f[2] ),
+                float ((1.0-f[0]) *      f[1]  * (1.0-f[2])),
+                float (     f[0]  *      f[1]  * (1.0-f[2])),
+                float (     f[0]  * (1.0-f[1]) * (1.0-f[2])),
+                float (     f[0]  * (1.0-f[1]) *      f[2] ),
+                float (     f[0]  *      f[1]  *      f[2] )
+              };
+              const ssize_t offsets[] = {
+                0,
+                stride[2],
+                stride[1] + stride[2],
+                stride[1],
+                stride[0] + stride[1],
+                stride[0],
+                stride[0] + stride[2],
+                stride[0] + stride[1] + stride[2]
+              };
+
+              float result[] = { 0.0, 0.0, 0.0 };
+              for (size_t n = 0; n < 8; ++n) {
+                if (weights[n] >= 1e-6) {
+                  const float* p = &data[offset + offsets[n]];
+                  result[0] += weights[n] * p[0];
+                  result[1] += weights[n] * p[1];
+                  result[2] += weights[n] * p[2];
+                }
+              }
+              return Point<float> (result[0], result[1], result[2]);
+            }
+
+
+            Point<float> value_cubic (const Point<float>& pos) const {
+              float weights[3][4];
+              ssize_t offsets[3][4];
+              for (size_t n = 0; n < 3; ++n) {
+                const ssize_t base = std::floor (pos[n]);
+                const float t = pos[n] - base;
+                const float t2 = t*t, t3 = t2*t;
+                weights[n][0] = (1.0f - 3.0f*t + 3.0f*t2 - t3) / 6.0f;
+                weights[n][1] = (4.0f - 6.0f*t2 + 3.0f*t3) / 6.0f;
+                weights[n][2] = (1.0f + 3.0f*t + 3.0f*t2 - 3.0f*t3) / 6.0f;
+                weights[n][3] = t3 / 6.0f;
+                for (ssize_t k = 0; k < 4; ++k)
+                  offsets[n][k] = stride[n] * mirror (base - 1 + k, size[n]);
+              }
+
+              float result[] = { 0.0, 0.0, 0.0 };
+              for (size_t z = 0; z < 4; ++z) {
+                for (size_t y = 0; y < 4; ++y) {
+                  const float* row = &data[offsets[2][z] + offsets[1][y]];
+                  float sum[] = { 0.0, 0.0, 0.0 };
+                  for (size_t x = 0; x < 4; ++x) {
+                    const float* p = row + offsets[0][x];
+                    sum[0] += weights[0][x] * p[0];
+                    sum[1] += weights[0][x] * p[1];
+                    sum[2] += weights[0][x] * p[2];
+                  }
+                  const float w = weights[2][z] * weights[1][y];
+                  result[0] += w * sum[0];
+                  result[1] += w * sum[1];
+                  result[2] += w * sum[2];
+                }
+              }
+              return Point<float> (result[0], result[1], result[2]);
+            }
+
+
+            static ssize_t mirror (ssize_t index, ssize_t n) {
+              if (n == 1)
+                return 0;
+              const ssize_t period = 2*n - 2;
+              index %= period;
+              if (index < 0)
+                index += period;
+              return index < n ? index : period - index;
+            }
+
+
+            // convert the samples along axis into cubic B-spline
+            // coefficients, using the recursive filter of Unser et al. (IEEE
+            // Trans Signal Process 1993) with mirror boundary conditions:
+            void prefilter (size_t axis) {
+              const ssize_t n = size[axis];
+              if (n < 2)
+                return;
+              const double z = std::sqrt (3.0) - 2.0;
+              const double lambda = (1.0 - z) * (1.0 - 1.0/z);
+              const size_t other[2] = { axis ? 0U : 1U, axis == 2 ? 1U : 2U };
+              std::vector<double> c (n);
+
+              for (ssize_t j = 0; j < size[other[1]]; ++j) {
+                for (ssize_t i = 0; i < size[other[0]]; ++i) {
+                  float* line = &data[i*stride[other[0]] + j*stride[other[1]]];
+                  for (size_t component = 0; component < 3; ++component) {
+                    for (ssize_t k = 0; k < n; ++k)
+                      c[k] = lambda * line[k*stride[axis] + component];
+
+                    // initial causal coefficient:
+                    double zk = z, z2n = std::pow (z, double (2*n-2)), sum = c[0] + std::pow (z, double (n-1)) * c[n-1];
+                    for (ssize_t k = 1; k < n-1; ++k) {
+                      sum += (zk + z2n/zk) * c[k];
+                      zk *= z;
+                    }
+                    c[0] = sum / (1.0 - z2n);
+                    for (ssize_t k = 1; k < n; ++k)
+                      c[k] += z * c[k-1];
+
+                    // initial anti-causal coefficient:
+                    c[n-1] = (z / (z*z - 1.0)) * (c[n-1] + z * c[n-2]);
+                    for (ssize_t k = n-2; k >= 0; --k)
+                      c[k] = z * (c[k+1] - c[k]);
+
+                    for (ssize_t k = 0; k < n; ++k)
+                      line[k*stride[axis] + component] = c[k];
+                  }
+                }
+              }
+            }
+
+        };
+
+        //! @}
+
+      }
+    }
+  }
+}
+
+#endif
+
@@ -0,0 +1,61 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __image_sparse_allocate_h__
+#define __image_sparse_allocate_h__
+
+#include "image/loop.h"
+
+
+namespace MR
+{
+  namespace Image
+  {
+    namespace Sparse
+    {
+
+
+    // Writing a sparse image in parallel proceeds in two passes:
+    // * First, the number of elements in each voxel of the output is set using allocate(). This runs
+    //     in a single thread, in the order of the raw image data, so that the sparse data are laid
+    //     out contiguously and identically from one run to the next. Where the number of elements
+    //     is expensive to determine, it can first be computed into a scratch image using a
+    //     ThreadedLoop, and then passed to allocate() from there.
+    // * Then, the elements of each voxel are filled using a ThreadedLoop, without any further calls
+    //     to set_size(). Since each voxel is visited by a single thread, and filling does not alter
+    //     the layout of the sparse data, this requires no synchronisation.
+
+    // Set the number of elements in each voxel of \a output to count (input...), where input... are
+    //   positioned at the corresponding voxel
+    template <class Functor, class SparseVoxelType, class... VoxelType>
+      void allocate (Functor&& count, SparseVoxelType& output, VoxelType&... input)
+      {
+        LoopInOrder loop (output);
+        for (auto l = loop (output, input...); l; ++l)
+          output.value().set_size (count (input...));
+      }
+
+
+    }
+  }
+}
+
+#endif
+
@@ -61,7 +61,7 @@ namespace MR
         {
           // Handler allocates new memory if necessary, and sets the relevant number of elements flag in the sparse image data
           // It returns the file offset necessary to access the relevant memory, so update the raw image value accordingly
-          set_value (V.get_handler().set_numel (get_value(), n));
+          set_value (V.get_handler().set_numel (get_value(), n, V.arena));
         }
 
 
@@ -41,12 +41,16 @@ namespace MR
 
 
 
+    // Copies of a Voxel can be used concurrently, e.g. as passed to ThreadedLoop workers: reading the
+    //   sparse data is always safe, and so is writing, provided that each voxel is only written by a
+    //   single thread (see image/sparse/allocate.h)
     template <class SparseDataType>
       class Voxel : public Image::Voxel< Image::Buffer<uint64_t> > {
         public:
           Voxel (BufferSparse<SparseDataType>& array) :
               Image::Voxel< Image::Buffer<uint64_t> > (array),
-              handler_ (array.__get_handler ()) { }
+              handler_ (array.__get_handler ()),
+              sparse_handler (dynamic_cast<Handler::Sparse*> (static_cast<Handler::Base*> (handler_))) { }
 
 
           typedef uint64_t value_type;
@@ -72,12 +76,12 @@ namespace MR
 
         protected:
           RefPtr<Handler::Base> handler_;
+          // Resolved once on construction, since this is needed for every access to the sparse data
+          Handler::Sparse* sparse_handler;
+          // Each copy of the voxel (e.g. one per ThreadedLoop worker) allocates sparse data from its own arena
+          Handler::Sparse::Arena arena;
 
-          Handler::Sparse& get_handler()
-          {
-            Handler::Base* ptr (handler_);
-            return *(dynamic_cast<Handler::Sparse*> (ptr));
-          }
+          Handler::Sparse& get_handler() const { return *sparse_handler; }
 
           value_type value() const { return Image::Voxel< Image::Buffer<uint64_t> >::value(); }
 
@@ -28,6 +28,7 @@
 #include "image/utils.h"
 #include "image/iterator.h"
 #include "thread.h"
+#include "thread_profile.h"
 
 namespace MR
 {
@@ -54,6 +55,12 @@ namespace MR
 
       template <int N, class Functor, class... VoxelType>
         class __RunFunctor;
+
+      // the functor type to report when profiling:
+      template <class Functor> 
+        class __functor_type { public: typedef Functor type; };
+      template <int N, class Functor, class... VoxelType>
+        class __functor_type<__RunFunctor<N,Functor,VoxelType...>> { public: typedef Functor type; };
     }
 
     /*! \addtogroup loop 
@@ -372,7 +379,9 @@ namespace MR
               return;
             }
 
-            __Outer<typename std::remove_reference<Functor>::type> loop_thread (*this, functor);
+            typedef typename std::remove_reference<Functor>::type FunctorType;
+            Thread::Profile::Pipeline profile ("ThreadedLoop");
+            __Outer<FunctorType> loop_thread (*this, functor, profile.stage<typename __functor_type<FunctorType>::type> ("loop"));
             loop.start (dummy);
             auto t = Thread::run (Thread::multi (loop_thread), "loop threads");
             t.wait();
@@ -442,19 +451,25 @@ namespace MR
        template <class Functor>
          class __Outer {
            public:
-             __Outer (ThreadedLoop& shared_info, Functor& functor) :
+             __Outer (ThreadedLoop& shared_info, Functor& functor, Thread::Profile::Stage* stage = nullptr) :
                shared (shared_info),
-               func (functor) { }
+               func (functor),
+               stage (stage) { }
 
              void execute () {
+               Thread::Profile::StageTimer timer (stage);
                Iterator pos (shared.iterator());
-               while (shared.next (pos))
+               while (shared.next (pos)) {
+                 timer.popped();
                  func (pos);
+                 timer.processed();
+               }
              }
 
            protected:
              ThreadedLoop& shared;
              typename std::remove_reference<Functor>::type func;
+             Thread::Profile::Stage* stage;
          };
 
 
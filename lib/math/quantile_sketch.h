@@ -0,0 +1,274 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef __math_quantile_sketch_h__
+#define __math_quantile_sketch_h__
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "types.h"
+
+#define MRTRIX_QUANTILE_SKETCH_DEFAULT_CAPACITY (1U<<20)
+
+namespace MR
+{
+  namespace Math
+  {
+
+    //! a mergeable, bounded-memory estimator of quantiles
+    /*! Values are held exactly until more than \a capacity values have been
+     * added, at which point they are collapsed into a histogram over the 16
+     * most significant bits of their (order-preserving) single-precision
+     * floating-point representation (sign, exponent and 7 bits of mantissa).
+     * This provides a relative precision of at least 2^-7 irrespective of
+     * the range of the data, using a fixed amount of memory. Within each bin
+     * of the histogram, values are assumed to be uniformly distributed.
+     *
+     * Values can optionally be given a weight, in which case the quantiles
+     * are computed over the cumulative weight rather than the number of
+     * values, and the exact values also retain their weights.
+     *
+     * Sketches accumulated over different subsets of the data (for example,
+     * in different threads) can be combined using operator+=(). NaN values
+     * are ignored. */
+    class QuantileSketch
+    {
+      public:
+        QuantileSketch (size_t capacity = MRTRIX_QUANTILE_SKETCH_DEFAULT_CAPACITY) :
+          capacity (capacity),
+          num (0),
+          total (0.0),
+          sorted (true),
+          weighted (false) { }
+
+        //! add \a value to the sketch
+        void operator() (float value) {
+          if (std::isnan (value))
+            return;
+          ++num;
+          total += 1.0;
+          if (bins.empty()) {
+            values.push_back (value);
+            if (weights.size())
+              weights.push_back (1.0f);
+            sorted = false;
+            if (values.size() > capacity)
+              collapse();
+          }
+          else
+            bins[to_key (value) >> 16] += 1.0;
+        }
+
+        //! add \a value to the sketch with weight \a weight
+        /*! Values with zero or negative weight are ignored. */
+        void operator() (float value, float weight) {
+          if (weight == 1.0f) {
+            (*this) (value);
+            return;
+          }
+          if (std::isnan (value) || !(weight > 0.0f))
+            return;
+          ++num;
+          total += weight;
+          if (bins.empty()) {
+            if (weights.empty())
+              weights.assign (values.size(), 1.0f);
+            values.push_back (value);
+            weights.push_back (weight);
+            sorted = false;
+            if (values.size() > capacity)
+              collapse();
+          }
+          else {
+            weighted = true;
+            bins[to_key (value) >> 16] += weight;
+          }
+        }
+
+        //! combine the contents of another sketch into this one
+        QuantileSketch& operator+= (const QuantileSketch& that) {
+          num += that.num;
+          total += that.total;
+          weighted = weighted || that.weighted;
+          if (that.bins.size()) {
+            collapse();
+            for (size_t n = 0; n < bins.size(); ++n)
+              bins[n] += that.bins[n];
+          }
+          else if (bins.size()) {
+            for (size_t i = 0; i < that.values.size(); ++i)
+              bins[to_key (that.values[i]) >> 16] += that.weight (i);
+            weighted = weighted || that.weights.size();
+          }
+          else {
+            if (weights.size() || that.weights.size()) {
+              weights.resize (values.size(), 1.0f);
+              if (that.weights.size())
+                weights.insert (weights.end(), that.weights.begin(), that.weights.end());
+              else
+                weights.resize (values.size() + that.values.size(), 1.0f);
+            }
+            values.insert (values.end(), that.values.begin(), that.values.end());
+            sorted = false;
+            if (values.size() > capacity)
+              collapse();
+          }
+          return *this;
+        }
+
+        //! the number of (non-NaN) values added
+        size_t count () const { return num; }
+
+        //! the sum of the weights of all values added
+        double total_weight () const { return total; }
+
+        //! whether the quantiles returned are exact
+        bool exact () const { return bins.empty(); }
+
+        //! the value at the fraction \a q (in the range [0 1]) of the sorted data
+        /*! As for Math::median(), the result is interpolated linearly
+         * between adjacent order statistics. For weighted values, the
+         * result is instead the smallest value at which the cumulative
+         * weight reaches the fraction \a q of the total (interpolated within
+         * the histogram bin once the sketch is no longer exact). Returns NaN
+         * if no values have been added. */
+        double quantile (double q) {
+          if (!num)
+            return std::numeric_limits<double>::quiet_NaN();
+          if (weighted || weights.size())
+            return weighted_quantile (std::min (std::max (q, 0.0), 1.0) * total);
+          const double rank = std::min (std::max (q, 0.0), 1.0) * (num - 1);
+          const size_t lower = size_t (rank);
+          const size_t upper = std::min (lower + 1, num - 1);
+          const double frac = rank - lower;
+          if (bins.empty()) {
+            if (!sorted) {
+              std::sort (values.begin(), values.end());
+              sorted = true;
+            }
+            return (1.0-frac) * values[lower] + frac * values[upper];
+          }
+          return (1.0-frac) * value_at (lower) + frac * value_at (upper);
+        }
+
+        double median () { return quantile (0.5); }
+
+      protected:
+        size_t capacity, num;
+        double total;
+        bool sorted, weighted;
+        std::vector<float> values, weights;
+        std::vector<double> bins;
+
+        // the weight of the exact value at index i:
+        double weight (size_t i) const { return weights.size() ? weights[i] : 1.0; }
+
+        void collapse () {
+          if (bins.size())
+            return;
+          bins.resize (1U<<16, 0.0);
+          for (size_t i = 0; i < values.size(); ++i)
+            bins[to_key (values[i]) >> 16] += weight (i);
+          weighted = weighted || weights.size();
+          std::vector<float>().swap (values);
+          std::vector<float>().swap (weights);
+        }
+
+        void sort_weighted () {
+          if (sorted)
+            return;
+          std::vector<std::pair<float,float> > pairs (values.size());
+          for (size_t i = 0; i < values.size(); ++i)
+            pairs[i] = std::make_pair (values[i], weights[i]);
+          std::sort (pairs.begin(), pairs.end());
+          for (size_t i = 0; i < values.size(); ++i) {
+            values[i] = pairs[i].first;
+            weights[i] = pairs[i].second;
+          }
+          sorted = true;
+        }
+
+        double weighted_quantile (double target) {
+          double cumulative = 0.0;
+          if (bins.empty()) {
+            sort_weighted();
+            for (size_t i = 0; i < values.size(); ++i) {
+              cumulative += weights[i];
+              if (cumulative >= target)
+                return values[i];
+            }
+            return values.back();
+          }
+          for (size_t n = 0; n < bins.size(); ++n) {
+            if (bins[n] > 0.0 && cumulative + bins[n] >= target) {
+              const double lower = from_key (uint32_t (n) << 16);
+              const double upper = from_key ((uint32_t (n) << 16) | 0xFFFFU);
+              if (!std::isfinite (lower) || !std::isfinite (upper))
+                return lower;
+              return lower + (upper - lower) * (target - cumulative) / bins[n];
+            }
+            cumulative += bins[n];
+          }
+          return from_key (0xFFFFFFFFU);
+        }
+
+        // estimate the value of the order statistic at \a rank from the histogram:
+        double value_at (size_t rank) const {
+          double cumulative = 0.0;
+          for (size_t n = 0; n < bins.size(); ++n) {
+            if (cumulative + bins[n] > rank) {
+              const double lower = from_key (uint32_t (n) << 16);
+              const double upper = from_key ((uint32_t (n) << 16) | 0xFFFFU);
+              if (!std::isfinite (lower) || !std::isfinite (upper))
+                return lower;
+              return lower + (upper - lower) * (rank - cumulative + 0.5) / double (bins[n]);
+            }
+            cumulative += bins[n];
+          }
+          return from_key (0xFFFFFFFFU);
+        }
+
+        // map floating-point value to unsigned integer preserving order:
+        static uint32_t to_key (float value) {
+          uint32_t bits;
+          memcpy (&bits, &value, sizeof (bits));
+          return (bits & 0x80000000U) ? ~bits : (bits | 0x80000000U);
+        }
+
+        static float from_key (uint32_t key) {
+          const uint32_t bits = (key & 0x80000000U) ? (key & 0x7FFFFFFFU) : ~key;
+          float value;
+          memcpy (&value, &bits, sizeof (value));
+          return value;
+        }
+
+    };
+
+
+  }
+}
+
+
+#endif
+
@@ -21,6 +21,14 @@
 */
 
 #include <thread>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+#ifdef __linux__
+# include <pthread.h>
+# include <sched.h>
+#endif
 
 #include "app.h"
 #include "thread.h"
@@ -52,6 +60,108 @@ namespace MR
     }
 
 
+    void set_number_of_threads (size_t num_threads)
+    {
+      __number_of_threads = num_threads;
+    }
+
+
+
+
+    namespace {
+
+      class WorkerPool {
+        public:
+          WorkerPool () :
+            idle (0),
+            //CONF option: ThreadAffinity
+            //CONF default: 0 (false)
+            //CONF pin each of the worker threads used for multi-threading to
+            //CONF a single CPU core. This can improve performance on
+            //CONF multi-socket (NUMA) systems by keeping each thread close to
+            //CONF the memory it allocated.
+            pin (File::Config::get_bool ("ThreadAffinity", false)),
+            num_cores (std::max (std::thread::hardware_concurrency(), 1U)) {
+              std::lock_guard<std::mutex> lock (mutex);
+              const size_t num = number_of_threads();
+              DEBUG ("initialising pool of " + str (num) + " worker threads" + ( pin ? " pinned to CPU cores" : "" ));
+              for (size_t n = 0; n < num; ++n)
+                spawn();
+            }
+
+          std::future<void> submit (std::function<void()>&& function) {
+            std::packaged_task<void()> task (std::move (function));
+            std::future<void> result (task.get_future());
+            {
+              std::lock_guard<std::mutex> lock (mutex);
+              tasks.push_back (std::move (task));
+              // every task must start immediately, since tasks may depend on
+              // each other (e.g. the stages of a Thread::run_queue() pipeline):
+              if (tasks.size() > idle)
+                spawn();
+            }
+            more_tasks.notify_one();
+            return result;
+          }
+
+        private:
+          std::mutex mutex;
+          std::condition_variable more_tasks;
+          std::deque<std::packaged_task<void()>> tasks;
+          std::vector<std::thread> workers;
+          size_t idle;
+          const bool pin;
+          const size_t num_cores;
+
+          // to be called with the mutex held:
+          void spawn () {
+            const size_t index = workers.size();
+            workers.push_back (std::thread (&WorkerPool::execute, this));
+            if (pin)
+              set_affinity (workers.back(), index % num_cores);
+          }
+
+          void execute () {
+            std::unique_lock<std::mutex> lock (mutex);
+            while (true) {
+              ++idle;
+              more_tasks.wait (lock, [this] () { return !tasks.empty(); });
+              --idle;
+              std::packaged_task<void()> task (std::move (tasks.front()));
+              tasks.pop_front();
+              lock.unlock();
+              task();
+              lock.lock();
+            }
+          }
+
+          static void set_affinity (std::thread& thread, size_t core) {
+#ifdef __linux__
+            cpu_set_t cpuset;
+            CPU_ZERO (&cpuset);
+            CPU_SET (core, &cpuset);
+            if (pthread_setaffinity_np (thread.native_handle(), sizeof (cpu_set_t), &cpuset))
+              DEBUG ("unable to pin worker thread to CPU core " + str (core));
+#else
+            (void) thread;
+            (void) core;
+#endif
+          }
+      };
+
+    }
+
+
+
+    std::future<void> __run_on_pool (std::function<void()>&& task)
+    {
+      // the pool is never destroyed: its (idle) workers are simply
+      // terminated along with the process.
+      static WorkerPool* pool = new WorkerPool;
+      return pool->submit (std::move (task));
+    }
+
+
 
 
 
@@ -25,6 +25,7 @@
 
 #include <thread>
 #include <future>
+#include <functional>
 #include <mutex>
 
 #include "debug.h"
@@ -91,6 +92,21 @@ namespace MR
     };
 
 
+    //! run \a task on one of the threads of the persistent worker pool
+    /*! Threads launched via Thread::run() (and hence Thread::run_queue() and
+     * Image::ThreadedLoop) are not created afresh for each invocation, but
+     * taken from a process-wide pool of worker threads. The pool is
+     * initialised with Thread::number_of_threads() workers on first use, and
+     * grows whenever a task is submitted while no worker is idle, so that all
+     * tasks submitted run concurrently (as required for the stages of a
+     * pipeline). Idle workers are retained for use by subsequent calls.
+     *
+     * If the \c ThreadAffinity configuration file entry is set, each worker
+     * is pinned to a single CPU core, so that a thread remains close to the
+     * memory it touched in previous passes. */
+    std::future<void> __run_on_pool (std::function<void()>&& task);
+
+
     namespace {
 
       class __thread_base {
@@ -113,7 +129,8 @@ namespace MR
             __thread_base (name) { 
               DEBUG ("launching thread \"" + name + "\"...");
               typedef typename std::remove_reference<Functor>::type F;
-              thread = std::async (std::launch::async, &F::execute, &functor);
+              F* f = &functor;
+              thread = __run_on_pool ([f] () { f->execute(); });
             }
           __single_thread (const __single_thread&) = delete;
           __single_thread (__single_thread&&) = default;
@@ -144,9 +161,12 @@ namespace MR
                 DEBUG ("launching " + str (nthreads) + " threads \"" + name + "\"...");
                 typedef typename std::remove_reference<Functor>::type F;
                 threads.reserve (nthreads);
-                for (auto& f : functors) 
-                  threads.push_back (std::async (std::launch::async, &F::execute, &f));
-                threads.push_back (std::async (std::launch::async, &F::execute, &functor));
+                for (auto& f : functors) {
+                  F* p = &f;
+                  threads.push_back (__run_on_pool ([p] () { p->execute(); }));
+                }
+                F* p = &functor;
+                threads.push_back (__run_on_pool ([p] () { p->execute(); }));
               }
 
             __multi_thread (const __multi_thread& m) = delete;
@@ -242,6 +262,11 @@ namespace MR
      * the -nthreads command-line option */
     size_t number_of_threads ();
 
+    /*! override the number of threads to use for any subsequent
+     * multi-threaded processing (mostly useful for benchmarking). A value
+     * of zero reverts to the default. */
+    void set_number_of_threads (size_t num_threads);
+
 
 
     //! used to request multiple threads of the corresponding functor
@@ -0,0 +1,279 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#ifdef __GNUG__
+# include <cxxabi.h>
+#endif
+
+#include "thread_profile.h"
+
+namespace MR
+{
+  namespace Thread
+  {
+    namespace Profile
+    {
+
+      bool __enabled = false;
+
+      namespace {
+
+        // totals over all invocations of the same pipeline:
+        class StageTotal {
+          public:
+            StageTotal (const Stage& stage) :
+              role (stage.role), functor (stage.functor),
+              threads (0), items (0), busy (0), pushing (0), popping (0), idle (0) { }
+            std::string role, functor;
+            size_t threads, items;
+            uint64_t busy, pushing, popping, idle;
+
+            uint64_t total () const { return busy + pushing + popping + idle; }
+        };
+
+        class QueueTotal {
+          public:
+            QueueTotal (const Queue& queue) :
+              name (queue.name), capacity (queue.capacity), histogram (MRTRIX_PROFILE_OCCUPANCY_BINS, 0) { }
+            std::string name;
+            size_t capacity;
+            std::vector<size_t> histogram;
+
+            size_t samples () const {
+              size_t sum = 0;
+              for (size_t n = 0; n < histogram.size(); ++n)
+                sum += histogram[n];
+              return sum;
+            }
+        };
+
+        class PipelineTotal {
+          public:
+            PipelineTotal (const std::string& kind) : kind (kind), runs (0), wall_time (0) { }
+            std::string kind;
+            size_t runs;
+            uint64_t wall_time;
+            std::vector<StageTotal> stages;
+            std::vector<QueueTotal> queues;
+        };
+
+
+        std::mutex& registry_mutex () { static std::mutex mutex; return mutex; }
+        std::vector<PipelineTotal>& registry () { static std::vector<PipelineTotal> list; return list; }
+        std::map<std::string,size_t>& registry_index () { static std::map<std::string,size_t> index; return index; }
+        std::string& json_filename () { static std::string filename; return filename; }
+
+
+
+        inline double seconds (uint64_t ns) { return 1.0e-9 * ns; }
+        inline double percent (uint64_t part, uint64_t whole) { return whole ? 100.0 * part / whole : 0.0; }
+        inline double rate (size_t items, uint64_t ns) { return ns ? items / seconds (ns) : 0.0; }
+
+
+        std::string json_string (const std::string& text)
+        {
+          std::string s ("\"");
+          for (size_t n = 0; n < text.size(); ++n) {
+            if (text[n] == '"' || text[n] == '\\')
+              s += '\\';
+            s += text[n];
+          }
+          return s + "\"";
+        }
+
+
+        void write_text (std::ostream& out, const std::vector<PipelineTotal>& list)
+        {
+          out << "\nThread profile (" << list.size() << " pipeline" << (list.size() > 1 ? "s" : "") << "):\n";
+          out << std::fixed;
+          for (std::vector<PipelineTotal>::const_iterator p = list.begin(); p != list.end(); ++p) {
+            out << "\n" << p->kind << ": " << p->runs << " run" << (p->runs > 1 ? "s" : "")
+              << ", wall time " << std::setprecision (3) << seconds (p->wall_time) << " s\n";
+            out << "  " << std::left << std::setw (8) << "stage" << std::right
+              << std::setw (8) << "threads" << std::setw (12) << "items" << std::setw (14) << "items/s"
+              << std::setw (8) << "busy" << std::setw (8) << "push" << std::setw (8) << "pop" << std::setw (8) << "idle"
+              << "  functor\n";
+            for (std::vector<StageTotal>::const_iterator s = p->stages.begin(); s != p->stages.end(); ++s) {
+              const uint64_t total = s->total();
+              out << "  " << std::left << std::setw (8) << s->role << std::right
+                << std::setw (8) << s->threads << std::setw (12) << s->items
+                << std::setw (14) << std::setprecision (0) << rate (s->items, p->wall_time) << std::setprecision (1)
+                << std::setw (7) << percent (s->busy, total) << "%"
+                << std::setw (7) << percent (s->pushing, total) << "%"
+                << std::setw (7) << percent (s->popping, total) << "%"
+                << std::setw (7) << percent (s->idle, total) << "%"
+                << "  " << s->functor << "\n";
+            }
+            for (std::vector<QueueTotal>::const_iterator q = p->queues.begin(); q != p->queues.end(); ++q) {
+              const size_t samples = q->samples();
+              out << "  queue \"" << q->name << "\" (capacity " << q->capacity << ") occupancy:";
+              for (size_t n = 0; n < q->histogram.size(); ++n)
+                out << " " << std::setprecision (0) << percent (q->histogram[n], samples) << "%";
+              out << "\n";
+            }
+          }
+          out << "\n(percentages are of the total thread time in each stage; queue occupancy is\n"
+            " sampled on each push, in " << MRTRIX_PROFILE_OCCUPANCY_BINS << " bins from empty to full)\n";
+        }
+
+
+        void write_json (std::ostream& out, const std::vector<PipelineTotal>& list)
+        {
+          out << "[\n";
+          for (std::vector<PipelineTotal>::const_iterator p = list.begin(); p != list.end(); ++p) {
+            out << "  { \"kind\": " << json_string (p->kind) << ", \"runs\": " << p->runs
+              << ", \"wall_time_ns\": " << p->wall_time << ",\n    \"stages\": [\n";
+            for (std::vector<StageTotal>::const_iterator s = p->stages.begin(); s != p->stages.end(); ++s) {
+              out << "      { \"role\": " << json_string (s->role) << ", \"functor\": " << json_string (s->functor)
+                << ", \"threads\": " << s->threads << ", \"items\": " << s->items
+                << ", \"items_per_second\": " << rate (s->items, p->wall_time)
+                << ", \"busy_ns\": " << s->busy << ", \"push_wait_ns\": " << s->pushing
+                << ", \"pop_wait_ns\": " << s->popping << ", \"idle_ns\": " << s->idle << " }"
+                << (s+1 != p->stages.end() ? "," : "") << "\n";
+            }
+            out << "    ],\n    \"queues\": [\n";
+            for (std::vector<QueueTotal>::const_iterator q = p->queues.begin(); q != p->queues.end(); ++q) {
+              out << "      { \"name\": " << json_string (q->name) << ", \"capacity\": " << q->capacity << ", \"occupancy\": [";
+              for (size_t n = 0; n < q->histogram.size(); ++n)
+                out << (n ? ", " : " ") << q->histogram[n];
+              out << " ] }" << (q+1 != p->queues.end() ? "," : "") << "\n";
+            }
+            out << "    ] }" << (p+1 != list.end() ? "," : "") << "\n";
+          }
+          out << "]\n";
+        }
+
+
+        void report ()
+        {
+          std::lock_guard<std::mutex> lock (registry_mutex());
+          const std::vector<PipelineTotal>& list (registry());
+          if (list.empty())
+            return;
+          write_text (std::cerr, list);
+          if (json_filename().size()) {
+            std::ofstream out (json_filename().c_str());
+            if (out)
+              write_json (out, list);
+            else
+              std::cerr << "error writing thread profile to file \"" << json_filename() << "\"\n";
+          }
+        }
+
+      }
+
+
+
+
+      void enable (const std::string& json_file)
+      {
+        if (json_file.size())
+          json_filename() = json_file;
+        if (__enabled)
+          return;
+        __enabled = true;
+        // construct the registry now, so that it outlives the call to report() on exit:
+        registry_mutex();
+        registry();
+        registry_index();
+        std::atexit (report);
+      }
+
+
+
+
+      std::string demangle (const char* name)
+      {
+        std::string s (name);
+#ifdef __GNUG__
+        int status = 0;
+        char* demangled = abi::__cxa_demangle (name, nullptr, nullptr, &status);
+        if (demangled) {
+          if (!status)
+            s = demangled;
+          std::free (demangled);
+        }
+#endif
+        // remove noise from type names:
+        const char* noise[] = { "(anonymous namespace)::", "MR::", nullptr };
+        for (const char** n = noise; *n; ++n) {
+          size_t pos;
+          while ((pos = s.find (*n)) != std::string::npos)
+            s.erase (pos, strlen (*n));
+        }
+        return s;
+      }
+
+
+
+
+      Pipeline::~Pipeline ()
+      {
+        if (!active)
+          return;
+        const uint64_t wall_time = std::chrono::duration_cast<std::chrono::nanoseconds> (clock::now() - start).count();
+
+        std::string key (kind);
+        for (size_t n = 0; n < stages.size(); ++n)
+          key += "|" + stages[n]->role + ":" + stages[n]->functor;
+
+        std::lock_guard<std::mutex> lock (registry_mutex());
+        std::map<std::string,size_t>::iterator entry = registry_index().find (key);
+        if (entry == registry_index().end()) {
+          entry = registry_index().insert (std::make_pair (key, registry().size())).first;
+          registry().push_back (PipelineTotal (kind));
+          PipelineTotal& total (registry().back());
+          for (size_t n = 0; n < stages.size(); ++n)
+            total.stages.push_back (StageTotal (*stages[n]));
+          for (size_t n = 0; n < queues.size(); ++n)
+            total.queues.push_back (QueueTotal (*queues[n]));
+        }
+
+        PipelineTotal& total (registry()[entry->second]);
+        ++total.runs;
+        total.wall_time += wall_time;
+        for (size_t n = 0; n < stages.size(); ++n) {
+          StageTotal& s (total.stages[n]);
+          s.threads = std::max (s.threads, size_t (stages[n]->threads));
+          s.items += stages[n]->items;
+          s.busy += stages[n]->busy;
+          s.pushing += stages[n]->pushing;
+          s.popping += stages[n]->popping;
+          s.idle += stages[n]->idle;
+        }
+        for (size_t n = 0; n < queues.size(); ++n)
+          for (size_t b = 0; b < MRTRIX_PROFILE_OCCUPANCY_BINS; ++b)
+            total.queues[n].histogram[b] += queues[n]->histogram[b];
+      }
+
+    }
+  }
+}
+
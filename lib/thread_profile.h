@@ -0,0 +1,203 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __thread_profile_h__
+#define __thread_profile_h__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <typeinfo>
+
+#include "ptr.h"
+
+#define MRTRIX_PROFILE_OCCUPANCY_BINS 10
+
+namespace MR
+{
+  namespace Thread
+  {
+
+    /** \addtogroup Thread
+     * @{ */
+
+    //! instrumentation of multi-threaded processing
+    /*! When enabled (using the \c -profile command-line option, or the \c
+     * ThreadProfile configuration file entry), each invocation of
+     * Thread::run_queue(), Thread::run_ordered_queue() and
+     * Image::ThreadedLoop records how each thread spent its time, along with
+     * the occupancy of the queues between stages. A summary is printed to
+     * stderr when the program exits, and optionally written in JSON format to
+     * the file specified by the \c ThreadProfileFile configuration entry.
+     *
+     * When disabled (the default), the cost of the instrumentation is a
+     * single test per item processed. */
+    namespace Profile
+    {
+
+      typedef std::chrono::high_resolution_clock clock;
+
+      extern bool __enabled;
+
+      //! whether profiling is active
+      inline bool enabled () { return __enabled; }
+
+      //! enable profiling, and register the report to be produced on exit
+      /*! If \a json_file is not empty, the report will also be written to
+       * that file in JSON format. */
+      void enable (const std::string& json_file = std::string());
+
+      //! return a human-readable version of the type name provided
+      std::string demangle (const char* name);
+
+      template <class X>
+        inline std::string type_name () { return demangle (typeid (X).name()); }
+
+
+
+      //! the totals accumulated over all threads of one stage of a pipeline
+      /*! All times are in nanoseconds. */
+      class Stage
+      {
+        public:
+          Stage (const std::string& role, const std::string& functor) :
+            role (role), functor (functor),
+            threads (0), items (0),
+            busy (0), pushing (0), popping (0), idle (0) { }
+
+          const std::string role, functor;
+          std::atomic<size_t> threads, items;
+          std::atomic<uint64_t> busy, pushing, popping, idle;
+      };
+
+
+
+      //! the occupancy of a queue, sampled every time an item is pushed
+      class Queue
+      {
+        public:
+          Queue (const std::string& name, size_t capacity) :
+            name (name), capacity (capacity) {
+              for (size_t n = 0; n < MRTRIX_PROFILE_OCCUPANCY_BINS; ++n)
+                histogram[n] = 0;
+            }
+
+          void sample (size_t size) {
+            ++histogram[std::min (size * MRTRIX_PROFILE_OCCUPANCY_BINS / capacity, size_t (MRTRIX_PROFILE_OCCUPANCY_BINS-1))];
+          }
+
+          const std::string name;
+          const size_t capacity;
+          std::atomic<size_t> histogram[MRTRIX_PROFILE_OCCUPANCY_BINS];
+      };
+
+
+
+      //! record of a single invocation of a pipeline
+      /*! The record is inert if profiling is not enabled, in which case
+       * stage() and queue() return nullptr. On destruction, the record is
+       * merged into the totals for all previous invocations of the same
+       * pipeline (i.e. with the same sequence of functors). */
+      class Pipeline
+      {
+        public:
+          Pipeline (const std::string& kind) :
+            active (enabled()),
+            kind (kind) {
+              if (active)
+                start = clock::now();
+            }
+          ~Pipeline ();
+
+          template <class Functor>
+            Stage* stage (const std::string& role) {
+              if (!active) return nullptr;
+              stages.push_back (new Stage (role, type_name<Functor>()));
+              return stages.back();
+            }
+
+          Queue* queue (const std::string& name, size_t capacity) {
+            if (!active) return nullptr;
+            queues.push_back (new Queue (name, capacity));
+            return queues.back();
+          }
+
+        private:
+          const bool active;
+          const std::string kind;
+          clock::time_point start;
+          VecPtr<Stage> stages;
+          VecPtr<Queue> queues;
+      };
+
+
+
+      //! accumulate the time spent by one thread in each state
+      /*! Each call to processed(), pushed(), popped() or waited() attributes
+       * the time elapsed since the previous call to the corresponding state.
+       * The totals are added to the Stage on destruction; any time not
+       * otherwise accounted for is recorded as idle. */
+      class StageTimer
+      {
+        public:
+          StageTimer (Stage* stage) :
+            stage (stage), items (0), busy (0), pushing (0), popping (0), idle (0) {
+              if (stage)
+                last = clock::now();
+            }
+          ~StageTimer () {
+            if (!stage) return;
+            idle += lap();
+            ++stage->threads;
+            stage->items += items;
+            stage->busy += busy;
+            stage->pushing += pushing;
+            stage->popping += popping;
+            stage->idle += idle;
+          }
+
+          void processed (size_t num = 1) { if (stage) { busy += lap(); items += num; } }
+          void pushed () { if (stage) pushing += lap(); }
+          void popped () { if (stage) popping += lap(); }
+          void waited () { if (stage) idle += lap(); }
+
+        private:
+          Stage* stage;
+          clock::time_point last;
+          size_t items;
+          uint64_t busy, pushing, popping, idle;
+
+          uint64_t lap () {
+            const clock::time_point now = clock::now();
+            const uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds> (now - last).count();
+            last = now;
+            return elapsed;
+          }
+      };
+
+    }
+
+    /** @} */
+  }
+}
+
+#endif
+
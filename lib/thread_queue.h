@@ -24,14 +24,18 @@
 #ifndef __mrtrix_thread_queue_h__
 #define __mrtrix_thread_queue_h__
 
+#include <atomic>
+#include <chrono>
+#include <map>
 #include <stack>
 #include <condition_variable>
 
 #include "ptr.h"
 #include "thread.h"
+#include "thread_profile.h"
 
 #define MRTRIX_QUEUE_DEFAULT_CAPACITY 128
-#define MRTRIX_QUEUE_DEFAULT_BATCH_SIZE 128
+#define MRTRIX_QUEUE_MAX_BATCH_SIZE 4096
 
 namespace MR
 {
@@ -49,7 +53,170 @@ namespace MR
         class __Batch {
           public:
             __Batch (size_t number) : num (number) { }
-            size_t num;
+            size_t num; // zero to select the batch size automatically
+        };
+
+
+
+      // Determines the number of items per batch. If a fixed size was not
+      // requested, this is adjusted at runtime so that the time taken to
+      // produce or consume each batch (whichever is larger) is around 100
+      // times the cost of a queue operation, within the range 10µs - 1ms.
+      // Cheap items are therefore sent in large batches to amortise the cost
+      // of synchronisation, while expensive items are sent individually or
+      // in small batches to preserve latency and load balancing. The
+      // estimates are exponential moving averages updated by all threads;
+      // races between updates only affect the precision of the estimates.
+      class __BatchSize {
+        public:
+          typedef std::chrono::steady_clock clock;
+
+          __BatchSize (size_t fixed_size) :
+            fixed (fixed_size),
+            current (fixed_size ? fixed_size : 1),
+            produce_cost (0.0), consume_cost (0.0),
+            push_cost (0.0), pop_cost (0.0) { }
+
+          size_t get () const { return current.load (std::memory_order_relaxed); }
+
+          void produced (size_t num, clock::duration processing, clock::duration sync) {
+            if (fixed || !num) return;
+            update (produce_cost, seconds (processing) / num);
+            update (push_cost, seconds (sync));
+            adjust();
+          }
+
+          void consumed (size_t num, clock::duration processing, clock::duration sync) {
+            if (fixed || !num) return;
+            update (consume_cost, seconds (processing) / num);
+            update (pop_cost, seconds (sync));
+            adjust();
+          }
+
+        private:
+          const size_t fixed;
+          std::atomic<size_t> current;
+          std::atomic<double> produce_cost, consume_cost, push_cost, pop_cost;
+
+          static double seconds (clock::duration d) { 
+            return std::chrono::duration<double> (d).count(); 
+          }
+
+          static void update (std::atomic<double>& average, double value) {
+            const double previous = average.load (std::memory_order_relaxed);
+            average.store (previous ? 0.8*previous + 0.2*value : value, std::memory_order_relaxed);
+          }
+
+          void adjust () {
+            const double item_cost = std::max (produce_cost.load (std::memory_order_relaxed), consume_cost.load (std::memory_order_relaxed));
+            if (item_cost <= 0.0) 
+              return;
+            // waiting on an empty or full queue inflates one of the two
+            // costs, so use the smaller one as the estimate of the overhead:
+            double sync_cost = push_cost.load (std::memory_order_relaxed);
+            const double pop = pop_cost.load (std::memory_order_relaxed);
+            if (pop > 0.0 && (sync_cost <= 0.0 || pop < sync_cost))
+              sync_cost = pop;
+            const double target = std::min (std::max (100.0 * sync_cost, 1.0e-5), 1.0e-3);
+            const double num = std::min (std::max (target / item_cost, 1.0), double (MRTRIX_QUEUE_MAX_BATCH_SIZE));
+            current.store (size_t (num), std::memory_order_relaxed);
+          }
+      };
+
+
+      /********************************************************************
+       * bounded lock-free multi-producer / multi-consumer ring of pointers
+       ********************************************************************/
+      // Each slot holds a sequence number indicating whether it is ready to
+      // be written to (sequence == position) or read from (sequence ==
+      // position + 1) for the current pass through the ring. Producers and
+      // consumers claim positions using compare-and-swap on their respective
+      // counters, so that no locking is required. The capacity is rounded up
+      // to the next power of two.
+      template <class T>
+        class __Ring {
+          public:
+            __Ring (size_t min_capacity) : 
+              mask (round_up (min_capacity) - 1), 
+              slots (new Slot [mask+1]),
+              write_pos (0),
+              read_pos (0) {
+                for (size_t n = 0; n <= mask; ++n)
+                  slots[n].sequence.store (n, std::memory_order_relaxed);
+              }
+
+            ~__Ring () { delete [] slots; }
+
+            bool push (T* item) {
+              Slot* slot;
+              size_t pos = write_pos.load (std::memory_order_relaxed);
+              while (true) {
+                slot = &slots[pos & mask];
+                const ssize_t diff = ssize_t (slot->sequence.load (std::memory_order_acquire)) - ssize_t (pos);
+                if (diff == 0) {
+                  if (write_pos.compare_exchange_weak (pos, pos+1, std::memory_order_relaxed))
+                    break;
+                }
+                else if (diff < 0) 
+                  return false;
+                else 
+                  pos = write_pos.load (std::memory_order_relaxed);
+              }
+              slot->item = item;
+              slot->sequence.store (pos+1, std::memory_order_release);
+              return true;
+            }
+
+            bool pop (T*& item) {
+              Slot* slot;
+              size_t pos = read_pos.load (std::memory_order_relaxed);
+              while (true) {
+                slot = &slots[pos & mask];
+                const ssize_t diff = ssize_t (slot->sequence.load (std::memory_order_acquire)) - ssize_t (pos+1);
+                if (diff == 0) {
+                  if (read_pos.compare_exchange_weak (pos, pos+1, std::memory_order_relaxed))
+                    break;
+                }
+                else if (diff < 0) 
+                  return false;
+                else 
+                  pos = read_pos.load (std::memory_order_relaxed);
+              }
+              item = slot->item;
+              slot->sequence.store (pos+mask+1, std::memory_order_release);
+              return true;
+            }
+
+            //! approximate number of items in the ring
+            size_t size () const {
+              const size_t w = write_pos.load (std::memory_order_relaxed);
+              const size_t r = read_pos.load (std::memory_order_relaxed);
+              return w > r ? w - r : 0;
+            }
+
+            size_t capacity () const { return mask+1; }
+
+          private:
+            class Slot {
+              public:
+                std::atomic<size_t> sequence;
+                T* item;
+            };
+
+            const size_t mask;
+            Slot* slots;
+            // keep counters on separate cache lines to avoid false sharing:
+            char pad0 [64];
+            std::atomic<size_t> write_pos;
+            char pad1 [64];
+            std::atomic<size_t> read_pos;
+            char pad2 [64];
+
+            static size_t round_up (size_t n) {
+              size_t p = 2;
+              while (p < n) p <<= 1;
+              return p;
+            }
         };
 
 
@@ -58,6 +225,10 @@ namespace MR
       template <class X> class __item { public: typedef X type; }; 
       template <class X> class __item <__Batch<X>> { public: typedef X type; };
 
+      // items are always batched within Thread::run_queue():
+      template <class X> class __batched { public: typedef __Batch<X> type; }; 
+      template <class X> class __batched <__Batch<X>> { public: typedef __Batch<X> type; };
+
       // to get multi/single job/functor seamlessly:
       template <class X>
         class __job
@@ -131,10 +302,10 @@ namespace MR
      *     N_source                    N_pipe                      N_sink
      * \endcode
      *
-     * By default, items are push to and pulled from the queue one by one. In
-     * situations where the amount of processing per item is small, items can
-     * be sent in batches to reduce the overhead of thread management (mutex
-     * locking/unlocking, etc). 
+     * When using Thread::run_queue(), items are pushed to and pulled from the
+     * queue in batches, whose size is adjusted at runtime to reduce the
+     * overhead of thread management where the amount of processing per item
+     * is small, while retaining good load balancing where it is large. 
      *
      * The simplest way to use this functionality is via the
      * Thread::run_queue() and associated Thread::multi() and Thread::batch()
@@ -229,6 +400,11 @@ namespace MR
      *   that each thread unregisters as soon as the execute() method returns,
      *   and hence \e before the thread exits.
      *
+     * Items are passed between threads through a bounded lock-free ring,
+     * and processed items are recycled through a lock-free free-list, so
+     * that threads only block (on a condition variable) when the queue is
+     * empty or full.
+     *
      * The Queue class performs all memory management for the items in the
      * queue. For this reason, the items are accessed via the Writer::Item &
      * Reader::Item classes. This allows items to be recycled once they have
@@ -367,31 +543,28 @@ namespace MR
          * MRTRIX_QUEUE_DEFAULT_CAPACITY items.
          */
         Queue (const std::string& description = "unnamed", size_t buffer_size = MRTRIX_QUEUE_DEFAULT_CAPACITY) :
-          buffer (new T* [buffer_size]),
-          front (buffer),
-          back (buffer),
-          capacity (buffer_size),
+          ring (buffer_size),
+          free_items (2*buffer_size),
           writer_count (0),
           reader_count (0),
-          name (description) {
-          assert (capacity > 0);
+          writers_waiting (0),
+          readers_waiting (0),
+          name (description),
+          occupancy (nullptr) {
+          assert (buffer_size > 0);
         }
 
         //! needed for Thread::run_queue()
         Queue (const T& item_type, const std::string& description = "unnamed", size_t buffer_size = MRTRIX_QUEUE_DEFAULT_CAPACITY) :
-          buffer (new T* [buffer_size]),
-          front (buffer),
-          back (buffer),
-          capacity (buffer_size),
+          ring (buffer_size),
+          free_items (2*buffer_size),
           writer_count (0),
           reader_count (0),
-          name (description) {
-          assert (capacity > 0);
-        }
-
-
-        ~Queue () {
-          delete [] buffer;
+          writers_waiting (0),
+          readers_waiting (0),
+          name (description),
+          occupancy (nullptr) {
+          assert (buffer_size > 0);
         }
 
         //! This class is used to register a writer with the queue
@@ -537,18 +710,20 @@ namespace MR
                     << reader_count << " reader" << (reader_count > 1 ? "s" : "") << ", items waiting: " << size() << "\n";
         }
 
+        //! record the occupancy of the queue into \a stats every time an item is pushed
+        void profile (Profile::Queue* stats) { occupancy = stats; }
+
 
       private:
+        __Ring<T> ring, free_items;
         std::mutex mutex;
         std::condition_variable more_data, more_space;
-        T** buffer;
-        T** front;
-        T** back;
-        size_t capacity;
-        size_t writer_count, reader_count;
+        std::atomic<size_t> writer_count, reader_count;
+        std::atomic<size_t> writers_waiting, readers_waiting;
         std::stack<T*,std::vector<T*> > item_stack;
         VecPtr<T> items;
         std::string name;
+        Profile::Queue* occupancy;
 
         Queue (const Queue& queue) {
           assert (0);
@@ -567,8 +742,7 @@ namespace MR
           {
             std::lock_guard<std::mutex> lock (mutex);
             assert (writer_count);
-            --writer_count;
-            if (!writer_count) 
+            if (!--writer_count)
               finish = true;
           }
           if (finish) {
@@ -585,8 +759,7 @@ namespace MR
           {
             std::lock_guard<std::mutex> lock (mutex);
             assert (reader_count);
-            --reader_count;
-            if (!reader_count) 
+            if (!--reader_count)
               finish = true;
           }
           if (finish) {
@@ -595,64 +768,89 @@ namespace MR
           }
         }
 
-        bool empty () const {
-          return (front == back);
-        }
-        bool full () const {
-          return (inc (back) == front);
-        }
         size_t size () const {
-          return ( (back < front ? back+capacity : back) - front);
+          return ring.size();
         }
 
+        // obtain a fresh item, preferably one that has already been processed:
         T* get_item () {
+          T* item;
+          if (free_items.pop (item))
+            return item;
           std::lock_guard<std::mutex> lock (mutex);
-          T* item = new T;
+          if (item_stack.size()) {
+            item = item_stack.top();
+            item_stack.pop();
+            return item;
+          }
+          item = new T;
           items.push_back (item);
           return item;
         }
 
+        void recycle (T* item) {
+          if (free_items.push (item))
+            return;
+          std::lock_guard<std::mutex> lock (mutex);
+          item_stack.push (item);
+        }
+
+        // wake any threads blocked waiting on the condition supplied. The
+        // fence ensures that either the waiting thread's registration is
+        // seen here, or the preceding ring operation is seen by that thread
+        // when it re-checks the ring while holding the mutex:
+        void wake (std::atomic<size_t>& waiting, std::condition_variable& condition) {
+          std::atomic_thread_fence (std::memory_order_seq_cst);
+          if (waiting.load (std::memory_order_relaxed)) {
+            { std::lock_guard<std::mutex> lock (mutex); }
+            condition.notify_all();
+          }
+        }
+
         bool push (T*& item) {
-          {
+          if (!reader_count)
+            return false;
+          if (!ring.push (item)) {
             std::unique_lock<std::mutex> lock (mutex);
-            more_space.wait (lock, [this]{ return !(full() && reader_count); });
-            if (!reader_count) return false;
-            *back = item;
-            back = inc (back);
-            if (item_stack.empty()) {
-              item = new T;
-              items.push_back (item);
-            }
-            else {
-              item = item_stack.top();
-              item_stack.pop();
+            ++writers_waiting;
+            std::atomic_thread_fence (std::memory_order_seq_cst);
+            while (!ring.push (item)) {
+              if (!reader_count) {
+                --writers_waiting;
+                return false;
+              }
+              more_space.wait (lock);
             }
+            --writers_waiting;
           }
-          more_data.notify_one();
+          if (occupancy)
+            occupancy->sample (size());
+          wake (readers_waiting, more_data);
+          item = get_item();
           return true;
         }
 
         bool pop (T*& item) {
-          {
+          if (item) 
+            recycle (item);
+          item = nullptr;
+          if (!ring.pop (item)) {
             std::unique_lock<std::mutex> lock (mutex);
-            if (item) 
-              item_stack.push (item);
-            item = nullptr;
-            more_data.wait (lock, [this]{ return !(empty() && writer_count); });
-            if (empty() && !writer_count) 
-              return false;
-            item = *front;
-            front = inc (front);
+            ++readers_waiting;
+            std::atomic_thread_fence (std::memory_order_seq_cst);
+            while (!ring.pop (item)) {
+              if (!writer_count) {
+                --readers_waiting;
+                item = nullptr;
+                return false;
+              }
+              more_data.wait (lock);
+            }
+            --readers_waiting;
           }
-          more_space.notify_one();
+          wake (writers_waiting, more_space);
           return true;
         }
-
-        T** inc (T** p) const {
-          ++p;
-          if (p >= buffer + capacity) p = buffer;
-          return p;
-        }
     };
 
 
@@ -667,12 +865,18 @@ namespace MR
       private:
         typedef std::vector<T> BatchType;
         typedef Queue<BatchType> BatchQueue;
+        typedef __BatchSize::clock clock;
 
       public:
         Queue (const __Batch<T>& item_type, const std::string& description = "unnamed", size_t buffer_size = MRTRIX_QUEUE_DEFAULT_CAPACITY) :
           batch_queue (description, buffer_size),
           batch_size (item_type.num) { }
 
+        //! a queue of unbatched items, with batch size selected automatically
+        Queue (const T& item_type, const std::string& description = "unnamed", size_t buffer_size = MRTRIX_QUEUE_DEFAULT_CAPACITY) :
+          batch_queue (description, buffer_size),
+          batch_size (0) { }
+
 
         class Writer
         {
@@ -684,8 +888,9 @@ namespace MR
             {
               public:
                 Item (const Writer& writer) : 
-                  batch_item (writer.batch_writer), batch_size (writer.batch_size), n (0) { 
-                    batch_item->resize (batch_size);
+                  batch_item (writer.batch_writer), batch_size (writer.batch_size), 
+                  size (batch_size.get()), n (0), start_of_batch (clock::now()) { 
+                    batch_item->resize (size);
                 }
                 ~Item () {
                   if (n) {
@@ -694,11 +899,16 @@ namespace MR
                   }
                 }
                 bool write () {
-                  if (++n >= batch_size) {
+                  if (++n >= size) {
+                    const clock::time_point before = clock::now();
                     if (!batch_item.write()) 
                       return false;
+                    const clock::time_point after = clock::now();
+                    batch_size.produced (n, before - start_of_batch, after - before);
+                    start_of_batch = after;
                     n = 0;
-                    batch_item->resize (batch_size);
+                    size = batch_size.get();
+                    batch_item->resize (size);
                   }
                   return true;
                 }
@@ -710,13 +920,14 @@ namespace MR
                 }
               private:
                 typename BatchQueue::Writer::Item batch_item;
-                const size_t batch_size;
-                size_t n;
+                __BatchSize& batch_size;
+                size_t size, n;
+                clock::time_point start_of_batch;
             };
 
           private:
             typename BatchQueue::Writer batch_writer;
-            const size_t batch_size;
+            __BatchSize& batch_size;
         };
 
 
@@ -732,10 +943,10 @@ namespace MR
                 Item (const Reader& reader) : batch_item (reader.batch_reader), batch_size (reader.batch_size), n (0) { }
                 bool read () {
                   if (!batch_item) 
-                    return batch_item.read();
+                    return next();
 
                   if (++n >= batch_item->size()) {
-                    if (!batch_item.read()) 
+                    if (!next()) 
                       return false;
                     n = 0;
                   }
@@ -749,20 +960,34 @@ namespace MR
                 }
               private:
                 typename BatchQueue::Reader::Item batch_item;
-                const size_t batch_size;
+                __BatchSize& batch_size;
                 size_t n;
+                clock::time_point start_of_batch;
+
+                bool next () {
+                  const clock::time_point before = clock::now();
+                  const size_t processed = !batch_item ? 0 : batch_item->size();
+                  if (!batch_item.read())
+                    return false;
+                  const clock::time_point after = clock::now();
+                  if (processed)
+                    batch_size.consumed (processed, before - start_of_batch, after - before);
+                  start_of_batch = after;
+                  return true;
+                }
             };
           private:
             typename BatchQueue::Reader batch_reader;
-            const size_t batch_size;
+            __BatchSize& batch_size;
         };
 
         void status () { batch_queue.status(); }
+        void profile (Profile::Queue* stats) { batch_queue.profile (stats); }
 
 
       private:
         BatchQueue batch_queue;
-        const size_t batch_size;
+        __BatchSize batch_size;
     };
 
 
@@ -780,20 +1005,24 @@ namespace MR
          class __Source
          {
            public:
-             __Source (Queue<Type>& queue, Functor& functor) :
-               writer (queue), func (__job<Functor>::functor (functor)) { }
+             __Source (Queue<Type>& queue, Functor& functor, Profile::Stage* stage = nullptr) :
+               writer (queue), func (__job<Functor>::functor (functor)), stage (stage) { }
 
              void execute () {
+               Profile::StageTimer timer (stage);
                typename Queue<Type>::Writer::Item out (writer);
-               do {
-                 if (!func (*out)) 
+               while (func (*out)) {
+                 timer.processed();
+                 if (!out.write())
                    return;
-               } while (out.write());
+                 timer.pushed();
+               }
              }
 
            private:
              typename Queue<Type>::Writer writer;
              typename __job<Functor>::member_type func;
+             Profile::Stage* stage;
          };
 
 
@@ -801,22 +1030,30 @@ namespace MR
          class __Pipe
          {
            public:
-             __Pipe (Queue<Type1>& queue_in, Functor& functor, Queue<Type2>& queue_out) :
-               reader (queue_in), writer (queue_out), func (__job<Functor>::functor (functor)) { }
+             __Pipe (Queue<Type1>& queue_in, Functor& functor, Queue<Type2>& queue_out, Profile::Stage* stage = nullptr) :
+               reader (queue_in), writer (queue_out), func (__job<Functor>::functor (functor)), stage (stage) { }
 
              void execute () {
+               Profile::StageTimer timer (stage);
                typename Queue<Type1>::Reader::Item in (reader);
                typename Queue<Type2>::Writer::Item out (writer);
-               do {
-                 do { if (!in.read()) return; } 
-                 while (!func (*in, *out));
-               } while (out.write());
+               while (in.read()) {
+                 timer.popped();
+                 const bool keep = func (*in, *out);
+                 timer.processed();
+                 if (keep) {
+                   if (!out.write())
+                     return;
+                   timer.pushed();
+                 }
+               }
              }
 
            private:
              typename Queue<Type1>::Reader reader;
              typename Queue<Type2>::Writer writer;
              typename __job<Functor>::member_type func;
+             Profile::Stage* stage;
          };
 
 
@@ -825,23 +1062,230 @@ namespace MR
          class __Sink
          {
            public:
-             __Sink (Queue<Type>& queue, Functor& functor) :
-               reader (queue), func (__job<Functor>::functor (functor)) { }
+             __Sink (Queue<Type>& queue, Functor& functor, Profile::Stage* stage = nullptr) :
+               reader (queue), func (__job<Functor>::functor (functor)), stage (stage) { }
 
              void execute () {
+               Profile::StageTimer timer (stage);
                typename Queue<Type>::Reader::Item in (reader);
                while (in.read()) {
+                 timer.popped();
                  if (!func (*in))
                    return;
+                 timer.processed();
                }
              }
 
            private:
              typename Queue<Type>::Reader reader;
              typename __job<Functor>::member_type func;
+             Profile::Stage* stage;
+         };
+
+
+
+
+
+       /********************************************************************
+        * wrapper classes for Thread::run_ordered_queue()
+        ********************************************************************/
+
+       // a batch of consecutive items, tagged with its position in the sequence:
+       template <class T>
+         class __Ordered {
+           public:
+             __Ordered () : index (0) { }
+             size_t index;
+             std::vector<T> items;
+             std::vector<bool> keep;
+         };
+
+       template <class X> inline size_t __batch_size (const X&) { return 0; }
+       template <class X> inline size_t __batch_size (const __Batch<X>& batch) { return batch.num; }
+
+
+       // Limits how far ahead of the sink the source can run, so that the
+       // number of batches held back for re-ordering is bounded:
+       class __Sequencer {
+         public:
+           __Sequencer (size_t window, size_t fixed_batch_size) :
+             batch_size (fixed_batch_size),
+             window (window),
+             delivered (0),
+             finished (false) { }
+
+           __BatchSize batch_size;
+
+           //! wait until batch \a index is within the window; returns false if the sink has finished
+           bool wait (size_t index) {
+             std::unique_lock<std::mutex> lock (mutex);
+             more_space.wait (lock, [&] { return finished || index < delivered + window; });
+             return !finished;
+           }
+
+           void deliver (size_t num_delivered) {
+             {
+               std::lock_guard<std::mutex> lock (mutex);
+               delivered = num_delivered;
+             }
+             more_space.notify_all();
+           }
+
+           void finish () {
+             {
+               std::lock_guard<std::mutex> lock (mutex);
+               finished = true;
+             }
+             more_space.notify_all();
+           }
+
+         private:
+           const size_t window;
+           size_t delivered;
+           bool finished;
+           std::mutex mutex;
+           std::condition_variable more_space;
+       };
+
+
+       template <class Type, class Functor>
+         class __OrderedSource
+         {
+           public:
+             __OrderedSource (Queue<__Ordered<Type>>& queue, Functor& functor, __Sequencer& sequencer, Profile::Stage* stage = nullptr) :
+               writer (queue), func (functor), sequencer (sequencer), stage (stage) { }
+
+             void execute () {
+               typedef __BatchSize::clock clock;
+               Profile::StageTimer timer (stage);
+               typename Queue<__Ordered<Type>>::Writer::Item out (writer);
+               clock::time_point start = clock::now();
+               for (size_t index = 0; sequencer.wait (index); ++index) {
+                 timer.pushed();
+                 const size_t size = sequencer.batch_size.get();
+                 out->index = index;
+                 out->items.resize (size);
+                 size_t n = 0;
+                 while (n < size && func (out->items[n]))
+                   ++n;
+                 if (!n) 
+                   return;
+                 out->items.resize (n);
+                 timer.processed (n);
+                 const clock::time_point before = clock::now();
+                 if (!out.write())
+                   return;
+                 const clock::time_point after = clock::now();
+                 timer.pushed();
+                 sequencer.batch_size.produced (n, before - start, after - before);
+                 start = after;
+                 if (n < size)
+                   return;
+               }
+             }
+
+           private:
+             typename Queue<__Ordered<Type>>::Writer writer;
+             Functor& func;
+             __Sequencer& sequencer;
+             Profile::Stage* stage;
+         };
+
+
+       template <class Type1, class Functor, class Type2>
+         class __OrderedPipe
+         {
+           public:
+             __OrderedPipe (Queue<__Ordered<Type1>>& queue_in, Functor& functor, Queue<__Ordered<Type2>>& queue_out, __Sequencer& sequencer, Profile::Stage* stage = nullptr) :
+               reader (queue_in), writer (queue_out), func (__job<Functor>::functor (functor)), sequencer (sequencer), stage (stage) { }
+
+             void execute () {
+               typedef __BatchSize::clock clock;
+               Profile::StageTimer timer (stage);
+               typename Queue<__Ordered<Type1>>::Reader::Item in (reader);
+               typename Queue<__Ordered<Type2>>::Writer::Item out (writer);
+               clock::time_point before = clock::now();
+               while (in.read()) {
+                 timer.popped();
+                 const clock::time_point start = clock::now();
+                 const size_t size = in->items.size();
+                 out->index = in->index;
+                 out->items.resize (size);
+                 out->keep.resize (size);
+                 for (size_t n = 0; n < size; ++n)
+                   out->keep[n] = func (in->items[n], out->items[n]);
+                 timer.processed (size);
+                 if (!out.write())
+                   return;
+                 timer.pushed();
+                 const clock::time_point end = clock::now();
+                 sequencer.batch_size.consumed (size, end - start, start - before);
+                 before = end;
+               }
+             }
+
+           private:
+             typename Queue<__Ordered<Type1>>::Reader reader;
+             typename Queue<__Ordered<Type2>>::Writer writer;
+             typename __job<Functor>::member_type func;
+             __Sequencer& sequencer;
+             Profile::Stage* stage;
          };
 
 
+       template <class Type, class Functor>
+         class __OrderedSink
+         {
+           public:
+             __OrderedSink (Queue<__Ordered<Type>>& queue, Functor& functor, __Sequencer& sequencer, Profile::Stage* stage = nullptr) :
+               reader (queue), func (functor), sequencer (sequencer), stage (stage) { }
+
+             void execute () {
+               Profile::StageTimer timer (stage);
+               typename Queue<__Ordered<Type>>::Reader::Item in (reader);
+               std::map<size_t, __Ordered<Type>> pending;
+               size_t next = 0;
+               while (in.read()) {
+                 timer.popped();
+                 const size_t size = in->items.size();
+                 if (in->index != next) {
+                   __Ordered<Type>& held (pending[in->index]);
+                   held.items.swap (in->items);
+                   held.keep.swap (in->keep);
+                   timer.processed (size);
+                   continue;
+                 }
+                 if (!deliver (*in))
+                   break;
+                 ++next;
+                 typename std::map<size_t, __Ordered<Type>>::iterator i;
+                 while ((i = pending.find (next)) != pending.end()) {
+                   if (!deliver (i->second))
+                     break;
+                   pending.erase (i);
+                   ++next;
+                 }
+                 if (i != pending.end())
+                   break;
+                 timer.processed (size);
+                 sequencer.deliver (next);
+               }
+               sequencer.finish();
+             }
+
+           private:
+             typename Queue<__Ordered<Type>>::Reader reader;
+             Functor& func;
+             __Sequencer& sequencer;
+             Profile::Stage* stage;
+
+             bool deliver (const __Ordered<Type>& batch) {
+               for (size_t n = 0; n < batch.items.size(); ++n)
+                 if (batch.keep[n] && !func (batch.items[n]))
+                   return false;
+               return true;
+             }
+         };
     }
 
 
@@ -854,11 +1298,13 @@ namespace MR
  
     //! used to request batched processing of items
     /*! This function is used in combination with Thread::run_queue to request
-     * that the items \a object be processed in batches of \a number items 
-     * (defaults to MRTRIX_QUEUE_DEFAULT_BATCH_SIZE).
+     * that the items \a object be processed in batches of \a number items. 
+     * If \a number is zero (the default), the batch size is adjusted
+     * automatically at runtime, as is done for items not wrapped in this
+     * function.
      * \sa Thread::run_queue() */
     template <class Item>
-      inline __Batch<Item> batch (const Item& object, size_t number = MRTRIX_QUEUE_DEFAULT_BATCH_SIZE) 
+      inline __Batch<Item> batch (const Item& object, size_t number = 0) 
       {
         return __Batch<Item> (number);
       }
@@ -1013,10 +1459,14 @@ namespace MR
      *
      * In cases where the amount of processing per item is small, the overhead
      * of managing the concurrent access to the various queues from all the
-     * threads may become prohibitive (see \ref multithreading for details). In
-     * this case, it is a good idea to process the items in batches, which
-     * drastically reduces the number of accesses to the queue. This can be
-     * done by wrapping the items in a call to Thread::batch():
+     * threads may become prohibitive (see \ref multithreading for details). 
+     * Items are therefore always sent through the queues in batches, with
+     * the number of items per batch adjusted at runtime based on the measured
+     * cost of producing and consuming each item relative to the cost of
+     * accessing the queue: cheap items are sent in large batches, while
+     * expensive items are sent in batches as small as a single item to
+     * preserve load balancing. A fixed batch size can be requested by 
+     * wrapping the items in a call to Thread::batch():
      *
      * \code 
      * ...
@@ -1025,13 +1475,13 @@ namespace MR
      * {
      *   ...
      *
-     *   // run a single-source => multi-sink pipeline on batches of size_t items:
-     *   Thread::run_queue (source, Thread::batch (size_t()), Thread::multi (sink));
+     *   // run a single-source => multi-sink pipeline on batches of 128 size_t items:
+     *   Thread::run_queue (source, Thread::batch (size_t(), 128), Thread::multi (sink));
      * }
      * \endcode
      *
-     * By default, batches consist of MRTRIX_QUEUE_DEFAULT_BATCH_SIZE items
-     * (defined as 128). This can be set explicitly by providing the desired
+     * Without a size argument, Thread::batch() retains the automatic batch
+     * size. A fixed size can be set explicitly by providing the desired
      * size as an additional argument to Thread::batch():
      *
      * \code 
@@ -1065,9 +1515,14 @@ namespace MR
           return;
         }
 
-         Queue<Type> queue (item_type, "source->sink", capacity);
-         __Source<Type,Source> source_functor (queue, source);
-         __Sink<Type,Sink>     sink_functor   (queue, sink);
+        typedef typename __batched<Type>::type BatchType;
+
+        Profile::Pipeline profile ("run_queue");
+        Queue<BatchType> queue (item_type, "source->sink", capacity);
+        queue.profile (profile.queue ("source->sink", capacity));
+
+        __Source<BatchType,Source> source_functor (queue, source, profile.stage<typename __job<Source>::type> ("source"));
+        __Sink<BatchType,Sink>     sink_functor   (queue, sink, profile.stage<typename __job<Sink>::type> ("sink"));
 
         auto t1 = run (__job<Source>::get (source, source_functor), "source");
         auto t2 = run (__job<Sink>::get (sink, sink_functor), "sink");
@@ -1143,12 +1598,18 @@ namespace MR
         }
 
 
-        Queue<Type1> queue1 (item_type1, "source->pipe", capacity);
-        Queue<Type2> queue2 (item_type2, "pipe->sink", capacity);
+        typedef typename __batched<Type1>::type BatchType1;
+        typedef typename __batched<Type2>::type BatchType2;
 
-        __Source<Type1,Source>   source_functor (queue1, source);
-        __Pipe<Type1,Pipe,Type2> pipe_functor   (queue1, pipe, queue2);
-        __Sink<Type2,Sink>       sink_functor   (queue2, sink);
+        Profile::Pipeline profile ("run_queue");
+        Queue<BatchType1> queue1 (item_type1, "source->pipe", capacity);
+        Queue<BatchType2> queue2 (item_type2, "pipe->sink", capacity);
+        queue1.profile (profile.queue ("source->pipe", capacity));
+        queue2.profile (profile.queue ("pipe->sink", capacity));
+
+        __Source<BatchType1,Source>        source_functor (queue1, source, profile.stage<typename __job<Source>::type> ("source"));
+        __Pipe<BatchType1,Pipe,BatchType2> pipe_functor   (queue1, pipe, queue2, profile.stage<typename __job<Pipe>::type> ("pipe"));
+        __Sink<BatchType2,Sink>            sink_functor   (queue2, sink, profile.stage<typename __job<Sink>::type> ("sink"));
 
         auto t1 = run (__job<Source>::get (source, source_functor), "source");
         auto t2 = run (__job<Pipe>::get (pipe, pipe_functor), "pipe");
@@ -1161,6 +1622,78 @@ namespace MR
 
 
 
+    //! set up and run a 3-stage multi-threaded pipeline that preserves the order of items
+    /*! This function behaves as the 3-stage Thread::run_queue(), except that
+     * the items are delivered to the Sink functor in the same order as they
+     * were produced by the Source functor, irrespective of the number of
+     * threads used for the Pipe functor. Items discarded by the Pipe (i.e. for
+     * which it returns false) are skipped, without affecting the order of
+     * the remaining items. This is intended for commands where the output
+     * must match the order of the input, for example when writing
+     * streamlines along with their associated weights.
+     *
+     * Items are tagged with their position in the sequence as they are
+     * produced, and re-ordered before being passed to the sink. To bound the
+     * amount of memory held for re-ordering, the Source is not allowed to run
+     * more than \a capacity batches ahead of the Sink. 
+     *
+     * The Source and Sink functors are always run in a single thread; the
+     * Pipe functor can be wrapped in Thread::multi(). Items are batched as
+     * for Thread::run_queue(); the items can be wrapped in Thread::batch() to
+     * request a fixed batch size (only the size requested for \a
+     * item_type1 is used).
+     *
+     * \code
+     * Thread::run_ordered_queue (loader, Streamline<>(), Thread::multi (worker), Streamline<>(), writer);
+     * \endcode
+     */
+    template <class Source, class Type1, class Pipe, class Type2, class Sink>
+      inline void run_ordered_queue (
+          Source&& source,
+          const Type1& item_type1, 
+          Pipe&& pipe, 
+          const Type2& item_type2, 
+          Sink&& sink, 
+          size_t capacity = MRTRIX_QUEUE_DEFAULT_CAPACITY)
+      {
+        typedef typename __item<Type1>::type ItemType1;
+        typedef typename __item<Type2>::type ItemType2;
+
+        if (number_of_threads() == 0) {
+          ItemType1 item1;
+          ItemType2 item2;
+          while (source (item1)) {
+            if (__job<Pipe>::functor (pipe) (item1, item2))
+              if (!sink (item2))
+                return;
+          }
+          return;
+        }
+
+        __Sequencer sequencer (capacity, __batch_size (item_type1));
+        Profile::Pipeline profile ("run_ordered_queue");
+        Queue<__Ordered<ItemType1>> queue1 ("source->pipe", capacity);
+        Queue<__Ordered<ItemType2>> queue2 ("pipe->sink", capacity);
+        queue1.profile (profile.queue ("source->pipe", capacity));
+        queue2.profile (profile.queue ("pipe->sink", capacity));
+
+        typedef typename std::remove_reference<Source>::type SourceType;
+        typedef typename std::remove_reference<Sink>::type SinkType;
+        __OrderedSource<ItemType1,SourceType>     source_functor (queue1, source, sequencer, profile.stage<SourceType> ("source"));
+        __OrderedPipe<ItemType1,Pipe,ItemType2>   pipe_functor   (queue1, pipe, queue2, sequencer, profile.stage<typename __job<Pipe>::type> ("pipe"));
+        __OrderedSink<ItemType2,SinkType>         sink_functor   (queue2, sink, sequencer, profile.stage<SinkType> ("sink"));
+
+        auto t1 = run (source_functor, "source");
+        auto t2 = run (__job<Pipe>::get (pipe, pipe_functor), "pipe");
+        auto t3 = run (sink_functor, "sink");
+
+        t1.wait();
+        t2.wait();
+        t3.wait();
+      }
+
+
+
     //! convenience functions to set up and run a 4-stage multi-threaded pipeline.
     /*! This function extends the 2-stage Thread::run_queue() function to allow
      * a 3-stage pipeline.  */
@@ -1189,14 +1722,22 @@ namespace MR
         }
 
 
-        Queue<Type1> queue1 (item_type1, "source->pipe", capacity);
-        Queue<Type2> queue2 (item_type2, "pipe->pipe", capacity);
-        Queue<Type3> queue3 (item_type3, "pipe->sink", capacity);
+        typedef typename __batched<Type1>::type BatchType1;
+        typedef typename __batched<Type2>::type BatchType2;
+        typedef typename __batched<Type3>::type BatchType3;
+
+        Profile::Pipeline profile ("run_queue");
+        Queue<BatchType1> queue1 (item_type1, "source->pipe", capacity);
+        Queue<BatchType2> queue2 (item_type2, "pipe->pipe", capacity);
+        Queue<BatchType3> queue3 (item_type3, "pipe->sink", capacity);
+        queue1.profile (profile.queue ("source->pipe", capacity));
+        queue2.profile (profile.queue ("pipe->pipe", capacity));
+        queue3.profile (profile.queue ("pipe->sink", capacity));
 
-        __Source<Type1,Source>    source_functor (queue1, source);
-        __Pipe<Type1,Pipe1,Type2> pipe1_functor   (queue1, pipe1, queue2);
-        __Pipe<Type2,Pipe2,Type3> pipe2_functor   (queue2, pipe2, queue3);
-        __Sink<Type3,Sink>        sink_functor   (queue3, sink);
+        __Source<BatchType1,Source>         source_functor (queue1, source, profile.stage<typename __job<Source>::type> ("source"));
+        __Pipe<BatchType1,Pipe1,BatchType2> pipe1_functor  (queue1, pipe1, queue2, profile.stage<typename __job<Pipe1>::type> ("pipe1"));
+        __Pipe<BatchType2,Pipe2,BatchType3> pipe2_functor  (queue2, pipe2, queue3, profile.stage<typename __job<Pipe2>::type> ("pipe2"));
+        __Sink<BatchType3,Sink>             sink_functor   (queue3, sink, profile.stage<typename __job<Sink>::type> ("sink"));
 
         auto t1 = run (__job<Source>::get (source, source_functor), "source");
         auto t2 = run (__job<Pipe1>::get (pipe1, pipe1_functor), "pipe1");
@@ -22,6 +22,8 @@
 
 
 
+#include <algorithm>
+
 #include "dwi/tractography/connectomics/connectomics.h"
 #include "dwi/tractography/connectomics/edge_metrics.h"
 #include "dwi/tractography/connectomics/tck2nodes.h"
@@ -60,7 +62,14 @@ const OptionGroup AssignmentOption = OptionGroup ("Structural connectome streaml
 
   + Option ("assignment_forward_search", "project the streamline forwards from the endpoint in search of a parcellation node voxel. "
                                          "Argument is the maximum traversal length in mm.")
-    + Argument ("max_dist").type_float (0.0, TCK2NODES_FORWARDSEARCH_DEFAULT_DIST, 1e6);
+    + Argument ("max_dist").type_float (0.0, TCK2NODES_FORWARDSEARCH_DEFAULT_DIST, 1e6)
+
+  + Option ("assignment_radial_lookup", "precompute the radial search for every voxel in the parcellation image, such that each streamline endpoint "
+                                        "is assigned using a single lookup (distances are then computed between voxel centres rather than from the precise endpoint). "
+                                        "The lookup is stored in the image provided, and re-used if it was generated from the same parcellation image "
+                                        "with a search radius at least as large as that requested; this avoids repeating the search when processing "
+                                        "multiple track files with the same parcellation.")
+    + Argument ("path").type_text();
 
 
 
@@ -89,6 +98,19 @@ Tck2nodes_base* load_assignment_mode (Image::Buffer<node_t>& nodes_data)
     }
   }
 
+  Options opt = get_options ("assignment_radial_lookup");
+  if (opt.size()) {
+    if (tck2nodes && !dynamic_cast<Connectomics::Tck2nodes_radial*> (tck2nodes)) {
+      delete tck2nodes;
+      tck2nodes = NULL;
+      throw Exception ("The -assignment_radial_lookup option is only applicable to the radial search assignment mechanism");
+    }
+    Options radial = get_options (modes[1]);
+    const float radius = radial.size() ? float(radial[0][0]) : TCK2NODES_RADIAL_DEFAULT_DIST;
+    delete tck2nodes;
+    tck2nodes = new Connectomics::Tck2nodes_radial_lookup (nodes_data, radius, opt[0][0]);
+  }
+
   // default
   if (!tck2nodes)
     tck2nodes = new Connectomics::Tck2nodes_radial (nodes_data, TCK2NODES_RADIAL_DEFAULT_DIST);
@@ -103,7 +125,10 @@ Tck2nodes_base* load_assignment_mode (Image::Buffer<node_t>& nodes_data)
 const OptionGroup MetricOption = OptionGroup ("Structural connectome metric option")
 
   + Option ("metric", "specify the edge weight metric. "
-                      "Options are: count (default), meanlength, invlength, invnodevolume, invlength_invnodevolume, mean_scalar")
+                      "Options are: count (default), meanlength, invlength, invnodevolume, invlength_invnodevolume, mean_scalar. "
+                      "This option can be used multiple times to compute several metrics from a single pass through the track file; "
+                      "in this case, one matrix is written per metric, with the metric name appended to the output file name")
+    .allow_multiple()
     + Argument ("choice").type_choice (metrics)
 
   + Option ("image", "provide the associated image for the mean_scalar metric")
@@ -111,12 +136,8 @@ const OptionGroup MetricOption = OptionGroup ("Structural connectome metric opti
 
 
 
-Metric_base* load_metric (Image::Buffer<node_t>& nodes_data)
+Metric_base* load_metric (Image::Buffer<node_t>& nodes_data, const int edge_metric)
 {
-  int edge_metric = 0; // default = count
-  Options opt = get_options ("metric");
-  if (opt.size())
-    edge_metric = opt[0][0];
   switch (edge_metric) {
 
     case 0: return new Connectomics::Metric_count (); break;
@@ -125,11 +146,12 @@ Metric_base* load_metric (Image::Buffer<node_t>& nodes_data)
     case 3: return new Connectomics::Metric_invnodevolume (nodes_data); break;
     case 4: return new Connectomics::Metric_invlength_invnodevolume (nodes_data); break;
 
-    case 5:
-      opt = get_options ("image");
+    case 5: {
+      Options opt = get_options ("image");
       if (!opt.size())
         throw Exception ("To use the \"mean_scalar\" metric, you must provide the associated scalar image using the -image option");
       return new Connectomics::Metric_meanscalar (opt[0][0]);
+      }
       break;
 
     default: throw Exception ("Undefined edge weight metric");
@@ -140,6 +162,25 @@ Metric_base* load_metric (Image::Buffer<node_t>& nodes_data)
 
 
 
+void load_metrics (Image::Buffer<node_t>& nodes_data, VecPtr<Metric_base>& loaded, std::vector<std::string>& names)
+{
+  Options opt = get_options ("metric");
+  std::vector<int> requested;
+  for (size_t i = 0; i != opt.size(); ++i) {
+    const int edge_metric = opt[i][0];
+    if (std::find (requested.begin(), requested.end(), edge_metric) == requested.end())
+      requested.push_back (edge_metric);
+  }
+  if (requested.empty())
+    requested.push_back (0); // default = count
+  for (std::vector<int>::const_iterator i = requested.begin(); i != requested.end(); ++i) {
+    loaded.push_back (load_metric (nodes_data, *i));
+    names.push_back (metrics[*i]);
+  }
+}
+
+
+
 
 
 }
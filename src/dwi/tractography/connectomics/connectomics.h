@@ -28,6 +28,7 @@
 
 #include "app.h"
 #include "args.h"
+#include "ptr.h"
 
 #include "image/buffer.h"
 
@@ -62,7 +63,7 @@ extern const App::OptionGroup AssignmentOption;
 Tck2nodes_base* load_assignment_mode (Image::Buffer<node_t>&);
 
 extern const App::OptionGroup MetricOption;
-Metric_base* load_metric (Image::Buffer<node_t>&);
+void load_metrics (Image::Buffer<node_t>&, VecPtr<Metric_base>&, std::vector<std::string>&);
 
 
 
@@ -27,7 +27,12 @@
 
 
 
-#include "math/matrix.h"
+#include <map>
+#include <mutex>
+#include <set>
+
+#include "ptr.h"
+#include "file/ofstream.h"
 
 #include "dwi/tractography/mapping/mapping.h"
 
@@ -38,8 +43,6 @@
 #include "dwi/tractography/connectomics/edge_metrics.h"
 #include "dwi/tractography/connectomics/tck2nodes.h"
 
-#include <set>
-
 
 
 namespace MR {
@@ -81,37 +84,41 @@ class Mapped_track
 
 
 
-class Mapper
+// Accumulated data for a single edge: the (weighted) number of streamlines
+//   assigned to it, and the sum of the per-streamline factors for every metric
+class Edge
 {
 
   public:
-    Mapper (Tck2nodes_base& a, const Metric_base& b) :
-      tck2nodes (a),
-      metric (b) { }
-
-    Mapper (const Mapper& that) :
-      tck2nodes (that.tck2nodes),
-      metric (that.metric) { }
-
+    Edge (const size_t num_metrics) :
+      count (0.0),
+      sums  (num_metrics, 0.0) { }
 
-    bool operator() (const Tractography::Streamline<float>& in, Mapped_track& out)
+    Edge& operator+= (const Edge& that)
     {
-      out.set_nodes (tck2nodes (in));
-      out.set_factor (metric (in, out.get_nodes()));
-      out.set_weight (in.weight);
-      return true;
+      assert (sums.size() == that.sums.size());
+      count += that.count;
+      for (size_t i = 0; i != sums.size(); ++i)
+        sums[i] += that.sums[i];
+      return *this;
     }
 
+    double get_count() const { return count; }
+    double get_sum (const size_t metric_index) const { return sums[metric_index]; }
+
+    void add (const double weight) { count += weight; }
+    void add (const size_t metric_index, const double value) { sums[metric_index] += value; }
 
   private:
-    Tck2nodes_base& tck2nodes;
-    const Metric_base& metric;
+    double count;
+    std::vector<double> sums;
 
 };
 
-
-
-
+// Edges are stored sparsely, ordered by (first node, second node); this avoids
+//   allocating (and reducing) dense matrices for high-resolution parcellations,
+//   and allows the dense output to be streamed in row-major order
+typedef std::map<NodePair, Edge> EdgeMap;
 
 
 
@@ -120,47 +127,64 @@ class Connectome
 {
 
   public:
-    Connectome (const node_t max_node_index) :
-      data   (max_node_index + 1, max_node_index + 1),
-      counts (max_node_index + 1, max_node_index + 1)
-    {
-      data = 0.0;
-      counts = 0.0;
-    }
+    Connectome (const node_t max_node_index, const VecPtr<Metric_base>& metrics) :
+      max_node_index (max_node_index),
+      first_node (0),
+      metrics (metrics) { }
 
 
-    bool operator() (const Mapped_track& in) {
-      assert (in.get_first_node()  < data.rows());
-      assert (in.get_second_node() < data.rows());
-      assert (in.get_first_node() <= in.get_second_node());
-      data   (in.get_first_node(), in.get_second_node()) += in.get_factor() * in.get_weight();
-      counts (in.get_first_node(), in.get_second_node()) += in.get_weight();
-      return true;
-    }
+    // Per-thread functor: assigns each streamline to a node pair, computes all
+    //   requested metrics, and accumulates these into a thread-local partial
+    //   connectome; partial connectomes are merged into the master on destruction
+    class Accumulator
+    {
+      public:
+        Accumulator (Connectome& master, Tck2nodes_base& tck2nodes) :
+          master    (master),
+          tck2nodes (tck2nodes),
+          mutex     (new std::mutex) { }
 
+        Accumulator (const Accumulator& that) :
+          master    (that.master),
+          tck2nodes (that.tck2nodes),
+          mutex     (that.mutex) { }
 
-    void scale_by_streamline_count() {
-      for (node_t i = 0; i != counts.rows(); ++i) {
-        for (node_t j = i; j != counts.columns(); ++j) {
-          if (counts (i, j)) {
-            data (i, j) /= counts (i, j);
-            counts (i, j) = 1;
-          }
+        ~Accumulator()
+        {
+          std::lock_guard<std::mutex> lock (*mutex);
+          master.merge (edges);
         }
-      }
-    }
-
 
-    void error_check (const std::set<node_t>& missing_nodes) {
-      std::vector<uint32_t> node_counts (num_nodes(), 0);
-      for (node_t i = 0; i != counts.rows() - 1; ++i) {
-        for (node_t j = i; j != counts.columns() - 1; ++j) {
-          node_counts[i] += counts (i, j);
-          node_counts[j] += counts (i, j);
+        bool operator() (const Tractography::Streamline<float>& in)
+        {
+          const NodePair nodes = tck2nodes (in);
+          assert (nodes.first  <= master.max_node_index);
+          assert (nodes.second <= master.max_node_index);
+          assert (nodes.first <= nodes.second);
+          Edge& edge = edges.insert (std::make_pair (nodes, Edge (master.metrics.size()))).first->second;
+          edge.add (in.weight);
+          for (size_t i = 0; i != master.metrics.size(); ++i)
+            edge.add (i, (*master.metrics[i]) (in, nodes) * in.weight);
+          return true;
         }
+
+      private:
+        Connectome& master;
+        Tck2nodes_base& tck2nodes;
+        RefPtr<std::mutex> mutex;
+        EdgeMap edges;
+    };
+
+
+    void error_check (const std::set<node_t>& missing_nodes) const
+    {
+      std::vector<double> node_counts (max_node_index + 1, 0.0);
+      for (EdgeMap::const_iterator e = edges.begin(); e != edges.end(); ++e) {
+        node_counts[e->first.first]  += e->second.get_count();
+        node_counts[e->first.second] += e->second.get_count();
       }
       std::vector<node_t> empty_nodes;
-      for (size_t i = 0; i != node_counts.size(); ++i) {
+      for (node_t i = 1; i != node_counts.size(); ++i) {
         if (!node_counts[i] && missing_nodes.find (i) == missing_nodes.end())
           empty_nodes.push_back (i);
       }
@@ -175,32 +199,70 @@ class Connectome
     }
 
 
-    void remove_unassigned() {
-      for (node_t i = 0; i != data.rows() - 1; ++i) {
-        for (node_t j = i; j != data.columns() - 1; ++j) {
-          data   (i, j) = data   (i+1, j+1);
-          counts (i, j) = counts (i+1, j+1);
-        }
-      }
-      data  .resize (data  .rows() - 1, data  .columns() - 1);
-      counts.resize (counts.rows() - 1, counts.columns() - 1);
+    void remove_unassigned()
+    {
+      EdgeMap::iterator e = edges.begin();
+      while (e != edges.end() && !e->first.first)
+        edges.erase (e++);
+      first_node = 1;
     }
 
 
-    void zero_diagonal() {
-      for (node_t i = 0; i != data.rows(); ++i)
-        data (i, i) = counts (i, i) = 0.0;
+    void zero_diagonal()
+    {
+      for (EdgeMap::iterator e = edges.begin(); e != edges.end();) {
+        if (e->first.first == e->first.second)
+          edges.erase (e++);
+        else
+          ++e;
+      }
     }
 
 
-    void write (const std::string& path) { data.save (path); }
+    // Write the dense (upper triangular) matrix for a particular metric;
+    //   edges are streamed from the sparse storage, so the full matrix is never allocated
+    void write (const std::string& path, const size_t metric_index) const
+    {
+      assert (metric_index < metrics.size());
+      const bool scale = metrics[metric_index]->scale_edges_by_streamline_count();
+      File::OFStream out (path);
+      EdgeMap::const_iterator e = edges.begin();
+      for (node_t i = first_node; i <= max_node_index; ++i) {
+        for (node_t j = first_node; j <= max_node_index; ++j) {
+          double value = 0.0;
+          if (e != edges.end() && e->first.first == i && e->first.second == j) {
+            value = e->second.get_sum (metric_index);
+            if (scale && e->second.get_count())
+              value /= e->second.get_count();
+            ++e;
+          }
+          out << str(value, 10) << " ";
+        }
+        out << "\n";
+      }
+    }
 
 
-    node_t num_nodes() const { return (data.rows() - 1); }
+    node_t num_nodes() const { return max_node_index; }
+    size_t num_metrics() const { return metrics.size(); }
 
 
   private:
-    Math::Matrix<double> data, counts;
+    const node_t max_node_index;
+    node_t first_node;
+    const VecPtr<Metric_base>& metrics;
+    EdgeMap edges;
+
+    void merge (const EdgeMap& partial)
+    {
+      for (EdgeMap::const_iterator e = partial.begin(); e != partial.end(); ++e) {
+        EdgeMap::iterator existing = edges.find (e->first);
+        if (existing == edges.end())
+          edges.insert (*e);
+        else
+          existing->second += e->second;
+      }
+    }
 
 };
 
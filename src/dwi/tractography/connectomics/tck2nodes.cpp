@@ -23,6 +23,11 @@
 
 #include "dwi/tractography/connectomics/tck2nodes.h"
 
+#include "file/path.h"
+#include "image/header.h"
+#include "image/loop.h"
+#include "image/threaded_loop.h"
+
 
 namespace MR {
 namespace DWI {
@@ -107,6 +112,161 @@ node_t Tck2nodes_radial::select_node (const Streamline<>& tck, VoxelType& voxel,
 
 
 
+class Tck2nodes_radial_lookup::Precompute
+{
+  public:
+    Precompute (Tck2nodes_radial_lookup& master, const std::vector<float>& offset_dists) :
+      master       (master),
+      voxel        (master.nodes),
+      offset_dists (offset_dists) { }
+
+    void operator() (const Image::Iterator& pos)
+    {
+      const Point<int> v (pos[0], pos[1], pos[2]);
+      Entry& entry (master.lookup[master.index (v)]);
+      // Offsets are sorted by distance, so the first voxel with a non-zero node index is the nearest
+      for (size_t i = 0; i != offset_dists.size(); ++i) {
+        const Point<int> this_voxel (v + master.radial_search[i]);
+        if (Image::Nav::within_bounds (voxel, this_voxel)) {
+          const node_t this_node = Image::Nav::get_value_at_pos (voxel, this_voxel);
+          if (this_node) {
+            entry.node = this_node;
+            entry.dist = offset_dists[i];
+            return;
+          }
+        }
+      }
+    }
+
+  private:
+    Tck2nodes_radial_lookup& master;
+    VoxelType voxel;
+    const std::vector<float>& offset_dists;
+};
+
+
+
+
+Tck2nodes_radial_lookup::Tck2nodes_radial_lookup (Image::Buffer<node_t>& nodes_data, const float radius, const std::string& cache_path) :
+  Tck2nodes_radial (nodes_data, radius),
+  lookup (Image::voxel_count (nodes, 0, 3))
+{
+  const std::string sum (checksum());
+  if (cache_path.size() && load (cache_path, sum)) {
+    INFO ("using precomputed radial search lookup from \"" + cache_path + "\"");
+    return;
+  }
+  precompute();
+  if (cache_path.size())
+    save (cache_path, sum);
+}
+
+
+
+// Identifies the parcellation image that a cached lookup was generated from
+std::string Tck2nodes_radial_lookup::checksum () const
+{
+  uint64_t hash = 14695981039346656037ULL;
+  VoxelType voxel (nodes);
+  for (auto l = Image::LoopInOrder (voxel, 0, 3) (voxel); l; ++l) {
+    hash ^= uint64_t (voxel.value());
+    hash *= 1099511628211ULL;
+  }
+  return str (hash);
+}
+
+
+
+void Tck2nodes_radial_lookup::precompute ()
+{
+  // Only those offsets within the maximum search distance are relevant between voxel centres
+  std::vector<float> offset_dists;
+  for (std::vector< Point<int> >::const_iterator offset = radial_search.begin(); offset != radial_search.end(); ++offset) {
+    const float dist = std::sqrt (Math::pow2 ((*offset)[2] * nodes.vox(2)) + Math::pow2 ((*offset)[1] * nodes.vox(1)) + Math::pow2 ((*offset)[0] * nodes.vox(0)));
+    if (dist > max_dist)
+      break;
+    offset_dists.push_back (dist);
+  }
+  Precompute functor (*this, offset_dists);
+  Image::ThreadedLoop ("precomputing radial search lookup... ", nodes, 0, 3).run (functor);
+}
+
+
+
+bool Tck2nodes_radial_lookup::load (const std::string& path, const std::string& sum)
+{
+  if (!Path::exists (path))
+    return false;
+  Image::Header H (path);
+  if (H.ndim() != 4 || H.dim(3) != 2 || H["parcellation_checksum"] != sum || H["radial_search_radius"].empty()) {
+    WARN ("radial search lookup \"" + path + "\" does not match parcellation image; regenerating");
+    return false;
+  }
+  for (size_t axis = 0; axis != 3; ++axis) {
+    if (H.dim(axis) != nodes.dim(axis)) {
+      WARN ("radial search lookup \"" + path + "\" does not match parcellation image dimensions; regenerating");
+      return false;
+    }
+  }
+  if (to<float> (H["radial_search_radius"]) < max_dist) {
+    WARN ("radial search lookup \"" + path + "\" was generated with a smaller search radius; regenerating");
+    return false;
+  }
+  Image::Buffer<float> buffer (H);
+  auto in = buffer.voxel();
+  for (auto l = Image::LoopInOrder (in, 0, 3) (in); l; ++l) {
+    Entry& entry (lookup[index (Point<int> (in[0], in[1], in[2]))]);
+    in[3] = 1;
+    entry.dist = in.value();
+    in[3] = 0;
+    // The cached lookup may extend further than the current search radius
+    entry.node = (entry.dist <= max_dist) ? node_t (in.value()) : 0;
+  }
+  return true;
+}
+
+
+
+void Tck2nodes_radial_lookup::save (const std::string& path, const std::string& sum) const
+{
+  Image::Header H (nodes);
+  H.set_ndim (4);
+  H.dim(3) = 2;
+  H.vox(3) = NAN;
+  H.datatype() = DataType::Float32;
+  H.datatype().set_byte_order_native();
+  H["parcellation_checksum"] = sum;
+  H["radial_search_radius"] = str (max_dist);
+  H.comments().push_back ("radial search lookup: node index (volume 0) & distance in mm (volume 1)");
+  Image::Buffer<float> buffer (path, H);
+  auto out = buffer.voxel();
+  for (auto l = Image::LoopInOrder (out, 0, 3) (out); l; ++l) {
+    const Entry& entry (lookup[index (Point<int> (out[0], out[1], out[2]))]);
+    out[3] = 0;
+    out.value() = entry.node;
+    out[3] = 1;
+    out.value() = entry.dist;
+  }
+}
+
+
+
+node_t Tck2nodes_radial_lookup::select_node (const Streamline<>& tck, VoxelType& voxel, bool end) const
+{
+
+  const Point<float>& p (end ? tck.back() : tck.front());
+  const Point<float> v_float = transform.scanner2voxel (p);
+  const Point<int> v (std::round (v_float[0]), std::round (v_float[1]), std::round (v_float[2]));
+  if (!Image::Nav::within_bounds (voxel, v))
+    return 0;
+  return lookup[index (v)].node;
+
+}
+
+
+
+
+
 node_t Tck2nodes_revsearch::select_node (const Streamline<>& tck, VoxelType& voxel, bool end) const
 {
 
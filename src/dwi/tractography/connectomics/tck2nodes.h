@@ -137,7 +137,7 @@ class Tck2nodes_radial : public Tck2nodes_base {
 
     ~Tck2nodes_radial() { }
 
-  private:
+  protected:
     node_t select_node (const Streamline<>& tck, VoxelType& voxel, bool end) const;
 
     void initialise_search ();
@@ -154,6 +154,47 @@ class Tck2nodes_radial : public Tck2nodes_base {
 
 
 
+// Radial search, precomputed for every voxel in the parcellation image
+// The nearest voxel with a non-zero node index (voxel centre to voxel centre) within the maximum search
+//   distance is found once for each voxel; assignment of a streamline endpoint then reduces to a single
+//   lookup at the voxel containing that endpoint. The resulting lookup table (node index & distance per
+//   voxel) can be cached on disk, and is re-used if it matches the parcellation image & search radius.
+class Tck2nodes_radial_lookup : public Tck2nodes_radial {
+
+  public:
+    Tck2nodes_radial_lookup (Image::Buffer<node_t>& nodes_data, const float radius, const std::string& cache_path = "");
+
+    Tck2nodes_radial_lookup (const Tck2nodes_radial_lookup& that) :
+      Tck2nodes_radial (that),
+      lookup           (that.lookup) { }
+
+    ~Tck2nodes_radial_lookup() { }
+
+  private:
+    class Entry {
+      public:
+        Entry () : node (0), dist (INFINITY) { }
+        node_t node;
+        float dist;
+    };
+
+    std::vector<Entry> lookup;
+
+    size_t index (const Point<int>& v) const { return v[0] + nodes.dim(0) * (v[1] + nodes.dim(1) * size_t(v[2])); }
+
+    node_t select_node (const Streamline<>& tck, VoxelType& voxel, bool end) const;
+
+    std::string checksum () const;
+    void precompute ();
+    bool load (const std::string& path, const std::string& sum);
+    void save (const std::string& path, const std::string& sum) const;
+
+    class Precompute;
+
+};
+
+
+
 // Do a reverse-search from the track endpoints inwards
 class Tck2nodes_revsearch : public Tck2nodes_base
 {
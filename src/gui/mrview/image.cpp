@@ -21,6 +21,7 @@
 */
 
 #include "progressbar.h"
+#include "file/config.h"
 #include "image/stride.h"
 #include "gui/mrview/image.h"
 #include "gui/mrview/window.h"
@@ -35,11 +36,38 @@ namespace MR
     namespace MRView
     {
 
+      namespace {
+
+        //CONF option: MRViewVolumeCacheSize
+        //CONF default: 512
+        //CONF The maximum amount of memory (in MB) used by MRView to hold
+        //CONF volumes of each 4D image ready for display, including those
+        //CONF loaded ahead of time (see MRViewPrefetchVolumes).
+        size_t volume_cache_size ()
+        {
+          return size_t (std::max (File::Config::get_int ("MRViewVolumeCacheSize", 512), 0)) << 20;
+        }
+
+        //CONF option: MRViewPrefetchVolumes
+        //CONF default: 2
+        //CONF The number of volumes on either side of the current volume
+        //CONF that MRView loads in the background when displaying a 4D
+        //CONF image, so that stepping through the volumes does not stall
+        //CONF the display. Set to 0 to disable.
+        size_t prefetch_volumes ()
+        {
+          static const size_t num = std::max (File::Config::get_int ("MRViewPrefetchVolumes", 2), 0);
+          return num;
+        }
+
+      }
+
 
 
       Image::Image (const MR::Image::Header& image_header) :
         Volume (image_header),
         buffer (image_header),
+        volume_cache (volume_cache_size()),
         interp (buffer),        
         position (image_header.ndim())
       {
@@ -52,6 +80,7 @@ namespace MR
       Image::Image (Window& window, const MR::Image::Header& image_header) :
         Volume (window, image_header),
         buffer (image_header),
+        volume_cache (volume_cache_size()),
         interp (buffer),        
         position (image_header.ndim())
       {
@@ -332,151 +361,79 @@ namespace MR
         }
 
         allocate();
-        texture_mode_changed = false;
 
-        if (format != gl::RG) {
-          switch (header().datatype() ()) {
-            case DataType::Bit:
-            case DataType::UInt8:
-              copy_texture_3D<uint8_t> ();
-              break;
-            case DataType::Int8:
-              copy_texture_3D<int8_t> ();
-              break;
-            case DataType::UInt16LE:
-            case DataType::UInt16BE:
-              copy_texture_3D<uint16_t> ();
-              break;
-            case DataType::Int16LE:
-            case DataType::Int16BE:
-              copy_texture_3D<int16_t> ();
-              break;
-            case DataType::UInt32LE:
-            case DataType::UInt32BE:
-              copy_texture_3D<uint32_t> ();
-              break;
-            case DataType::Int32LE:
-            case DataType::Int32BE:
-              copy_texture_3D<int32_t> ();
-              break;
-            default:
-              copy_texture_3D<float> ();
-              break;
+        if (texture_mode_changed) {
+          if (format != gl::RG) {
+            switch (header().datatype() ()) {
+              case DataType::Bit:
+              case DataType::UInt8:
+                set_volume_converter<uint8_t> ();
+                break;
+              case DataType::Int8:
+                set_volume_converter<int8_t> ();
+                break;
+              case DataType::UInt16LE:
+              case DataType::UInt16BE:
+                set_volume_converter<uint16_t> ();
+                break;
+              case DataType::Int16LE:
+              case DataType::Int16BE:
+                set_volume_converter<int16_t> ();
+                break;
+              case DataType::UInt32LE:
+              case DataType::UInt32BE:
+                set_volume_converter<uint32_t> ();
+                break;
+              case DataType::Int32LE:
+              case DataType::Int32BE:
+                set_volume_converter<int32_t> ();
+                break;
+              default:
+                set_volume_converter<float> ();
+                break;
+            }
           }
+          else 
+            set_volume_converter_complex();
+          texture_mode_changed = false;
         }
-        else 
-          copy_texture_3D_complex();
 
-        set_min_max (value_min, value_max);
-      }
+        // the volumes are identified by their position along axes 3 and above:
+        VolumeCache::Position volume (position);
+        volume[0] = volume[1] = volume[2] = 0;
+        std::shared_ptr<const VolumeSlab> slab = volume_cache.get (volume);
+        upload_data ({ { 0, 0, 0 } }, { { header().dim(0), header().dim(1), header().dim(2) } }, reinterpret_cast<const void*> (&slab->data[0]));
+
+        // convert the neighbouring volumes ahead of time:
+        if (header().ndim() > 3)
+          volume_cache.prefetch (volume, 3, header().dim(3), prefetch_volumes());
 
-      // required to shut up clang's compiler warnings about std::abs() when
-      // instantiating Image::copy_texture_3D() with unsigned types:
-      template <typename ValueType> 
-        inline ValueType abs_if_signed (ValueType x, typename std::enable_if<!std::is_unsigned<ValueType>::value>::type* = nullptr) { return std::abs(x); }
+        set_min_max (slab->value_min, slab->value_max);
+      }
 
-      template <typename ValueType> 
-        inline ValueType abs_if_signed (ValueType x, typename std::enable_if<std::is_unsigned<ValueType>::value>::type* = nullptr) { return x; }
 
 
+      // The typed buffers are created here in the GUI thread, and only
+      // released when the converter is replaced, also from the GUI thread.
+      // The conversion itself may run in the background.
       template <typename ValueType>
-        inline void Image::copy_texture_3D ()
+        inline void Image::set_volume_converter ()
         {
-          MR::Image::Buffer<ValueType> buffer_tmp (buffer);
-          auto V = buffer_tmp.voxel();
-          int N = ( format == gl::RED ? 1 : 3 );
-          std::vector<ValueType> data (N * V.dim(0) * V.dim(1));
-
-          ProgressBar progress ("loading image data...", V.dim(2));
-
-          for (size_t n = 3; n < V.ndim(); ++n) 
-            V[n] = position[n];
-
-        for (V[2] = 0; V[2] < V.dim(2); ++V[2]) {
-
-          if (format == gl::RED) {
-            auto p = data.begin();
-
-            for (V[1] = 0; V[1] < V.dim(1); ++V[1]) {
-              for (V[0] = 0; V[0] < V.dim(0); ++V[0]) {
-                ValueType val = *p = V.value();
-                if (std::isfinite (val)) {
-                  if (val < value_min) value_min = val;
-                  if (val > value_max) value_max = val;
-                }
-                ++p;
-              }
-            }
-
-          }
-          else {
-
-            for (auto& d : data) d = 0.0f;
-
-            for (size_t n = 0; n < 3; ++n) {
-              if (V.ndim() > 3) {
-                if (V.dim(3) > int(position[3] + n))
-                  V[3] = position[3] + n;
-                else break;
-              }
-
-              auto p = data.begin() + n;
-              for (V[1] = 0; V[1] < V.dim (1); ++V[1]) {
-                for (V[0] = 0; V[0] < V.dim (0); ++V[0]) {
-                  ValueType val = *p = abs_if_signed (ValueType (V.value()));
-                  if (std::isfinite (val)) {
-                    if (val < value_min) value_min = val;
-                    if (val > value_max) value_max = val;
-                  }
-                  p += 3;
-                }
-              }
-
-              if (V.ndim() <= 3) 
-                break;
-            }
-            if (V.ndim() > 3) 
-              V[3] = position[3];
-
-          }
-
-          upload_data ({ { 0, 0, V[2] } }, { { V.dim(0), V.dim(1), 1 } }, reinterpret_cast<void*> (&data[0]));
-          ++progress;
+          std::shared_ptr<MR::Image::Buffer<ValueType>> buffer_tmp (new MR::Image::Buffer<ValueType> (buffer));
+          const size_t channels = ( format == gl::RED ? 1 : 3 );
+          volume_cache.set_converter ([buffer_tmp, channels] (const VolumeCache::Position& position, VolumeSlab& slab, bool show_progress) {
+              convert_volume<ValueType> (*buffer_tmp, position, channels, slab, show_progress);
+              });
         }
 
-      }
 
 
-
-      inline void Image::copy_texture_3D_complex ()
+      inline void Image::set_volume_converter_complex ()
       {
-        auto V = buffer.voxel();
-        std::vector<float> data (2 * V.dim (0) * V.dim (1));
-
-        ProgressBar progress ("loading image data...", V.dim (2));
-
-        for (size_t n = 3; n < V.ndim(); ++n) 
-          V[n] = position[n];
-
-        for (V[2] = 0; V[2] < V.dim (2); ++V[2]) {
-          auto p = data.begin();
-
-          for (V[1] = 0; V[1] < V.dim (1); ++V[1]) {
-            for (V[0] = 0; V[0] < V.dim (0); ++V[0]) {
-              cfloat val = V.value();
-              *(p++) = val.real();
-              *(p++) = val.imag();
-              float mag = std::abs (val);
-              if (std::isfinite (mag)) {
-                if (mag < value_min) value_min = mag;
-                if (mag > value_max) value_max = mag;
-              }
-            }
-          }
-
-          upload_data ({ { 0, 0, V[2] } }, { { V.dim(0), V.dim(1), 1 } }, reinterpret_cast<void*> (&data[0]));
-          ++progress;
-        }
+        BufferType* source = &buffer;
+        volume_cache.set_converter ([source] (const VolumeCache::Position& position, VolumeSlab& slab, bool show_progress) {
+            convert_volume_complex (*source, position, slab, show_progress);
+            });
       }
 
 
@@ -25,6 +25,7 @@
 
 #include "gui/opengl/gl.h"
 #include "gui/mrview/volume.h"
+#include "gui/mrview/volume_cache.h"
 #include "image/buffer.h"
 #include "image/voxel.h"
 #include "math/versor.h"
@@ -85,6 +86,7 @@ namespace MR
 
         private:
           BufferType buffer;
+          VolumeCache volume_cache;
 
         public:
           InterpVoxelType interp;
@@ -97,8 +99,8 @@ namespace MR
           bool volume_unchanged ();
           size_t guess_colourmap () const;
 
-          template <typename T> void copy_texture_3D ();
-          void copy_texture_3D_complex ();
+          template <typename T> void set_volume_converter ();
+          void set_volume_converter_complex ();
 
       };
 
@@ -0,0 +1,168 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+
+#include "gui/mrview/tool/tractography/track_bricks.h"
+
+namespace MR
+{
+  namespace GUI
+  {
+    namespace MRView
+    {
+      namespace Tool
+      {
+
+
+        bool TrackBricks::Brick::intersects_slab (const Point<float>& normal, float centre, float thickness) const
+        {
+          float distance = -centre, radius = 0.5f * thickness;
+          for (size_t n = 0; n < 3; ++n) {
+            distance += 0.5f * (lower[n] + upper[n]) * normal[n];
+            radius += 0.5f * (upper[n] - lower[n]) * std::abs (normal[n]);
+          }
+          return std::abs (distance) <= radius;
+        }
+
+
+
+
+        void TrackBricks::add (const std::vector<Point<float> >& tck)
+        {
+          const uint32_t track = num_tracks();
+          track_offsets.push_back (track_offsets.back() + tck.size());
+          if (tck.size() < 2)
+            return;
+
+          for (size_t i = 1; i < tck.size(); ++i)
+            total_length += dist (tck[i-1], tck[i]);
+          num_steps += tck.size() - 1;
+
+          // a new segment starts whenever the streamline enters another brick;
+          // the previous segment ends on the first vertex in the new brick:
+          uint32_t first = 0;
+          Key current = key (tck[0]);
+          for (uint32_t i = 1; i < tck.size(); ++i) {
+            const Key next = key (tck[i]);
+            if (next != current) {
+              add_segment (brick_for (current), track, first, i, tck);
+              first = i;
+              current = next;
+            }
+          }
+          if (first < tck.size() - 1)
+            add_segment (brick_for (current), track, first, tck.size() - 1, tck);
+        }
+
+
+
+
+        void TrackBricks::finalise ()
+        {
+          for (std::vector<Brick>::iterator brick = bricks.begin(); brick != bricks.end(); ++brick) {
+            size_t total = 1;
+            for (size_t level = 0; level < num_levels; ++level)
+              total += brick->level_vertices[level].size();
+            brick->vertices.reserve (total);
+            for (size_t level = 0; level < num_levels; ++level) {
+              const int32_t offset = brick->vertices.size();
+              std::vector<int32_t>& starts (brick->levels[level].starts);
+              for (size_t n = 0; n < starts.size(); ++n)
+                starts[n] += offset;
+              brick->vertices.insert (brick->vertices.end(), brick->level_vertices[level].begin(), brick->level_vertices[level].end());
+            }
+            brick->vertices.push_back (Point<float>());
+            std::vector<std::vector<Point<float> > >().swap (brick->level_vertices);
+          }
+          brick_index.clear();
+        }
+
+
+
+
+        size_t TrackBricks::level_for_spacing (float distance) const
+        {
+          const float step = mean_step_size();
+          size_t level = 0;
+          if (step > 0.0f)
+            while (level+1 < num_levels && step * float (uint32_t (2) << level) <= distance)
+              ++level;
+          return level;
+        }
+
+
+
+
+        size_t TrackBricks::brick_for (const Key& k)
+        {
+          if (bricks.size() && !(k != last_key))
+            return last_brick;
+          std::map<Key,size_t>::const_iterator existing = brick_index.find (k);
+          if (existing != brick_index.end()) {
+            last_brick = existing->second;
+          }
+          else {
+            last_brick = bricks.size();
+            brick_index.insert (std::make_pair (k, last_brick));
+            bricks.push_back (Brick());
+            bricks.back().levels.resize (num_levels);
+            bricks.back().level_vertices.resize (num_levels);
+          }
+          last_key = k;
+          return last_brick;
+        }
+
+
+
+
+        void TrackBricks::add_segment (size_t index, uint32_t track, uint32_t first, uint32_t last, const std::vector<Point<float> >& tck)
+        {
+          Brick& brick (bricks[index]);
+          Segment segment;
+          segment.track = track;
+          segment.first = first;
+          segment.last = last;
+          brick.segments.push_back (segment);
+
+          for (uint32_t i = first; i <= last; ++i) {
+            for (size_t n = 0; n < 3; ++n) {
+              brick.lower[n] = std::min (brick.lower[n], tck[i][n]);
+              brick.upper[n] = std::max (brick.upper[n], tck[i][n]);
+            }
+          }
+
+          for (size_t level = 0; level < num_levels; ++level) {
+            std::vector<Point<float> >& vertices (brick.level_vertices[level]);
+            Level& lod (brick.levels[level]);
+            lod.starts.push_back (vertices.size());
+            vertices.push_back (Point<float>());
+            const size_t start = vertices.size();
+            decimate (first, last, level, [&] (uint32_t vertex) { vertices.push_back (tck[vertex]); });
+            lod.sizes.push_back (vertices.size() - start);
+          }
+        }
+
+
+      }
+    }
+  }
+}
+
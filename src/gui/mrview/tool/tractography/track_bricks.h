@@ -0,0 +1,189 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __gui_mrview_tool_track_bricks_h__
+#define __gui_mrview_tool_track_bricks_h__
+
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "point.h"
+
+
+namespace MR
+{
+  namespace GUI
+  {
+    namespace MRView
+    {
+      namespace Tool
+      {
+
+
+        //! a spatial index of the streamlines of a tractogram, with multiple levels of detail
+        /*! Space is divided into cubic bricks, and each streamline is split
+         * into segments, one for each brick it passes through, so that the
+         * bricks that do not intersect the region being displayed can be
+         * skipped. Each segment also includes the first vertex of the
+         * following segment, so that streamlines are drawn without gaps
+         * across brick boundaries.
+         *
+         * The segments of each brick are stored at several levels of detail:
+         * level \e n retains only those vertices whose index along the
+         * streamline is a multiple of 2^\e n, along with the first and last
+         * vertex of each segment. The vertices of all levels are stored
+         * consecutively in the layout used by Tractogram: each segment is
+         * preceded by an invalid (NaN) point, and the data are terminated by
+         * a further invalid point. Per-vertex attributes (colours, scalars)
+         * can be laid out to match using fill().
+         *
+         * This class performs no OpenGL calls. */
+        class TrackBricks
+        {
+          public:
+            //! the range of vertices [first, last] of streamline \a track within a brick
+            class Segment {
+              public:
+                uint32_t track, first, last;
+            };
+
+            //! the segments of one level of detail, as passed to glMultiDrawArrays()
+            class Level {
+              public:
+                std::vector<int32_t> starts, sizes;
+            };
+
+            class Brick {
+              public:
+                Brick () : lower (INFINITY, INFINITY, INFINITY), upper (-INFINITY, -INFINITY, -INFINITY) { }
+
+                //! the bounding box of all vertices in the brick
+                Point<float> lower, upper;
+                std::vector<Segment> segments;
+                std::vector<Level> levels;
+                //! the vertices of all levels, released by release_vertices()
+                std::vector<Point<float> > vertices;
+
+                bool intersects_slab (const Point<float>& normal, float centre, float thickness) const;
+
+              private:
+                std::vector<std::vector<Point<float> > > level_vertices;
+                friend class TrackBricks;
+            };
+
+
+            TrackBricks (float brick_size, size_t num_levels) :
+              brick_size (brick_size),
+              num_levels (num_levels),
+              track_offsets (1, 0),
+              total_length (0.0),
+              num_steps (0),
+              last_key (INT32_MIN, INT32_MIN, INT32_MIN),
+              last_brick (0) { }
+
+            //! add the next streamline
+            void add (const std::vector<Point<float> >& tck);
+            //! lay out the vertices of each brick, once all streamlines have been added
+            void finalise ();
+
+            size_t num_bricks () const { return bricks.size(); }
+            size_t num_levels_of_detail () const { return num_levels; }
+            size_t num_tracks () const { return track_offsets.size() - 1; }
+            //! the number of vertices in streamline \a track
+            size_t num_vertices (size_t track) const { return track_offsets[track+1] - track_offsets[track]; }
+            //! the index of the first vertex of streamline \a track, over all streamlines
+            size_t track_offset (size_t track) const { return track_offsets[track]; }
+            //! the mean distance between consecutive vertices
+            float mean_step_size () const { return num_steps ? total_length / num_steps : 0.0f; }
+
+            const Brick& operator[] (size_t index) const { return bricks[index]; }
+
+            //! discard the vertices of brick \a index, once they are no longer needed
+            void release_vertices (size_t index) {
+              std::vector<Point<float> >().swap (bricks[index].vertices);
+            }
+
+            //! the level of detail with vertices no further apart than \a distance
+            size_t level_for_spacing (float distance) const;
+
+            //! lay out a per-vertex attribute for brick \a index to match its vertices
+            /*! \a functor (track, vertex) must return the value for the vertex
+             * at index \a vertex along streamline \a track. */
+            template <typename ValueType, class Functor>
+              void fill (size_t index, std::vector<ValueType>& data, const ValueType& separator, Functor&& functor) const {
+                const Brick& brick (bricks[index]);
+                data.clear();
+                for (size_t level = 0; level < num_levels; ++level) {
+                  for (std::vector<Segment>::const_iterator s = brick.segments.begin(); s != brick.segments.end(); ++s) {
+                    data.push_back (separator);
+                    decimate (s->first, s->last, level, [&] (uint32_t vertex) { data.push_back (functor (s->track, vertex)); });
+                  }
+                }
+                data.push_back (separator);
+              }
+
+          protected:
+            class Key {
+              public:
+                Key (int32_t x, int32_t y, int32_t z) { v[0] = x; v[1] = y; v[2] = z; }
+                bool operator< (const Key& other) const {
+                  return v[0] < other.v[0] || (v[0] == other.v[0] && (v[1] < other.v[1] || (v[1] == other.v[1] && v[2] < other.v[2])));
+                }
+                bool operator!= (const Key& other) const { return v[0] != other.v[0] || v[1] != other.v[1] || v[2] != other.v[2]; }
+                int32_t v[3];
+            };
+
+            const float brick_size;
+            const size_t num_levels;
+            std::vector<Brick> bricks;
+            std::map<Key,size_t> brick_index;
+            std::vector<size_t> track_offsets;
+            double total_length;
+            size_t num_steps;
+            Key last_key;
+            size_t last_brick;
+
+            Key key (const Point<float>& p) const {
+              return Key (std::floor (p[0] / brick_size), std::floor (p[1] / brick_size), std::floor (p[2] / brick_size));
+            }
+            size_t brick_for (const Key& k);
+            void add_segment (size_t brick, uint32_t track, uint32_t first, uint32_t last, const std::vector<Point<float> >& tck);
+
+            // invoke functor (vertex) for each vertex of [first, last] retained at level:
+            template <class Functor>
+              static void decimate (uint32_t first, uint32_t last, size_t level, Functor&& functor) {
+                const uint32_t step = uint32_t (1) << level;
+                functor (first);
+                for (uint32_t vertex = (first / step + 1) * step; vertex < last; vertex += step)
+                  functor (vertex);
+                functor (last);
+              }
+        };
+
+
+      }
+    }
+  }
+}
+
+#endif
+
@@ -21,6 +21,7 @@
 */
 
 #include "progressbar.h"
+#include "file/config.h"
 #include "image/stride.h"
 #include "gui/mrview/tool/tractography/tractogram.h"
 #include "gui/mrview/window.h"
@@ -31,7 +32,8 @@
 
 
 
-const size_t MAX_BUFFER_SIZE = 2796200;  // number of points to fill 32MB
+const float TRACK_BRICK_SIZE = 10.0;  // in mm
+const size_t TRACK_LEVELS_OF_DETAIL = 6;
 
 namespace MR
 {
@@ -42,6 +44,34 @@ namespace MR
       namespace Tool
       {
 
+        namespace {
+
+          //CONF option: MRViewTrackDetail
+          //CONF default: 1.0
+          //CONF The maximum distance on screen (in pixels) between the
+          //CONF vertices of streamlines displayed in MRView. Streamlines are
+          //CONF displayed with fewer vertices when zoomed out, down to a
+          //CONF 32nd of the vertices in the file. Set to 0 to always
+          //CONF display all vertices.
+          float track_detail ()
+          {
+            static const float detail = std::max (File::Config::get_float ("MRViewTrackDetail", 1.0), 0.0f);
+            return detail;
+          }
+
+          void delete_buffers (std::vector<GLuint>& buffers)
+          {
+            for (std::vector<GLuint>::iterator i = buffers.begin(); i != buffers.end(); ++i) {
+              if (*i) {
+                gl::DeleteBuffers (1, &*i);
+                *i = 0;
+              }
+            }
+          }
+
+        }
+
+
         std::string Tractogram::Shader::vertex_shader_source (const Displayable& tractogram)
         {
           bool colour_by_direction = ( color_type == Direction || 
@@ -238,6 +268,8 @@ namespace MR
             window (window),
             tractography_tool (tool),
             filename (filename),
+            bricks (TRACK_BRICK_SIZE, TRACK_LEVELS_OF_DETAIL),
+            scalars_per_vertex (false),
             colourbar_position_index (4)
         {
           set_allowed_features (true, true, true);
@@ -250,14 +282,12 @@ namespace MR
 
         Tractogram::~Tractogram ()
         {
-          if (vertex_buffers.size())
-            gl::DeleteBuffers (vertex_buffers.size(), &vertex_buffers[0]);
-          if (vertex_array_objects.size())
-            gl::DeleteVertexArrays (vertex_array_objects.size(), &vertex_array_objects[0]);
-          if (colour_buffers.size())
-            gl::DeleteBuffers (colour_buffers.size(), &colour_buffers[0]);
-          if (scalar_buffers.size())
-            gl::DeleteBuffers (scalar_buffers.size(), &scalar_buffers[0]);
+          delete_buffers (vertex_buffers);
+          delete_buffers (colour_buffers);
+          delete_buffers (scalar_buffers);
+          for (std::vector<GLuint>::iterator i = vertex_array_objects.begin(); i != vertex_array_objects.end(); ++i)
+            if (*i)
+              gl::DeleteVertexArrays (1, &*i);
         }
 
 
@@ -314,9 +344,31 @@ namespace MR
 
           gl::LineWidth (tractography_tool.line_thickness);
 
-          for (size_t buf = 0; buf < vertex_buffers.size(); ++buf) {
-            gl::BindVertexArray (vertex_array_objects[buf]);
-            gl::MultiDrawArrays (gl::LINE_STRIP, &track_starts[buf][0], &track_sizes[buf][0], num_tracks_per_buffer[buf]);
+          // display fewer vertices per streamline when zoomed out:
+          size_t level = 0;
+          if (track_detail() > 0.0) {
+            const float pixel_size = transform.screen_to_model_direction (1.0, 0.0, transform.depth_of (window.focus())).norm();
+            level = bricks.level_for_spacing (track_detail() * pixel_size);
+          }
+
+          // only bricks that intersect the slab are uploaded and drawn:
+          const bool crop = tractography_tool.crop_to_slab();
+          const Point<float> normal (transform.screen_normal());
+          const float centre = window.focus().dot (normal);
+
+          for (size_t n = 0; n < bricks.num_bricks(); ++n) {
+            const TrackBricks::Brick& brick (bricks[n]);
+            if (crop && !brick.intersects_slab (normal, centre, tractography_tool.slab_thickness))
+              continue;
+            if (!vertex_array_objects[n])
+              upload_vertices (n);
+            if (color_type == Ends && !colour_buffers[n])
+              upload_end_colours (n);
+            else if (color_type == ScalarFile && !scalar_buffers[n])
+              upload_scalars (n);
+            const TrackBricks::Level& lod (brick.levels[level]);
+            gl::BindVertexArray (vertex_array_objects[n]);
+            gl::MultiDrawArrays (gl::LINE_STRIP, &lod.starts[0], &lod.sizes[0], lod.starts.size());
           }
 
           if (tractography_tool.line_opacity < 1.0) {
@@ -339,49 +391,33 @@ namespace MR
         {
           DWI::Tractography::Reader<float> file (filename, properties);
           DWI::Tractography::Streamline<float> tck;
-          std::vector<Point<float> > buffer;
-          std::vector<GLint> starts;
-          std::vector<GLint> sizes;
-          size_t tck_count = 0;
 
           while (file (tck)) {
-            starts.push_back (buffer.size());
-            buffer.push_back (Point<float>());
-            buffer.insert (buffer.end(), tck.begin(), tck.end());
-            sizes.push_back (tck.size());
-            tck_count++;
-            if (buffer.size() >= MAX_BUFFER_SIZE)
-              load_tracks_onto_GPU (buffer, starts, sizes, tck_count);
+            bricks.add (tck);
+            if (tck.size()) {
+              const Point<float> tangent ((tck.back() - tck.front()).normalise());
+              end_colours.push_back (Point<float> (std::abs (tangent[0]), std::abs (tangent[1]), std::abs (tangent[2])));
+            }
+            else
+              end_colours.push_back (Point<float>());
           }
-          if (buffer.size())
-            load_tracks_onto_GPU (buffer, starts, sizes, tck_count);
           file.close();
+          bricks.finalise();
+
+          vertex_buffers.assign (bricks.num_bricks(), 0);
+          vertex_array_objects.assign (bricks.num_bricks(), 0);
+          colour_buffers.assign (bricks.num_bricks(), 0);
+          scalar_buffers.assign (bricks.num_bricks(), 0);
         }
-        
-        
-        
-        
+
+
+
+
         void Tractogram::load_end_colours()
         {
+          // the colours are computed from the endpoints stored by
+          // load_tracks(), and uploaded along with each brick in render():
           erase_nontrack_data();
-          // TODO Is it possible to read the track endpoints from the GPU buffer rather than re-reading the .tck file?
-          DWI::Tractography::Reader<float> file (filename, properties);
-          for (size_t buffer_index = 0; buffer_index != vertex_buffers.size(); ++buffer_index) {
-            size_t num_tracks = num_tracks_per_buffer[buffer_index];
-            std::vector< Point<float> > buffer;
-            DWI::Tractography::Streamline<float> tck;
-            while (num_tracks--) {
-              file (tck);
-              const Point<float> tangent ((tck.back() - tck.front()).normalise());
-              const Point<float> colour (std::abs (tangent[0]), std::abs (tangent[1]), std::abs (tangent[2]));
-              buffer.push_back (Point<float>());
-              for (std::vector< Point<float> >::iterator i = tck.begin(); i != tck.end(); ++i)
-                *i = colour;
-              buffer.insert (buffer.end(), tck.begin(), tck.end());
-            }
-            load_end_colours_onto_GPU (buffer);
-          }
-          file.close();
         }
 
 
@@ -394,48 +430,38 @@ namespace MR
           scalar_filename = filename;
           value_min = std::numeric_limits<float>::infinity();
           value_max = -std::numeric_limits<float>::infinity();
-          std::vector<float> buffer;
-          std::vector<float> tck_scalar;
+          std::vector<float> scalars;
 
           if (Path::has_suffix (filename, ".tsf")) {
             DWI::Tractography::Properties scalar_properties;
             DWI::Tractography::ScalarReader<float> file (filename, scalar_properties);
             DWI::Tractography::check_properties_match (properties, scalar_properties, ".tck / .tsf");
-            while (file (tck_scalar)) {
-              buffer.push_back (NAN);
-              for (size_t i = 0; i < tck_scalar.size(); ++i) {
-                buffer.push_back (tck_scalar[i]);
-                if (tck_scalar[i] > value_max) value_max = tck_scalar[i];
-                if (tck_scalar[i] < value_min) value_min = tck_scalar[i];
-              }
-              if (buffer.size() >= MAX_BUFFER_SIZE)
-                load_scalars_onto_GPU (buffer);
+            std::vector<float> tck_scalar;
+            for (size_t track = 0; file (tck_scalar); ++track) {
+              if (track >= bricks.num_tracks() || tck_scalar.size() != bricks.num_vertices (track))
+                throw Exception ("The scalar file does not contain the same number of values as the selected tractogram");
+              scalars.insert (scalars.end(), tck_scalar.begin(), tck_scalar.end());
             }
-            if (buffer.size())
-              load_scalars_onto_GPU (buffer);
             file.close();
+            if (scalars.size() != bricks.track_offset (bricks.num_tracks()))
+              throw Exception ("The scalar file does not contain the same number of values as the selected tractogram");
+            scalars_per_vertex = true;
           } else {
-            Math::Vector<float> scalars (filename);
-            size_t total_num_tracks = 0;
-            for (std::vector<size_t>::const_iterator i = num_tracks_per_buffer.begin(); i != num_tracks_per_buffer.end(); ++i)
-              total_num_tracks += *i;
-            if (scalars.size() != total_num_tracks)
+            Math::Vector<float> values (filename);
+            if (values.size() != bricks.num_tracks())
               throw Exception ("The scalar text file does not contain the same number of elements as the selected tractogram");
-            size_t running_index = 0;
-            for (size_t buffer_index = 0; buffer_index != vertex_buffers.size(); ++buffer_index) {
-              const size_t num_tracks = num_tracks_per_buffer[buffer_index];
-              std::vector<GLint>& track_lengths (track_sizes[buffer_index]);
-              for (size_t index = 0; index != num_tracks; ++index, ++running_index) {
-                const float value = scalars[running_index];
-                buffer.push_back (NAN);
-                tck_scalar.assign (track_lengths[index], value);
-                buffer.insert (buffer.end(), tck_scalar.begin(), tck_scalar.end());
-                if (value > value_max) value_max = value;
-                if (value < value_min) value_min = value;
-              }
-              load_scalars_onto_GPU (buffer);
-            }
+            scalars.resize (values.size());
+            for (size_t i = 0; i < values.size(); ++i)
+              scalars[i] = values[i];
+            scalars_per_vertex = false;
+          }
+
+          for (std::vector<float>::const_iterator i = scalars.begin(); i != scalars.end(); ++i) {
+            if (*i > value_max) value_max = *i;
+            if (*i < value_min) value_min = *i;
           }
+          std::swap (track_scalars, scalars);
+
           this->set_windowing (value_min, value_max);
           greaterthan = value_max;
           lessthan = value_min;
@@ -445,13 +471,9 @@ namespace MR
         
         void Tractogram::erase_nontrack_data()
         {
-          if (colour_buffers.size()) {
-            gl::DeleteBuffers (colour_buffers.size(), &colour_buffers[0]);
-            colour_buffers.clear();
-          }
-          if (scalar_buffers.size()) {
-            gl::DeleteBuffers (scalar_buffers.size(), &scalar_buffers[0]);
-            scalar_buffers.clear();
+          delete_buffers (colour_buffers);
+          delete_buffers (scalar_buffers);
+          if (track_scalars.size()) {
             set_use_discard_lower (false);
             set_use_discard_upper (false);
           }
@@ -460,19 +482,15 @@ namespace MR
 
 
 
-        void Tractogram::load_tracks_onto_GPU (std::vector<Point<float> >& buffer,
-            std::vector<GLint>& starts,
-            std::vector<GLint>& sizes,
-            size_t& tck_count) {
-          buffer.push_back (Point<float>());
-          GLuint vertexbuffer;
-          gl::GenBuffers (1, &vertexbuffer);
-          gl::BindBuffer (gl::ARRAY_BUFFER, vertexbuffer);
-          gl::BufferData (gl::ARRAY_BUFFER, buffer.size() * sizeof(Point<float>), &buffer[0][0], gl::STATIC_DRAW);
+        void Tractogram::upload_vertices (size_t brick)
+        {
+          const std::vector<Point<float> >& vertices (bricks[brick].vertices);
+          gl::GenBuffers (1, &vertex_buffers[brick]);
+          gl::BindBuffer (gl::ARRAY_BUFFER, vertex_buffers[brick]);
+          gl::BufferData (gl::ARRAY_BUFFER, vertices.size() * sizeof(Point<float>), &vertices[0][0], gl::STATIC_DRAW);
 
-          GLuint vertex_array_object;
-          gl::GenVertexArrays (1, &vertex_array_object);
-          gl::BindVertexArray (vertex_array_object);
+          gl::GenVertexArrays (1, &vertex_array_objects[brick]);
+          gl::BindVertexArray (vertex_array_objects[brick]);
           gl::EnableVertexAttribArray (0);
           gl::VertexAttribPointer (0, 3, gl::FLOAT, gl::FALSE_, 0, (void*)(3*sizeof(float)));
           gl::EnableVertexAttribArray (1);
@@ -480,52 +498,47 @@ namespace MR
           gl::EnableVertexAttribArray (2);
           gl::VertexAttribPointer (2, 3, gl::FLOAT, gl::FALSE_, 0, (void*)(6*sizeof(float)));
 
-          vertex_array_objects.push_back (vertex_array_object);
-          vertex_buffers.push_back (vertexbuffer);
-          track_starts.push_back (starts);
-          track_sizes.push_back (sizes);
-          num_tracks_per_buffer.push_back (tck_count);
-          buffer.clear();
-          starts.clear();
-          sizes.clear();
-          tck_count = 0;
+          // the vertices are no longer needed on the CPU:
+          bricks.release_vertices (brick);
         }
         
         
         
         
         
-        void Tractogram::load_end_colours_onto_GPU (std::vector< Point<float> >& buffer) {
-          buffer.push_back (Point<float>());
-          GLuint vertexbuffer;
-          gl::GenBuffers (1, &vertexbuffer);
-          gl::BindBuffer (gl::ARRAY_BUFFER, vertexbuffer);
+        void Tractogram::upload_end_colours (size_t brick)
+        {
+          std::vector<Point<float> > buffer;
+          bricks.fill (brick, buffer, Point<float>(), [&] (uint32_t track, uint32_t) { return end_colours[track]; });
+          gl::GenBuffers (1, &colour_buffers[brick]);
+          gl::BindBuffer (gl::ARRAY_BUFFER, colour_buffers[brick]);
           gl::BufferData (gl::ARRAY_BUFFER, buffer.size() * sizeof(Point<float>), &buffer[0][0], gl::STATIC_DRAW);
 
-          gl::BindVertexArray (vertex_array_objects[colour_buffers.size()]);
+          gl::BindVertexArray (vertex_array_objects[brick]);
           gl::EnableVertexAttribArray (3);
           gl::VertexAttribPointer (3, 3, gl::FLOAT, gl::FALSE_, 0, (void*)(3*sizeof(float)));
-
-          colour_buffers.push_back (vertexbuffer);
-          buffer.clear();
         }
 
 
 
 
 
-        void Tractogram::load_scalars_onto_GPU (std::vector<float>& buffer) {
-          buffer.push_back (NAN);
-          GLuint vertexbuffer;
-          gl::GenBuffers (1, &vertexbuffer);
-          gl::BindBuffer (gl::ARRAY_BUFFER, vertexbuffer);
+        void Tractogram::upload_scalars (size_t brick)
+        {
+          if (track_scalars.empty())
+            return;
+          std::vector<float> buffer;
+          if (scalars_per_vertex)
+            bricks.fill (brick, buffer, float (NAN), [&] (uint32_t track, uint32_t vertex) { return track_scalars[bricks.track_offset (track) + vertex]; });
+          else
+            bricks.fill (brick, buffer, float (NAN), [&] (uint32_t track, uint32_t) { return track_scalars[track]; });
+          gl::GenBuffers (1, &scalar_buffers[brick]);
+          gl::BindBuffer (gl::ARRAY_BUFFER, scalar_buffers[brick]);
           gl::BufferData (gl::ARRAY_BUFFER, buffer.size() * sizeof(float), &buffer[0], gl::STATIC_DRAW);
 
-          gl::BindVertexArray (vertex_array_objects[scalar_buffers.size()]);
+          gl::BindVertexArray (vertex_array_objects[brick]);
           gl::EnableVertexAttribArray (3);
           gl::VertexAttribPointer (3, 1, gl::FLOAT, gl::FALSE_, 0, (void*)(sizeof(float)));
-          scalar_buffers.push_back (vertexbuffer);
-          buffer.clear();
         }
 
 
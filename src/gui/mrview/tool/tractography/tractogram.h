@@ -26,6 +26,7 @@
 #include "gui/mrview/displayable.h"
 #include "dwi/tractography/properties.h"
 #include "gui/mrview/tool/tractography/tractography.h"
+#include "gui/mrview/tool/tractography/track_bricks.h"
 #include "gui/mrview/colourmap.h"
 
 
@@ -101,26 +102,23 @@ namespace MR
             Window& window;
             Tractography& tractography_tool;
             std::string filename;
+            // the OpenGL objects of each brick, or zero if not yet uploaded:
             std::vector<GLuint> vertex_buffers;
             std::vector<GLuint> vertex_array_objects;
             std::vector<GLuint> colour_buffers;
             std::vector<GLuint> scalar_buffers;
             DWI::Tractography::Properties properties;
-            std::vector<std::vector<GLint> > track_starts;
-            std::vector<std::vector<GLint> > track_sizes;
-            std::vector<size_t> num_tracks_per_buffer;
+            TrackBricks bricks;
+            std::vector<Point<float> > end_colours;
+            std::vector<float> track_scalars;
+            bool scalars_per_vertex;
             ColourMap::Renderer colourbar_renderer;
             int colourbar_position_index;
 
 
-            void load_tracks_onto_GPU (std::vector<Point<float> >& buffer,
-                                       std::vector<GLint>& starts,
-                                       std::vector<GLint>& sizes,
-                                       size_t& tck_count);
-                                              
-            void load_end_colours_onto_GPU (std::vector<Point<float> >& buffer);
-
-            void load_scalars_onto_GPU (std::vector<float>& buffer);
+            void upload_vertices (size_t brick);
+            void upload_end_colours (size_t brick);
+            void upload_scalars (size_t brick);
 
         };
       }
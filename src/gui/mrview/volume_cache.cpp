@@ -0,0 +1,186 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+
+#include "gui/mrview/volume_cache.h"
+
+namespace MR
+{
+  namespace GUI
+  {
+    namespace MRView
+    {
+
+
+      VolumeCache::~VolumeCache ()
+      {
+        {
+          std::lock_guard<std::mutex> lock (mutex);
+          stop = true;
+        }
+        requests_changed.notify_all();
+        if (worker.joinable())
+          worker.join();
+      }
+
+
+
+      void VolumeCache::set_converter (Converter&& new_converter)
+      {
+        std::unique_lock<std::mutex> lock (mutex);
+        requests.clear();
+        // the converter may hold image data that must not be released from
+        // the background thread, so wait for any conversion still running:
+        conversion_done.wait (lock, [this] () { return in_progress.empty(); });
+        converter = std::move (new_converter);
+        entries.clear();
+        lru.clear();
+        current_bytes = 0;
+      }
+
+
+
+      std::shared_ptr<const VolumeSlab> VolumeCache::get (const Position& position)
+      {
+        std::unique_lock<std::mutex> lock (mutex);
+        assert (converter);
+
+        conversion_done.wait (lock, [&] () { return !is_in_progress (position); });
+
+        std::map<Position,Entry>::iterator entry = entries.find (position);
+        if (entry != entries.end()) {
+          lru.splice (lru.begin(), lru, entry->second.lru);
+          return entry->second.slab;
+        }
+
+        // not available: convert in this thread
+        requests.erase (std::remove (requests.begin(), requests.end(), position), requests.end());
+        lock.unlock();
+
+        std::shared_ptr<VolumeSlab> slab (new VolumeSlab);
+        converter (position, *slab, true);
+
+        lock.lock();
+        insert (position, slab);
+        return slab;
+      }
+
+
+
+      void VolumeCache::prefetch (const Position& position, size_t axis, ssize_t size, size_t extent)
+      {
+        {
+          std::lock_guard<std::mutex> lock (mutex);
+          if (!converter || !extent)
+            return;
+          requests.clear();
+          for (ssize_t offset = 1; offset <= ssize_t (extent); ++offset) {
+            for (ssize_t sign = 1; sign >= -1; sign -= 2) {
+              Position neighbour (position);
+              neighbour[axis] += sign * offset;
+              if (neighbour[axis] < 0 || neighbour[axis] >= size)
+                continue;
+              if (entries.find (neighbour) == entries.end() && !is_in_progress (neighbour))
+                requests.push_back (neighbour);
+            }
+          }
+          if (requests.empty())
+            return;
+          if (!worker.joinable())
+            worker = std::thread (&VolumeCache::execute, this);
+        }
+        requests_changed.notify_one();
+      }
+
+
+
+      void VolumeCache::execute ()
+      {
+        std::unique_lock<std::mutex> lock (mutex);
+        while (true) {
+          requests_changed.wait (lock, [this] () { return stop || !requests.empty(); });
+          if (stop)
+            return;
+
+          const Position position (requests.front());
+          requests.pop_front();
+          if (entries.find (position) != entries.end())
+            continue;
+
+          in_progress.push_back (position);
+          lock.unlock();
+
+          std::shared_ptr<VolumeSlab> slab (new VolumeSlab);
+          try {
+            converter (position, *slab, false);
+          }
+          catch (Exception&) {
+            // the error will be reported if the volume is requested via get()
+            slab.reset();
+          }
+
+          lock.lock();
+          in_progress.erase (std::find (in_progress.begin(), in_progress.end(), position));
+          if (slab)
+            insert (position, slab);
+          conversion_done.notify_all();
+        }
+      }
+
+
+
+      bool VolumeCache::is_in_progress (const Position& position) const
+      {
+        return std::find (in_progress.begin(), in_progress.end(), position) != in_progress.end();
+      }
+
+
+
+      void VolumeCache::insert (const Position& position, const std::shared_ptr<const VolumeSlab>& slab)
+      {
+        std::map<Position,Entry>::iterator existing = entries.find (position);
+        if (existing != entries.end()) {
+          current_bytes -= existing->second.slab->data.size();
+          lru.erase (existing->second.lru);
+          entries.erase (existing);
+        }
+
+        lru.push_front (position);
+        Entry& entry (entries[position]);
+        entry.slab = slab;
+        entry.lru = lru.begin();
+        current_bytes += entry.slab->data.size();
+
+        // discard the least recently used volumes, but always keep this one:
+        while (current_bytes > max_bytes && lru.size() > 1) {
+          std::map<Position,Entry>::iterator oldest = entries.find (lru.back());
+          current_bytes -= oldest->second.slab->data.size();
+          entries.erase (oldest);
+          lru.pop_back();
+        }
+      }
+
+
+    }
+  }
+}
+
+
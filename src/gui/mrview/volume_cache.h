@@ -0,0 +1,260 @@
+/*
+   Copyright 2015 Brain Research Institute, Melbourne, Australia
+
+   This file is part of MRtrix.
+
+   MRtrix is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   MRtrix is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with MRtrix.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __gui_mrview_volume_cache_h__
+#define __gui_mrview_volume_cache_h__
+
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ptr.h"
+#include "types.h"
+#include "progressbar.h"
+
+
+namespace MR
+{
+  namespace GUI
+  {
+    namespace MRView
+    {
+
+
+      //! a volume of image data, converted ready for upload as a 3D texture
+      /*! The data are stored as consecutive values of the texture data type,
+       * with \a channels values per voxel, and the x axis varying fastest.
+       * The range of finite values (or magnitudes, for complex data) is
+       * computed during the conversion. */
+      class VolumeSlab
+      {
+        public:
+          VolumeSlab () : value_min (std::numeric_limits<float>::infinity()), value_max (-std::numeric_limits<float>::infinity()) { }
+
+          std::vector<char> data;
+          float value_min, value_max;
+
+          template <typename ValueType>
+            ValueType* allocate (size_t count) {
+              data.resize (count * sizeof (ValueType));
+              return reinterpret_cast<ValueType*> (&data[0]);
+            }
+
+          template <typename ValueType>
+            void update_range (ValueType value) {
+              if (std::isfinite (value)) {
+                if (value < value_min) value_min = value;
+                if (value > value_max) value_max = value;
+              }
+            }
+      };
+
+
+
+
+      // required to shut up clang's compiler warnings about std::abs() when
+      // instantiating convert_volume() with unsigned types:
+      template <typename ValueType>
+        inline ValueType abs_if_signed (ValueType x, typename std::enable_if<!std::is_unsigned<ValueType>::value>::type* = nullptr) { return std::abs(x); }
+
+      template <typename ValueType>
+        inline ValueType abs_if_signed (ValueType x, typename std::enable_if<std::is_unsigned<ValueType>::value>::type* = nullptr) { return x; }
+
+
+
+      //! convert the 3D volume at \a position (for axes 3 and above) to texture data
+      /*! With \a channels set to 3, consecutive volumes along axis 3 are
+       * interleaved as the RGB channels, using their absolute values. */
+      template <typename ValueType, class BufferType>
+        void convert_volume (BufferType& buffer, const std::vector<ssize_t>& position, size_t channels, VolumeSlab& slab, bool show_progress)
+        {
+          auto V = buffer.voxel();
+          const size_t slice_size = V.dim(0) * V.dim(1);
+          ValueType* data = slab.allocate<ValueType> (channels * slice_size * V.dim(2));
+          if (channels != 1)
+            std::fill (data, data + channels * slice_size * V.dim(2), ValueType (0));
+
+          Ptr<ProgressBar> progress (show_progress ? new ProgressBar ("loading image data...", V.dim(2)) : nullptr);
+
+          for (size_t n = 3; n < V.ndim(); ++n)
+            V[n] = position[n];
+
+          for (V[2] = 0; V[2] < V.dim(2); ++V[2]) {
+            ValueType* slice = data + channels * slice_size * V[2];
+
+            if (channels == 1) {
+              ValueType* p = slice;
+              for (V[1] = 0; V[1] < V.dim(1); ++V[1]) {
+                for (V[0] = 0; V[0] < V.dim(0); ++V[0]) {
+                  const ValueType val = *p++ = V.value();
+                  slab.update_range (val);
+                }
+              }
+            }
+            else {
+              for (size_t n = 0; n < channels; ++n) {
+                if (V.ndim() > 3) {
+                  if (V.dim(3) > int(position[3] + n))
+                    V[3] = position[3] + n;
+                  else break;
+                }
+
+                ValueType* p = slice + n;
+                for (V[1] = 0; V[1] < V.dim (1); ++V[1]) {
+                  for (V[0] = 0; V[0] < V.dim (0); ++V[0]) {
+                    const ValueType val = *p = abs_if_signed (ValueType (V.value()));
+                    slab.update_range (val);
+                    p += channels;
+                  }
+                }
+
+                if (V.ndim() <= 3)
+                  break;
+              }
+              if (V.ndim() > 3)
+                V[3] = position[3];
+            }
+
+            if (progress)
+              ++(*progress);
+          }
+        }
+
+
+
+      //! convert the complex 3D volume at \a position to (real, imaginary) texture data
+      template <class BufferType>
+        void convert_volume_complex (BufferType& buffer, const std::vector<ssize_t>& position, VolumeSlab& slab, bool show_progress)
+        {
+          auto V = buffer.voxel();
+          float* p = slab.allocate<float> (2 * V.dim(0) * V.dim(1) * V.dim(2));
+
+          Ptr<ProgressBar> progress (show_progress ? new ProgressBar ("loading image data...", V.dim(2)) : nullptr);
+
+          for (size_t n = 3; n < V.ndim(); ++n)
+            V[n] = position[n];
+
+          for (V[2] = 0; V[2] < V.dim (2); ++V[2]) {
+            for (V[1] = 0; V[1] < V.dim (1); ++V[1]) {
+              for (V[0] = 0; V[0] < V.dim (0); ++V[0]) {
+                const cfloat val = V.value();
+                *(p++) = val.real();
+                *(p++) = val.imag();
+                slab.update_range (std::abs (val));
+              }
+            }
+            if (progress)
+              ++(*progress);
+          }
+        }
+
+
+
+
+
+      //! a bounded cache of converted volumes, with background prefetching
+      /*! Volumes are converted by the Converter function, either on demand
+       * by get(), or ahead of time by a background thread for the positions
+       * passed to prefetch(). The least recently used volumes are discarded
+       * once the total size of the cached data exceeds the limit specified.
+       *
+       * This class performs no OpenGL calls, so that the GUI thread is only
+       * responsible for the upload of the data returned by get(). */
+      class VolumeCache
+      {
+        public:
+          typedef std::vector<ssize_t> Position;
+          typedef std::function<void (const Position& position, VolumeSlab& slab, bool show_progress)> Converter;
+
+          VolumeCache (size_t max_bytes) :
+            max_bytes (max_bytes),
+            current_bytes (0),
+            stop (false) { }
+          ~VolumeCache ();
+
+          //! set the function used to convert volumes
+          /*! This discards all cached volumes, and any pending prefetch
+           * requests, after waiting for any conversion in progress. The
+           * Converter will be invoked from the background thread, and so must
+           * be safe to run concurrently with the GUI thread (in particular, it
+           * must not copy or release any image buffers). */
+          void set_converter (Converter&& converter);
+
+          //! return the volume at \a position, converting it if necessary
+          /*! If the volume is currently being converted in the background,
+           * this waits for the conversion to complete. */
+          std::shared_ptr<const VolumeSlab> get (const Position& position);
+
+          //! request conversion of the volumes within \a extent of \a position along \a axis
+          /*! The volumes nearest to \a position are converted first. Any
+           * previous prefetch requests not yet started are discarded. */
+          void prefetch (const Position& position, size_t axis, ssize_t size, size_t extent);
+
+          //! the number of volumes currently held
+          size_t size () const {
+            std::lock_guard<std::mutex> lock (mutex);
+            return entries.size();
+          }
+
+          //! whether the volume at \a position is currently held
+          bool contains (const Position& position) const {
+            std::lock_guard<std::mutex> lock (mutex);
+            return entries.find (position) != entries.end();
+          }
+
+        private:
+          class Entry {
+            public:
+              std::shared_ptr<const VolumeSlab> slab;
+              std::list<Position>::iterator lru;
+          };
+
+          const size_t max_bytes;
+          size_t current_bytes;
+          bool stop;
+
+          mutable std::mutex mutex;
+          std::condition_variable requests_changed, conversion_done;
+          Converter converter;
+          std::map<Position,Entry> entries;
+          std::list<Position> lru;
+          std::deque<Position> requests;
+          std::vector<Position> in_progress;
+          std::thread worker;
+
+          void execute ();
+          bool is_in_progress (const Position& position) const;
+          void insert (const Position& position, const std::shared_ptr<const VolumeSlab>& slab);
+      };
+
+
+    }
+  }
+}
+
+#endif
+
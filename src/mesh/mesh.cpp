@@ -24,7 +24,16 @@
 #include "mesh/mesh.h"
 
 
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
 #include <ctime>
+#include <fstream>
+
+#include "get_set.h"
+#include "thread_queue.h"
+#include "file/mmap.h"
+#include "file/path.h"
 
 
 namespace MR
@@ -60,7 +69,331 @@ namespace MR
 
 
 
-    void Mesh::output_pve_image (const Image::Header& H, const std::string& path)
+    namespace {
+
+
+
+      // Voxel-space geometry of each polygon, computed once rather than for
+      //   every point tested
+      class PolygonGeometry
+      {
+        public:
+          PolygonGeometry (const VertexList& v) :
+              normal (((v[1] - v[0]).cross (v[2] - v[1])).normalise()),
+              centre ((v[0] + v[1] + v[2]) * (1.0 / 3.0))
+          {
+            for (size_t i = 0; i != 3; ++i)
+              vertices[i] = v[i];
+            edge_normals[0] = (v[2] - v[0]).cross (normal);
+            edge_normals[1] = (v[1] - v[2]).cross (normal);
+            edge_normals[2] = (v[0] - v[1]).cross (normal);
+          }
+
+          Vertex vertices[3];
+          Point<float> normal, centre, edge_normals[3];
+      };
+
+
+
+      // Flat list of the voxels that may intersect the mesh, with the
+      //   polygons that may intersect each voxel stored contiguously
+      //   (polygons of voxel i are at indices [offsets[i], offsets[i+1]) )
+      class BoundaryVoxels
+      {
+        public:
+          BoundaryVoxels (const Image::Header& H, const std::vector<PolygonGeometry>& geometry)
+          {
+            // Pairs of (linear voxel index, polygon index), for each polygon
+            //   and each voxel within its bounding box
+            std::vector< std::pair<size_t, uint32_t> > pairs;
+            for (size_t poly_index = 0; poly_index != geometry.size(); ++poly_index) {
+
+              Point<int> lower_bound (H.dim(0)-1, H.dim(1)-1, H.dim(2)-1), upper_bound (0, 0, 0);
+              for (size_t vertex = 0; vertex != 3; ++vertex) {
+                for (size_t axis = 0; axis != 3; ++axis) {
+                  const int this_axis_voxel = std::round (geometry[poly_index].vertices[vertex][axis]);
+                  lower_bound[axis] = std::min (lower_bound[axis], this_axis_voxel);
+                  upper_bound[axis] = std::max (upper_bound[axis], this_axis_voxel);
+                }
+              }
+              for (size_t axis = 0; axis != 3; ++axis) {
+                lower_bound[axis] = std::max (0,             lower_bound[axis]);
+                upper_bound[axis] = std::min (H.dim(axis)-1, upper_bound[axis]);
+              }
+
+              Point<int> voxel;
+              for (voxel[2] = lower_bound[2]; voxel[2] <= upper_bound[2]; ++voxel[2]) {
+                for (voxel[1] = lower_bound[1]; voxel[1] <= upper_bound[1]; ++voxel[1]) {
+                  for (voxel[0] = lower_bound[0]; voxel[0] <= upper_bound[0]; ++voxel[0])
+                    pairs.push_back (std::make_pair (voxel[0] + H.dim(0) * (voxel[1] + size_t (H.dim(1)) * voxel[2]), poly_index));
+              } }
+
+            }
+            std::sort (pairs.begin(), pairs.end());
+
+            polygons.reserve (pairs.size());
+            for (size_t i = 0; i != pairs.size(); ++i) {
+              if (!i || pairs[i].first != pairs[i-1].first) {
+                offsets.push_back (polygons.size());
+                const size_t index = pairs[i].first;
+                voxels.push_back (Point<int> (index % H.dim(0), (index / H.dim(0)) % H.dim(1), index / (H.dim(0) * size_t (H.dim(1)))));
+              }
+              polygons.push_back (pairs[i].second);
+            }
+            offsets.push_back (polygons.size());
+          }
+
+          size_t size () const { return voxels.size(); }
+
+          std::vector< Point<int> > voxels;
+          std::vector<size_t> offsets;
+          std::vector<uint32_t> polygons;
+      };
+
+
+
+      // Sequentially provides the index of each boundary voxel to be processed
+      class BoundaryVoxelSource
+      {
+        public:
+          BoundaryVoxelSource (const size_t count) : count (count), index (0) { }
+
+          bool operator() (size_t& item)
+          {
+            if (index == count)
+              return false;
+            item = index++;
+            return true;
+          }
+
+        private:
+          const size_t count;
+          size_t index;
+      };
+
+
+
+      // Estimate the partial volume fraction of a boundary voxel as the
+      //   fraction of a regular grid of points within the voxel that lie
+      //   inside the mesh
+      class PVESampler
+      {
+        public:
+          PVESampler (const BoundaryVoxels& boundary, const std::vector<PolygonGeometry>& geometry, std::vector<float>& output) :
+              boundary (boundary),
+              geometry (geometry),
+              output (output) { }
+
+          bool operator() (const size_t& index)
+          {
+            const Point<int>& voxel (boundary.voxels[index]);
+            const uint32_t* const first = &boundary.polygons[boundary.offsets[index]];
+            const uint32_t* const last  = first + (boundary.offsets[index+1] - boundary.offsets[index]);
+
+            int inside_mesh_count = 0;
+            for (size_t x_idx = 0; x_idx != os_ratio; ++x_idx) {
+              const float x = voxel[0] - 0.5 + ((float(x_idx) + 0.5) / float(os_ratio));
+              for (size_t y_idx = 0; y_idx != os_ratio; ++y_idx) {
+                const float y = voxel[1] - 0.5 + ((float(y_idx) + 0.5) / float(os_ratio));
+                for (size_t z_idx = 0; z_idx != os_ratio; ++z_idx) {
+                  const float z = voxel[2] - 0.5 + ((float(z_idx) + 0.5) / float(os_ratio));
+                  if (is_inside (Point<float> (x, y, z), first, last))
+                    ++inside_mesh_count;
+                }
+              }
+            }
+
+            output[index] = (float)inside_mesh_count / (float)Math::pow3 (os_ratio);
+            return true;
+          }
+
+        private:
+          static const size_t os_ratio = 10;
+
+          const BoundaryVoxels& boundary;
+          const std::vector<PolygonGeometry>& geometry;
+          std::vector<float>& output;
+
+          // Only test against those polygons that are near this voxel; the
+          //   polygon onto which the point projects most centrally decides
+          bool is_inside (const Point<float>& p, const uint32_t* polygon_index, const uint32_t* const last) const
+          {
+            float best_min_edge_distance = -INFINITY;
+            bool best_result_inside = false;
+            for (; polygon_index != last; ++polygon_index) {
+              const PolygonGeometry& g (geometry[*polygon_index]);
+
+              // First: is it aligned with the normal?
+              const Point<float> diff (p - g.centre);
+              const float distance = diff.dot (g.normal);
+
+              // Second: does it project onto the polygon?
+              const Point<float> p_on_plane (p - (g.normal * distance));
+              const float min_edge_distance = minvalue ((p_on_plane - g.vertices[0]).dot (g.edge_normals[0]),
+                                                        (p_on_plane - g.vertices[2]).dot (g.edge_normals[1]),
+                                                        (p_on_plane - g.vertices[1]).dot (g.edge_normals[2]));
+
+              if (min_edge_distance > best_min_edge_distance) {
+                best_min_edge_distance = min_edge_distance;
+                best_result_inside = (distance <= 0.0);
+              }
+            }
+            return best_result_inside;
+          }
+      };
+
+
+
+      // For each column of voxels along the x axis, the polygons whose
+      //   bounding box overlaps that column
+      class ColumnIndex
+      {
+        public:
+          ColumnIndex (const Image::Header& H, const std::vector<PolygonGeometry>& geometry) :
+              dim_y (H.dim(1)),
+              dim_z (H.dim(2)),
+              offsets (dim_y * dim_z + 1, 0)
+          {
+            for (size_t pass = 0; pass != 2; ++pass) {
+              std::vector<size_t> fill;
+              if (pass) {
+                for (size_t i = 1; i != offsets.size(); ++i)
+                  offsets[i] += offsets[i-1];
+                polygons.resize (offsets.back());
+                fill.assign (offsets.begin(), offsets.end() - 1);
+              }
+              for (size_t poly_index = 0; poly_index != geometry.size(); ++poly_index) {
+                const Vertex* const v = geometry[poly_index].vertices;
+                const int y_from = std::max (0,           int (std::floor (minvalue (v[0][1], v[1][1], v[2][1]) + 0.5)));
+                const int y_to   = std::min (dim_y - 1,   int (std::floor (maxvalue (v[0][1], v[1][1], v[2][1]) + 0.5)));
+                const int z_from = std::max (0,           int (std::floor (minvalue (v[0][2], v[1][2], v[2][2]) + 0.5)));
+                const int z_to   = std::min (dim_z - 1,   int (std::floor (maxvalue (v[0][2], v[1][2], v[2][2]) + 0.5)));
+                for (int z = z_from; z <= z_to; ++z) {
+                  for (int y = y_from; y <= y_to; ++y) {
+                    if (pass)
+                      polygons[fill[y + dim_y * z]++] = poly_index;
+                    else
+                      ++offsets[y + dim_y * z + 1];
+                  }
+                }
+              }
+            }
+          }
+
+          const uint32_t* begin (const int y, const int z) const { return &polygons[0] + offsets[y + dim_y * z]; }
+          const uint32_t* end   (const int y, const int z) const { return &polygons[0] + offsets[y + dim_y * z + 1]; }
+
+        private:
+          const int dim_y, dim_z;
+          std::vector<size_t> offsets;
+          std::vector<uint32_t> polygons;
+      };
+
+
+
+      // Compute the exact volume of intersection between a boundary voxel
+      //   and the (closed) mesh.
+      // By the divergence theorem applied to the field F = (g(x), 0, 0), with
+      //   g(x) = clamp (x - x0, 0, 1), over the intersection of the mesh
+      //   interior with the column of the voxel along the x axis:
+      //     volume = sum over polygons of integral { g(x) n_x dA }
+      //   taken over the part of each polygon within the column; the sides
+      //   of the column do not contribute since F is parallel to them.
+      class PVEIntersector
+      {
+        public:
+          PVEIntersector (const BoundaryVoxels& boundary, const std::vector<PolygonGeometry>& geometry, const ColumnIndex& columns, const float orientation, std::vector<float>& output) :
+              boundary (boundary),
+              geometry (geometry),
+              columns (columns),
+              orientation (orientation),
+              output (output) { }
+
+          bool operator() (const size_t& index)
+          {
+            const Point<int>& voxel (boundary.voxels[index]);
+            const double x0 = voxel[0] - 0.5;
+            double volume = 0.0;
+            for (const uint32_t* p = columns.begin (voxel[1], voxel[2]); p != columns.end (voxel[1], voxel[2]); ++p) {
+              const PolygonGeometry& g (geometry[*p]);
+              if (!(std::abs (g.normal[0]) > 0.0) || maxvalue (g.vertices[0][0], g.vertices[1][0], g.vertices[2][0]) <= x0)
+                continue;
+              polygon.assign (g.vertices, g.vertices + 3);
+              clip (polygon, 1, voxel[1] - 0.5, true);
+              clip (polygon, 1, voxel[1] + 0.5, false);
+              clip (polygon, 2, voxel[2] - 0.5, true);
+              clip (polygon, 2, voxel[2] + 0.5, false);
+              if (polygon.size() < 3)
+                continue;
+              // g(x) is linear within the voxel and constant beyond it:
+              clip (polygon, 0, x0, true);
+              upper = polygon;
+              clip (upper, 0, x0 + 1.0, true);
+              clip (polygon, 0, x0 + 1.0, false);
+              Point<double> centroid;
+              const double area = area_and_centroid (polygon, centroid);
+              volume += g.normal[0] * (area * (centroid[0] - x0) + area_and_centroid (upper, centroid));
+            }
+            output[index] = std::min (std::max (orientation * volume, 0.0), 1.0);
+            return true;
+          }
+
+        private:
+          const BoundaryVoxels& boundary;
+          const std::vector<PolygonGeometry>& geometry;
+          const ColumnIndex& columns;
+          const float orientation;
+          std::vector<float>& output;
+          std::vector< Point<double> > polygon, upper, clipped;
+
+          // Sutherland-Hodgman clipping of a convex polygon against a plane
+          //   normal to one of the axes
+          void clip (std::vector< Point<double> >& vertices, const size_t axis, const double value, const bool keep_above)
+          {
+            if (vertices.empty())
+              return;
+            clipped.clear();
+            for (size_t i = 0; i != vertices.size(); ++i) {
+              const Point<double>& a (vertices[i]);
+              const Point<double>& b (vertices[(i+1) % vertices.size()]);
+              const bool a_in = keep_above ? (a[axis] >= value) : (a[axis] <= value);
+              const bool b_in = keep_above ? (b[axis] >= value) : (b[axis] <= value);
+              if (a_in)
+                clipped.push_back (a);
+              if (a_in != b_in) {
+                const double mu = (value - a[axis]) / (b[axis] - a[axis]);
+                Point<double> intersection (a + (b - a) * mu);
+                intersection[axis] = value;
+                clipped.push_back (intersection);
+              }
+            }
+            std::swap (vertices, clipped);
+          }
+
+          static double area_and_centroid (const std::vector< Point<double> >& vertices, Point<double>& centroid)
+          {
+            double area = 0.0;
+            centroid.set (0.0, 0.0, 0.0);
+            for (size_t i = 2; i < vertices.size(); ++i) {
+              const double this_area = 0.5 * ((vertices[i-1] - vertices[0]).cross (vertices[i] - vertices[0])).norm();
+              area += this_area;
+              centroid += (vertices[0] + vertices[i-1] + vertices[i]) * (this_area / 3.0);
+            }
+            if (area)
+              centroid /= area;
+            return area;
+          }
+      };
+
+
+
+    }
+
+
+
+
+
+    void Mesh::output_pve_image (const Image::Header& H, const std::string& path, const bool exact)
     {
 
       // For initial segmentation of mesh - identify voxels on the mesh, inside & outside
@@ -81,12 +414,13 @@ namespace MR
                                                 Point<int> ( 0,  0, -1),
                                                 Point<int> ( 0,  0, +1)};
 
-      // Compute normals for polygons
-      std::vector< Point<float> > normals;
-      normals.reserve (polygons.size());
-      for (PolygonList::const_iterator p = polygons.begin(); p != polygons.end(); ++p) {
-        const Point<float> this_normal (((vertices[(*p)[1]] - vertices[(*p)[0]]).cross (vertices[(*p)[2]] - vertices[(*p)[1]])).normalise());
-        normals.push_back (this_normal);
+      // Compute normals etc. for polygons
+      std::vector<PolygonGeometry> geometry;
+      geometry.reserve (polygons.size());
+      VertexList this_poly_verts;
+      for (size_t poly_index = 0; poly_index != polygons.size(); ++poly_index) {
+        load_polygon_vertices (this_poly_verts, poly_index);
+        geometry.push_back (PolygonGeometry (this_poly_verts));
       }
 
       // Create some memory to work with:
@@ -94,54 +428,10 @@ namespace MR
       Image::BufferScratch<uint8_t> init_seg_data (H);
       auto init_seg  = init_seg_data.voxel();
 
-      // For every voxel, stores those polygons that may intersect the voxel
-      typedef std::map< Point<int>, std::vector<size_t> > Vox2Poly;
-      Vox2Poly voxel2poly;
-
       // Map each polygon to the underlying voxels
-      for (size_t poly_index = 0; poly_index != polygons.size(); ++poly_index) {
-
-        // Figure out the voxel extent of this polygon in three dimensions
-        Point<int> lower_bound (H.dim(0)-1, H.dim(1)-1, H.dim(2)-1), upper_bound (0, 0, 0);
-        VertexList this_poly_verts;
-        load_polygon_vertices (this_poly_verts, poly_index);
-        for (VertexList::const_iterator v = this_poly_verts.begin(); v != this_poly_verts.end(); ++v) {
-          for (size_t axis = 0; axis != 3; ++axis) {
-            const int this_axis_voxel = std::round((*v)[axis]);
-            lower_bound[axis] = std::min (lower_bound[axis], this_axis_voxel);
-            upper_bound[axis] = std::max (upper_bound[axis], this_axis_voxel);
-          }
-        }
-
-        // Constrain to lie within the dimensions of the image
-        for (size_t axis = 0; axis != 3; ++axis) {
-          lower_bound[axis] = std::max(0,             lower_bound[axis]);
-          upper_bound[axis] = std::min(H.dim(axis)-1, upper_bound[axis]);
-        }
-
-        // For all voxels within this rectangular region, assign this polygon to the map
-        Point<int> voxel;
-        for (voxel[2] = lower_bound[2]; voxel[2] <= upper_bound[2]; ++voxel[2]) {
-          for (voxel[1] = lower_bound[1]; voxel[1] <= upper_bound[1]; ++voxel[1]) {
-            for (voxel[0] = lower_bound[0]; voxel[0] <= upper_bound[0]; ++voxel[0]) {
-              std::vector<size_t> this_voxel_polys;
-#if __clang__
-              Vox2Poly::const_iterator existing = voxel2poly.find (voxel);
-#else
-              Vox2Poly::iterator existing = voxel2poly.find (voxel);
-#endif
-              if (existing != voxel2poly.end()) {
-                this_voxel_polys = existing->second;
-                voxel2poly.erase (existing);
-              } else {
-                // Only call this once each voxel, regardless of the number of intersecting polygons
-                Image::Nav::set_value_at_pos (init_seg, voxel, ON_MESH);
-              }
-              this_voxel_polys.push_back (poly_index);
-              voxel2poly.insert (std::make_pair (voxel, this_voxel_polys));
-        } } }
-
-      }
+      const BoundaryVoxels boundary (H, geometry);
+      for (size_t i = 0; i != boundary.size(); ++i)
+        Image::Nav::set_value_at_pos (init_seg, boundary.voxels[i], ON_MESH);
       ++progress;
 
 
@@ -208,78 +498,140 @@ namespace MR
 
 
       // Get better partial volume estimates for all necessary voxels
-      // TODO This could be multi-threaded, but hard to justify the dev time
-      static const size_t pve_os_ratio = 10;
-
-      for (Vox2Poly::const_iterator i = voxel2poly.begin(); i != voxel2poly.end(); ++i) {
-
-        const Point<int>& voxel (i->first);
-
-        // Generate a set of points within this voxel that need to be tested individually
-        std::vector< Point<float> > to_test;
-        to_test.reserve (Math::pow3 (pve_os_ratio));
-        for (size_t x_idx = 0; x_idx != pve_os_ratio; ++x_idx) {
-          const float x = voxel[0] - 0.5 + ((float(x_idx) + 0.5) / float(pve_os_ratio));
-          for (size_t y_idx = 0; y_idx != pve_os_ratio; ++y_idx) {
-            const float y = voxel[1] - 0.5 + ((float(y_idx) + 0.5) / float(pve_os_ratio));
-            for (size_t z_idx = 0; z_idx != pve_os_ratio; ++z_idx) {
-              const float z = voxel[2] - 0.5 + ((float(z_idx) + 0.5) / float(pve_os_ratio));
-              to_test.push_back (Point<float> (x, y, z));
-            }
-          }
+      std::vector<float> boundary_pve (boundary.size());
+      BoundaryVoxelSource source (boundary.size());
+      if (exact) {
+        // The mesh normals are assumed to point outwards; if the mesh
+        //   encloses a negative volume, the polygons are wound the other way
+        double mesh_volume = 0.0;
+        for (size_t i = 0; i != geometry.size(); ++i) {
+          const Point<double> v0 (geometry[i].vertices[0]), v1 (geometry[i].vertices[1]), v2 (geometry[i].vertices[2]);
+          mesh_volume += v0.dot (v1.cross (v2));
         }
+        const ColumnIndex columns (H, geometry);
+        PVEIntersector intersector (boundary, geometry, columns, mesh_volume < 0.0 ? -1.0 : 1.0, boundary_pve);
+        Thread::run_queue (source, size_t(), Thread::multi (intersector));
+      } else {
+        PVESampler sampler (boundary, geometry, boundary_pve);
+        Thread::run_queue (source, size_t(), Thread::multi (sampler));
+      }
+      for (size_t i = 0; i != boundary.size(); ++i)
+        Image::Nav::set_value_at_pos (pve_est, boundary.voxels[i], boundary_pve[i]);
+      ++progress;
+
+      // Write image to file
+      pve_est.save (path);
+      ++progress;
 
-        // Count the number of these points that lie inside the mesh
-        int inside_mesh_count = 0;
-        for (std::vector< Point<float> >::const_iterator i_p = to_test.begin(); i_p != to_test.end(); ++i_p) {
-          const Point<float>& p (*i_p);
+      // Restore the vertex data back to realspace
+      vertices = vertices_realspace;
 
-          float best_min_edge_distance = -INFINITY;
-          bool best_result_inside = false;
+    }
 
-          // Only test against those polygons that are near this voxel
-          for (std::vector<size_t>::const_iterator polygon_index = i->second.begin(); polygon_index != i->second.end(); ++polygon_index) {
-            const Point<float>& n (normals[*polygon_index]);
 
-            VertexList v;
-            load_polygon_vertices (v, *polygon_index);
 
-            // First: is it aligned with the normal?
-            const Point<float> poly_centre ((v[0] + v[1] + v[2]) * (1.0 / 3.0));
-            const Point<float> diff (p - poly_centre);
-            const bool is_inside = (diff.dot (n) <= 0.0);
 
-            // Second: does it project onto the polygon?
-            const Point<float> p_on_plane (p - (n * (diff.dot (n))));
 
-            const float min_edge_distance = minvalue ((p_on_plane - v[0]).dot ((v[2]-v[0]).cross (n)),
-                                                      (p_on_plane - v[2]).dot ((v[1]-v[2]).cross (n)),
-                                                      (p_on_plane - v[1]).dot ((v[0]-v[1]).cross (n)));
+    namespace {
 
-            if (min_edge_distance > best_min_edge_distance) {
-              best_min_edge_distance = min_edge_distance;
-              best_result_inside = is_inside;
-            }
+      // Sequential parser for a memory-mapped mesh file: the vertex and
+      //   polygon data are read directly from the mapping, without any
+      //   intermediate stream buffering or per-token string allocation
+      class MappedReader
+      {
+        public:
+          MappedReader (const File::MMap& mmap) :
+              ptr (reinterpret_cast<const char*> (mmap.address())),
+              end (ptr + mmap.size()),
+              path (mmap.name()) { }
 
+          bool eof () const { return ptr >= end; }
+
+          // Read the next line, excluding the terminating newline
+          std::string line ()
+          {
+            const char* const start = ptr;
+            while (ptr < end && *ptr != '\n')
+              ++ptr;
+            std::string result (start, ptr);
+            if (ptr < end)
+              ++ptr;
+            if (result.size() && result[result.size()-1] == '\r')
+              result.resize (result.size() - 1);
+            return result;
           }
 
-          if (best_result_inside)
-            ++inside_mesh_count;
+          // Read the next whitespace-delimited ASCII value
+          uint32_t ascii_uint ()
+          {
+            skip_whitespace();
+            if (ptr == end || *ptr < '0' || *ptr > '9')
+              throw Exception ("Error parsing integer value in mesh file \"" + path + "\"");
+            uint32_t value = 0;
+            while (ptr < end && *ptr >= '0' && *ptr <= '9')
+              value = 10 * value + (*ptr++ - '0');
+            return value;
+          }
 
-        }
+          float ascii_float ()
+          {
+            skip_whitespace();
+            // copy the token, since the mapped data is not null-terminated:
+            char token[64];
+            size_t length = 0;
+            while (ptr < end && !isspace (*ptr) && length < sizeof (token) - 1)
+              token[length++] = *ptr++;
+            token[length] = '\0';
+            char* token_end;
+            const float value = strtof (token, &token_end);
+            if (!length || token_end != token + length)
+              throw Exception ("Error parsing floating-point value in mesh file \"" + path + "\"");
+            return value;
+          }
+
+          // Access the next block of binary data
+          const char* binary (const size_t bytes)
+          {
+            if (size_t (end - ptr) < bytes)
+              throw Exception ("Unexpected end of mesh file \"" + path + "\"");
+            const char* const data = ptr;
+            ptr += bytes;
+            return data;
+          }
+
+        private:
+          const char* ptr;
+          const char* const end;
+          const std::string path;
+
+          void skip_whitespace () { while (ptr < end && isspace (*ptr)) ++ptr; }
+      };
 
-        Image::Nav::set_value_at_pos (pve_est, voxel, (float)inside_mesh_count / (float)Math::pow3 (pve_os_ratio));
 
+      // FreeSurfer binary triangle surface files start with the magic number FF FF FE:
+      bool is_fs (const std::string& path)
+      {
+        std::ifstream in (path.c_str(), std::ios::in | std::ios::binary);
+        unsigned char magic[3];
+        if (!in.read (reinterpret_cast<char*> (magic), 3))
+          return false;
+        return magic[0] == 0xFF && magic[1] == 0xFF && magic[2] == 0xFE;
       }
-      ++progress;
 
-      // Write image to file
-      pve_est.save (path);
-      ++progress;
+    }
 
-      // Restore the vertex data back to realspace
-      vertices = vertices_realspace;
 
+
+
+
+    Mesh::Mesh (const std::string& path)
+    {
+      if (Path::has_suffix (path, ".vtk"))
+        load_vtk (path);
+      else if (is_fs (path))
+        load_fs (path);
+      else
+        throw Exception ("Input mesh file not in supported format");
     }
 
 
@@ -289,33 +641,26 @@ namespace MR
     void Mesh::load_vtk (const std::string& path)
     {
 
-      std::ifstream in (path.c_str(), std::ios_base::in);
-      if (!in)
-        throw Exception ("Error opening input file!");
-
-      std::string line;
+      File::MMap mmap (path);
+      MappedReader in (mmap);
 
       // First line: VTK version ID
-      std::getline (in, line);
-      // Strip the version numbers
-      line[23] = line[25] = 'x';
-      // Verify that the line is correct
-      if (line != "# vtk DataFile Version x.x")
+      if (in.line().substr (0, 22) != "# vtk DataFile Version")
         throw Exception ("Incorrect first line of .vtk file");
 
       // Second line: identifier
-      std::getline (in, line);
+      in.line();
 
       // Third line: format of data
-      std::getline (in, line);
+      const std::string format = in.line();
       bool is_ascii = false;
-      if (line == "ASCII")
+      if (format == "ASCII")
         is_ascii = true;
-      else if (line != "BINARY")
+      else if (format != "BINARY")
         throw Exception ("unknown data format in .vtk data");
 
       // Fourth line: Data set type
-      std::getline (in, line);
+      std::string line = in.line();
       if (line.substr(0, 7) != "DATASET")
         throw Exception ("Error in definition of .vtk dataset");
       line = line.substr (8);
@@ -324,7 +669,7 @@ namespace MR
 
       // From here, don't necessarily know which parts of the data will come first
       while (!in.eof()) {
-        std::getline (in, line);
+        line = in.line();
 
         if (line.size()) {
           if (line.substr (0, 6) == "POINTS") {
@@ -332,21 +677,22 @@ namespace MR
             line = line.substr (7);
             const size_t ws = line.find (' ');
             const int num_vertices = to<int> (line.substr (0, ws));
-            line = line.substr (ws + 1);
-
-            vertices.reserve (num_vertices);
-            for (int i = 0; i != num_vertices; ++i) {
-
-              Vertex v;
-              if (is_ascii) {
-                std::getline (in, line);
-                sscanf (line.c_str(), "%f %f %f", &v[0], &v[1], &v[2]);
-              } else {
-                for (size_t i = 0; i != 3; ++i)
-                  in.read (reinterpret_cast<char*>(&v[i]), sizeof (float));
-              }
-              vertices.push_back (v);
-
+            const std::string type = ws == std::string::npos ? std::string ("float") : line.substr (ws + 1);
+            const bool is_double = (type == "double");
+            if (!is_double && type != "float")
+              throw Exception ("Unsupported vertex data type \"" + type + "\" in .vtk file \"" + path + "\"");
+
+            vertices.resize (num_vertices);
+            if (is_ascii) {
+              for (int i = 0; i != num_vertices; ++i)
+                for (size_t axis = 0; axis != 3; ++axis)
+                  vertices[i][axis] = in.ascii_float();
+            } else {
+              // Binary legacy VTK data are always big-endian
+              const char* data = in.binary (3 * num_vertices * (is_double ? sizeof (float64) : sizeof (float32)));
+              for (int i = 0; i != num_vertices; ++i)
+                for (size_t axis = 0; axis != 3; ++axis)
+                  vertices[i][axis] = is_double ? getBE<float64> (data, 3*i+axis) : getBE<float32> (data, 3*i+axis);
             }
 
           } else if (line.substr (0, 8) == "POLYGONS") {
@@ -356,38 +702,18 @@ namespace MR
             const int num_polygons = to<int> (line.substr (0, ws));
             line = line.substr (ws + 1);
             const int num_elements = to<int> (line);
+            if (num_elements != 4 * num_polygons)
+              throw Exception ("Could not parse file \"" + path + "\";  only suppport 3-vertex polygons");
 
-            polygons.reserve (num_polygons);
-            int polygon_count = 0, element_count = 0;
-            while (polygon_count < num_polygons && element_count < num_elements) {
-
-              int vertex_count;
-              if (is_ascii) {
-                std::getline (in, line);
-                sscanf (line.c_str(), "%u", &vertex_count);
-              } else {
-                in.read (reinterpret_cast<char*>(&vertex_count), sizeof (int));
-              }
-
+            polygons.resize (num_polygons);
+            const char* data = is_ascii ? nullptr : in.binary (num_elements * sizeof (int32_t));
+            for (int i = 0; i != num_polygons; ++i) {
+              const uint32_t vertex_count = is_ascii ? in.ascii_uint() : getBE<int32_t> (data, 4*i);
               if (vertex_count != 3)
                 throw Exception ("Could not parse file \"" + path + "\";  only suppport 3-vertex polygons");
-
-              Polygon<3> t;
-
-              if (is_ascii) {
-                line = line.substr (line.find (' ') + 1); // Strip the vertex count
-                sscanf (line.c_str(), "%u %u %u", &t[0], &t[1], &t[2]);
-              } else {
-                for (size_t i = 0; i != 3; ++i)
-                  in.read (reinterpret_cast<char*>(&t[i]), sizeof (int));
-              }
-              polygons.push_back (t);
-              ++polygon_count;
-              element_count += 4;
-
+              for (size_t j = 0; j != 3; ++j)
+                polygons[i][j] = is_ascii ? in.ascii_uint() : getBE<int32_t> (data, 4*i+j+1);
             }
-            if (polygon_count != num_polygons || element_count != num_elements)
-              throw Exception ("Incorrectly read polygon data from .vtk file \"" + path + "\"");
 
           } else {
             throw Exception ("Unsupported data \"" + line + "\" in .vtk file \"" + path + "\"");
@@ -401,6 +727,50 @@ namespace MR
 
 
 
+    void Mesh::load_fs (const std::string& path)
+    {
+
+      // FreeSurfer binary triangle surface format (e.g. lh.white, rh.pial):
+      //   3-byte magic number, creation comment terminated by two newlines,
+      //   then big-endian vertex & triangle counts, vertex coordinates
+      //   and vertex indices
+      // The vertices are returned as stored, in surface RAS coordinates:
+      //   the c_ras offset to scanner space is not applied
+      File::MMap mmap (path);
+      MappedReader in (mmap);
+
+      const uint8_t* magic = reinterpret_cast<const uint8_t*> (in.binary (3));
+      if (magic[0] != 0xFF || magic[1] != 0xFF || magic[2] != 0xFE)
+        throw Exception ("Input mesh file not in supported format");
+
+      in.line();
+      if (*in.binary (1) != '\n')
+        throw Exception ("Error reading header of FreeSurfer surface file \"" + path + "\"");
+
+      const char* counts = in.binary (2 * sizeof (int32_t));
+      const int32_t num_vertices = getBE<int32_t> (counts, 0);
+      const int32_t num_polygons = getBE<int32_t> (counts, 1);
+      if (num_vertices < 0 || num_polygons < 0)
+        throw Exception ("Invalid vertex or polygon count in FreeSurfer surface file \"" + path + "\"");
+
+      const char* data = in.binary (3 * num_vertices * sizeof (float32));
+      vertices.resize (num_vertices);
+      for (int32_t i = 0; i != num_vertices; ++i)
+        for (size_t axis = 0; axis != 3; ++axis)
+          vertices[i][axis] = getBE<float32> (data, 3*i+axis);
+
+      data = in.binary (3 * num_polygons * sizeof (int32_t));
+      polygons.resize (num_polygons);
+      for (int32_t i = 0; i != num_polygons; ++i)
+        for (size_t j = 0; j != 3; ++j)
+          polygons[i][j] = getBE<int32_t> (data, 3*i+j);
+
+      verify_data();
+
+    }
+
+
+
     void Mesh::verify_data() const
     {
 
@@ -99,19 +99,16 @@ namespace MR
     class Mesh {
 
       public:
-        Mesh (const std::string& path)
-        {
-          if (path.substr (path.size() - 4) == ".vtk")
-            load_vtk (path);
-          else
-            throw Exception ("Input mesh file not in supported format");
-        }
+        //! load a mesh from a legacy VTK file (ASCII or binary; .vtk suffix),
+        //! or a FreeSurfer binary triangle surface file (any other name, identified by
+        //! its magic number; vertices are in surface RAS, without the c_ras offset)
+        Mesh (const std::string& path);
 
 
         void transform_first_to_realspace (const Image::Header&);
         void transform_realspace_to_voxel (const Image::Header&);
 
-        void output_pve_image (const Image::Header&, const std::string&);
+        void output_pve_image (const Image::Header&, const std::string&, const bool exact = false);
 
 
       private:
@@ -120,6 +117,7 @@ namespace MR
 
 
         void load_vtk (const std::string&);
+        void load_fs  (const std::string&);
 
         void verify_data() const;
 